@@ -22,6 +22,9 @@
  */
 
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <ulfius.h>
 
 #include "static_file_callback.h"
@@ -38,32 +41,12 @@ const char * get_filename_ext(const char *path) {
     return dot;
 }
 
-/**
- * Streaming callback function to ease sending large files
- */
-static ssize_t callback_static_file_stream(void * cls, uint64_t pos, char * buf, size_t max) {
-  if (cls != NULL) {
-    return fread (buf, 1, max, (FILE *)cls);
-  } else {
-    return U_STREAM_END;
-  }
-}
-
-/**
- * Cleanup FILE* structure when streaming is complete
- */
-static void callback_static_file_stream_free(void * cls) {
-  if (cls != NULL) {
-    fclose((FILE *)cls);
-  }
-}
-
 /**
  * static file callback endpoint
  */
 int callback_static_file (const struct _u_request * request, struct _u_response * response, void * user_data) {
-  size_t length;
-  FILE * f;
+  int fd;
+  struct stat file_stat;
   char * file_requested, * file_path, * url_dup_save;
   const char * content_type;
 
@@ -102,12 +85,8 @@ int callback_static_file (const struct _u_request * request, struct _u_response
     file_path = msprintf("%s/%s", ((struct _static_file_config *)user_data)->files_path, file_requested);
 
     if (access(file_path, F_OK) != -1) {
-      f = fopen (file_path, "rb");
-      if (f) {
-        fseek (f, 0, SEEK_END);
-        length = ftell (f);
-        fseek (f, 0, SEEK_SET);
-        
+      fd = open(file_path, O_RDONLY);
+      if (fd >= 0 && fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
         content_type = u_map_get_case(((struct _static_file_config *)user_data)->mime_types, get_filename_ext(file_requested));
         if (content_type == NULL) {
           content_type = u_map_get(((struct _static_file_config *)user_data)->mime_types, "*");
@@ -116,9 +95,13 @@ int callback_static_file (const struct _u_request * request, struct _u_response
         u_map_put(response->map_header, "Content-Type", content_type);
         u_map_copy_into(response->map_header, ((struct _static_file_config *)user_data)->map_header);
         
-        if (ulfius_set_stream_response(response, 200, callback_static_file_stream, callback_static_file_stream_free, length, STATIC_FILE_CHUNK, f) != U_OK) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "callback_static_file - Error ulfius_set_stream_response");
+        // The file is sent by the kernel, the framework closes fd when the response is complete
+        if (ulfius_set_fd_response(response, 200, fd, 0, (uint64_t)file_stat.st_size) != U_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "callback_static_file - Error ulfius_set_fd_response");
+          close(fd);
         }
+      } else if (fd >= 0) {
+        close(fd);
       }
     } else {
       if (((struct _static_file_config *)user_data)->redirect_on_404 == NULL) {
@@ -59,8 +59,6 @@
 #ifndef _STATIC_FILE
 #define _STATIC_FILE
 
-#define STATIC_FILE_CHUNK 256
-
 struct _static_file_config {
   char          * files_path;
   char          * url_prefix;
@@ -0,0 +1,245 @@
+/**
+ *
+ * Ulfius Framework example program
+ *
+ * This example program compares the threading models of the framework:
+ * it opens a large number of idle keep-alive connections,
+ * then measures the memory and threads used by the process
+ * and the throughput of a set of active clients
+ *
+ * Copyright 2019 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ulfius.h>
+#include <u_example.h>
+
+#define PORT 7880
+#define BENCHMARK_URL "/benchmark"
+#define BENCHMARK_REQUEST "GET " BENCHMARK_URL " HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n"
+#define BENCHMARK_BUFFER_SIZE 1024
+
+#define DEFAULT_IDLE_CONNECTIONS   1000
+#define DEFAULT_ACTIVE_CLIENTS     8
+#define DEFAULT_REQUESTS_PER_CLIENT 5000
+
+struct active_client {
+  unsigned int nb_requests;
+  unsigned int nb_errors;
+};
+
+/**
+ * callback function
+ */
+int callback_benchmark (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ulfius_set_string_body_response(response, 200, "ok");
+  return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * Open a tcp connection to the benchmark server
+ */
+static int connect_server() {
+  struct sockaddr_in server;
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (sock >= 0) {
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(PORT);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
+      close(sock);
+      sock = -1;
+    }
+  }
+  return sock;
+}
+
+/**
+ * Send one request on the keep-alive connection and read the full response
+ * return 1 on success
+ */
+static int send_request(int sock) {
+  char buffer[BENCHMARK_BUFFER_SIZE+1], * header_end, * content_length;
+  size_t request_len = strlen(BENCHMARK_REQUEST), offset = 0, expected = 0;
+  ssize_t len;
+
+  while (offset < request_len) {
+    if ((len = write(sock, BENCHMARK_REQUEST + offset, request_len - offset)) <= 0) {
+      return 0;
+    }
+    offset += len;
+  }
+  offset = 0;
+  do {
+    if ((len = read(sock, buffer + offset, BENCHMARK_BUFFER_SIZE - offset)) <= 0) {
+      return 0;
+    }
+    offset += len;
+    buffer[offset] = '\0';
+    if (!expected && (header_end = strstr(buffer, "\r\n\r\n")) != NULL) {
+      if ((content_length = o_strcasestr(buffer, "Content-Length:")) == NULL) {
+        return 0;
+      }
+      expected = (header_end - buffer) + 4 + strtoul(content_length + strlen("Content-Length:"), NULL, 10);
+    }
+  } while ((!expected || offset < expected) && offset < BENCHMARK_BUFFER_SIZE);
+  return offset == expected;
+}
+
+/**
+ * Read the value of a field in /proc/self/status, i.e. VmRSS or Threads
+ */
+static long get_process_status(const char * field) {
+  FILE * f = fopen("/proc/self/status", "r");
+  char line[256];
+  long value = -1;
+
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (0 == strncmp(line, field, strlen(field)) && line[strlen(field)] == ':') {
+        value = strtol(line + strlen(field) + 1, NULL, 10);
+        break;
+      }
+    }
+    fclose(f);
+  }
+  return value;
+}
+
+static void * run_active_client(void * args) {
+  struct active_client * client = (struct active_client *)args;
+  unsigned int i;
+  int sock = connect_server();
+
+  for (i=0; i<client->nb_requests; i++) {
+    if (sock < 0 || !send_request(sock)) {
+      client->nb_errors++;
+      if (sock >= 0) {
+        close(sock);
+      }
+      sock = connect_server();
+    }
+  }
+  if (sock >= 0) {
+    close(sock);
+  }
+  return NULL;
+}
+
+int main (int argc, char **argv) {
+  struct _u_instance instance;
+  struct rlimit limit;
+  struct timespec start, end;
+  struct active_client * clients;
+  pthread_t * threads;
+  int * idle_socks, ret = 0;
+  unsigned int nb_idle = DEFAULT_IDLE_CONNECTIONS, nb_clients = DEFAULT_ACTIVE_CLIENTS, nb_requests = DEFAULT_REQUESTS_PER_CLIENT, i, nb_idle_opened = 0, nb_errors = 0;
+  double elapsed;
+  long rss_start, rss_idle, threads_idle;
+
+  if (argc < 2 || (0 != strcmp(argv[1], "thread") && 0 != strcmp(argv[1], "pool"))) {
+    fprintf(stderr, "Usage: %s <thread|pool> [idle_connections] [active_clients] [requests_per_client]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2) {
+    nb_idle = strtoul(argv[2], NULL, 10);
+  }
+  if (argc > 3) {
+    nb_clients = strtoul(argv[3], NULL, 10);
+  }
+  if (argc > 4) {
+    nb_requests = strtoul(argv[4], NULL, 10);
+  }
+
+  // Each connection uses a client and a server file descriptor
+  if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  y_init_logs("thread_mode_benchmark", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_ERROR, NULL, "Starting thread_mode_benchmark");
+
+  if (ulfius_init_instance(&instance, PORT, NULL, NULL) != U_OK) {
+    fprintf(stderr, "Error ulfius_init_instance, abort\n");
+    return 1;
+  }
+  instance.thread_mode = (0 == strcmp(argv[1], "pool"))?U_THREAD_POOL:U_THREAD_PER_CONNECTION;
+  instance.max_connections = nb_idle + nb_clients + 16;
+  ulfius_add_endpoint_by_val(&instance, "GET", BENCHMARK_URL, NULL, 0, &callback_benchmark, NULL);
+
+  idle_socks = o_malloc(nb_idle * sizeof(int));
+  clients = o_malloc(nb_clients * sizeof(struct active_client));
+  threads = o_malloc(nb_clients * sizeof(pthread_t));
+
+  if (idle_socks != NULL && clients != NULL && threads != NULL && ulfius_start_framework(&instance) == U_OK) {
+    rss_start = get_process_status("VmRSS");
+
+    // Open idle keep-alive connections, each one has served one request
+    for (i=0; i<nb_idle; i++) {
+      if ((idle_socks[nb_idle_opened] = connect_server()) >= 0) {
+        if (send_request(idle_socks[nb_idle_opened])) {
+          nb_idle_opened++;
+        } else {
+          close(idle_socks[nb_idle_opened]);
+        }
+      }
+    }
+    sleep(1);
+    rss_idle = get_process_status("VmRSS");
+    threads_idle = get_process_status("Threads");
+
+    // Run active clients while the idle connections are still open
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i=0; i<nb_clients; i++) {
+      clients[i].nb_requests = nb_requests;
+      clients[i].nb_errors = 0;
+      pthread_create(&threads[i], NULL, run_active_client, &clients[i]);
+    }
+    for (i=0; i<nb_clients; i++) {
+      pthread_join(threads[i], NULL);
+      nb_errors += clients[i].nb_errors;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + ((double)(end.tv_nsec - start.tv_nsec) / 1000000000.0);
+
+    printf("thread mode:          %s\n", instance.thread_mode==U_THREAD_POOL?"U_THREAD_POOL":"U_THREAD_PER_CONNECTION");
+    printf("idle connections:     %u/%u\n", nb_idle_opened, nb_idle);
+    printf("RSS before idle:      %ld kB\n", rss_start);
+    printf("RSS with idle:        %ld kB (%.2f kB per connection)\n", rss_idle, nb_idle_opened?((double)(rss_idle - rss_start)/nb_idle_opened):0.0);
+    printf("threads with idle:    %ld\n", threads_idle);
+    printf("active clients:       %u x %u requests\n", nb_clients, nb_requests);
+    printf("errors:               %u\n", nb_errors);
+    printf("throughput:           %.0f requests/s\n", elapsed>0?((double)nb_clients*nb_requests - nb_errors)/elapsed:0.0);
+
+    for (i=0; i<nb_idle_opened; i++) {
+      close(idle_socks[i]);
+    }
+    ulfius_stop_framework(&instance);
+  } else {
+    fprintf(stderr, "Error starting framework\n");
+    ret = 1;
+  }
+
+  o_free(idle_socks);
+  o_free(clients);
+  o_free(threads);
+  ulfius_clean_instance(&instance);
+  y_close_logs();
+
+  return ret;
+}
@@ -0,0 +1,95 @@
+/**
+ *
+ * Ulfius Framework example program
+ *
+ * This example program measures the usual operations on a struct _u_map
+ * the size of the headers of a proxied request
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ulfius.h>
+
+#define DEFAULT_NB_KEYS 64
+#define DEFAULT_LOOPS 2000
+#define MAX_NB_KEYS 1024
+
+static double elapsed_ns(const struct timespec * start, const struct timespec * end) {
+  return (end->tv_sec - start->tv_sec)*1000000000.0 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char ** argv) {
+  struct _u_map map, * copy;
+  struct timespec start, end;
+  static char keys[MAX_NB_KEYS][32], upper_keys[MAX_NB_KEYS][32];
+  int nb_keys = argc>1?atoi(argv[1]):DEFAULT_NB_KEYS, loops = argc>2?atoi(argv[2]):DEFAULT_LOOPS, i, j;
+  unsigned long found = 0;
+  
+  if (nb_keys <= 0 || nb_keys > MAX_NB_KEYS || loops <= 0) {
+    fprintf(stderr, "Usage: %s [nb_keys] [loops], nb_keys between 1 and %d\n", argv[0], MAX_NB_KEYS);
+    return 1;
+  }
+  for (i=0; i<nb_keys; i++) {
+    snprintf(keys[i], sizeof(keys[i]), "X-Header-Name-%d", i);
+    snprintf(upper_keys[i], sizeof(upper_keys[i]), "X-HEADER-NAME-%d", i);
+  }
+  
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (j=0; j<loops; j++) {
+    u_map_init(&map);
+    for (i=0; i<nb_keys; i++) {
+      u_map_put(&map, keys[i], "header value");
+    }
+    u_map_clean(&map);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("u_map_put:      %.1f ns per key\n", elapsed_ns(&start, &end)/((double)loops*nb_keys));
+  
+  u_map_init(&map);
+  for (i=0; i<nb_keys; i++) {
+    if (u_map_put(&map, keys[i], "header value") != U_OK) {
+      fprintf(stderr, "Error u_map_put\n");
+      u_map_clean(&map);
+      return 1;
+    }
+  }
+  
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (j=0; j<loops; j++) {
+    for (i=0; i<nb_keys; i++) {
+      found += (u_map_get(&map, keys[i]) != NULL);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("u_map_get:      %.1f ns per lookup\n", elapsed_ns(&start, &end)/((double)loops*nb_keys));
+  
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (j=0; j<loops; j++) {
+    for (i=0; i<nb_keys; i++) {
+      found += (u_map_get_case(&map, upper_keys[i]) != NULL);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("u_map_get_case: %.1f ns per lookup\n", elapsed_ns(&start, &end)/((double)loops*nb_keys));
+  
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (j=0; j<loops; j++) {
+    copy = u_map_copy(&map);
+    found += (copy != NULL && u_map_count(copy) == nb_keys);
+    u_map_clean_full(copy);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("u_map_copy:     %.1f ns per map\n", elapsed_ns(&start, &end)/loops);
+  
+  u_map_clean(&map);
+  // Every lookup and every copy must have succeeded
+  return found == (unsigned long)loops*(2*nb_keys+1)?0:1;
+}
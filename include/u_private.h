@@ -51,12 +51,250 @@
  **********************************/
 
 /**
- * ulfius_endpoint_match
- * return the endpoint array matching the url called with the proper http method
- * the returned array always has its last value to NULL
+ * Maximum number of matching endpoints stored on the stack during a request dispatch
+ */
+#define U_ENDPOINT_MATCH_STACK_SIZE 16
+
+/**
+ * States of an asynchronous response in connection_info_struct
+ */
+#define U_ASYNC_NONE      0
+#define U_ASYNC_SUSPENDED 1
+#define U_ASYNC_COMPLETE  2
+#define U_ASYNC_ABORTED   3
+
+/**
+ * Connections suspended by a callback function returning U_CALLBACK_ASYNC,
+ * aborted when the instance stops
+ */
+struct _u_async_list {
+  pthread_mutex_t                 lock;
+  int                             suspend_resume;
+  int                             stopping;
+  struct connection_info_struct * first;
+};
+
+/**
+ * Metrics of the endpoints of an instance
+ */
+struct _u_metrics;
+
+/**
+ * Metrics of one endpoint, split in shards updated without locking
+ */
+struct _u_metrics_entry;
+
+/**
+ * Immutable snapshot of the endpoints of an instance with its routing tree
+ */
+struct _u_router;
+
+/**
+ * Current snapshot of an instance
+ */
+struct _u_router_handle;
+
+/**
+ * ulfius_router_handle_init
+ * Allocate a router handle without snapshot
+ * return NULL on error
+ */
+struct _u_router_handle * ulfius_router_handle_init();
+
+/**
+ * ulfius_router_handle_clean
+ * Free the router handle and its current snapshot
+ * Must not be called while requests are dispatched
+ */
+void ulfius_router_handle_clean(struct _u_router_handle * handle);
+
+/**
+ * ulfius_router_lock
+ * Lock the handle against the other writers
+ * Readers are never blocked
+ */
+void ulfius_router_lock(struct _u_router_handle * handle);
+
+/**
+ * ulfius_router_unlock
+ * Unlock the handle for the other writers
+ */
+void ulfius_router_unlock(struct _u_router_handle * handle);
+
+/**
+ * ulfius_router_publish
+ * Build a new snapshot of endpoint_list and default_endpoint
+ * and make it the current one
+ * If metrics isn't NULL, the metrics entry of each endpoint is kept in the snapshot
+ * The previous snapshot is freed when its last user releases it
+ * The caller must hold the handle lock
+ * return U_OK on success
+ */
+int ulfius_router_publish(struct _u_router_handle * handle, const struct _u_endpoint * endpoint_list, const struct _u_endpoint * default_endpoint, struct _u_metrics * metrics);
+
+/**
+ * ulfius_router_acquire
+ * Return the current snapshot and take a reference on it without locking
+ * The endpoints of the snapshot stay valid until ulfius_router_release is called
+ * return NULL if no snapshot was published
+ */
+const struct _u_router * ulfius_router_acquire(struct _u_router_handle * handle);
+
+/**
+ * ulfius_router_release
+ * Release a reference on a snapshot, free it if it was the last one
+ */
+void ulfius_router_release(const struct _u_router * router);
+
+/**
+ * ulfius_router_get_default_endpoint
+ * return the default endpoint of the snapshot, NULL if none
+ */
+const struct _u_endpoint * ulfius_router_get_default_endpoint(const struct _u_router * router);
+
+/**
+ * ulfius_router_match
+ * Fill endpoint_list with at most size endpoints matching the method and url
+ * sorted by priority
+ * The lookup doesn't allocate memory
+ * return the total number of endpoints matching, may be greater than size
+ */
+size_t ulfius_router_match(const struct _u_router * router, const char * method, const char * url, const struct _u_endpoint ** endpoint_list, size_t size);
+
+/**
+ * ulfius_router_has_body_callback
+ * return true if an endpoint of the snapshot has a body_callback
+ */
+int ulfius_router_has_body_callback(const struct _u_router * router);
+
+/**
+ * ulfius_router_get_metrics
+ * return the metrics entry of an endpoint of the snapshot, NULL if none
+ */
+struct _u_metrics_entry * ulfius_router_get_metrics(const struct _u_router * router, const struct _u_endpoint * endpoint);
+
+/**
+ * ulfius_metrics_init
+ * Allocate an empty metrics table
  * return NULL on memory error
  */
-struct _u_endpoint ** ulfius_endpoint_match(const char * method, const char * url, struct _u_endpoint * endpoint_list);
+struct _u_metrics * ulfius_metrics_init();
+
+/**
+ * ulfius_metrics_clean
+ * Free the metrics table and its entries
+ * Must not be called while requests are dispatched
+ */
+void ulfius_metrics_clean(struct _u_metrics * metrics);
+
+/**
+ * ulfius_metrics_get_entry
+ * Return the metrics entry of the endpoint, add it if it doesn't exist
+ * The entries are never removed, so the metrics of an endpoint survive the new snapshots
+ * The caller must hold the router lock
+ * return NULL on memory error
+ */
+struct _u_metrics_entry * ulfius_metrics_get_entry(struct _u_metrics * metrics, const struct _u_endpoint * endpoint);
+
+/**
+ * ulfius_metrics_now
+ * return a monotonic time in nanoseconds
+ */
+uint64_t ulfius_metrics_now();
+
+/**
+ * ulfius_metrics_record
+ * Account a completed request to the entry in the shard of the current thread
+ * phases contains the duration of each phase in nanoseconds
+ */
+void ulfius_metrics_record(struct _u_metrics_entry * entry, long status, const uint64_t * phases);
+
+/**
+ * Task run by a worker pool
+ * The task is allocated by the caller and must stay valid until run is called
+ */
+struct _u_worker_task {
+  void                 (* run)(void * args);
+  void                  * args;
+  struct _u_worker_task * next;
+};
+
+/**
+ * Pool of worker threads running the tasks in submission order
+ */
+struct _u_worker_pool;
+
+/**
+ * ulfius_worker_pool_init
+ * Start a pool of nb_workers threads
+ * return NULL on error
+ */
+struct _u_worker_pool * ulfius_worker_pool_init(unsigned int nb_workers);
+
+/**
+ * ulfius_worker_pool_run
+ * Queue a task to be run by the first worker available
+ * return U_OK on success, U_ERROR if the pool is stopped
+ */
+int ulfius_worker_pool_run(struct _u_worker_pool * pool, struct _u_worker_task * task);
+
+/**
+ * ulfius_worker_pool_stop
+ * Run the remaining tasks, then stop the workers
+ * The tasks queued afterwards are refused
+ */
+void ulfius_worker_pool_stop(struct _u_worker_pool * pool);
+
+/**
+ * ulfius_worker_pool_clean
+ * Stop the pool if needed and free it
+ */
+void ulfius_worker_pool_clean(struct _u_worker_pool * pool);
+
+/**
+ * Default size of the blocks of a request memory arena
+ */
+#define U_ARENA_BLOCK_SIZE 4096
+
+/**
+ * Memory arena, the memory allocated is released in one shot
+ */
+struct _u_arena;
+
+/**
+ * ulfius_arena_init
+ * Create a memory arena, the arena is stored in its first block
+ * return NULL on memory error
+ */
+struct _u_arena * ulfius_arena_init(size_t block_size);
+
+/**
+ * ulfius_arena_alloc
+ * Allocate size bytes in the arena
+ * return NULL on memory error
+ */
+void * ulfius_arena_alloc(struct _u_arena * arena, size_t size);
+
+/**
+ * ulfius_arena_strndup
+ * Duplicate at most len characters of str in the arena
+ * return NULL on error
+ */
+char * ulfius_arena_strndup(struct _u_arena * arena, const char * str, size_t len);
+
+/**
+ * ulfius_arena_free
+ * Release all the memory of the arena, including the arena itself
+ */
+void ulfius_arena_free(struct _u_arena * arena);
+
+/**
+ * ulfius_init_request_arena
+ * Initialize a request dispatched by the framework
+ * The maps of the request and the strings set by the framework are allocated in arena
+ * return U_OK on success
+ */
+int ulfius_init_request_arena(struct _u_request * request, struct _u_arena * arena);
 
 /**
  * ulfius_parse_url
@@ -91,14 +329,18 @@ int ulfius_set_response_cookie(struct MHD_Response * mhd_response, const struct
  * very effective heuristic for distinguishing between UTF-8 and other
  * encodings.
  *
- * I wrote this code mainly as a specification of functionality; there
- * are no doubt performance optimizations possible for certain CPUs.
- *
  * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/> -- 2005-03-30
  * License: http://www.cl.cam.ac.uk/~mgk25/short-license.html
  */
 const unsigned char * utf8_check(const char * s_orig);
 
+/**
+ * utf8_check_len
+ * Same as utf8_check on the len bytes starting at s_orig, s_orig doesn't need to be '\0'-terminated
+ * return a pointer to the first byte of the first invalid sequence, NULL if the string is valid
+ */
+const unsigned char * utf8_check_len(const char * s_orig, size_t len);
+
 #ifndef U_DISABLE_WEBSOCKET
 
 /**
@@ -199,6 +441,152 @@ int ulfius_init_websocket_manager(struct _websocket_manager * websocket_manager)
  */
 int ulfius_check_handshake_response(const char * key, const char * response);
 
+/**
+ * ulfius_websocket_mask
+ * Apply the 4 bytes mask to data in place, used to mask and unmask websocket payloads
+ * Uses AVX2 or SSE2 if the CPU supports it
+ */
+void ulfius_websocket_mask(uint8_t * data, size_t len, const uint8_t * mask);
+
+/**
+ * Maximum size of a websocket frame header
+ */
+#define U_WEBSOCKET_FRAME_HEADER_MAX_SIZE 14
+
+/**
+ * ulfius_websocket_frame_header
+ * Write the header of a frame in header, header must be at least U_WEBSOCKET_FRAME_HEADER_MAX_SIZE bytes long
+ * mask is NULL for unmasked frames
+ * return the header length
+ */
+size_t ulfius_websocket_frame_header(uint8_t * header, const uint8_t opcode, const int fin, const uint64_t payload_len, const uint8_t * mask);
+
+/**
+ * A complete frame shared by the outgoing queues of several websockets
+ * The frame is freed when the last queue has sent it
+ */
+struct _websocket_frame {
+  unsigned int refcount;
+  size_t       len;
+  uint8_t      data[];
+};
+
+/**
+ * An element of the outgoing queue of a websocket
+ */
+struct _websocket_frame_queue {
+  struct _websocket_frame       * frame;
+  struct _websocket_frame_queue * next;
+};
+
+/**
+ * Flush modes of the outgoing queue
+ * U_WEBSOCKET_FLUSH_TRY: flush only if no other thread writes in the socket, don't wait for the socket
+ * U_WEBSOCKET_FLUSH_LOCK: wait for the other writers, don't wait for the socket
+ * U_WEBSOCKET_FLUSH_ALL: wait until the queue is empty
+ */
+#define U_WEBSOCKET_FLUSH_TRY  0
+#define U_WEBSOCKET_FLUSH_LOCK 1
+#define U_WEBSOCKET_FLUSH_ALL  2
+
+/**
+ * ulfius_websocket_frame_build
+ * Build the unmasked frames of data starting at offset in one buffer,
+ * each frame has at most fragment_len bytes of payload, 0 means one frame
+ * The frame has one reference
+ * return NULL on error
+ */
+struct _websocket_frame * ulfius_websocket_frame_build(const uint8_t opcode, const uint64_t data_len, const char * data, const uint64_t fragment_len, const uint64_t offset);
+
+/**
+ * ulfius_websocket_frame_release
+ * Release a reference to the frame, free it if it was the last one
+ */
+void ulfius_websocket_frame_release(struct _websocket_frame * frame);
+
+/**
+ * ulfius_websocket_queue_frame
+ * Append the frame at the end of the outgoing queue of a server websocket and try to flush the queue
+ * The queue takes its own reference to the frame
+ * return U_OK on success
+ */
+int ulfius_websocket_queue_frame(struct _websocket_manager * websocket_manager, struct _websocket_frame * frame);
+
+/**
+ * ulfius_websocket_flush_queue
+ * Send the outgoing queue in the socket, mode is one of U_WEBSOCKET_FLUSH_TRY, U_WEBSOCKET_FLUSH_LOCK or U_WEBSOCKET_FLUSH_ALL
+ * return U_OK if the connection is still valid, even if the queue isn't empty
+ */
+int ulfius_websocket_flush_queue(struct _websocket_manager * websocket_manager, int mode);
+
+/**
+ * ulfius_websocket_deflate_negotiate
+ * Accept the first permessage-deflate offer of the Sec-WebSocket-Extensions header extensions
+ * compatible with the parameters of websocket_handle, then set the deflate context of websocket_manager
+ * return the extension to send in the handshake response, or NULL if no offer is accepted
+ * returned value must be u_free'd after use
+ */
+char * ulfius_websocket_deflate_negotiate(struct _websocket_manager * websocket_manager, const struct _websocket_handle * websocket_handle, const char * extensions);
+
+/**
+ * ulfius_websocket_check_rsv
+ * Check the RSV bits of the first byte of a frame header
+ * Only the first frame of a text or binary message can have RSV1, if permessage-deflate is negotiated
+ * return U_OK if the bits are valid
+ */
+int ulfius_websocket_check_rsv(struct _websocket_manager * websocket_manager, const uint8_t header);
+
+/**
+ * ulfius_websocket_inflate_message
+ * Decompress the data of a complete message received with RSV1
+ * The reader of the websocket must be the only one to call this function
+ * If the decompressed message is larger than max_inflated_size, a close frame with the status 1009 is sent
+ * return U_OK on success
+ */
+int ulfius_websocket_inflate_message(struct _websocket_manager * websocket_manager, struct _websocket_message * message);
+
+/**
+ * Reactor running the server websockets in U_WEBSOCKET_MODE_REACTOR
+ */
+struct _u_websocket_reactor;
+
+/**
+ * ulfius_websocket_reactor_init
+ * Start nb_threads reactor threads polling the websockets
+ * and nb_workers worker threads running the websocket_incoming_message_callback functions
+ * return NULL on error
+ */
+struct _u_websocket_reactor * ulfius_websocket_reactor_init(unsigned int nb_threads, unsigned int nb_workers);
+
+/**
+ * ulfius_websocket_reactor_clean
+ * Stop the reactor threads and the worker threads, then free the reactor
+ * All the websockets of the reactor must be closed
+ */
+void ulfius_websocket_reactor_clean(struct _u_websocket_reactor * reactor);
+
+/**
+ * ulfius_websocket_reactor_add
+ * Hand an upgraded server websocket to the reactor
+ * return U_OK on success, on error the websocket must be cleared by the caller
+ */
+int ulfius_websocket_reactor_add(struct _u_websocket_reactor * reactor, struct _websocket * websocket);
+
+/**
+ * ulfius_websocket_reactor_close_signal
+ * Wake up the reactor thread of the websocket so it checks the close_flag
+ * Does nothing if the websocket doesn't run in a reactor
+ */
+void ulfius_websocket_reactor_close_signal(struct _websocket_manager * websocket_manager);
+
+/**
+ * ulfius_websocket_reactor_update_events
+ * Poll the socket for writing if want_write is set
+ * Does nothing if the websocket doesn't run in a reactor
+ * The queue_lock of the websocket_manager must be held
+ */
+void ulfius_websocket_reactor_update_events(struct _websocket_manager * websocket_manager, int want_write);
+
 #endif // U_DISABLE_WEBSOCKET
 
 #endif // __U_PRIVATE_H__
@@ -137,6 +137,10 @@ int y_close_logs();
  * @def Connection closed
 */
 #define U_ERROR_DISCONNECTED 7
+/**
+ * @def Outgoing queue full, the message was dropped
+*/
+#define U_ERROR_QUEUE_FULL   8
 
 /**
  * @def Callback exited with success, continue to next callback
@@ -154,6 +158,10 @@ int y_close_logs();
  * @def Error during request process, exit callback list and return status 500
 */
 #define U_CALLBACK_ERROR        3
+/**
+ * @def The response will be completed later by ulfius_complete_async_response, the connection is suspended until then
+*/
+#define U_CALLBACK_ASYNC        4
 
 /**
  * @def Set same_site cookie property to 0
@@ -181,6 +189,79 @@ int y_close_logs();
 */
 #define U_USE_ALL (U_USE_IPV4|U_USE_IPV6)
 
+/**
+ * @def Run the webservice with one thread per connection
+*/
+#define U_THREAD_PER_CONNECTION 0
+/**
+ * @def Run the webservice with a fixed pool of threads polling connections with epoll if available
+*/
+#define U_THREAD_POOL           1
+
+/**
+ * @def Number of buckets of a latency histogram, the last one counts the values above all the limits
+*/
+#define U_METRICS_NB_BUCKETS     52
+/**
+ * @def Request phase from the first byte received to the end of the request body
+*/
+#define U_METRICS_PHASE_PARSE    0
+/**
+ * @def Request phase matching the url with the endpoints
+*/
+#define U_METRICS_PHASE_MATCH    1
+/**
+ * @def Request phase running the callback functions and building the response, including the time the callback functions are suspended
+*/
+#define U_METRICS_PHASE_CALLBACK 2
+/**
+ * @def Request phase queuing the response to libmicrohttpd
+*/
+#define U_METRICS_PHASE_QUEUE    3
+/**
+ * @def Number of request phases measured
+*/
+#define U_METRICS_NB_PHASES      4
+
+/**
+ * @def Store the form-urlencoded and multipart request bodies in binary_body
+*/
+#define U_FORM_BODY_RAW    0x01
+/**
+ * @def Parse the form-urlencoded and multipart request bodies in map_post_body
+*/
+#define U_FORM_BODY_PARSED 0x02
+
+/**
+ * @def Run each server websocket in its own thread, reading incoming messages in a polling loop
+*/
+#define U_WEBSOCKET_MODE_THREAD  0
+/**
+ * @def Run the server websockets in epoll reactor threads, incoming messages are handled by a pool of worker threads
+*/
+#define U_WEBSOCKET_MODE_REACTOR 1
+
+/**
+ * @def When the outgoing queue of a server websocket is above its high-water mark, the sender waits until the queue is sent
+*/
+#define U_WEBSOCKET_QUEUE_BLOCK 0
+/**
+ * @def When the outgoing queue of a server websocket is above its high-water mark, the message is dropped
+*/
+#define U_WEBSOCKET_QUEUE_DROP  1
+/**
+ * @def When the outgoing queue of a server websocket is above its high-water mark, the websocket is closed
+*/
+#define U_WEBSOCKET_QUEUE_CLOSE 2
+/**
+ * @def Default high-water mark of the outgoing queue of a server websocket in bytes
+*/
+#define U_WEBSOCKET_QUEUE_HIGH_WATER 1048576
+/**
+ * @def Default maximum size in bytes of an incoming websocket message decompressed with permessage-deflate
+*/
+#define U_WEBSOCKET_MAX_INFLATED_SIZE 16777216
+
 /**
  * @def Verify TLS session with peers
 */
@@ -204,14 +285,28 @@ int y_close_logs();
  * @{
  */
 
+/**
+ * struct _u_map_entry
+ * key/value pair of a struct _u_map
+ */
+struct _u_map_entry {
+  char         * key; /* !< Key */
+  char         * value; /* !< Value */
+  size_t         length; /* !< Length of the value */
+  unsigned int   hash; /* !< Case insensitive hash of the key */
+};
+
 /**
  * struct _u_map
  */
 struct _u_map {
-  int      nb_values; /* !< Values count */
-  char  ** keys; /* !< Array of keys */
-  char  ** values; /* !< Array of values */
-  size_t * lengths; /* !< Lengths of each values */
+  int                   nb_values; /* !< Values count */
+  char               ** keys; /* !< Array of keys, NULL terminated, used by u_map_enum_keys */
+  char               ** values; /* !< Array of values, NULL terminated, used by u_map_enum_values */
+  struct _u_map_entry * entries; /* !< Array of key/value pairs, keys and values are stored in the same allocation, internal, do not change */
+  size_t                capacity; /* !< Number of entries allocated */
+  unsigned int        * index; /* !< Hash index of the keys, NULL while the map is small, internal, do not change */
+  size_t                index_size; /* !< Number of slots in index */
 };
 
 /**
@@ -269,6 +364,7 @@ struct _u_request {
   char *               client_key_password; /* !< password to unlock client key file, available only if websocket support is enabled */
 #endif
   int                  socketFd;
+  void *               arena; /* !< memory arena of a request dispatched by the framework, use ulfius_request_alloc, internal, do not change */
 };
 
 /**
@@ -291,9 +387,13 @@ struct _u_response {
   uint64_t           stream_size; /* !< size of the streamed data (U_STREAM_SIZE_UNKOWN if unknown) */
   size_t             stream_block_size; /* !< size of each block to be streamed, set according to your system */
   void             * stream_user_data; /* !< user defined data that will be available in your callback stream functions */
+  int                file_fd; /* !< file descriptor of the file to send in the response body, -1 if none, closed by the framework */
+  uint64_t           file_offset; /* !< offset in file_fd of the data to send */
+  uint64_t           file_size; /* !< size of the data to send from file_fd */
   void             * websocket_handle; /* !< handle for websocket extension */
   void *             shared_data; /* !< any data shared between callback functions, must be allocated and freed by the callback functions */
   unsigned int       timeout; /* !< Timeout in seconds to close the connection because of inactivity between the client and the server */
+  void             * async_handle; /* !< handle of the connection, used by ulfius_complete_async_response */
 };
 
 /**
@@ -311,6 +411,36 @@ struct _u_endpoint {
                                   struct _u_response * response,
                                   void * user_data);
   void       * user_data; /* !< pointer to a data or a structure that will be available in callback_function */
+  int          offload; /* !< if true, callback_function is run in the worker pool of the instance while the connection is suspended, use it for slow or blocking callback functions, default false */
+  int       (* body_callback)(const struct _u_request * request, /* !< if not NULL, the request body is sent to this function chunk by chunk as it's received instead of being stored in binary_body, user_data is the one of the endpoint, return U_OK to go on, any other value closes the connection, default NULL */
+                              const char * data,
+                              uint64_t offset,
+                              size_t size,
+                              void * user_data);
+};
+
+/**
+ * 
+ * @struct _u_metrics_histogram latency histogram
+ * @brief Number of values by range, the limit of each bucket is given by ulfius_metrics_bucket_limit
+ * 
+ */
+struct _u_metrics_histogram {
+  uint64_t count; /* !< number of values */
+  uint64_t sum; /* !< sum of the values in microseconds */
+  uint64_t buckets[U_METRICS_NB_BUCKETS]; /* !< number of values in each bucket, buckets aren't cumulative */
+};
+
+/**
+ * 
+ * @struct _u_endpoint_metrics endpoint metrics
+ * @brief Counters and latency histograms of the requests completed by an endpoint
+ * 
+ */
+struct _u_endpoint_metrics {
+  uint64_t                    nb_requests; /* !< number of requests completed */
+  uint64_t                    nb_status[5]; /* !< number of responses by status class, from 1xx to 5xx */
+  struct _u_metrics_histogram phases[U_METRICS_NB_PHASES]; /* !< latency histograms of the request phases, indexed by U_METRICS_PHASE_* */
 };
 
 /**
@@ -332,10 +462,13 @@ struct _u_instance {
   int                           nb_endpoints; /* !< Number of available endpoints */
   char                        * default_auth_realm; /* !< Default realm on authentication error */
   struct _u_endpoint          * endpoint_list; /* !< List of available endpoints */
+  void                        * router; /* !< snapshot of endpoint_list and default_endpoint used to route the requests, internal, do not change */
   struct _u_endpoint          * default_endpoint; /* !< Default endpoint if no other endpoint match the current url */
   struct _u_map               * default_headers; /* !< Default headers that will be added to all response->map_header */
   size_t                        max_post_param_size; /* !< maximum size for a post parameter, 0 means no limit, default 0 */
   size_t                        max_post_body_size; /* !< maximum size for the entire post body, 0 means no limit, default 0 */
+  size_t                        body_mmap_threshold; /* !< request bodies larger than this size are stored in an unlinked temporary file mapped in memory instead of the heap, 0 means never, default 0, not available for Windows where the body is always on the heap */
+  unsigned short                form_body_mode; /* !< how the form-urlencoded and multipart bodies are available in the request, values available are U_FORM_BODY_RAW for binary_body, U_FORM_BODY_PARSED for map_post_body or both, default U_FORM_BODY_RAW|U_FORM_BODY_PARSED */
   void                        * websocket_handler; /* !< handler for the websocket structure */
   int                        (* file_upload_callback) (const struct _u_request * request,  /* !< callback function to manage file upload by blocks */
                                                        const char * key, 
@@ -349,6 +482,21 @@ struct _u_instance {
   void                        * file_upload_cls; /* !< any pointer to pass to the file_upload_callback function */
   int                           mhd_response_copy_data; /* !< to choose between MHD_RESPMEM_MUST_COPY and MHD_RESPMEM_MUST_FREE, only if you use MHD < 0.9.61, otherwise this option is skipped because it's useless */
   int                           check_utf8; /* !< check that all parameters values in the request (url, header and post_body), are valid utf8 strings, if a parameter value has non utf8 character, the value, will be ignored, default 1 */
+  unsigned short                thread_mode; /* !< threading model of the webservice, values available are U_THREAD_PER_CONNECTION or U_THREAD_POOL, default U_THREAD_PER_CONNECTION */
+  unsigned int                  thread_pool_size; /* !< number of threads in the pool if thread_mode is U_THREAD_POOL, 0 means one thread per available CPU core, default 0 */
+  unsigned int                  max_connections; /* !< maximum number of concurrent connections accepted, 0 means libmicrohttpd default limit, default 0 */
+  unsigned int                  worker_pool_size; /* !< number of worker threads running the callback functions of the endpoints with offload set, 0 means one thread per available CPU core, default 0 */
+  void                        * worker_pool; /* !< worker pool running the offloaded callback functions, internal, do not change */
+  void                        * metrics; /* !< metrics of the endpoints if enabled with ulfius_enable_metrics, internal, do not change */
+  void                        * async_connections; /* !< connections suspended by U_CALLBACK_ASYNC, internal, do not change */
+#ifndef U_DISABLE_WEBSOCKET
+  unsigned short                websocket_mode; /* !< engine used to run the server websockets, values available are U_WEBSOCKET_MODE_THREAD or U_WEBSOCKET_MODE_REACTOR, default U_WEBSOCKET_MODE_THREAD */
+  unsigned int                  websocket_reactor_threads; /* !< number of reactor threads if websocket_mode is U_WEBSOCKET_MODE_REACTOR, 0 means 1, default 0 */
+  unsigned int                  websocket_worker_pool_size; /* !< number of worker threads running websocket_incoming_message_callback if websocket_mode is U_WEBSOCKET_MODE_REACTOR, 0 means one thread per available CPU core, default 0 */
+  size_t                        websocket_queue_high_water; /* !< number of bytes waiting in the outgoing queue of a server websocket above which websocket_queue_policy applies, 0 means no limit, default U_WEBSOCKET_QUEUE_HIGH_WATER */
+  unsigned short                websocket_queue_policy; /* !< what to do when a message is sent in a server websocket above the high-water mark, values available are U_WEBSOCKET_QUEUE_BLOCK, U_WEBSOCKET_QUEUE_DROP or U_WEBSOCKET_QUEUE_CLOSE, default U_WEBSOCKET_QUEUE_BLOCK */
+  size_t                        websocket_max_inflated_size; /* !< maximum size in bytes of an incoming message decompressed with permessage-deflate, above it the websocket is closed with the status 1009, 0 means no limit, default U_WEBSOCKET_MAX_INFLATED_SIZE */
+#endif
 #ifndef U_DISABLE_GNUTLS
   int                           use_client_cert_auth; /* !< Internal variable use to indicate if the instance uses client certificate authentication, Do not change this value, available only if websocket support is enabled */
 #endif
@@ -369,6 +517,29 @@ struct connection_info_struct {
   struct _u_request        * request;
   size_t                     max_post_param_size;
   struct _u_map              map_url_initial;
+  void                     * arena;
+  struct MHD_Connection    * connection;
+  pthread_mutex_t            async_lock;
+  int                        async_state;
+  int                        async_callback_ret;
+  size_t                     async_position;
+  const void               * async_router;
+  const struct _u_endpoint ** async_endpoint_list;
+  size_t                     async_nb_endpoints;
+  struct _u_response       * async_response;
+  unsigned int               async_refcount;
+  int                        async_linked;
+  struct connection_info_struct * async_prev;
+  struct connection_info_struct * async_next;
+  uint64_t                   metrics_time;
+  uint64_t                   metrics_phases[U_METRICS_NB_PHASES];
+  int                        body_checked;
+  const void               * body_router;
+  const struct _u_endpoint * body_endpoint;
+  uint64_t                   body_offset;
+  size_t                     body_capacity;
+  int                        body_fd;
+  int                        store_body;
 };
 
 /**********************************
@@ -669,6 +840,25 @@ int ulfius_equals_endpoints(const struct _u_endpoint * endpoint1, const struct _
  */
 
 #ifndef U_DISABLE_CURL
+/**
+ * struct _u_http_client
+ * Client context used to send HTTP requests on persistent connections
+ * The curl handles are kept in a pool between the requests with their connections open,
+ * and share their DNS cache and their TLS sessions,
+ * so the following requests to the same servers don't open new connections
+ * A client context can be used by multiple threads at the same time
+ * The asynchronous requests are run by ulfius_perform_http_client
+ * or by a thread started with ulfius_start_http_client_loop
+ */
+struct _u_http_client {
+  size_t            max_handles; /* !< maximum number of idle curl handles kept in the pool */
+  size_t            nb_handles;  /* !< number of idle curl handles in the pool */
+  void            * handles;     /* !< idle curl handles */
+  void            * share;       /* !< DNS cache and TLS sessions shared by the curl handles */
+  void            * async;       /* !< asynchronous transfers */
+  pthread_mutex_t   lock;        /* !< mutex to access the pool */
+};
+
 /********************************************
  * Requests/Responses functions declarations
  ********************************************/
@@ -694,6 +884,105 @@ int ulfius_send_http_request(const struct _u_request * request, struct _u_respon
  */
 int ulfius_send_http_streaming_request(const struct _u_request * request, struct _u_response * response, size_t (* write_body_function)(void * contents, size_t size, size_t nmemb, void * user_data), void * write_body_data);
 
+/**
+ * ulfius_init_http_client
+ * Initialize a client context to send HTTP requests on persistent connections
+ * @param http_client the client context to initialize
+ * @param max_handles maximum number of idle curl handles kept in the pool, must be greater than 0
+ * @return U_OK on success
+ */
+int ulfius_init_http_client(struct _u_http_client * http_client, size_t max_handles);
+
+/**
+ * ulfius_clean_http_client
+ * Close the connections and free the resources of a client context
+ * No request must be running with this client context
+ * @param http_client the client context to clean
+ */
+void ulfius_clean_http_client(struct _u_http_client * http_client);
+
+/**
+ * ulfius_send_http_client_request
+ * Send a HTTP request with a client context and store the result into a _u_response
+ * The connection is kept open to be reused by the following requests of the client context
+ * @param http_client the client context used to send the request
+ * @param request the struct _u_request that contains all the input parameters to perform the HTTP request
+ * @param response the struct _u_response that will be filled with all response parameter values, optional, may be NULL
+ * @return U_OK on success
+ */
+int ulfius_send_http_client_request(struct _u_http_client * http_client, const struct _u_request * request, struct _u_response * response);
+
+/**
+ * ulfius_send_http_client_streaming_request
+ * Send a HTTP request with a client context and store the result into a _u_response
+ * Except for the body which will be available using write_body_function in the write_body_data
+ * The connection is kept open to be reused by the following requests of the client context
+ * @param http_client the client context used to send the request
+ * @param request the struct _u_request that contains all the input parameters to perform the HTTP request
+ * @param response the struct _u_response that will be filled with all response parameter values, optional, may be NULL
+ * @param write_body_function a pointer to a function that will be used to receive response body in chunks
+ * @param write_body_data a user-defined poitner that will be passed in parameter to write_body_function
+ * @return U_OK on success
+ */
+int ulfius_send_http_client_streaming_request(struct _u_http_client * http_client, const struct _u_request * request, struct _u_response * response, size_t (* write_body_function)(void * contents, size_t size, size_t nmemb, void * user_data), void * write_body_data);
+
+/**
+ * ulfius_send_http_async_request
+ * Send a HTTP request asynchronously with a client context
+ * The function returns immediately, the transfer is run by ulfius_perform_http_client
+ * or by the thread started with ulfius_start_http_client_loop
+ * When the transfer is complete, http_callback is called in the thread running the transfers
+ * with the result U_OK on success, the request sent and its response
+ * The request and the response are freed after http_callback returns
+ * http_callback must not call ulfius_perform_http_client, ulfius_stop_http_client_loop or ulfius_clean_http_client
+ * @param http_client the client context used to send the request
+ * @param request the struct _u_request that contains all the input parameters to perform the HTTP request
+ * @param http_callback the function called when the transfer is complete, may be NULL
+ * @param http_user_data a user-defined pointer passed to http_callback
+ * @return U_OK if the request is added to the transfers of the client context
+ */
+int ulfius_send_http_async_request(struct _u_http_client * http_client,
+                                   const struct _u_request * request,
+                                   void (* http_callback) (int result, const struct _u_request * request, struct _u_response * response, void * http_user_data),
+                                   void * http_user_data);
+
+/**
+ * ulfius_perform_http_client
+ * Run the asynchronous transfers of a client context in the current thread
+ * Wait up to timeout milliseconds for activity on the transfers, 0 to return immediately
+ * This function can't be used while the thread started by ulfius_start_http_client_loop is running
+ * @param http_client the client context
+ * @param timeout maximum time in milliseconds to wait for activity on the transfers
+ * @return U_OK on success
+ */
+int ulfius_perform_http_client(struct _u_http_client * http_client, unsigned int timeout);
+
+/**
+ * ulfius_http_client_nb_transfers
+ * Return the number of asynchronous transfers of a client context not completed yet
+ * @param http_client the client context
+ * @return the number of transfers
+ */
+size_t ulfius_http_client_nb_transfers(struct _u_http_client * http_client);
+
+/**
+ * ulfius_start_http_client_loop
+ * Start a thread running the asynchronous transfers of a client context
+ * @param http_client the client context
+ * @return U_OK on success
+ */
+int ulfius_start_http_client_loop(struct _u_http_client * http_client);
+
+/**
+ * ulfius_stop_http_client_loop
+ * Stop the thread running the asynchronous transfers of a client context
+ * The transfers not completed are kept, ulfius_clean_http_client cancels them
+ * and calls their http_callback with the result U_ERROR
+ * @param http_client the client context
+ * @return U_OK on success
+ */
+int ulfius_stop_http_client_loop(struct _u_http_client * http_client);
+
 /**
  * ulfius_send_smtp_email
  * Send an email using libcurl
@@ -875,6 +1164,20 @@ int ulfius_set_string_body_response(struct _u_response * response, const unsigne
  */
 int ulfius_set_binary_body_response(struct _u_response * response, const unsigned int status, const char * body, const size_t length);
 
+/**
+ * ulfius_set_binary_body_response_no_copy
+ * Add a binary body to a response without copying it, replace any existing body in the response
+ * The response takes ownership of body on success, the framework will free it with o_free
+ * after the response is sent, so body must be allocated with o_malloc
+ * On error, body still belongs to the caller
+ * @param response the response to be updated
+ * @param status the http status code to set to the response
+ * @param body the array of char to set
+ * @param length the length of body to set to the request body
+ * @return U_OK on success
+ */
+int ulfius_set_binary_body_response_no_copy(struct _u_response * response, const unsigned int status, char * body, const size_t length);
+
 /**
  * ulfius_set_empty_body_response
  * Set an empty response with only a status
@@ -914,6 +1217,96 @@ int ulfius_set_stream_response(struct _u_response * response,
                                 size_t stream_block_size,
                                 void * stream_user_data);
 
+/**
+ * ulfius_set_fd_response
+ * Set a response with a status and a body read from a file descriptor
+ * The data is sent by the kernel (sendfile) when possible, without being copied in userspace
+ * The response takes ownership of fd on success, the framework will close it when the response is sent
+ * On error, fd still belongs to the caller
+ * @param response the response to be updated
+ * @param status the http status code to set to the response
+ * @param fd the file descriptor of a regular file opened for reading
+ * @param offset the offset in the file of the data to send
+ * @param size the size of the data to send
+ * @return U_OK on success
+ */
+int ulfius_set_fd_response(struct _u_response * response, const unsigned int status, int fd, uint64_t offset, uint64_t size);
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup async Asynchronous response
+ * Asynchronous response function
+ * @{
+ */
+
+/**
+ * ulfius_complete_async_response
+ * Complete a response whose callback function returned U_CALLBACK_ASYNC
+ * The connection is resumed and the endpoint list goes on as if the callback function had returned callback_ret
+ * May be called from any thread, even before the callback function has returned
+ * The response must not be used by the caller after this call
+ * If the instance was stopped before, the client was sent an error 500 and the connection is closed,
+ * the response must still be completed to be released
+ * @param response the response given to the callback function
+ * @param callback_ret the callback result, U_CALLBACK_CONTINUE, U_CALLBACK_COMPLETE, U_CALLBACK_UNAUTHORIZED or U_CALLBACK_ERROR
+ * @return U_OK on success, U_ERROR_DISCONNECTED if the instance was stopped before
+ */
+int ulfius_complete_async_response(struct _u_response * response, int callback_ret);
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup metrics Endpoints metrics
+ * Endpoints metrics functions
+ * @{
+ */
+
+/**
+ * ulfius_enable_metrics
+ * Record the number of requests, the status classes and the latency of each request phase for each endpoint
+ * A request is accounted to the last endpoint whose callback function was run
+ * Must be called before ulfius_start_framework
+ * @param u_instance pointer to a struct _u_instance
+ * @param metrics_url_format if not NULL, url_format of an endpoint added to the instance
+ * that sends the metrics in the Prometheus text format, e.g. "/metrics"
+ * @return U_OK on success
+ */
+int ulfius_enable_metrics(struct _u_instance * u_instance, const char * metrics_url_format);
+
+/**
+ * ulfius_get_endpoint_metrics
+ * Get the metrics of an endpoint, the metrics of a removed endpoint are kept
+ * Use NULL http_method, url_prefix and url_format for the default endpoint
+ * @param u_instance pointer to a struct _u_instance
+ * @param http_method http verb of the endpoint
+ * @param url_prefix url_prefix of the endpoint
+ * @param url_format url_format of the endpoint
+ * @param metrics the metrics to fill
+ * @return U_OK on success, U_ERROR_NOT_FOUND if the endpoint has no metrics
+ */
+int ulfius_get_endpoint_metrics(const struct _u_instance * u_instance, const char * http_method, const char * url_prefix, const char * url_format, struct _u_endpoint_metrics * metrics);
+
+/**
+ * ulfius_export_metrics
+ * Export the metrics of all the endpoints in the Prometheus text format
+ * @param u_instance pointer to a struct _u_instance
+ * @return a string that must be freed after use, NULL on error
+ */
+char * ulfius_export_metrics(const struct _u_instance * u_instance);
+
+/**
+ * ulfius_metrics_bucket_limit
+ * Get the upper limit of a histogram bucket, the limits grow by half powers of 2
+ * @param index the bucket index
+ * @return the upper limit in microseconds, UINT64_MAX for the last bucket
+ */
+uint64_t ulfius_metrics_bucket_limit(size_t index);
+
 /**
  * @}
  */
@@ -959,6 +1352,18 @@ int ulfius_clean_request_full(struct _u_request * request);
  */
 int ulfius_copy_request(struct _u_request * dest, const struct _u_request * source);
 
+/**
+ * ulfius_request_alloc
+ * Allocate memory that lives as long as the request
+ * The memory is released by the framework in one shot when the request is complete,
+ * it must not be freed or reallocated
+ * Available only for a request dispatched by the framework, i.e. in a callback function
+ * @param request the request dispatched by the framework
+ * @param size the size of the memory to allocate
+ * @return a pointer to the allocated memory, NULL on error
+ */
+void * ulfius_request_alloc(const struct _u_request * request, size_t size);
+
 /**
  * ulfius_init_response
  * Initialize a response structure by allocating inner elements
@@ -1386,8 +1791,12 @@ int u_map_empty(struct _u_map * u_map);
 #define U_WEBSOCKET_BAD_REQUEST_BODY "Error in websocket handshake, wrong parameters"
 #define U_WEBSOCKET_USEC_WAIT        50
 #define WEBSOCKET_MAX_CLOSE_TRY      10
+#define U_WEBSOCKET_READ_BUFFER_SIZE 4096
 
 #define U_WEBSOCKET_BIT_FIN         0x80
+#define U_WEBSOCKET_RSV1            0x40
+#define U_WEBSOCKET_RSV2            0x20
+#define U_WEBSOCKET_RSV3            0x10
 #define U_WEBSOCKET_MASK            0x80
 #define U_WEBSOCKET_LEN_MASK        0x7F
 #define U_WEBSOCKET_OPCODE_CONTINUE 0x00
@@ -1415,6 +1824,9 @@ int u_map_empty(struct _u_map * u_map);
 #define WEBSOCKET_RESPONSE_PROTCOL    0x0010
 #define WEBSOCKET_RESPONSE_EXTENSION  0x0020
 
+#define U_WEBSOCKET_PERMESSAGE_DEFLATE  "permessage-deflate"
+#define U_WEBSOCKET_DEFLATE_WINDOW_BITS 15
+
 /**
  * @struct _websocket_manager Websocket manager structure
  * contains among other things the socket
@@ -1439,6 +1851,20 @@ struct _websocket_manager {
   pthread_cond_t                   status_cond; /* !< condition to broadcast new status */
   struct pollfd                    fds;
   int                              type;
+  uint8_t                        * read_buffer; /* !< data read from the socket and not parsed yet, internal, do not change */
+  size_t                           read_buffer_offset; /* !< offset of the first byte not parsed in read_buffer, internal, do not change */
+  size_t                           read_buffer_len; /* !< number of bytes read in read_buffer, internal, do not change */
+  void                           * reactor_connection; /* !< connection in the reactor if the websocket runs in U_WEBSOCKET_MODE_REACTOR, internal, do not change */
+  pthread_mutex_t                  queue_lock; /* !< mutex to access the outgoing queue */
+  void                           * queue_first; /* !< first frame of the outgoing queue, internal, do not change */
+  void                           * queue_last; /* !< last frame of the outgoing queue, internal, do not change */
+  size_t                           queue_offset; /* !< number of bytes of the first frame already sent, internal, do not change */
+  size_t                           queue_size; /* !< number of bytes waiting in the outgoing queue, internal, do not change */
+  int                              queue_want_write; /* !< set when the reactor polls the socket to flush the outgoing queue, internal, do not change */
+  size_t                           queue_high_water; /* !< high-water mark of the outgoing queue, use ulfius_websocket_set_queue_policy to change it */
+  int                              queue_policy; /* !< policy applied above the high-water mark, use ulfius_websocket_set_queue_policy to change it */
+  void                           * deflate; /* !< permessage-deflate context if the extension was negotiated, internal, do not change */
+  size_t                           max_inflated_size; /* !< maximum size in bytes of an incoming message decompressed with permessage-deflate, 0 means no limit, default U_WEBSOCKET_MAX_INFLATED_SIZE */
 };
 
 /**
@@ -1449,6 +1875,7 @@ struct _websocket_manager {
 struct _websocket_message {
   time_t  datestamp; /* !< date stamp of the message */
   uint8_t opcode; /* !< opcode for the message (string or binary) */
+  uint8_t rsv; /* !< RSV bits of the first frame, U_WEBSOCKET_RSV1 if the message was compressed with permessage-deflate */
   uint8_t has_mask; /* !< does the message contain a mask? */
   uint8_t mask[4]; /* !< mask used if any */
   size_t  data_len; /* !< length of the data */
@@ -1593,6 +2020,28 @@ int ulfius_set_websocket_response(struct _u_response * response,
  */
 int ulfius_websocket_send_close_signal(struct _websocket_manager * websocket_manager);
 
+/**
+ * Enable the permessage-deflate extension (RFC 7692) on a websocket response
+ * The extension is used if the client offers it, the text and binary messages are then compressed
+ * The window bits values must be between 9 and 15, smaller windows use less memory per websocket
+ * and compress less, the values can be reduced by the client offer
+ * If the context takeover is disabled, the compression context is reset after each message,
+ * so the websocket uses less memory but the messages compress less
+ * ulfius_set_websocket_response must be called first, if websocket_extensions is set,
+ * it must contain U_WEBSOCKET_PERMESSAGE_DEFLATE
+ * @param response the response with the websocket
+ * @param server_max_window_bits maximum window bits of the messages compressed by the server, default U_WEBSOCKET_DEFLATE_WINDOW_BITS
+ * @param client_max_window_bits maximum window bits requested for the messages compressed by the client, default U_WEBSOCKET_DEFLATE_WINDOW_BITS
+ * @param server_no_context_takeover set to true if the server resets its compression context after each message
+ * @param client_no_context_takeover set to true if the client must reset its compression context after each message
+ * @return U_OK on success
+ */
+int ulfius_add_websocket_deflate_extension(struct _u_response * response,
+                                           unsigned int server_max_window_bits,
+                                           unsigned int client_max_window_bits,
+                                           int server_no_context_takeover,
+                                           int client_no_context_takeover);
+
 /**
  * Get the websocket status
  * @param websocket_manager the _websocket_manager to analyze
@@ -1612,6 +2061,59 @@ int ulfius_websocket_status(struct _websocket_manager * websocket_manager);
  */
 int ulfius_websocket_wait_close(struct _websocket_manager * websocket_manager, unsigned int timeout);
 
+/**
+ * Set the high-water mark and the policy of the outgoing queue of a server websocket
+ * The messages sent in a server websocket are written without waiting for the client,
+ * the data that doesn't fit in the socket waits in the outgoing queue.
+ * When a message is sent while the queue holds more than high_water bytes, the policy applies:
+ * - U_WEBSOCKET_QUEUE_BLOCK: the sender waits until the queue is sent
+ * - U_WEBSOCKET_QUEUE_DROP: the message is dropped, the send function returns U_ERROR_QUEUE_FULL
+ * - U_WEBSOCKET_QUEUE_CLOSE: the queued messages are dropped and the websocket is closed, the send function returns U_ERROR_DISCONNECTED
+ * A message is always accepted if the queue is empty, control frames are always accepted
+ * The default values are the websocket_queue_high_water and websocket_queue_policy of the instance
+ * @param websocket_manager the websocket manager to update
+ * @param high_water the high-water mark in bytes, 0 means no limit
+ * @param policy the policy, values available are U_WEBSOCKET_QUEUE_BLOCK, U_WEBSOCKET_QUEUE_DROP or U_WEBSOCKET_QUEUE_CLOSE
+ * @return U_OK on success
+ */
+int ulfius_websocket_set_queue_policy(struct _websocket_manager * websocket_manager, size_t high_water, int policy);
+
+/**
+ * Get the number of bytes waiting in the outgoing queue of a server websocket
+ * @param websocket_manager the websocket manager to analyze
+ * @return the number of bytes not sent yet
+ */
+size_t ulfius_websocket_queued_bytes(struct _websocket_manager * websocket_manager);
+
+/**
+ * Send a message to all the server websockets of the instance
+ * The frame is built once and queued to every websocket,
+ * the sockets are flushed without blocking, the remaining data is sent
+ * by the thread or the reactor of each websocket when the socket becomes writable,
+ * so a slow client doesn't delay the others
+ * The queue policy of each websocket applies, except U_WEBSOCKET_QUEUE_BLOCK:
+ * the broadcast never waits, the frame is queued even above the high-water mark
+ * websocket_filter is called for each websocket while the list of active websockets is locked,
+ * it must not open or close websockets
+ * @param u_instance the instance running the websockets
+ * @param opcode the opcode to use
+ * values available are U_WEBSOCKET_OPCODE_TEXT, U_WEBSOCKET_OPCODE_BINARY, U_WEBSOCKET_OPCODE_PING
+ * @param data_len the length of the data to send
+ * @param data the data to send
+ * @param websocket_filter a function returning true if the message must be sent to this websocket, may be NULL to send it to all the websockets
+ * A topic can be implemented by checking the request url or the websocket_filter_user_data
+ * @param websocket_filter_user_data a user-defined pointer passed to websocket_filter
+ * @return U_OK on success
+ */
+int ulfius_websocket_broadcast(struct _u_instance * u_instance,
+                               const uint8_t opcode,
+                               const uint64_t data_len,
+                               const char * data,
+                               int (* websocket_filter) (const struct _u_request * request,
+                                                         struct _websocket_manager * websocket_manager,
+                                                         void * websocket_filter_user_data),
+                               void * websocket_filter_user_data);
+
 /********************************/
 /** Client websocket functions **/
 /********************************/
@@ -1691,6 +2193,25 @@ int ulfius_set_websocket_request(struct _u_request * request,
                                  const char * websocket_protocol,
                                  const char * websocket_extensions);
 
+/**
+ * Offer the permessage-deflate extension (RFC 7692) in a websocket request
+ * The offer is added to the Sec-WebSocket-Extensions header, if the server accepts it,
+ * the text and binary messages are compressed
+ * The window bits values must be between 9 and 15, the server may reduce them
+ * ulfius_set_websocket_request must be called first
+ * @param request the request to use to open the websocket
+ * @param server_max_window_bits maximum window bits requested for the messages compressed by the server, default U_WEBSOCKET_DEFLATE_WINDOW_BITS
+ * @param client_max_window_bits maximum window bits of the messages compressed by the client, default U_WEBSOCKET_DEFLATE_WINDOW_BITS
+ * @param server_no_context_takeover set to true to request the server to reset its compression context after each message
+ * @param client_no_context_takeover set to true if the client resets its compression context after each message
+ * @return U_OK on success
+ */
+int ulfius_add_websocket_client_deflate_extension(struct _u_request * request,
+                                                  unsigned int server_max_window_bits,
+                                                  unsigned int client_max_window_bits,
+                                                  int server_no_context_takeover,
+                                                  int client_no_context_takeover);
+
 #endif
 
 /** Macro values **/
@@ -1734,6 +2255,10 @@ struct _websocket_handle {
                                                   struct _websocket_manager * websocket_manager,
                                                   void * websocket_onclose_user_data);
   void             * websocket_onclose_user_data; /* !< user-defined data that will be handled to websocket_onclose_callback */
+  unsigned int       deflate_server_max_window_bits; /* !< maximum window bits of the messages compressed by the server, 0 if permessage-deflate is disabled */
+  unsigned int       deflate_client_max_window_bits; /* !< maximum window bits requested for the messages compressed by the client */
+  int                deflate_server_no_context_takeover; /* !< set if the server resets its compression context after each message */
+  int                deflate_client_no_context_takeover; /* !< set if the client must reset its compression context after each message */
 };
 
 /**
@@ -1745,6 +2270,7 @@ struct _websocket_handler {
   pthread_mutex_t               websocket_close_lock; /* !< mutex to broadcast close signal */
   pthread_cond_t                websocket_close_cond; /* !< condition to broadcast close signal */
   int                           pthread_init;
+  void                        * reactor; /* !< reactor running the websockets if websocket_mode is U_WEBSOCKET_MODE_REACTOR, internal, do not change */
 };
 
 #endif // U_DISABLE_WEBSOCKET
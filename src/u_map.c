@@ -26,10 +26,146 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "u_private.h"
 #include "ulfius.h"
 
+/**
+ * Number of keys from which the map builds its hash index
+ * Under this number, the keys are scanned linearly using their hash
+ */
+#define U_MAP_INDEX_THRESHOLD 8
+
+/**
+ * Number of entries allocated for the first key of a map
+ */
+#define U_MAP_INITIAL_CAPACITY 8
+
+/**
+ * Returned by u_map_enum_keys and u_map_enum_values for a map without allocated entries
+ */
+static const char * u_map_empty_enum[1] = {NULL};
+
+/**
+ * Return the case insensitive FNV-1a hash of key
+ * Keys equal with o_strcmp or o_strcasecmp have the same hash
+ */
+static unsigned int u_map_hash_key(const char * key) {
+  unsigned int hash = 2166136261U;
+  
+  while (*key) {
+    hash ^= (unsigned char)tolower((unsigned char)*key);
+    hash *= 16777619U;
+    key++;
+  }
+  return hash;
+}
+
+/**
+ * Rebuild the hash index of the map
+ * The index is freed if the map is small enough to be scanned linearly
+ * On memory error, the index is removed and the lookups are linear
+ */
+static void u_map_build_index(struct _u_map * u_map) {
+  size_t index_size, slot;
+  int i;
+  
+  o_free(u_map->index);
+  u_map->index = NULL;
+  u_map->index_size = 0;
+  if (u_map->nb_values >= U_MAP_INDEX_THRESHOLD) {
+    // Keep the load factor under 1/2
+    for (index_size = 2*U_MAP_INDEX_THRESHOLD; index_size < (size_t)(2*u_map->nb_values); index_size *= 2);
+    if ((u_map->index = o_malloc(index_size*sizeof(unsigned int))) != NULL) {
+      memset(u_map->index, 0, index_size*sizeof(unsigned int));
+      u_map->index_size = index_size;
+      for (i=0; i<u_map->nb_values; i++) {
+        for (slot = u_map->entries[i].hash & (index_size - 1); u_map->index[slot]; slot = (slot + 1) & (index_size - 1));
+        u_map->index[slot] = (unsigned int)i + 1;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->index");
+    }
+  }
+}
+
+/**
+ * Add the last key of the map to the hash index, rebuild it if it's too small
+ */
+static void u_map_index_last_key(struct _u_map * u_map) {
+  size_t slot;
+  
+  if (u_map->index == NULL || (size_t)(2*u_map->nb_values) > u_map->index_size) {
+    u_map_build_index(u_map);
+  } else {
+    for (slot = u_map->entries[u_map->nb_values - 1].hash & (u_map->index_size - 1); u_map->index[slot]; slot = (slot + 1) & (u_map->index_size - 1));
+    u_map->index[slot] = (unsigned int)u_map->nb_values;
+  }
+}
+
+/**
+ * Return the position of key in the map, -1 if not found
+ * If the search is case insensitive and many keys match, the first one inserted is returned
+ */
+static int u_map_find_key(const struct _u_map * u_map, const char * key, int case_sensitive) {
+  unsigned int hash = u_map_hash_key(key);
+  size_t slot;
+  int i, found = -1;
+  
+  if (u_map->index != NULL) {
+    for (slot = hash & (u_map->index_size - 1); u_map->index[slot]; slot = (slot + 1) & (u_map->index_size - 1)) {
+      i = (int)u_map->index[slot] - 1;
+      if (u_map->entries[i].hash == hash && (found == -1 || i < found) && 0 == (case_sensitive?o_strcmp(u_map->entries[i].key, key):o_strcasecmp(u_map->entries[i].key, key))) {
+        if (case_sensitive) {
+          return i;
+        }
+        found = i;
+      }
+    }
+  } else {
+    for (i=0; i<u_map->nb_values; i++) {
+      if (u_map->entries[i].hash == hash && 0 == (case_sensitive?o_strcmp(u_map->entries[i].key, key):o_strcasecmp(u_map->entries[i].key, key))) {
+        return i;
+      }
+    }
+  }
+  return found;
+}
+
+/**
+ * Double the capacity of the map
+ * The entries, the keys array and the values array are stored in one allocation:
+ * capacity entries followed by capacity+1 keys and capacity+1 values
+ * return U_OK on success
+ */
+static int u_map_grow(struct _u_map * u_map) {
+  size_t capacity = u_map->capacity?2*u_map->capacity:U_MAP_INITIAL_CAPACITY;
+  char * block;
+  char ** keys, ** values;
+  
+  block = o_realloc(u_map->entries, capacity*sizeof(struct _u_map_entry) + 2*(capacity + 1)*sizeof(char *));
+  if (block == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->entries");
+    return U_ERROR_MEMORY;
+  }
+  keys = (char **)(block + capacity*sizeof(struct _u_map_entry));
+  values = keys + capacity + 1;
+  if (u_map->capacity) {
+    // Move the values first, they go further than the keys
+    memmove(values, block + u_map->capacity*sizeof(struct _u_map_entry) + (u_map->capacity + 1)*sizeof(char *), (u_map->nb_values + 1)*sizeof(char *));
+    memmove(keys, block + u_map->capacity*sizeof(struct _u_map_entry), (u_map->nb_values + 1)*sizeof(char *));
+  } else {
+    keys[0] = NULL;
+    values[0] = NULL;
+  }
+  u_map->entries = (struct _u_map_entry *)block;
+  u_map->keys = keys;
+  u_map->values = values;
+  u_map->capacity = capacity;
+  return U_OK;
+}
+
 /**
  * initialize a struct _u_map
  * this function MUST be called after a declaration or allocation
@@ -37,31 +173,14 @@
  */
 int u_map_init(struct _u_map * u_map) {
   if (u_map != NULL) {
+    // The entries are allocated with the first key
     u_map->nb_values = 0;
-    u_map->keys = o_malloc(sizeof(char *));
-    if (u_map->keys == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->keys");
-      return U_ERROR_MEMORY;
-    }
-    u_map->keys[0] = NULL;
-
-    u_map->values = o_malloc(sizeof(char *));
-    if (u_map->values == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->values");
-      o_free(u_map->keys);
-      return U_ERROR_MEMORY;
-    }
-    u_map->values[0] = NULL;
-    
-    u_map->lengths = o_malloc(sizeof(size_t));
-    if (u_map->lengths == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->lengths");
-      o_free(u_map->keys);
-      o_free(u_map->values);
-      return U_ERROR_MEMORY;
-    }
-    u_map->lengths[0] = 0;
-
+    u_map->keys = NULL;
+    u_map->values = NULL;
+    u_map->entries = NULL;
+    u_map->capacity = 0;
+    u_map->index = NULL;
+    u_map->index_size = 0;
     return U_OK;
   } else {
     return U_ERROR_PARAMS;
@@ -76,12 +195,18 @@ int u_map_clean(struct _u_map * u_map) {
   int i;
   if (u_map != NULL) {
     for (i=0; i<u_map->nb_values; i++) {
-      o_free(u_map->keys[i]);
-      o_free(u_map->values[i]);
+      o_free(u_map->entries[i].key);
+      o_free(u_map->entries[i].value);
     }
-    o_free(u_map->keys);
-    o_free(u_map->values);
-    o_free(u_map->lengths);
+    o_free(u_map->entries);
+    o_free(u_map->index);
+    u_map->nb_values = 0;
+    u_map->keys = NULL;
+    u_map->values = NULL;
+    u_map->entries = NULL;
+    u_map->capacity = 0;
+    u_map->index = NULL;
+    u_map->index_size = 0;
     return U_OK;
   } else {
     return U_ERROR_PARAMS;
@@ -124,7 +249,7 @@ int u_map_clean_enum(char ** array) {
  * return an array of char * ending with a NULL element
  */
 const char ** u_map_enum_keys(const struct _u_map * u_map) {
-  return (const char **)u_map->keys;
+  return u_map->keys!=NULL?(const char **)u_map->keys:u_map_empty_enum;
 }
 
 /**
@@ -132,7 +257,7 @@ const char ** u_map_enum_keys(const struct _u_map * u_map) {
  * return an array of char * ending with a NULL element
  */
 const char ** u_map_enum_values(const struct _u_map * u_map) {
-  return (const char **)u_map->values;
+  return u_map->values!=NULL?(const char **)u_map->values:u_map_empty_enum;
 }
 
 /**
@@ -141,13 +266,8 @@ const char ** u_map_enum_values(const struct _u_map * u_map) {
  * search is case sensitive
  */
 int u_map_has_key(const struct _u_map * u_map, const char * key) {
-  int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcmp(u_map->keys[i], key)) {
-        return 1;
-      }
-    }
+    return u_map_find_key(u_map, key, 1) != -1;
   }
   return 0;
 }
@@ -169,8 +289,8 @@ int u_map_has_value(const struct _u_map * u_map, const char * value) {
 int u_map_has_value_binary(const struct _u_map * u_map, const char * value, size_t length) {
   int i;
   if (u_map != NULL && value != NULL) {
-    for (i=0; u_map->values[i] != NULL; i++) {
-      if (0 == memcmp(u_map->values[i], value, length)) {
+    for (i=0; i<u_map->nb_values; i++) {
+      if (0 == memcmp(u_map->entries[i].value, value, length)) {
         return 1;
       }
     }
@@ -201,31 +321,32 @@ int u_map_put_binary(struct _u_map * u_map, const char * key, const char * value
   int i;
   char * dup_key, * dup_value;
   if (u_map != NULL && key != NULL && o_strlen(key) > 0) {
-    for (i=0; i < u_map->nb_values; i++) {
-      if (0 == o_strcmp(u_map->keys[i], key)) {
-        // Key already exist, extend and/or replace value
-        if (u_map->lengths[i] < (offset + length)) {
-          u_map->values[i] = o_realloc(u_map->values[i], (offset + length)*sizeof(char));
-          if (u_map->values[i] == NULL) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->values");
-            return U_ERROR_MEMORY;
-          }
+    if ((i = u_map_find_key(u_map, key, 1)) != -1) {
+      // Key already exist, extend and/or replace value
+      if (u_map->entries[i].length < (offset + length)) {
+        dup_value = o_realloc(u_map->entries[i].value, (offset + length)*sizeof(char));
+        if (dup_value == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->entries[i].value");
+          return U_ERROR_MEMORY;
         }
-        if (value != NULL) {
-          memcpy(u_map->values[i]+offset, value, length);
-          if (u_map->lengths[i] < (offset + length)) {
-            u_map->lengths[i] = (offset + length);
-          }
-        } else {
-          o_free(u_map->values[i]);
-          u_map->values[i] = o_strdup("");
-          u_map->lengths[i] = 0;
+        u_map->entries[i].value = u_map->values[i] = dup_value;
+      }
+      if (value != NULL) {
+        memcpy(u_map->entries[i].value+offset, value, length);
+        if (u_map->entries[i].length < (offset + length)) {
+          u_map->entries[i].length = (offset + length);
         }
-        return U_OK;
+      } else {
+        o_free(u_map->entries[i].value);
+        u_map->entries[i].value = u_map->values[i] = o_strdup("");
+        u_map->entries[i].length = 0;
       }
-    }
-    if (u_map->values[i] == NULL) {
+      return U_OK;
+    } else {
       // Not found, add key/value
+      if ((size_t)u_map->nb_values == u_map->capacity && u_map_grow(u_map) != U_OK) {
+        return U_ERROR_MEMORY;
+      }
       dup_key = o_strdup(key);
       if (dup_key == NULL) {
         y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for dup_key");
@@ -243,41 +364,17 @@ int u_map_put_binary(struct _u_map * u_map, const char * key, const char * value
         dup_value = o_strdup("");
       }
       
-      // Append key
-      for (i = 0; u_map->keys[i] != NULL; i++);
-      u_map->keys = o_realloc(u_map->keys, (i + 2)*sizeof(char *));
-      if (u_map->keys == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->keys");
-        o_free(dup_key);
-        o_free(dup_value);
-        return U_ERROR_MEMORY;
-      }
-      u_map->keys[i] = (char *)dup_key;
+      // Append the entry
+      i = u_map->nb_values;
+      u_map->entries[i].key = u_map->keys[i] = dup_key;
+      u_map->entries[i].value = u_map->values[i] = dup_value;
+      u_map->entries[i].length = (offset + length);
+      u_map->entries[i].hash = u_map_hash_key(key);
       u_map->keys[i+1] = NULL;
-      
-      // Append value
-      u_map->values = o_realloc(u_map->values, (i + 2)*sizeof(char *));
-      if (u_map->values == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->values");
-        o_free(dup_key);
-        o_free(dup_value);
-        return U_ERROR_MEMORY;
-      }
-      u_map->values[i] = (char *)dup_value;
       u_map->values[i+1] = NULL;
       
-      // Append length
-      u_map->lengths = o_realloc(u_map->lengths, (i + 2)*sizeof(size_t));
-      if (u_map->lengths == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->lengths");
-        o_free(dup_key);
-        o_free(dup_value);
-        return U_ERROR_MEMORY;
-      }
-      u_map->lengths[i] = (offset + length);
-      u_map->lengths[i+1] = 0;
-      
       u_map->nb_values++;
+      u_map_index_last_key(u_map);
     }
     return U_OK;
   } else {
@@ -291,12 +388,14 @@ int u_map_put_binary(struct _u_map * u_map, const char * key, const char * value
  */
 int u_map_remove_from_key(struct _u_map * u_map, const char * key) {
   int i, res, found = 0;
+  unsigned int hash;
   
   if (u_map == NULL || key == NULL) {
     return U_ERROR_PARAMS;
   } else {
+    hash = u_map_hash_key(key);
     for (i = u_map->nb_values-1; i >= 0; i--) {
-      if (0 == o_strcmp(u_map->keys[i], key)) {
+      if (u_map->entries[i].hash == hash && 0 == o_strcmp(u_map->entries[i].key, key)) {
         found = 1;
         res = u_map_remove_at(u_map, i);
         if (res != U_OK) {
@@ -318,12 +417,14 @@ int u_map_remove_from_key(struct _u_map * u_map, const char * key) {
  */
 int u_map_remove_from_key_case(struct _u_map * u_map, const char * key) {
   int i, res, found = 0;
+  unsigned int hash;
   
   if (u_map == NULL || key == NULL) {
     return U_ERROR_PARAMS;
   } else {
+    hash = u_map_hash_key(key);
     for (i = u_map->nb_values-1; i >= 0; i--) {
-      if (0 == o_strcasecmp(u_map->keys[i], key)) {
+      if (u_map->entries[i].hash == hash && 0 == o_strcasecmp(u_map->entries[i].key, key)) {
         found = 1;
         res = u_map_remove_at(u_map, i);
         if (res != U_OK) {
@@ -358,7 +459,7 @@ int u_map_remove_from_value_binary(struct _u_map * u_map, const char * value, si
     return U_ERROR_PARAMS;
   } else {
     for (i = u_map->nb_values-1; i >= 0; i--) {
-      if (0 == memcmp(u_map->values[i], value, length)) {
+      if (0 == memcmp(u_map->entries[i].value, value, length)) {
         found = 1;
         res = u_map_remove_at(u_map, i);
         if (res != U_OK) {
@@ -385,7 +486,7 @@ int u_map_remove_from_value_case(struct _u_map * u_map, const char * value) {
     return U_ERROR_PARAMS;
   } else {
     for (i = u_map->nb_values-1; i >= 0; i--) {
-      if (0 == o_strcasecmp(u_map->values[i], value)) {
+      if (0 == o_strcasecmp(u_map->entries[i].value, value)) {
         found = 1;
         res = u_map_remove_at(u_map, i);
         if (res != U_OK) {
@@ -406,36 +507,21 @@ int u_map_remove_from_value_case(struct _u_map * u_map, const char * value) {
  * return U_OK on success, U_NOT_FOUND if index is out of bound, error otherwise
  */
 int u_map_remove_at(struct _u_map * u_map, const int index) {
-  int i;
   if (u_map == NULL || index < 0) {
     return U_ERROR_PARAMS;
   } else if (index >= u_map->nb_values) {
     return U_ERROR_NOT_FOUND;
   } else {
-    o_free(u_map->keys[index]);
-    o_free(u_map->values[index]);
-    for (i = index; i < u_map->nb_values; i++) {
-      u_map->keys[i] = u_map->keys[i + 1];
-      u_map->values[i] = u_map->values[i + 1];
-      u_map->lengths[i] = u_map->lengths[i + 1];
-    }
-    u_map->keys = o_realloc(u_map->keys, (u_map->nb_values)*sizeof(char *));
-    if (u_map->keys == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->keys");
-      return U_ERROR_MEMORY;
-    }
-    u_map->values = o_realloc(u_map->values, (u_map->nb_values)*sizeof(char *));
-    if (u_map->values == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->values");
-      return U_ERROR_MEMORY;
-    }
-    u_map->lengths = o_realloc(u_map->lengths, (u_map->nb_values)*sizeof(char *));
-    if (u_map->lengths == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->lengths");
-      return U_ERROR_MEMORY;
-    }
+    o_free(u_map->entries[index].key);
+    o_free(u_map->entries[index].value);
+    // Shift the next entries, keys and values, including the NULL terminators
+    memmove(u_map->entries + index, u_map->entries + index + 1, (u_map->nb_values - index - 1)*sizeof(struct _u_map_entry));
+    memmove(u_map->keys + index, u_map->keys + index + 1, (u_map->nb_values - index)*sizeof(char *));
+    memmove(u_map->values + index, u_map->values + index + 1, (u_map->nb_values - index)*sizeof(char *));
     
     u_map->nb_values--;
+    // The positions have changed
+    u_map_build_index(u_map);
     return U_OK;
   }
 }
@@ -448,14 +534,8 @@ int u_map_remove_at(struct _u_map * u_map, const int index) {
 const char * u_map_get(const struct _u_map * u_map, const char * key) {
   int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcmp(u_map->keys[i], key)) {
-        if (u_map->lengths[i] > 0) {
-          return u_map->values[i];
-        } else {
-          return NULL;
-        }
-      }
+    if ((i = u_map_find_key(u_map, key, 1)) != -1 && u_map->entries[i].length > 0) {
+      return u_map->entries[i].value;
     }
     return NULL;
   } else {
@@ -469,13 +549,8 @@ const char * u_map_get(const struct _u_map * u_map, const char * key) {
  * search is case insensitive
  */
 int u_map_has_key_case(const struct _u_map * u_map, const char * key) {
-  int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcasecmp(u_map->keys[i], key)) {
-        return 1;
-      }
-    }
+    return u_map_find_key(u_map, key, 0) != -1;
   }
   return 0;
 }
@@ -488,8 +563,8 @@ int u_map_has_key_case(const struct _u_map * u_map, const char * key) {
 int u_map_has_value_case(const struct _u_map * u_map, const char * value) {
   int i;
   if (u_map != NULL && value != NULL) {
-    for (i=0; u_map->values[i] != NULL; i++) {
-      if (0 == o_strcasecmp(u_map->values[i], value)) {
+    for (i=0; i<u_map->nb_values; i++) {
+      if (0 == o_strcasecmp(u_map->entries[i].value, value)) {
         return 1;
       }
     }
@@ -505,10 +580,8 @@ int u_map_has_value_case(const struct _u_map * u_map, const char * value) {
 const char * u_map_get_case(const struct _u_map * u_map, const char * key) {
   int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcasecmp(u_map->keys[i], key)) {
-        return u_map->values[i];
-      }
+    if ((i = u_map_find_key(u_map, key, 0)) != -1) {
+      return u_map->entries[i].value;
     }
     return NULL;
   } else {
@@ -524,10 +597,8 @@ const char * u_map_get_case(const struct _u_map * u_map, const char * key) {
 ssize_t u_map_get_length(const struct _u_map * u_map, const char * key) {
   int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcmp(u_map->keys[i], key)) {
-        return u_map->lengths[i];
-      }
+    if ((i = u_map_find_key(u_map, key, 1)) != -1) {
+      return u_map->entries[i].length;
     }
     return -1;
   } else {
@@ -543,10 +614,8 @@ ssize_t u_map_get_length(const struct _u_map * u_map, const char * key) {
 ssize_t u_map_get_case_length(const struct _u_map * u_map, const char * key) {
   int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcasecmp(u_map->keys[i], key)) {
-        return u_map->lengths[i];
-      }
+    if ((i = u_map_find_key(u_map, key, 0)) != -1) {
+      return u_map->entries[i].length;
     }
     return -1;
   } else {
@@ -575,8 +644,8 @@ struct _u_map * u_map_copy(const struct _u_map * source) {
     }
     keys = u_map_enum_keys(source);
     for (i=0; keys != NULL && keys[i] != NULL; i++) {
-      value = u_map_get(source, keys[i]);
-      if (value == NULL || u_map_put_binary(copy, keys[i], value, 0, source->lengths[i]) != U_OK) {
+      value = source->entries[i].length>0?source->entries[i].value:NULL;
+      if (value == NULL || u_map_put_binary(copy, keys[i], value, 0, source->entries[i].length) != U_OK) {
         return NULL;
       }
     }
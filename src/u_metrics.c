@@ -0,0 +1,506 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_metrics.c: endpoints metrics functions definitions
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "u_private.h"
+#include "ulfius.h"
+
+/**
+ * Number of shards of an entry
+ * Each thread updates the shard it was given on its first request, so the threads rarely share a shard
+ */
+#define U_METRICS_NB_SHARDS 16
+
+/**
+ * Size of a cache line, the shards don't share their cache lines
+ */
+#define U_METRICS_CACHE_LINE 64
+
+/**
+ * Size of a shard rounded up to a whole number of cache lines
+ */
+#define U_METRICS_SHARD_SIZE (((sizeof(struct _u_endpoint_metrics) + U_METRICS_CACHE_LINE - 1) / U_METRICS_CACHE_LINE) * U_METRICS_CACHE_LINE)
+
+/**
+ * Metrics of one endpoint
+ * The identity of the endpoint is copied, so the entry outlives the endpoint
+ * shards is aligned on a cache line inside shard_buffer
+ */
+struct _u_metrics_entry {
+  char                    * http_method;
+  char                    * url_prefix;
+  char                    * url_format;
+  void                    * shard_buffer;
+  char                    * shards;
+  struct _u_metrics_entry * next;
+};
+
+/**
+ * Metrics table of an instance
+ * The entries are only added at the head of the list, so the readers don't lock
+ */
+struct _u_metrics {
+  struct _u_metrics_entry * entry_list;
+};
+
+/**
+ * Growing buffer used to export the metrics
+ */
+struct _u_metrics_buffer {
+  char   * data;
+  size_t   len;
+  size_t   size;
+  int      error;
+};
+
+/**
+ * Index of the shard of the current thread
+ */
+static unsigned int ulfius_metrics_shard_index() {
+  static unsigned int next_shard = 0;
+  static __thread unsigned int shard = 0;
+
+  // shard is the index plus 1, 0 means the thread has no shard yet
+  if (!shard) {
+    shard = (__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % U_METRICS_NB_SHARDS) + 1;
+  }
+  return shard - 1;
+}
+
+/**
+ * Return the shard at index in the entry
+ */
+static struct _u_endpoint_metrics * ulfius_metrics_get_shard(const struct _u_metrics_entry * entry, unsigned int index) {
+  return (struct _u_endpoint_metrics *)(entry->shards + index*U_METRICS_SHARD_SIZE);
+}
+
+/**
+ * Index of the histogram bucket for a value in microseconds
+ * Buckets 0 and 1 end at 1 and 2, then every power of 2 is split in 2 buckets: ]2^o, 1.5*2^o] and ]1.5*2^o, 2^(o+1)]
+ */
+static size_t ulfius_metrics_bucket_index(uint64_t value) {
+  unsigned int octave;
+  size_t index;
+
+  if (value <= 2) {
+    return value<=1?0:1;
+  }
+  octave = 63 - __builtin_clzll(value - 1);
+  index = 2*octave + (value > (uint64_t)3<<(octave-1));
+  return index<U_METRICS_NB_BUCKETS?index:U_METRICS_NB_BUCKETS-1;
+}
+
+/**
+ * Find the entry of an endpoint identity
+ * return NULL if not found
+ */
+static struct _u_metrics_entry * ulfius_metrics_find_entry(const struct _u_metrics * metrics, const char * http_method, const char * url_prefix, const char * url_format) {
+  struct _u_metrics_entry * entry;
+
+  for (entry = __atomic_load_n(&((struct _u_metrics *)metrics)->entry_list, __ATOMIC_ACQUIRE); entry != NULL; entry = entry->next) {
+    if (0 == o_strcmp(entry->http_method, http_method) && 0 == o_strcmp(entry->url_prefix, url_prefix) && 0 == o_strcmp(entry->url_format, url_format)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Sum the shards of an entry in metrics
+ */
+static void ulfius_metrics_aggregate(const struct _u_metrics_entry * entry, struct _u_endpoint_metrics * metrics) {
+  struct _u_endpoint_metrics * shard;
+  unsigned int i;
+  size_t j, k;
+
+  memset(metrics, 0, sizeof(struct _u_endpoint_metrics));
+  for (i=0; i<U_METRICS_NB_SHARDS; i++) {
+    shard = ulfius_metrics_get_shard(entry, i);
+    metrics->nb_requests += __atomic_load_n(&shard->nb_requests, __ATOMIC_RELAXED);
+    for (j=0; j<5; j++) {
+      metrics->nb_status[j] += __atomic_load_n(&shard->nb_status[j], __ATOMIC_RELAXED);
+    }
+    for (j=0; j<U_METRICS_NB_PHASES; j++) {
+      metrics->phases[j].count += __atomic_load_n(&shard->phases[j].count, __ATOMIC_RELAXED);
+      metrics->phases[j].sum += __atomic_load_n(&shard->phases[j].sum, __ATOMIC_RELAXED);
+      for (k=0; k<U_METRICS_NB_BUCKETS; k++) {
+        metrics->phases[j].buckets[k] += __atomic_load_n(&shard->phases[j].buckets[k], __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+/**
+ * Append a formatted string to the buffer
+ */
+static void ulfius_metrics_printf(struct _u_metrics_buffer * buffer, const char * format, ...) {
+  va_list args;
+  int len;
+  char * data;
+
+  if (buffer->error) {
+    return;
+  }
+  va_start(args, format);
+  len = vsnprintf(buffer->data + buffer->len, buffer->size - buffer->len, format, args);
+  va_end(args);
+  if (len < 0) {
+    buffer->error = 1;
+  } else if ((size_t)len >= buffer->size - buffer->len) {
+    // The buffer is too small, grow it and print again
+    if ((data = o_realloc(buffer->data, 2*buffer->size + (size_t)len)) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for metrics buffer");
+      buffer->error = 1;
+    } else {
+      buffer->data = data;
+      buffer->size = 2*buffer->size + (size_t)len;
+      va_start(args, format);
+      vsnprintf(buffer->data + buffer->len, buffer->size - buffer->len, format, args);
+      va_end(args);
+      buffer->len += (size_t)len;
+    }
+  } else {
+    buffer->len += (size_t)len;
+  }
+}
+
+/**
+ * Append a label value with its quotes, backslashes and new lines escaped
+ */
+static void ulfius_metrics_print_label(struct _u_metrics_buffer * buffer, const char * value) {
+  for (; value != NULL && *value; value++) {
+    if (*value == '\\' || *value == '"') {
+      ulfius_metrics_printf(buffer, "\\%c", *value);
+    } else if (*value == '\n') {
+      ulfius_metrics_printf(buffer, "\\n");
+    } else {
+      ulfius_metrics_printf(buffer, "%c", *value);
+    }
+  }
+}
+
+/**
+ * Append the labels identifying an entry
+ * The url is the prefix and the format joined without duplicate slashes,
+ * the default endpoint is identified by method and url "*"
+ */
+static void ulfius_metrics_print_entry_labels(struct _u_metrics_buffer * buffer, const struct _u_metrics_entry * entry) {
+  char * url, * cur;
+  size_t i, len;
+
+  if (entry->http_method == NULL) {
+    ulfius_metrics_printf(buffer, "method=\"*\",url=\"*\"");
+  } else {
+    ulfius_metrics_printf(buffer, "method=\"");
+    ulfius_metrics_print_label(buffer, entry->http_method);
+    ulfius_metrics_printf(buffer, "\",url=\"");
+    if ((url = msprintf("/%s/%s", entry->url_prefix!=NULL?entry->url_prefix:"", entry->url_format!=NULL?entry->url_format:"")) != NULL) {
+      len = o_strlen(url);
+      for (i=0, cur=url; i<len; i++) {
+        if (url[i] != '/' || cur == url || *(cur-1) != '/') {
+          *cur++ = url[i];
+        }
+      }
+      if (cur > url+1 && *(cur-1) == '/') {
+        cur--;
+      }
+      *cur = '\0';
+      ulfius_metrics_print_label(buffer, url);
+      o_free(url);
+    } else {
+      buffer->error = 1;
+    }
+    ulfius_metrics_printf(buffer, "\"");
+  }
+}
+
+/**
+ * Send the metrics of the instance in the Prometheus text format
+ */
+static int callback_ulfius_metrics(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  char * body = ulfius_export_metrics((const struct _u_instance *)user_data);
+  UNUSED(request);
+
+  if (body != NULL && ulfius_set_binary_body_response_no_copy(response, 200, body, o_strlen(body)) == U_OK) {
+    u_map_put(response->map_header, ULFIUS_HTTP_HEADER_CONTENT, "text/plain; version=0.0.4");
+    return U_CALLBACK_COMPLETE;
+  } else {
+    o_free(body);
+    return U_CALLBACK_ERROR;
+  }
+}
+
+/**
+ * ulfius_metrics_init
+ * Allocate an empty metrics table
+ * return NULL on memory error
+ */
+struct _u_metrics * ulfius_metrics_init() {
+  struct _u_metrics * metrics = o_malloc(sizeof(struct _u_metrics));
+
+  if (metrics != NULL) {
+    metrics->entry_list = NULL;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for metrics");
+  }
+  return metrics;
+}
+
+/**
+ * ulfius_metrics_clean
+ * Free the metrics table and its entries
+ * Must not be called while requests are dispatched
+ */
+void ulfius_metrics_clean(struct _u_metrics * metrics) {
+  struct _u_metrics_entry * entry, * next;
+
+  if (metrics != NULL) {
+    for (entry = metrics->entry_list; entry != NULL; entry = next) {
+      next = entry->next;
+      o_free(entry->http_method);
+      o_free(entry->url_prefix);
+      o_free(entry->url_format);
+      o_free(entry->shard_buffer);
+      o_free(entry);
+    }
+    o_free(metrics);
+  }
+}
+
+/**
+ * ulfius_metrics_get_entry
+ * Return the metrics entry of the endpoint, add it if it doesn't exist
+ * The entries are never removed, so the metrics of an endpoint survive the new snapshots
+ * The caller must hold the router lock
+ * return NULL on memory error
+ */
+struct _u_metrics_entry * ulfius_metrics_get_entry(struct _u_metrics * metrics, const struct _u_endpoint * endpoint) {
+  struct _u_metrics_entry * entry;
+
+  if (metrics == NULL || endpoint == NULL) {
+    return NULL;
+  }
+  if ((entry = ulfius_metrics_find_entry(metrics, endpoint->http_method, endpoint->url_prefix, endpoint->url_format)) == NULL) {
+    if ((entry = o_malloc(sizeof(struct _u_metrics_entry))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for metrics entry");
+      return NULL;
+    }
+    entry->http_method = o_strdup(endpoint->http_method);
+    entry->url_prefix = o_strdup(endpoint->url_prefix);
+    entry->url_format = o_strdup(endpoint->url_format);
+    entry->shard_buffer = o_malloc(U_METRICS_NB_SHARDS*U_METRICS_SHARD_SIZE + U_METRICS_CACHE_LINE);
+    if ((endpoint->http_method != NULL && entry->http_method == NULL) ||
+        (endpoint->url_prefix != NULL && entry->url_prefix == NULL) ||
+        (endpoint->url_format != NULL && entry->url_format == NULL) ||
+        entry->shard_buffer == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for metrics entry");
+      o_free(entry->http_method);
+      o_free(entry->url_prefix);
+      o_free(entry->url_format);
+      o_free(entry->shard_buffer);
+      o_free(entry);
+      return NULL;
+    }
+    entry->shards = (char *)(((uintptr_t)entry->shard_buffer + U_METRICS_CACHE_LINE - 1) & ~(uintptr_t)(U_METRICS_CACHE_LINE - 1));
+    memset(entry->shards, 0, U_METRICS_NB_SHARDS*U_METRICS_SHARD_SIZE);
+    entry->next = metrics->entry_list;
+    __atomic_store_n(&metrics->entry_list, entry, __ATOMIC_RELEASE);
+  }
+  return entry;
+}
+
+/**
+ * ulfius_metrics_now
+ * return a monotonic time in nanoseconds
+ */
+uint64_t ulfius_metrics_now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec*1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * ulfius_metrics_record
+ * Account a completed request to the entry in the shard of the current thread
+ * phases contains the duration of each phase in nanoseconds
+ */
+void ulfius_metrics_record(struct _u_metrics_entry * entry, long status, const uint64_t * phases) {
+  struct _u_endpoint_metrics * shard;
+  uint64_t value;
+  size_t i;
+
+  if (entry != NULL && phases != NULL) {
+    shard = ulfius_metrics_get_shard(entry, ulfius_metrics_shard_index());
+    __atomic_fetch_add(&shard->nb_requests, 1, __ATOMIC_RELAXED);
+    if (status >= 100 && status < 600) {
+      __atomic_fetch_add(&shard->nb_status[status/100 - 1], 1, __ATOMIC_RELAXED);
+    }
+    for (i=0; i<U_METRICS_NB_PHASES; i++) {
+      value = phases[i]/1000;
+      __atomic_fetch_add(&shard->phases[i].count, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&shard->phases[i].sum, value, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&shard->phases[i].buckets[ulfius_metrics_bucket_index(value)], 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * ulfius_enable_metrics
+ * Record the number of requests, the status classes and the latency of each request phase for each endpoint
+ * Must be called before ulfius_start_framework
+ * return U_OK on success
+ */
+int ulfius_enable_metrics(struct _u_instance * u_instance, const char * metrics_url_format) {
+  if (u_instance == NULL || u_instance->status == U_STATUS_RUNNING) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_enable_metrics, invalid parameters");
+    return U_ERROR_PARAMS;
+  }
+  if (u_instance->metrics == NULL && (u_instance->metrics = ulfius_metrics_init()) == NULL) {
+    return U_ERROR_MEMORY;
+  }
+  if (metrics_url_format != NULL) {
+    return ulfius_add_endpoint_by_val(u_instance, "GET", NULL, metrics_url_format, 0, &callback_ulfius_metrics, u_instance);
+  } else {
+    return U_OK;
+  }
+}
+
+/**
+ * ulfius_get_endpoint_metrics
+ * Get the metrics of an endpoint
+ * return U_OK on success, U_ERROR_NOT_FOUND if the endpoint has no metrics
+ */
+int ulfius_get_endpoint_metrics(const struct _u_instance * u_instance, const char * http_method, const char * url_prefix, const char * url_format, struct _u_endpoint_metrics * metrics) {
+  struct _u_metrics_entry * entry;
+
+  if (u_instance == NULL || u_instance->metrics == NULL || metrics == NULL) {
+    return U_ERROR_PARAMS;
+  } else if ((entry = ulfius_metrics_find_entry((struct _u_metrics *)u_instance->metrics, http_method, url_prefix, url_format)) == NULL) {
+    return U_ERROR_NOT_FOUND;
+  } else {
+    ulfius_metrics_aggregate(entry, metrics);
+    return U_OK;
+  }
+}
+
+/**
+ * ulfius_export_metrics
+ * Export the metrics of all the endpoints in the Prometheus text format
+ * return a string that must be freed after use, NULL on error
+ */
+char * ulfius_export_metrics(const struct _u_instance * u_instance) {
+  static const char * phase_names[U_METRICS_NB_PHASES] = {"parse", "match", "callback", "queue"};
+  struct _u_metrics_buffer buffer;
+  struct _u_metrics_entry * entry, * entry_list;
+  struct _u_endpoint_metrics * metrics;
+  uint64_t cumulative;
+  size_t i, j;
+
+  if (u_instance == NULL || u_instance->metrics == NULL) {
+    return NULL;
+  }
+  buffer.size = 4096;
+  buffer.len = 0;
+  buffer.error = 0;
+  if ((buffer.data = o_malloc(buffer.size)) == NULL || (metrics = o_malloc(sizeof(struct _u_endpoint_metrics))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for metrics export");
+    o_free(buffer.data);
+    return NULL;
+  }
+  buffer.data[0] = '\0';
+  entry_list = __atomic_load_n(&((struct _u_metrics *)u_instance->metrics)->entry_list, __ATOMIC_ACQUIRE);
+
+  ulfius_metrics_printf(&buffer, "# HELP ulfius_requests_total Number of requests completed by endpoint\n# TYPE ulfius_requests_total counter\n");
+  for (entry = entry_list; entry != NULL; entry = entry->next) {
+    ulfius_metrics_aggregate(entry, metrics);
+    ulfius_metrics_printf(&buffer, "ulfius_requests_total{");
+    ulfius_metrics_print_entry_labels(&buffer, entry);
+    ulfius_metrics_printf(&buffer, "} %" PRIu64 "\n", metrics->nb_requests);
+  }
+
+  ulfius_metrics_printf(&buffer, "# HELP ulfius_responses_total Number of responses by endpoint and status class\n# TYPE ulfius_responses_total counter\n");
+  for (entry = entry_list; entry != NULL; entry = entry->next) {
+    ulfius_metrics_aggregate(entry, metrics);
+    for (i=0; i<5; i++) {
+      ulfius_metrics_printf(&buffer, "ulfius_responses_total{");
+      ulfius_metrics_print_entry_labels(&buffer, entry);
+      ulfius_metrics_printf(&buffer, ",status=\"%zuxx\"} %" PRIu64 "\n", i+1, metrics->nb_status[i]);
+    }
+  }
+
+  ulfius_metrics_printf(&buffer, "# HELP ulfius_request_phase_seconds Duration of the request phases by endpoint\n# TYPE ulfius_request_phase_seconds histogram\n");
+  for (entry = entry_list; entry != NULL; entry = entry->next) {
+    ulfius_metrics_aggregate(entry, metrics);
+    for (i=0; i<U_METRICS_NB_PHASES; i++) {
+      cumulative = 0;
+      for (j=0; j<U_METRICS_NB_BUCKETS; j++) {
+        cumulative += metrics->phases[i].buckets[j];
+        ulfius_metrics_printf(&buffer, "ulfius_request_phase_seconds_bucket{");
+        ulfius_metrics_print_entry_labels(&buffer, entry);
+        if (j < U_METRICS_NB_BUCKETS - 1) {
+          ulfius_metrics_printf(&buffer, ",phase=\"%s\",le=\"%.6f\"} %" PRIu64 "\n", phase_names[i], (double)ulfius_metrics_bucket_limit(j)/1000000, cumulative);
+        } else {
+          ulfius_metrics_printf(&buffer, ",phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", phase_names[i], cumulative);
+        }
+      }
+      ulfius_metrics_printf(&buffer, "ulfius_request_phase_seconds_sum{");
+      ulfius_metrics_print_entry_labels(&buffer, entry);
+      ulfius_metrics_printf(&buffer, ",phase=\"%s\"} %.6f\n", phase_names[i], (double)metrics->phases[i].sum/1000000);
+      ulfius_metrics_printf(&buffer, "ulfius_request_phase_seconds_count{");
+      ulfius_metrics_print_entry_labels(&buffer, entry);
+      ulfius_metrics_printf(&buffer, ",phase=\"%s\"} %" PRIu64 "\n", phase_names[i], metrics->phases[i].count);
+    }
+  }
+  o_free(metrics);
+
+  if (buffer.error) {
+    o_free(buffer.data);
+    return NULL;
+  } else {
+    return buffer.data;
+  }
+}
+
+/**
+ * ulfius_metrics_bucket_limit
+ * Get the upper limit of a histogram bucket
+ * return the upper limit in microseconds, UINT64_MAX for the last bucket
+ */
+uint64_t ulfius_metrics_bucket_limit(size_t index) {
+  if (index >= U_METRICS_NB_BUCKETS - 1) {
+    return UINT64_MAX;
+  } else if (index < 2) {
+    return index + 1;
+  } else if (index % 2) {
+    return (uint64_t)1 << (index/2 + 1);
+  } else {
+    return (uint64_t)3 << (index/2 - 1);
+  }
+}
@@ -33,100 +33,6 @@
 #define strtok_r strtok_s
 #endif
 
-/**
- * Splits the url to an array of char *
- */
-static char ** ulfius_split_url(const char * prefix, const char * url) {
-  char * saveptr = NULL, * cur_word = NULL, ** to_return = o_malloc(sizeof(char*)), * url_cpy = NULL, * url_cpy_addr = NULL;
-  int counter = 1;
-  
-  if (to_return != NULL) {
-    to_return[0] = NULL;
-    if (prefix != NULL) {
-      url_cpy = url_cpy_addr = o_strdup(prefix);
-      cur_word = strtok_r( url_cpy, ULFIUS_URL_SEPARATOR, &saveptr );
-      while (cur_word != NULL) {
-        to_return = o_realloc(to_return, (counter+1)*sizeof(char*));
-        if (to_return == NULL) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for ulfius_split_url.to_return");
-          break;
-        }
-        to_return[counter-1] = o_strdup(cur_word);
-        if (to_return[counter-1] == NULL) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for ulfius_split_url.to_return[counter-1]");
-          break;
-        }
-        to_return[counter] = NULL;
-        counter++;
-        cur_word = strtok_r( NULL, ULFIUS_URL_SEPARATOR, &saveptr );
-      }
-      o_free(url_cpy_addr);
-      url_cpy_addr = NULL;
-    }
-    if (url != NULL) {
-      url_cpy = url_cpy_addr = o_strdup(url);
-      cur_word = strtok_r( url_cpy, ULFIUS_URL_SEPARATOR, &saveptr );
-      while (cur_word != NULL) {
-        if (0 != o_strcmp("", cur_word) && cur_word[0] != '?') {
-          to_return = o_realloc(to_return, (counter+1)*sizeof(char*));
-          if (to_return == NULL) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for ulfius_split_url.to_return");
-            break;
-          }
-          to_return[counter-1] = o_strdup(cur_word);
-          if (to_return[counter-1] == NULL) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for ulfius_split_url.to_return[counter-1]");
-            break;
-          }
-          to_return[counter] = NULL;
-          counter++;
-        }
-        cur_word = strtok_r( NULL, ULFIUS_URL_SEPARATOR, &saveptr );
-      }
-      o_free(url_cpy_addr);
-      url_cpy_addr = NULL;
-    }
-  } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for ulfius_split_url.to_return");
-  }
-  return to_return;
-}
-
-/**
- * Compare two endoints by their priorities
- * Used by qsort to compare endpoints
- */
-static int compare_endpoint_priorities(const void * a, const void * b) {
-  struct _u_endpoint * e1 = *(struct _u_endpoint **)a, * e2 = *(struct _u_endpoint **)b;
-  
-  if (e1->priority < e2->priority) {
-    return -1;
-  } else if (e1->priority > e2->priority) {
-    return 1;
-  } else {
-    return 0;
-  }
-}
-
-/**
- * ulfius_url_format_match
- * return true if splitted_url matches splitted_url_format
- * false otherwise
- */
-static int ulfius_url_format_match(const char ** splitted_url, const char ** splitted_url_format) {
-  int i;
-  
-  for (i=0; splitted_url_format[i] != NULL; i++) {
-    if (splitted_url_format[i][0] == '*' && splitted_url_format[i+1] == NULL) {
-      return 1;
-    }
-    if (splitted_url[i] == NULL || (splitted_url_format[i][0] != '@' && splitted_url_format[i][0] != ':' && 0 != o_strcmp(splitted_url_format[i], splitted_url[i]))) {
-      return 0;
-    }
-  }
-  return (splitted_url[i] == NULL && splitted_url_format[i] == NULL);
-}
-
 /**
  * Converts a hex character to its integer value
  */
@@ -163,65 +69,6 @@ static char * url_decode(const char * str) {
   }
 }
 
-/**
- * ulfius_endpoint_match
- * return the endpoint array matching the url called with the proper http method
- * the returned array always has its last value to NULL
- * return NULL on memory error
- * returned value must be free'd after use
- */
-struct _u_endpoint ** ulfius_endpoint_match(const char * method, const char * url, struct _u_endpoint * endpoint_list) {
-  char ** splitted_url, ** splitted_url_format;
-  struct _u_endpoint ** endpoint_returned = o_malloc(sizeof(struct _u_endpoint *));
-  int i;
-  size_t count = 0;
-  
-  if (endpoint_returned == NULL) {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for endpoint_returned");
-  } else {
-    endpoint_returned[0] = NULL;
-    if (method != NULL && url != NULL && endpoint_list != NULL) {
-      splitted_url = ulfius_split_url(url, NULL);
-      for (i=0; (splitted_url != NULL && !ulfius_equals_endpoints(&(endpoint_list[i]), ulfius_empty_endpoint())); i++) {
-        if (0 == o_strcasecmp(endpoint_list[i].http_method, method) || endpoint_list[i].http_method[0] == '*') {
-          splitted_url_format = ulfius_split_url(endpoint_list[i].url_prefix, endpoint_list[i].url_format);
-          if (splitted_url_format != NULL && ulfius_url_format_match((const char **)splitted_url, (const char **)splitted_url_format)) {
-            endpoint_returned = o_realloc(endpoint_returned, (count+2)*sizeof(struct _u_endpoint *));
-            if (endpoint_returned != NULL) {
-              endpoint_returned[count] = o_malloc(sizeof(struct _u_endpoint));
-              if (endpoint_returned[count] != NULL) {
-                if (ulfius_copy_endpoint(endpoint_returned[count], (endpoint_list + i)) != U_OK) {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_copy_endpoint for endpoint_returned[%zu]", count);
-                }
-              } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for endpoint_returned[%zu]", count);
-              }
-              endpoint_returned[count + 1] = NULL;
-            } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reallocating memory for endpoint_returned");
-            }
-            count++;
-            u_map_clean_enum(splitted_url_format);
-            splitted_url_format = NULL;
-          }
-          u_map_clean_enum(splitted_url_format);
-          splitted_url_format = NULL;
-        }
-      }
-      u_map_clean_enum(splitted_url);
-      splitted_url = NULL;
-    }
-  }
-  /* 
-   * only sort if endpoint_returned is != NULL
-   * can be NULL either after initial o_malloc() or after o_realloc()
-   */
-  if (endpoint_returned != NULL) {
-    qsort(endpoint_returned, count, sizeof(struct endpoint_list *), &compare_endpoint_priorities);
-  }
-  return endpoint_returned;
-}
-
 /**
  * ulfius_parse_url
  * fills map with the keys/values defined in the url that are described in the endpoint format url
@@ -294,33 +141,192 @@ int ulfius_parse_url(const char * url, const struct _u_endpoint * endpoint, stru
 }
 
 /**
- * ulfius_init_request
+ * Memory arena block, the data follows the header
+ */
+struct _u_arena_block {
+  struct _u_arena_block * next;
+  size_t                  size;
+  size_t                  used;
+};
+
+struct _u_arena {
+  struct _u_arena_block * block;
+  size_t                  block_size;
+};
+
+/**
+ * Alignment of the memory returned by ulfius_arena_alloc
+ */
+#define U_ARENA_ALIGNMENT 16
+#define U_ARENA_ALIGN(size) (((size) + U_ARENA_ALIGNMENT - 1) & ~((size_t)U_ARENA_ALIGNMENT - 1))
+
+/**
+ * ulfius_arena_init
+ * Create a memory arena, the arena is stored in its first block
+ * return NULL on memory error
+ */
+struct _u_arena * ulfius_arena_init(size_t block_size) {
+  struct _u_arena_block * block;
+  struct _u_arena * arena = NULL;
+  
+  if (block_size < U_ARENA_ALIGN(sizeof(struct _u_arena_block)) + U_ARENA_ALIGN(sizeof(struct _u_arena))) {
+    block_size = U_ARENA_BLOCK_SIZE;
+  }
+  if ((block = o_malloc(block_size)) != NULL) {
+    block->next = NULL;
+    block->size = block_size;
+    block->used = U_ARENA_ALIGN(sizeof(struct _u_arena_block)) + U_ARENA_ALIGN(sizeof(struct _u_arena));
+    arena = (struct _u_arena *)((char *)block + U_ARENA_ALIGN(sizeof(struct _u_arena_block)));
+    arena->block = block;
+    arena->block_size = block_size;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for arena");
+  }
+  return arena;
+}
+
+/**
+ * ulfius_arena_alloc
+ * Allocate size bytes in the arena
+ * return NULL on memory error
+ */
+void * ulfius_arena_alloc(struct _u_arena * arena, size_t size) {
+  struct _u_arena_block * block;
+  size_t header_size = U_ARENA_ALIGN(sizeof(struct _u_arena_block)), block_size;
+  void * ptr;
+  
+  if (arena == NULL || !size) {
+    return NULL;
+  }
+  size = U_ARENA_ALIGN(size);
+  if (arena->block->used + size <= arena->block->size) {
+    ptr = (char *)arena->block + arena->block->used;
+    arena->block->used += size;
+    return ptr;
+  }
+  // Allocate a new block, a large allocation gets its own block
+  // so the current block keeps serving the small ones
+  block_size = header_size + size > arena->block_size ? header_size + size : arena->block_size;
+  if ((block = o_malloc(block_size)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for arena block");
+    return NULL;
+  }
+  block->size = block_size;
+  block->used = header_size + size;
+  if (block_size > arena->block_size) {
+    block->next = arena->block->next;
+    arena->block->next = block;
+  } else {
+    block->next = arena->block;
+    arena->block = block;
+  }
+  return (char *)block + header_size;
+}
+
+/**
+ * ulfius_arena_strndup
+ * Duplicate at most len characters of str in the arena
+ * return NULL on error
+ */
+char * ulfius_arena_strndup(struct _u_arena * arena, const char * str, size_t len) {
+  char * dup;
+  
+  if (str == NULL) {
+    return NULL;
+  }
+  len = strnlen(str, len);
+  if ((dup = ulfius_arena_alloc(arena, len + 1)) != NULL) {
+    memcpy(dup, str, len);
+    dup[len] = '\0';
+  }
+  return dup;
+}
+
+/**
+ * ulfius_arena_free
+ * Release all the memory of the arena, including the arena itself
+ */
+void ulfius_arena_free(struct _u_arena * arena) {
+  struct _u_arena_block * block, * next;
+  
+  if (arena != NULL) {
+    // The arena is stored in one of its blocks, so its fields are read only once
+    for (block = arena->block; block != NULL; block = next) {
+      next = block->next;
+      o_free(block);
+    }
+  }
+}
+
+/**
+ * ulfius_request_alloc
+ * Allocate memory that lives as long as the request
+ * The memory is released by the framework in one shot when the request is complete,
+ * it must not be freed or reallocated
+ * Available only for a request dispatched by the framework, i.e. in a callback function
+ * return a pointer to the allocated memory, NULL on error
+ */
+void * ulfius_request_alloc(const struct _u_request * request, size_t size) {
+  if (request != NULL && request->arena != NULL) {
+    return ulfius_arena_alloc((struct _u_arena *)request->arena, size);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_request_alloc, request isn't dispatched by the framework");
+    return NULL;
+  }
+}
+
+/**
+ * internal_ulfius_init_request
  * Initialize a request structure by allocating inner elements
+ * the maps are allocated in arena if it's not NULL
  * return U_OK on success
  */
-int ulfius_init_request(struct _u_request * request) {
+static int internal_ulfius_init_request(struct _u_request * request, struct _u_arena * arena) {
   if (request != NULL) {
-    request->map_url = o_malloc(sizeof(struct _u_map));
+    request->arena = arena;
+    if (arena != NULL) {
+      request->map_url = ulfius_arena_alloc(arena, sizeof(struct _u_map));
+      request->map_header = ulfius_arena_alloc(arena, sizeof(struct _u_map));
+      request->map_cookie = ulfius_arena_alloc(arena, sizeof(struct _u_map));
+      request->map_post_body = ulfius_arena_alloc(arena, sizeof(struct _u_map));
+    } else {
+      request->map_url = o_malloc(sizeof(struct _u_map));
+      request->map_header = o_malloc(sizeof(struct _u_map));
+      request->map_cookie = o_malloc(sizeof(struct _u_map));
+      request->map_post_body = o_malloc(sizeof(struct _u_map));
+    }
     request->auth_basic_user = NULL;
     request->auth_basic_password = NULL;
-    request->map_header = o_malloc(sizeof(struct _u_map));
-    request->map_cookie = o_malloc(sizeof(struct _u_map));
-    request->map_post_body = o_malloc(sizeof(struct _u_map));
+    request->http_protocol = NULL;
+    request->http_verb = NULL;
+    request->http_url = NULL;
+    request->url_path = NULL;
+    request->proxy = NULL;
+    request->ca_path = NULL;
+    request->client_address = NULL;
+    request->binary_body = NULL;
+#ifndef U_DISABLE_GNUTLS
+    request->client_cert = NULL;
+    request->client_cert_file = NULL;
+    request->client_key_file = NULL;
+    request->client_key_password = NULL;
+#endif
     if (request->map_post_body == NULL || request->map_cookie == NULL || 
         request->map_url == NULL || request->map_header == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for request->map*");
-      ulfius_clean_request(request);
+      if (arena == NULL) {
+        o_free(request->map_url);
+        o_free(request->map_header);
+        o_free(request->map_cookie);
+        o_free(request->map_post_body);
+      }
+      request->map_url = request->map_header = request->map_cookie = request->map_post_body = NULL;
       return U_ERROR_MEMORY;
     }
     u_map_init(request->map_url);
     u_map_init(request->map_header);
     u_map_init(request->map_cookie);
     u_map_init(request->map_post_body);
-    request->http_protocol = NULL;
-    request->http_verb = NULL;
-    request->http_url = NULL;
-    request->url_path = NULL;
-    request->proxy = NULL;
 #if MHD_VERSION >= 0x00095208
     request->network_type = U_USE_ALL;
 #endif
@@ -330,23 +336,33 @@ int ulfius_init_request(struct _u_request * request) {
     request->check_proxy_certificate = 1;
     request->check_proxy_certificate_flag = U_SSL_VERIFY_PEER|U_SSL_VERIFY_HOSTNAME;
     request->follow_redirect = 0;
-    request->ca_path = NULL;
-    request->client_address = NULL;
-    request->binary_body = NULL;
     request->binary_body_length = 0;
     request->callback_position = 0;
-#ifndef U_DISABLE_GNUTLS
-    request->client_cert = NULL;
-    request->client_cert_file = NULL;
-    request->client_key_file = NULL;
-    request->client_key_password = NULL;
-#endif
     return U_OK;
   } else {
     return U_ERROR_PARAMS;
   }
 }
 
+/**
+ * ulfius_init_request
+ * Initialize a request structure by allocating inner elements
+ * return U_OK on success
+ */
+int ulfius_init_request(struct _u_request * request) {
+  return internal_ulfius_init_request(request, NULL);
+}
+
+/**
+ * ulfius_init_request_arena
+ * Initialize a request dispatched by the framework
+ * The maps of the request and the strings set by the framework are allocated in arena
+ * return U_OK on success
+ */
+int ulfius_init_request_arena(struct _u_request * request, struct _u_arena * arena) {
+  return internal_ulfius_init_request(request, arena);
+}
+
 /**
  * ulfius_clean_request
  * clean the specified request's inner elements
@@ -356,23 +372,32 @@ int ulfius_init_request(struct _u_request * request) {
  */
 int ulfius_clean_request(struct _u_request * request) {
   if (request != NULL) {
-    o_free(request->http_protocol);
-    o_free(request->http_verb);
-    o_free(request->http_url);
-    o_free(request->url_path);
+    if (request->arena == NULL) {
+      o_free(request->http_protocol);
+      o_free(request->http_verb);
+      o_free(request->http_url);
+      o_free(request->url_path);
+      o_free(request->client_address);
+      u_map_clean_full(request->map_url);
+      u_map_clean_full(request->map_header);
+      u_map_clean_full(request->map_cookie);
+      u_map_clean_full(request->map_post_body);
+    } else {
+      // These elements belong to the arena of the request
+      u_map_clean(request->map_url);
+      u_map_clean(request->map_header);
+      u_map_clean(request->map_cookie);
+      u_map_clean(request->map_post_body);
+    }
     o_free(request->proxy);
     o_free(request->auth_basic_user);
     o_free(request->auth_basic_password);
-    o_free(request->client_address);
     o_free(request->ca_path);
-    u_map_clean_full(request->map_url);
-    u_map_clean_full(request->map_header);
-    u_map_clean_full(request->map_cookie);
-    u_map_clean_full(request->map_post_body);
     o_free(request->binary_body);
     request->http_protocol = NULL;
     request->http_verb = NULL;
     request->http_url = NULL;
+    request->url_path = NULL;
     request->proxy = NULL;
     request->client_address = NULL;
     request->map_url = NULL;
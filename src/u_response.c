@@ -23,6 +23,7 @@
  * 
  */
 #include <string.h>
+#include <unistd.h>
 
 #include "u_private.h"
 #include "ulfius.h"
@@ -383,6 +384,10 @@ int ulfius_clean_response(struct _u_response * response) {
     response->auth_realm = NULL;
     response->map_cookie = NULL;
     response->binary_body = NULL;
+    if (response->file_fd >= 0) {
+      close(response->file_fd);
+      response->file_fd = -1;
+    }
 #ifndef U_DISABLE_WEBSOCKET
     /* ulfius_clean_response might be called without websocket_handle being initialized */
     if ((struct _websocket_handle *)response->websocket_handle) {
@@ -419,6 +424,9 @@ int ulfius_clean_response_full(struct _u_response * response) {
 int ulfius_init_response(struct _u_response * response) {
   if (response != NULL) {
     response->status = 200;
+    response->file_fd = -1;
+    response->file_offset = 0;
+    response->file_size = 0;
     response->map_header = o_malloc(sizeof(struct _u_map));
     if (response->map_header == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for response->map_header");
@@ -440,6 +448,7 @@ int ulfius_init_response(struct _u_response * response) {
     response->stream_user_data = NULL;
     response->timeout = 0;
     response->shared_data = NULL;
+    response->async_handle = NULL;
 #ifndef U_DISABLE_WEBSOCKET
     response->websocket_handle = o_malloc(sizeof(struct _websocket_handle));
     if (response->websocket_handle == NULL) {
@@ -454,6 +463,10 @@ int ulfius_init_response(struct _u_response * response) {
     ((struct _websocket_handle *)response->websocket_handle)->websocket_incoming_user_data = NULL;
     ((struct _websocket_handle *)response->websocket_handle)->websocket_onclose_callback = NULL;
     ((struct _websocket_handle *)response->websocket_handle)->websocket_onclose_user_data = NULL;
+    ((struct _websocket_handle *)response->websocket_handle)->deflate_server_max_window_bits = 0;
+    ((struct _websocket_handle *)response->websocket_handle)->deflate_client_max_window_bits = 0;
+    ((struct _websocket_handle *)response->websocket_handle)->deflate_server_no_context_takeover = 0;
+    ((struct _websocket_handle *)response->websocket_handle)->deflate_client_no_context_takeover = 0;
 #endif
     return U_OK;
   } else {
@@ -513,6 +526,16 @@ int ulfius_copy_response(struct _u_response * dest, const struct _u_response * s
       dest->stream_user_data = source->stream_user_data;
     }
     
+    if (source->file_fd >= 0) {
+      dest->file_fd = dup(source->file_fd);
+      if (dest->file_fd < 0) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error duplicating source->file_fd");
+        return U_ERROR;
+      }
+      dest->file_offset = source->file_offset;
+      dest->file_size = source->file_size;
+    }
+    
     dest->shared_data = source->shared_data;
     dest->timeout = source->timeout;
 #ifndef U_DISABLE_WEBSOCKET
@@ -525,6 +548,10 @@ int ulfius_copy_response(struct _u_response * dest, const struct _u_response * s
       ((struct _websocket_handle *)dest->websocket_handle)->websocket_incoming_user_data = ((struct _websocket_handle *)source->websocket_handle)->websocket_incoming_user_data;
       ((struct _websocket_handle *)dest->websocket_handle)->websocket_onclose_callback = ((struct _websocket_handle *)source->websocket_handle)->websocket_onclose_callback;
       ((struct _websocket_handle *)dest->websocket_handle)->websocket_onclose_user_data = ((struct _websocket_handle *)source->websocket_handle)->websocket_onclose_user_data;
+      ((struct _websocket_handle *)dest->websocket_handle)->deflate_server_max_window_bits = ((struct _websocket_handle *)source->websocket_handle)->deflate_server_max_window_bits;
+      ((struct _websocket_handle *)dest->websocket_handle)->deflate_client_max_window_bits = ((struct _websocket_handle *)source->websocket_handle)->deflate_client_max_window_bits;
+      ((struct _websocket_handle *)dest->websocket_handle)->deflate_server_no_context_takeover = ((struct _websocket_handle *)source->websocket_handle)->deflate_server_no_context_takeover;
+      ((struct _websocket_handle *)dest->websocket_handle)->deflate_client_no_context_takeover = ((struct _websocket_handle *)source->websocket_handle)->deflate_client_no_context_takeover;
     }
 #endif
     return U_OK;
@@ -610,6 +637,25 @@ int ulfius_set_binary_body_response(struct _u_response * response, const unsigne
   }
 }
 
+/**
+ * ulfius_set_binary_body_response_no_copy
+ * Set a binary binary_body to a response without copying it
+ * The response takes ownership of binary_body on success
+ * return U_OK on success
+ */
+int ulfius_set_binary_body_response_no_copy(struct _u_response * response, const unsigned int status, char * binary_body, const size_t length) {
+  if (response != NULL && binary_body != NULL && length > 0) {
+    // Free all the bodies available
+    o_free(response->binary_body);
+    response->binary_body = binary_body;
+    response->binary_body_length = length;
+    response->status = status;
+    return U_OK;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
 /**
  * ulfius_set_empty_body_response
  * Set an empty response with only a status
@@ -661,6 +707,32 @@ int ulfius_set_stream_response(struct _u_response * response,
   }
 }
 
+/**
+ * ulfius_set_fd_response
+ * Set a response with a status and a body read from a file descriptor
+ * The response takes ownership of fd on success
+ * return U_OK on success
+ */
+int ulfius_set_fd_response(struct _u_response * response, const unsigned int status, int fd, uint64_t offset, uint64_t size) {
+  if (response != NULL && fd >= 0) {
+    // Free all the bodies available
+    o_free(response->binary_body);
+    response->binary_body = NULL;
+    response->binary_body_length = 0;
+    if (response->file_fd >= 0 && response->file_fd != fd) {
+      close(response->file_fd);
+    }
+    
+    response->status = status;
+    response->file_fd = fd;
+    response->file_offset = offset;
+    response->file_size = size;
+    return U_OK;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
 #ifndef U_DISABLE_JANSSON
 /**
  * ulfius_set_json_body_response
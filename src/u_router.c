@@ -0,0 +1,616 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_router.c: endpoint routing tree functions definitions
+ *
+ * Copyright 2019 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "u_private.h"
+#include "ulfius.h"
+
+struct _u_route_node;
+
+/**
+ * Static segment leading to a child node
+ * segment isn't '\0'-terminated, use segment_len
+ */
+struct _u_route_static {
+  char                 * segment;
+  size_t                 segment_len;
+  struct _u_route_node * node;
+};
+
+/**
+ * Node of the routing tree, one level per url segment
+ * static_list is sorted by segment length then segment value
+ * param_node is the child for all the segments starting with ':' or '@'
+ * terminal_list contains the endpoints whose format ends on this node
+ * wildcard_list contains the endpoints whose format ends on this node with a segment starting with '*'
+ */
+struct _u_route_node {
+  struct _u_route_static    * static_list;
+  size_t                      nb_static;
+  struct _u_route_node      * param_node;
+  const struct _u_endpoint ** terminal_list;
+  size_t                      nb_terminal;
+  const struct _u_endpoint ** wildcard_list;
+  size_t                      nb_wildcard;
+};
+
+/**
+ * Immutable snapshot of the endpoints of an instance
+ * The routing tree references the endpoints of endpoint_list,
+ * which are copies owned by the snapshot
+ * The snapshot is freed when refcount reaches 0,
+ * the handle holds one reference on its current snapshot
+ */
+struct _u_router {
+  struct _u_route_node   root;
+  struct _u_endpoint   * endpoint_list;
+  size_t                 nb_endpoints;
+  struct _u_endpoint   * default_endpoint;
+  struct _u_metrics_entry ** metrics;
+  struct _u_metrics_entry  * default_metrics;
+  int                    has_body_callback;
+  unsigned int           refcount;
+};
+
+/**
+ * Hazard pointer record
+ * A reader sets router while it takes a reference on the snapshot,
+ * so the snapshot can't be freed in between
+ * The records are reused by the readers and freed with the handle
+ */
+struct _u_router_hazard {
+  struct _u_router        * router;
+  int                       active;
+  struct _u_router_hazard * next;
+};
+
+/**
+ * Holds the current snapshot of an instance
+ * current and hazard_list are read and updated atomically, readers never lock
+ * write_lock serializes the writers
+ */
+struct _u_router_handle {
+  struct _u_router        * current;
+  struct _u_router_hazard * hazard_list;
+  pthread_mutex_t           write_lock;
+};
+
+/**
+ * Matches found during a lookup, sorted by priority
+ */
+struct _u_route_match {
+  const struct _u_endpoint ** endpoint_list;
+  size_t                      size;
+  size_t                      count;
+};
+
+/**
+ * Return the next url segment starting from url and sets its length in len
+ * len is 0 if there is no more segment
+ */
+static const char * ulfius_router_next_segment(const char * url, size_t * len) {
+  while (*url == '/') {
+    url++;
+  }
+  *len = strcspn(url, ULFIUS_URL_SEPARATOR);
+  return url;
+}
+
+static int ulfius_router_compare_segment(const char * segment1, size_t segment1_len, const char * segment2, size_t segment2_len) {
+  if (segment1_len != segment2_len) {
+    return segment1_len<segment2_len?-1:1;
+  } else {
+    return memcmp(segment1, segment2, segment1_len);
+  }
+}
+
+/**
+ * Look for the static child matching segment using a binary search
+ * Return the index of the child if found, or the index where the child should be inserted and set found to 0
+ */
+static size_t ulfius_router_search_static(const struct _u_route_node * node, const char * segment, size_t segment_len, int * found) {
+  size_t low = 0, high = node->nb_static, mid;
+  int cmp;
+
+  while (low < high) {
+    mid = low + ((high - low) / 2);
+    cmp = ulfius_router_compare_segment(node->static_list[mid].segment, node->static_list[mid].segment_len, segment, segment_len);
+    if (!cmp) {
+      *found = 1;
+      return mid;
+    } else if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  *found = 0;
+  return low;
+}
+
+static struct _u_route_node * ulfius_router_new_node() {
+  struct _u_route_node * node = o_malloc(sizeof(struct _u_route_node));
+
+  if (node != NULL) {
+    memset(node, 0, sizeof(struct _u_route_node));
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for route node");
+  }
+  return node;
+}
+
+/**
+ * Return the child of node for segment, create it if necessary
+ * Return NULL on memory error
+ */
+static struct _u_route_node * ulfius_router_get_child(struct _u_route_node * node, const char * segment, size_t segment_len) {
+  struct _u_route_static * static_list;
+  size_t index;
+  int found;
+
+  if (segment[0] == ':' || segment[0] == '@') {
+    if (node->param_node == NULL) {
+      node->param_node = ulfius_router_new_node();
+    }
+    return node->param_node;
+  } else {
+    index = ulfius_router_search_static(node, segment, segment_len, &found);
+    if (found) {
+      return node->static_list[index].node;
+    }
+    if ((static_list = o_realloc(node->static_list, (node->nb_static + 1)*sizeof(struct _u_route_static))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for node->static_list");
+      return NULL;
+    }
+    node->static_list = static_list;
+    memmove(node->static_list + index + 1, node->static_list + index, (node->nb_static - index)*sizeof(struct _u_route_static));
+    node->static_list[index].segment = o_strndup(segment, segment_len);
+    node->static_list[index].segment_len = segment_len;
+    node->static_list[index].node = ulfius_router_new_node();
+    node->nb_static++;
+    if (node->static_list[index].segment == NULL || node->static_list[index].node == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for static route node");
+      return NULL;
+    }
+    return node->static_list[index].node;
+  }
+}
+
+static int ulfius_router_append_endpoint(const struct _u_endpoint *** endpoint_list, size_t * nb_endpoints, const struct _u_endpoint * endpoint) {
+  const struct _u_endpoint ** new_list = o_realloc(*endpoint_list, ((*nb_endpoints) + 1)*sizeof(struct _u_endpoint *));
+
+  if (new_list != NULL) {
+    new_list[*nb_endpoints] = endpoint;
+    (*endpoint_list) = new_list;
+    (*nb_endpoints)++;
+    return U_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for route endpoint list");
+    return U_ERROR_MEMORY;
+  }
+}
+
+/**
+ * Insert an endpoint in the routing tree
+ * The url segments are the words of url_prefix followed by the words of url_format
+ * that don't start with '?', like in ulfius_parse_url
+ */
+static int ulfius_router_insert(struct _u_route_node * root, const struct _u_endpoint * endpoint) {
+  struct _u_route_node * node = root;
+  const char * url, * segment = NULL, * next;
+  size_t segment_len = 0, next_len;
+  int part;
+
+  for (part = 0; part < 2 && node != NULL; part++) {
+    url = part?endpoint->url_format:endpoint->url_prefix;
+    if (url != NULL) {
+      next = ulfius_router_next_segment(url, &next_len);
+      while (next_len && node != NULL) {
+        if (!part || next[0] != '?') {
+          // The previous segment isn't the last one, go down one level
+          if (segment != NULL) {
+            node = ulfius_router_get_child(node, segment, segment_len);
+          }
+          segment = next;
+          segment_len = next_len;
+        }
+        next = ulfius_router_next_segment(next + next_len, &next_len);
+      }
+    }
+  }
+
+  if (node != NULL && segment != NULL && segment[0] == '*') {
+    return ulfius_router_append_endpoint(&node->wildcard_list, &node->nb_wildcard, endpoint);
+  } else {
+    if (node != NULL && segment != NULL) {
+      node = ulfius_router_get_child(node, segment, segment_len);
+    }
+    if (node != NULL) {
+      return ulfius_router_append_endpoint(&node->terminal_list, &node->nb_terminal, endpoint);
+    } else {
+      return U_ERROR_MEMORY;
+    }
+  }
+}
+
+static void ulfius_router_clean_node(struct _u_route_node * node) {
+  size_t i;
+
+  if (node != NULL) {
+    for (i=0; i<node->nb_static; i++) {
+      o_free(node->static_list[i].segment);
+      ulfius_router_clean_node(node->static_list[i].node);
+      o_free(node->static_list[i].node);
+    }
+    o_free(node->static_list);
+    ulfius_router_clean_node(node->param_node);
+    o_free(node->param_node);
+    o_free(node->terminal_list);
+    o_free(node->wildcard_list);
+  }
+}
+
+/**
+ * Add endpoint to the matches if the method fits
+ * The matches are sorted by priority, then by their position in the endpoint list
+ */
+static void ulfius_router_add_match(struct _u_route_match * match, const struct _u_endpoint * endpoint, const char * method) {
+  size_t i;
+
+  if (0 == o_strcasecmp(endpoint->http_method, method) || endpoint->http_method[0] == '*') {
+    if (match->count < match->size) {
+      for (i=match->count; i>0 && (match->endpoint_list[i-1]->priority > endpoint->priority || (match->endpoint_list[i-1]->priority == endpoint->priority && match->endpoint_list[i-1] > endpoint)); i--) {
+        match->endpoint_list[i] = match->endpoint_list[i-1];
+      }
+      match->endpoint_list[i] = endpoint;
+    }
+    match->count++;
+  }
+}
+
+static void ulfius_router_lookup(const struct _u_route_node * node, const char * method, const char * url, struct _u_route_match * match) {
+  const char * segment;
+  size_t segment_len, i, index;
+  int found;
+
+  segment = ulfius_router_next_segment(url, &segment_len);
+
+  // '*' matches the rest of the url, even if there is none
+  for (i=0; i<node->nb_wildcard; i++) {
+    ulfius_router_add_match(match, node->wildcard_list[i], method);
+  }
+  if (!segment_len) {
+    for (i=0; i<node->nb_terminal; i++) {
+      ulfius_router_add_match(match, node->terminal_list[i], method);
+    }
+  } else {
+    index = ulfius_router_search_static(node, segment, segment_len, &found);
+    if (found) {
+      ulfius_router_lookup(node->static_list[index].node, method, segment + segment_len, match);
+    }
+    if (node->param_node != NULL) {
+      ulfius_router_lookup(node->param_node, method, segment + segment_len, match);
+    }
+  }
+}
+
+static void ulfius_router_free(struct _u_router * router) {
+  size_t i;
+
+  if (router != NULL) {
+    ulfius_router_clean_node(&router->root);
+    for (i=0; i<router->nb_endpoints; i++) {
+      ulfius_clean_endpoint(&router->endpoint_list[i]);
+    }
+    o_free(router->endpoint_list);
+    o_free(router->metrics);
+    if (router->default_endpoint != NULL) {
+      ulfius_clean_endpoint(router->default_endpoint);
+      o_free(router->default_endpoint);
+    }
+    o_free(router);
+  }
+}
+
+/**
+ * Build a snapshot with a copy of endpoint_list and default_endpoint and its routing tree
+ * return NULL on memory error
+ */
+static struct _u_router * ulfius_router_build(const struct _u_endpoint * endpoint_list, const struct _u_endpoint * default_endpoint, struct _u_metrics * metrics) {
+  struct _u_router * router = o_malloc(sizeof(struct _u_router));
+  size_t nb_endpoints = 0, i;
+
+  if (router == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for router");
+    return NULL;
+  }
+  memset(router, 0, sizeof(struct _u_router));
+  router->refcount = 1;
+  while (endpoint_list != NULL && !ulfius_equals_endpoints(&endpoint_list[nb_endpoints], ulfius_empty_endpoint())) {
+    nb_endpoints++;
+  }
+  if (nb_endpoints) {
+    if ((router->endpoint_list = o_malloc(nb_endpoints*sizeof(struct _u_endpoint))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for router->endpoint_list");
+      ulfius_router_free(router);
+      return NULL;
+    }
+    for (i=0; i<nb_endpoints; i++) {
+      router->nb_endpoints++;
+      if (ulfius_copy_endpoint(&router->endpoint_list[i], &endpoint_list[i]) != U_OK || ulfius_router_insert(&router->root, &router->endpoint_list[i]) != U_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error inserting endpoint in the router");
+        ulfius_router_free(router);
+        return NULL;
+      }
+      if (router->endpoint_list[i].body_callback != NULL) {
+        router->has_body_callback = 1;
+      }
+    }
+    if (metrics != NULL) {
+      if ((router->metrics = o_malloc(nb_endpoints*sizeof(struct _u_metrics_entry *))) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for router->metrics");
+        ulfius_router_free(router);
+        return NULL;
+      }
+      for (i=0; i<nb_endpoints; i++) {
+        router->metrics[i] = ulfius_metrics_get_entry(metrics, &router->endpoint_list[i]);
+      }
+    }
+  }
+  if (default_endpoint != NULL) {
+    if ((router->default_endpoint = o_malloc(sizeof(struct _u_endpoint))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for router->default_endpoint");
+      ulfius_router_free(router);
+      return NULL;
+    }
+    ulfius_copy_endpoint(router->default_endpoint, default_endpoint);
+    if (router->default_endpoint->body_callback != NULL) {
+      router->has_body_callback = 1;
+    }
+    if (metrics != NULL) {
+      router->default_metrics = ulfius_metrics_get_entry(metrics, router->default_endpoint);
+    }
+  }
+  return router;
+}
+
+/**
+ * Get an inactive hazard record or add a new one to the list
+ * return NULL on memory error
+ */
+static struct _u_router_hazard * ulfius_router_hazard_acquire(struct _u_router_handle * handle) {
+  struct _u_router_hazard * hazard;
+  int inactive;
+
+  for (hazard = __atomic_load_n(&handle->hazard_list, __ATOMIC_ACQUIRE); hazard != NULL; hazard = hazard->next) {
+    inactive = 0;
+    if (__atomic_load_n(&hazard->active, __ATOMIC_RELAXED) == 0 && __atomic_compare_exchange_n(&hazard->active, &inactive, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return hazard;
+    }
+  }
+  if ((hazard = o_malloc(sizeof(struct _u_router_hazard))) != NULL) {
+    hazard->router = NULL;
+    hazard->active = 1;
+    hazard->next = __atomic_load_n(&handle->hazard_list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&handle->hazard_list, &hazard->next, hazard, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for router hazard");
+  }
+  return hazard;
+}
+
+/**
+ * Return 1 if a reader is taking a reference on router
+ */
+static int ulfius_router_is_hazard(struct _u_router_handle * handle, const struct _u_router * router) {
+  struct _u_router_hazard * hazard;
+
+  for (hazard = __atomic_load_n(&handle->hazard_list, __ATOMIC_ACQUIRE); hazard != NULL; hazard = hazard->next) {
+    if (__atomic_load_n(&hazard->router, __ATOMIC_SEQ_CST) == router) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * ulfius_router_handle_init
+ * Allocate a router handle without snapshot
+ * return NULL on error
+ */
+struct _u_router_handle * ulfius_router_handle_init() {
+  struct _u_router_handle * handle = o_malloc(sizeof(struct _u_router_handle));
+
+  if (handle != NULL) {
+    handle->current = NULL;
+    handle->hazard_list = NULL;
+    if (pthread_mutex_init(&handle->write_lock, NULL)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing router write_lock");
+      o_free(handle);
+      handle = NULL;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for router handle");
+  }
+  return handle;
+}
+
+/**
+ * ulfius_router_handle_clean
+ * Free the router handle and its current snapshot
+ * Must not be called while requests are dispatched
+ */
+void ulfius_router_handle_clean(struct _u_router_handle * handle) {
+  struct _u_router_hazard * hazard, * next;
+
+  if (handle != NULL) {
+    ulfius_router_release(handle->current);
+    for (hazard = handle->hazard_list; hazard != NULL; hazard = next) {
+      next = hazard->next;
+      o_free(hazard);
+    }
+    pthread_mutex_destroy(&handle->write_lock);
+    o_free(handle);
+  }
+}
+
+/**
+ * ulfius_router_lock
+ * Lock the handle against the other writers
+ * Readers are never blocked
+ */
+void ulfius_router_lock(struct _u_router_handle * handle) {
+  if (handle != NULL) {
+    pthread_mutex_lock(&handle->write_lock);
+  }
+}
+
+/**
+ * ulfius_router_unlock
+ * Unlock the handle for the other writers
+ */
+void ulfius_router_unlock(struct _u_router_handle * handle) {
+  if (handle != NULL) {
+    pthread_mutex_unlock(&handle->write_lock);
+  }
+}
+
+/**
+ * ulfius_router_publish
+ * Build a new snapshot of endpoint_list and default_endpoint
+ * and make it the current one
+ * If metrics isn't NULL, the metrics entry of each endpoint is kept in the snapshot
+ * The previous snapshot is freed when its last user releases it
+ * The caller must hold the handle lock
+ * return U_OK on success
+ */
+int ulfius_router_publish(struct _u_router_handle * handle, const struct _u_endpoint * endpoint_list, const struct _u_endpoint * default_endpoint, struct _u_metrics * metrics) {
+  struct _u_router * router, * previous;
+
+  if (handle == NULL) {
+    return U_ERROR_PARAMS;
+  }
+  if ((router = ulfius_router_build(endpoint_list, default_endpoint, metrics)) == NULL) {
+    return U_ERROR_MEMORY;
+  }
+  previous = __atomic_exchange_n(&handle->current, router, __ATOMIC_SEQ_CST);
+  if (previous != NULL) {
+    // Wait for the readers that have loaded the previous snapshot to take their reference,
+    // this only lasts a few instructions and the new readers load the new snapshot
+    while (ulfius_router_is_hazard(handle, previous)) {
+      sched_yield();
+    }
+    ulfius_router_release(previous);
+  }
+  return U_OK;
+}
+
+/**
+ * ulfius_router_acquire
+ * Return the current snapshot and take a reference on it without locking
+ * The endpoints of the snapshot stay valid until ulfius_router_release is called
+ * return NULL if no snapshot was published
+ */
+const struct _u_router * ulfius_router_acquire(struct _u_router_handle * handle) {
+  struct _u_router_hazard * hazard;
+  struct _u_router * router = NULL;
+
+  if (handle != NULL && (hazard = ulfius_router_hazard_acquire(handle)) != NULL) {
+    // Protect the snapshot with the hazard pointer, then check it's still the current one
+    do {
+      router = __atomic_load_n(&handle->current, __ATOMIC_SEQ_CST);
+      __atomic_store_n(&hazard->router, router, __ATOMIC_SEQ_CST);
+    } while (router != __atomic_load_n(&handle->current, __ATOMIC_SEQ_CST));
+    if (router != NULL) {
+      __atomic_add_fetch(&router->refcount, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&hazard->router, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&hazard->active, 0, __ATOMIC_RELEASE);
+  }
+  return router;
+}
+
+/**
+ * ulfius_router_release
+ * Release a reference on a snapshot, free it if it was the last one
+ */
+void ulfius_router_release(const struct _u_router * router) {
+  if (router != NULL && !__atomic_sub_fetch(&((struct _u_router *)router)->refcount, 1, __ATOMIC_ACQ_REL)) {
+    ulfius_router_free((struct _u_router *)router);
+  }
+}
+
+/**
+ * ulfius_router_get_default_endpoint
+ * return the default endpoint of the snapshot, NULL if none
+ */
+const struct _u_endpoint * ulfius_router_get_default_endpoint(const struct _u_router * router) {
+  return router!=NULL?router->default_endpoint:NULL;
+}
+
+/**
+ * ulfius_router_has_body_callback
+ * return true if an endpoint of the snapshot has a body_callback
+ */
+int ulfius_router_has_body_callback(const struct _u_router * router) {
+  return router!=NULL?router->has_body_callback:0;
+}
+
+/**
+ * ulfius_router_get_metrics
+ * return the metrics entry of an endpoint of the snapshot, NULL if none
+ */
+struct _u_metrics_entry * ulfius_router_get_metrics(const struct _u_router * router, const struct _u_endpoint * endpoint) {
+  if (router == NULL || endpoint == NULL) {
+    return NULL;
+  } else if (endpoint == router->default_endpoint) {
+    return router->default_metrics;
+  } else if (router->metrics != NULL && endpoint >= router->endpoint_list && endpoint < router->endpoint_list + router->nb_endpoints) {
+    return router->metrics[endpoint - router->endpoint_list];
+  } else {
+    return NULL;
+  }
+}
+
+/**
+ * ulfius_router_match
+ * Fill endpoint_list with at most size endpoints matching the method and url
+ * sorted by priority
+ * The lookup doesn't allocate memory
+ * return the total number of endpoints matching, may be greater than size
+ */
+size_t ulfius_router_match(const struct _u_router * router, const char * method, const char * url, const struct _u_endpoint ** endpoint_list, size_t size) {
+  struct _u_route_match match;
+
+  match.endpoint_list = endpoint_list;
+  match.size = endpoint_list!=NULL?size:0;
+  match.count = 0;
+  if (router != NULL && method != NULL && url != NULL) {
+    ulfius_router_lookup(&router->root, method, url, &match);
+  }
+  return match.count;
+}
@@ -149,18 +149,895 @@ static size_t smtp_payload_source(void * ptr, size_t size, size_t nmemb, void *
   return len;
 }
 
+/**
+ * Set the curl handle options to send the request
+ * header_list must be freed by the caller after the transfer
+ * return U_OK on success
+ */
+static int ulfius_set_curl_request(CURL * curl_handle,
+                                   struct _u_request * copy_request,
+                                   struct _u_response * response,
+                                   size_t (* write_body_function)(void * contents, size_t size, size_t nmemb, void * user_data),
+                                   void * write_body_data,
+                                   struct curl_slist ** header_list) {
+  char * key_esc = NULL, * value_esc = NULL, * cookie = NULL, * header = NULL, * fp = "?", * np = "&";
+  const char * value = NULL, ** keys = NULL;
+  int i, has_params = 0, ret = U_OK, exit_loop;
+
+  // Here comes the fake loop with breaks to exit smoothly
+  do {
+    // Set basic auth if defined
+    if (copy_request->auth_basic_user != NULL && copy_request->auth_basic_password != NULL) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC) == CURLE_OK) {
+        if (curl_easy_setopt(curl_handle, CURLOPT_USERNAME, copy_request->auth_basic_user) != CURLE_OK ||
+            curl_easy_setopt(curl_handle, CURLOPT_PASSWORD, copy_request->auth_basic_password) != CURLE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting HTTP Basic user name or password");
+          ret = U_ERROR_LIBCURL;
+          break;
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting HTTP Basic Auth option");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+
+#ifndef U_DISABLE_GNUTLS
+    // Set client certificate authentication if defined
+    if (copy_request->client_cert_file != NULL && copy_request->client_key_file != NULL) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_SSLCERT, copy_request->client_cert_file) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting client certificate file");
+        ret = U_ERROR_LIBCURL;
+        break;
+      } else if (curl_easy_setopt(curl_handle, CURLOPT_SSLKEY, copy_request->client_key_file) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting client key file");
+        ret = U_ERROR_LIBCURL;
+        break;
+      } else if (copy_request->client_key_password != NULL && curl_easy_setopt(curl_handle, CURLOPT_KEYPASSWD, copy_request->client_key_password) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting client key password");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+#endif
+
+    // Set proxy if defined
+    if (copy_request->proxy != NULL) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_PROXY, copy_request->proxy) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting proxy option");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+
+    // follow redirection if set
+    if (copy_request->follow_redirect) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting follow redirection option");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+
+#if MHD_VERSION >= 0x00095208
+    // Set network type
+    if (copy_request->network_type & U_USE_ALL) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_WHATEVER) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting IPRESOLVE WHATEVER option");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    } else if (copy_request->network_type & U_USE_IPV6) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V6) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting IPRESOLVE V6 option");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    } else {
+      if (curl_easy_setopt(curl_handle, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting IPRESOLVE V4 option");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+#endif
+
+    has_params = (o_strchr(copy_request->http_url, '?') != NULL);
+    if (u_map_count(copy_request->map_url) > 0) {
+      // Append url parameters
+      keys = u_map_enum_keys(copy_request->map_url);
+
+      exit_loop = 0;
+      // Append parameters from map_url
+      for (i=0; !exit_loop && keys != NULL && keys[i] != NULL; i++) {
+        key_esc = curl_easy_escape(curl_handle, keys[i], 0);
+        if (key_esc != NULL) {
+          value = u_map_get(copy_request->map_url, keys[i]);
+          if (value != NULL) {
+            value_esc = curl_easy_escape(curl_handle, value, 0);
+            if (value_esc != NULL) {
+              if (!has_params) {
+                copy_request->http_url = mstrcatf(copy_request->http_url, "%s%s=%s", fp, key_esc, value_esc);
+                has_params = 1;
+              } else {
+                copy_request->http_url = mstrcatf(copy_request->http_url, "%s%s=%s", np, key_esc, value_esc);
+              }
+              curl_free(value_esc);
+            } else {
+              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_escape for url parameter value %s=%s", keys[i], value);
+              exit_loop = 1;
+            }
+          } else {
+            if (!has_params) {
+              copy_request->http_url = mstrcatf(copy_request->http_url, "%s%s", fp, key_esc);
+              has_params = 1;
+            } else {
+              copy_request->http_url = mstrcatf(copy_request->http_url, "%s%s", np, key_esc);
+            }
+          }
+          curl_free(key_esc);
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_escape for url key %s", keys[i]);
+          exit_loop = 1;
+        }
+      }
+      if (exit_loop) {
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+
+    if (u_map_count(copy_request->map_post_body) > 0) {
+      o_free(copy_request->binary_body);
+      copy_request->binary_body = NULL;
+      copy_request->binary_body_length = 0;
+      // Append MHD_HTTP_POST_ENCODING_FORM_URLENCODED post parameters
+      keys = u_map_enum_keys(copy_request->map_post_body);
+      exit_loop = 0;
+      for (i=0; !exit_loop && keys != NULL && keys[i] != NULL; i++) {
+        // Build parameter
+        key_esc = curl_easy_escape(curl_handle, keys[i], 0);
+        if (key_esc != NULL) {
+          value = u_map_get(copy_request->map_post_body, keys[i]);
+          if (value != NULL) {
+            value_esc = curl_easy_escape(curl_handle, value, 0);
+            if (value_esc != NULL) {
+              if (!i) {
+                copy_request->binary_body = mstrcatf(copy_request->binary_body, "%s=%s", key_esc, value_esc);
+              } else {
+                copy_request->binary_body = mstrcatf(copy_request->binary_body, "%s%s=%s", np, key_esc, value_esc);
+              }
+              copy_request->binary_body_length = o_strlen(copy_request->binary_body);
+            } else {
+              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_escape for body parameter value %s=%s", keys[i], value);
+              exit_loop = 1;
+            }
+            o_free(value_esc);
+          } else {
+            if (!i) {
+              copy_request->binary_body = mstrcatf(copy_request->binary_body, "%s", key_esc);
+            } else {
+              copy_request->binary_body = mstrcatf(copy_request->binary_body, "%s%s", np, key_esc);
+            }
+            copy_request->binary_body_length = o_strlen(copy_request->binary_body);
+          }
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_escape for body key %s", keys[i]);
+          exit_loop = 1;
+        }
+        o_free(key_esc);
+      }
+
+      if (exit_loop) {
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+
+      if (u_map_put(copy_request->map_header, ULFIUS_HTTP_HEADER_CONTENT, MHD_HTTP_POST_ENCODING_FORM_URLENCODED) != U_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headr fields");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+
+    // Set body content
+    if (copy_request->binary_body_length && copy_request->binary_body != NULL) {
+      if (copy_request->binary_body_length < 2147483648) {
+        if (curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE, (curl_off_t)copy_request->binary_body_length) != CURLE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting POST fields size");
+          ret = U_ERROR_LIBCURL;
+          break;
+        }
+      } else {
+        if (curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)copy_request->binary_body_length) != CURLE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting POST fields size large");
+          ret = U_ERROR_LIBCURL;
+          break;
+        }
+      }
+
+      if (curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, copy_request->binary_body) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting POST fields");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+
+    if (u_map_count(copy_request->map_header) > 0) {
+      // Append map headers
+      keys = u_map_enum_keys(copy_request->map_header);
+      exit_loop = 0;
+      for (i=0; !exit_loop && keys != NULL && keys[i] != NULL; i++) {
+        // Build parameter
+        value = u_map_get(copy_request->map_header, keys[i]);
+        if (value != NULL) {
+          header = msprintf("%s:%s", keys[i], value);
+          if ((*header_list = curl_slist_append(*header_list, header)) == NULL) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_slist_append for header_list (1)");
+            exit_loop = 1;
+          }
+          o_free(header);
+        } else {
+          header = msprintf("%s:", keys[i]);
+          if ((*header_list = curl_slist_append(*header_list, header)) == NULL) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_slist_append for header_list (2)");
+            exit_loop = 1;
+          }
+          o_free(header);
+        }
+      }
+      if (exit_loop) {
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+
+    if (copy_request->map_cookie != NULL && u_map_count(copy_request->map_cookie) > 0) {
+      // Append cookies
+      keys = u_map_enum_keys(copy_request->map_cookie);
+      exit_loop = 0;
+      for (i=0; !exit_loop && keys != NULL && keys[i] != NULL; i++) {
+        // Build parameter
+        value = u_map_get(copy_request->map_cookie, keys[i]);
+        if (value != NULL) {
+          cookie = msprintf("%s=%s", keys[i], value);
+          if (curl_easy_setopt(curl_handle, CURLOPT_COOKIE, cookie) != CURLE_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting cookie %s", cookie);
+            exit_loop = 1;
+          }
+          o_free(cookie);
+        } else {
+          cookie = msprintf("%s:", keys[i]);
+          if (curl_easy_setopt(curl_handle, CURLOPT_COOKIE, cookie) != CURLE_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting cookie %s", cookie);
+            exit_loop = 1;
+          }
+          o_free(cookie);
+        }
+      }
+      if (exit_loop) {
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+
+    // Request parameters
+    if (curl_easy_setopt(curl_handle, CURLOPT_URL, copy_request->http_url) != CURLE_OK ||
+        curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, copy_request->http_verb!=NULL?copy_request->http_verb:"GET") != CURLE_OK ||
+        curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, *header_list) != CURLE_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (1)");
+      ret = U_ERROR_LIBCURL;
+      break;
+    }
+
+    // Set CURLOPT_WRITEFUNCTION if specified
+    if (write_body_function != NULL && curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_body_function) != CURLE_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (2)");
+      ret = U_ERROR_LIBCURL;
+      break;
+    }
+
+    // Set CURLOPT_WRITEDATA if specified
+    if (write_body_data != NULL && curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, write_body_data) != CURLE_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (3)");
+      ret = U_ERROR_LIBCURL;
+      break;
+    }
+
+    // Disable server certificate validation if needed
+    if (!copy_request->check_server_certificate) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 0) != CURLE_OK || curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYHOST, 0) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (4)");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    } else {
+      if (!(copy_request->check_server_certificate_flag & U_SSL_VERIFY_PEER)) {
+        if (curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 0) != CURLE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (5)");
+          ret = U_ERROR_LIBCURL;
+          break;
+        }
+      }
+      if (!(copy_request->check_server_certificate_flag & U_SSL_VERIFY_HOSTNAME)) {
+        if (curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYHOST, 0) != CURLE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (6)");
+          ret = U_ERROR_LIBCURL;
+          break;
+        }
+      }
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x073400
+    // Disable proxy certificate validation if needed
+    if (!copy_request->check_proxy_certificate) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_PROXY_SSL_VERIFYPEER, 0) != CURLE_OK || curl_easy_setopt(curl_handle, CURLOPT_PROXY_SSL_VERIFYHOST, 0) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (7)");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    } else {
+      if (!(copy_request->check_proxy_certificate_flag & U_SSL_VERIFY_PEER)) {
+        if (curl_easy_setopt(curl_handle, CURLOPT_PROXY_SSL_VERIFYPEER, 0) != CURLE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (8)");
+          ret = U_ERROR_LIBCURL;
+          break;
+        }
+      }
+      if (!(copy_request->check_proxy_certificate_flag & U_SSL_VERIFY_HOSTNAME)) {
+        if (curl_easy_setopt(curl_handle, CURLOPT_PROXY_SSL_VERIFYHOST, 0) != CURLE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (9)");
+          ret = U_ERROR_LIBCURL;
+          break;
+        }
+      }
+    }
+#endif
+
+    // Set request ca_path value
+    if (copy_request->ca_path) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_CAPATH, copy_request->ca_path) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (10)");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+
+    // Set request timeout value
+    if (copy_request->timeout) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, copy_request->timeout) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (10)");
+        ret = U_ERROR_LIBCURL;
+        break;
+      }
+    }
+
+    // Response parameters
+    if (response != NULL) {
+      if (response->map_header != NULL) {
+        if (curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, write_header) != CURLE_OK ||
+            curl_easy_setopt(curl_handle, CURLOPT_WRITEHEADER, response) != CURLE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headers");
+          ret = U_ERROR_LIBCURL;
+          break;
+        }
+      }
+    }
+
+    if (curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1) != CURLE_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl CURLOPT_NOSIGNAL");
+      ret = U_ERROR_LIBCURL;
+      break;
+    }
+
+    if (curl_easy_setopt(curl_handle, CURLOPT_COOKIEFILE, "") != CURLE_OK) { // Apparently you have to do that to tell libcurl you'll need cookies afterwards
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl CURLOPT_COOKIEFILE");
+      ret = U_ERROR_LIBCURL;
+      break;
+    }
+  } while (0);
+  return ret;
+}
+
+/**
+ * Fill the response status and cookies after the transfer
+ * return U_OK on success
+ */
+static int ulfius_get_curl_response(CURL * curl_handle, struct _u_response * response) {
+  struct curl_slist * cookies_list = NULL;
+  int ret = U_OK;
+
+  if (curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &response->status) != CURLE_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error getting http response code");
+    ret = U_ERROR_LIBCURL;
+  } else if (curl_easy_getinfo(curl_handle, CURLINFO_COOKIELIST, &cookies_list) == CURLE_OK) {
+    struct curl_slist * nc = cookies_list;
+    char * key = NULL, * value = NULL, * expires = NULL, * domain = NULL, * path = NULL;
+    int secure = 0, http_only = 0;
+
+    while (nc != NULL) {
+      char * nc_dup = o_strdup(nc->data), * saveptr, * elt;
+      int counter = 0;
+
+      if (nc_dup != NULL) {
+        elt = strtok_r(nc_dup, "\t", &saveptr);
+        while (elt != NULL) {
+          // libcurl cookie format is domain\tsecure\tpath\thttp_only\texpires\tkey\tvalue
+          switch (counter) {
+            case 0:
+              domain = o_strdup(elt);
+              break;
+            case 1:
+              secure = (0==o_strcmp(elt, "TRUE"));
+              break;
+            case 2:
+              path = o_strdup(elt);
+              break;
+            case 3:
+              http_only = (0==o_strcmp(elt, "TRUE"));
+              break;
+            case 4:
+              expires = o_strdup(elt);
+              break;
+            case 5:
+              key = o_strdup(elt);
+              break;
+            case 6:
+              value = o_strdup(elt);
+              break;
+          }
+          elt = strtok_r(NULL, "\t", &saveptr);
+          counter++;
+        }
+        if (ulfius_add_cookie_to_response(response, key, value, expires, 0, domain, path, secure, http_only) != U_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error adding cookie %s/%s to response", key, value);
+        }
+        o_free(key);
+        o_free(value);
+        o_free(domain);
+        o_free(path);
+        o_free(expires);
+      }
+      o_free(nc_dup);
+      nc = nc->next;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error getting response cookies");
+    ret = U_ERROR_LIBCURL;
+  }
+  curl_slist_free_all(cookies_list);
+  return ret;
+}
+
+/**
+ * Internal structure used to share the DNS cache and the TLS sessions
+ * between the curl handles of a struct _u_http_client
+ * The connection cache isn't shared, libcurl doesn't support sharing it between concurrent threads,
+ * each pooled handle keeps its own connections open instead
+ */
+struct _u_http_client_share {
+  CURLSH          * share;
+  pthread_mutex_t   lock[CURL_LOCK_DATA_LAST];
+};
+
+static void ulfius_http_client_share_lock(CURL * curl_handle, curl_lock_data data, curl_lock_access access, void * user_data) {
+  UNUSED(curl_handle);
+  UNUSED(access);
+  pthread_mutex_lock(&((struct _u_http_client_share *)user_data)->lock[data]);
+}
+
+static void ulfius_http_client_share_unlock(CURL * curl_handle, curl_lock_data data, void * user_data) {
+  UNUSED(curl_handle);
+  pthread_mutex_unlock(&((struct _u_http_client_share *)user_data)->lock[data]);
+}
+
+/**
+ * Initialize libcurl with the orcania memory functions
+ * return U_OK on success
+ */
+static int ulfius_curl_global_init(void) {
+  o_malloc_t malloc_fn;
+  o_realloc_t realloc_fn;
+  o_free_t free_fn;
+
+  o_get_alloc_funcs(&malloc_fn, &realloc_fn, &free_fn);
+  if (curl_global_init_mem(CURL_GLOBAL_DEFAULT, malloc_fn, free_fn, realloc_fn, *o_strdup, *calloc) == CURLE_OK) {
+    return U_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_global_init_mem");
+    return U_ERROR_MEMORY;
+  }
+}
+
+/**
+ * Get an idle curl handle from the client pool, or a new one if the pool is empty
+ */
+static CURL * ulfius_http_client_get_handle(struct _u_http_client * http_client) {
+  CURL * curl_handle = NULL;
+
+  pthread_mutex_lock(&http_client->lock);
+  if (http_client->nb_handles) {
+    curl_handle = ((CURL **)http_client->handles)[--http_client->nb_handles];
+  }
+  pthread_mutex_unlock(&http_client->lock);
+  if (curl_handle == NULL) {
+    if ((curl_handle = curl_easy_init()) != NULL) {
+      if (curl_easy_setopt(curl_handle, CURLOPT_SHARE, ((struct _u_http_client_share *)http_client->share)->share) != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl CURLOPT_SHARE");
+        curl_easy_cleanup(curl_handle);
+        curl_handle = NULL;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_init");
+    }
+  }
+  return curl_handle;
+}
+
+/**
+ * Put back a curl handle in the client pool, or close it if the pool is full
+ * The request options and the cookies are removed, the connections stay open
+ * curl_easy_reset keeps the cookies in memory, so they are cleared first,
+ * otherwise the cookies received for a caller would be sent in the next request of another one
+ */
+static void ulfius_http_client_release_handle(struct _u_http_client * http_client, CURL * curl_handle) {
+  curl_easy_setopt(curl_handle, CURLOPT_COOKIELIST, "ALL");
+  curl_easy_setopt(curl_handle, CURLOPT_COOKIEFILE, NULL);
+  curl_easy_reset(curl_handle);
+  pthread_mutex_lock(&http_client->lock);
+  if (http_client->nb_handles < http_client->max_handles) {
+    ((CURL **)http_client->handles)[http_client->nb_handles++] = curl_handle;
+    curl_handle = NULL;
+  }
+  pthread_mutex_unlock(&http_client->lock);
+  if (curl_handle != NULL) {
+    curl_easy_cleanup(curl_handle);
+  }
+}
+
+/**
+ * Internal structure of an asynchronous transfer
+ */
+struct _u_http_transfer {
+  CURL                    * curl_handle;
+  struct _u_request       * request;
+  struct _u_response      * response;
+  struct curl_slist       * header_list;
+  struct _u_body            body;
+  void                   (* http_callback) (int result, const struct _u_request * request, struct _u_response * response, void * http_user_data);
+  void                    * http_user_data;
+  struct _u_http_transfer * prev;
+  struct _u_http_transfer * next;
+};
+
+/**
+ * Internal structure used to run the asynchronous transfers of a struct _u_http_client
+ * The transfers sent by any thread are added to the pending list,
+ * then moved to the multi handle by the thread running the transfers
+ */
+struct _u_http_client_async {
+  CURLM                   * multi;
+  pthread_mutex_t           lock;          /* protects the pending list, nb_transfers and stop */
+  pthread_mutex_t           multi_lock;    /* protects the multi handle and the running list */
+  struct _u_http_transfer * pending_first;
+  struct _u_http_transfer * pending_last;
+  struct _u_http_transfer * running;
+  size_t                    nb_transfers;
+  pthread_t                 thread;
+  int                       thread_running;
+  int                       stop;
+};
+
+static struct _u_http_client_async * ulfius_http_client_async_init(void) {
+  struct _u_http_client_async * async;
+
+  if ((async = o_malloc(sizeof(struct _u_http_client_async))) != NULL) {
+    if ((async->multi = curl_multi_init()) != NULL) {
+      pthread_mutex_init(&async->lock, NULL);
+      pthread_mutex_init(&async->multi_lock, NULL);
+      async->pending_first = NULL;
+      async->pending_last = NULL;
+      async->running = NULL;
+      async->nb_transfers = 0;
+      async->thread_running = 0;
+      async->stop = 0;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_multi_init");
+      o_free(async);
+      async = NULL;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for async");
+  }
+  return async;
+}
+
+/**
+ * Wake up the thread waiting for the transfers of the multi handle
+ */
+static void ulfius_http_client_async_wakeup(struct _u_http_client_async * async) {
+#if LIBCURL_VERSION_NUM >= 0x074400
+  curl_multi_wakeup(async->multi);
+#else
+  UNUSED(async);
+#endif
+}
+
+/**
+ * Call the callback function of a finished transfer, then free it
+ */
+static void ulfius_http_transfer_complete(struct _u_http_client * http_client, struct _u_http_transfer * transfer, int result) {
+  struct _u_http_client_async * async = (struct _u_http_client_async *)http_client->async;
+
+  if (result == U_OK && (result = ulfius_get_curl_response(transfer->curl_handle, transfer->response)) == U_OK && transfer->body.size) {
+    // The body buffer is given to the response without copy
+    transfer->response->binary_body = transfer->body.data;
+    transfer->response->binary_body_length = transfer->body.size;
+    transfer->body.data = NULL;
+  }
+  if (transfer->http_callback != NULL) {
+    transfer->http_callback(result, transfer->request, transfer->response, transfer->http_user_data);
+  }
+  ulfius_http_client_release_handle(http_client, transfer->curl_handle);
+  curl_slist_free_all(transfer->header_list);
+  o_free(transfer->body.data);
+  ulfius_clean_request_full(transfer->request);
+  ulfius_clean_response_full(transfer->response);
+  o_free(transfer);
+  pthread_mutex_lock(&async->lock);
+  async->nb_transfers--;
+  pthread_mutex_unlock(&async->lock);
+}
+
+/**
+ * Move the pending transfers to the multi handle
+ * async->multi_lock must be locked
+ */
+static void ulfius_http_client_add_pending(struct _u_http_client * http_client) {
+  struct _u_http_client_async * async = (struct _u_http_client_async *)http_client->async;
+  struct _u_http_transfer * transfer, * next;
+
+  pthread_mutex_lock(&async->lock);
+  transfer = async->pending_first;
+  async->pending_first = async->pending_last = NULL;
+  pthread_mutex_unlock(&async->lock);
+  while (transfer != NULL) {
+    next = transfer->next;
+    if (curl_multi_add_handle(async->multi, transfer->curl_handle) == CURLM_OK) {
+      transfer->prev = NULL;
+      transfer->next = async->running;
+      if (async->running != NULL) {
+        async->running->prev = transfer;
+      }
+      async->running = transfer;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_multi_add_handle");
+      ulfius_http_transfer_complete(http_client, transfer, U_ERROR_LIBCURL);
+    }
+    transfer = next;
+  }
+}
+
+/**
+ * Complete the finished transfers of the multi handle
+ * async->multi_lock must be locked
+ */
+static void ulfius_http_client_read_info(struct _u_http_client * http_client) {
+  struct _u_http_client_async * async = (struct _u_http_client_async *)http_client->async;
+  struct _u_http_transfer * transfer;
+  CURLMsg * msg;
+  int msgs_left;
+  char * private_data;
+
+  while ((msg = curl_multi_info_read(async->multi, &msgs_left)) != NULL) {
+    if (msg->msg == CURLMSG_DONE && curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private_data) == CURLE_OK && private_data != NULL) {
+      transfer = (struct _u_http_transfer *)private_data;
+      curl_multi_remove_handle(async->multi, transfer->curl_handle);
+      if (transfer->prev != NULL) {
+        transfer->prev->next = transfer->next;
+      } else {
+        async->running = transfer->next;
+      }
+      if (transfer->next != NULL) {
+        transfer->next->prev = transfer->prev;
+      }
+      if (msg->data.result != CURLE_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error asynchronous transfer");
+        y_log_message(Y_LOG_LEVEL_DEBUG, "Ulfius - libcurl error: %d, error message '%s'", msg->data.result, curl_easy_strerror(msg->data.result));
+        ulfius_http_transfer_complete(http_client, transfer, U_ERROR_LIBCURL);
+      } else {
+        ulfius_http_transfer_complete(http_client, transfer, U_OK);
+      }
+    }
+  }
+}
+
+/**
+ * Run the transfers of the multi handle, wait for activity up to timeout milliseconds
+ * async->multi_lock must be locked
+ */
+static void ulfius_http_client_run(struct _u_http_client * http_client, unsigned int timeout) {
+  struct _u_http_client_async * async = (struct _u_http_client_async *)http_client->async;
+  int running = 0;
+
+  ulfius_http_client_add_pending(http_client);
+  curl_multi_perform(async->multi, &running);
+  ulfius_http_client_read_info(http_client);
+  if (timeout) {
+#if LIBCURL_VERSION_NUM >= 0x074400
+    curl_multi_poll(async->multi, NULL, 0, timeout, NULL);
+#else
+    // Without curl_multi_wakeup, the new transfers are added at least every 50 milliseconds
+    curl_multi_wait(async->multi, NULL, 0, timeout<50?timeout:50, NULL);
+#endif
+    curl_multi_perform(async->multi, &running);
+    ulfius_http_client_read_info(http_client);
+  }
+}
+
+/**
+ * Thread running the asynchronous transfers until ulfius_stop_http_client_loop
+ */
+static void * ulfius_http_client_loop(void * args) {
+  struct _u_http_client * http_client = (struct _u_http_client *)args;
+  struct _u_http_client_async * async = (struct _u_http_client_async *)http_client->async;
+  int stop = 0;
+
+  pthread_mutex_lock(&async->multi_lock);
+  while (!stop) {
+    ulfius_http_client_run(http_client, 1000);
+    pthread_mutex_lock(&async->lock);
+    stop = async->stop;
+    pthread_mutex_unlock(&async->lock);
+  }
+  pthread_mutex_unlock(&async->multi_lock);
+  return NULL;
+}
+
+/**
+ * Cancel the transfers not completed, then free the asynchronous resources
+ */
+static void ulfius_http_client_async_clean(struct _u_http_client * http_client) {
+  struct _u_http_client_async * async = (struct _u_http_client_async *)http_client->async;
+  struct _u_http_transfer * transfer;
+
+  if (async != NULL) {
+    ulfius_stop_http_client_loop(http_client);
+    pthread_mutex_lock(&async->multi_lock);
+    do {
+      ulfius_http_client_add_pending(http_client);
+      while ((transfer = async->running) != NULL) {
+        async->running = transfer->next;
+        curl_multi_remove_handle(async->multi, transfer->curl_handle);
+        ulfius_http_transfer_complete(http_client, transfer, U_ERROR);
+      }
+    } while (async->pending_first != NULL);
+    pthread_mutex_unlock(&async->multi_lock);
+    curl_multi_cleanup(async->multi);
+    pthread_mutex_destroy(&async->lock);
+    pthread_mutex_destroy(&async->multi_lock);
+    o_free(async);
+    http_client->async = NULL;
+  }
+}
+
+/**
+ * ulfius_init_http_client
+ * Initialize a client context to send HTTP requests
+ * return U_OK on success
+ */
+int ulfius_init_http_client(struct _u_http_client * http_client, size_t max_handles) {
+  struct _u_http_client_share * client_share = NULL;
+  int ret, i;
+
+  if (http_client != NULL && max_handles) {
+    http_client->max_handles = max_handles;
+    http_client->nb_handles = 0;
+    http_client->handles = NULL;
+    http_client->share = NULL;
+    http_client->async = NULL;
+    if ((ret = ulfius_curl_global_init()) == U_OK) {
+      if ((http_client->handles = o_malloc(max_handles*sizeof(CURL *))) != NULL) {
+        if ((client_share = o_malloc(sizeof(struct _u_http_client_share))) != NULL) {
+          for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_init(&client_share->lock[i], NULL);
+          }
+          if ((client_share->share = curl_share_init()) != NULL) {
+            if (curl_share_setopt(client_share->share, CURLSHOPT_LOCKFUNC, ulfius_http_client_share_lock) == CURLSHE_OK &&
+                curl_share_setopt(client_share->share, CURLSHOPT_UNLOCKFUNC, ulfius_http_client_share_unlock) == CURLSHE_OK &&
+                curl_share_setopt(client_share->share, CURLSHOPT_USERDATA, client_share) == CURLSHE_OK &&
+                curl_share_setopt(client_share->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) == CURLSHE_OK &&
+                curl_share_setopt(client_share->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) == CURLSHE_OK) {
+              if ((http_client->async = ulfius_http_client_async_init()) != NULL) {
+                pthread_mutex_init(&http_client->lock, NULL);
+                http_client->share = client_share;
+                ret = U_OK;
+              } else {
+                curl_share_cleanup(client_share->share);
+                ret = U_ERROR_MEMORY;
+              }
+            } else {
+              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl share options");
+              curl_share_cleanup(client_share->share);
+              ret = U_ERROR_LIBCURL;
+            }
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_share_init");
+            ret = U_ERROR_LIBCURL;
+          }
+          if (ret != U_OK) {
+            for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+              pthread_mutex_destroy(&client_share->lock[i]);
+            }
+            o_free(client_share);
+          }
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for client_share");
+          ret = U_ERROR_MEMORY;
+        }
+        if (ret != U_OK) {
+          o_free(http_client->handles);
+          http_client->handles = NULL;
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for http_client->handles");
+        ret = U_ERROR_MEMORY;
+      }
+    }
+  } else {
+    ret = U_ERROR_PARAMS;
+  }
+  return ret;
+}
+
+/**
+ * ulfius_clean_http_client
+ * Close the connections and free the resources of a client context
+ */
+void ulfius_clean_http_client(struct _u_http_client * http_client) {
+  struct _u_http_client_share * client_share;
+  size_t i;
+
+  if (http_client != NULL && http_client->share != NULL) {
+    ulfius_http_client_async_clean(http_client);
+    client_share = (struct _u_http_client_share *)http_client->share;
+    for (i=0; i<http_client->nb_handles; i++) {
+      curl_easy_cleanup(((CURL **)http_client->handles)[i]);
+    }
+    curl_share_cleanup(client_share->share);
+    for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+      pthread_mutex_destroy(&client_share->lock[i]);
+    }
+    pthread_mutex_destroy(&http_client->lock);
+    o_free(client_share);
+    o_free(http_client->handles);
+    http_client->share = NULL;
+    http_client->handles = NULL;
+    http_client->nb_handles = 0;
+  }
+}
+
 /**
  * ulfius_send_http_request
  * Send a HTTP request and store the result into a _u_response
  * return U_OK on success
  */
 int ulfius_send_http_request(const struct _u_request * request, struct _u_response * response) {
+  return ulfius_send_http_client_request(NULL, request, response);
+}
+
+/**
+ * ulfius_send_http_client_request
+ * Send a HTTP request with a client context and store the result into a _u_response
+ * return U_OK on success
+ */
+int ulfius_send_http_client_request(struct _u_http_client * http_client, const struct _u_request * request, struct _u_response * response) {
   struct _u_body body_data;
   body_data.size = 0;
   body_data.data = NULL;
   int res;
   
-  res = ulfius_send_http_streaming_request(request, response, ulfius_write_body, (void *)&body_data);
+  res = ulfius_send_http_client_streaming_request(http_client, request, response, ulfius_write_body, (void *)&body_data);
   if (res == U_OK && response != NULL) {
     if (body_data.data != NULL && body_data.size > 0) {
       response->binary_body = o_malloc(body_data.size);
@@ -190,489 +1067,243 @@ int ulfius_send_http_streaming_request(const struct _u_request * request,
                                        struct _u_response * response, 
                                        size_t (* write_body_function)(void * contents, size_t size, size_t nmemb, void * user_data), 
                                        void * write_body_data) {
+  return ulfius_send_http_client_streaming_request(NULL, request, response, write_body_function, write_body_data);
+}
+
+/**
+ * ulfius_send_http_client_streaming_request
+ * Send a HTTP request with a client context and store the result into a _u_response
+ * Except for the body which will be available using write_body_function in the write_body_data
+ * return U_OK on success
+ */
+int ulfius_send_http_client_streaming_request(struct _u_http_client * http_client,
+                                              const struct _u_request * request,
+                                              struct _u_response * response, 
+                                              size_t (* write_body_function)(void * contents, size_t size, size_t nmemb, void * user_data), 
+                                              void * write_body_data) {
   CURLcode res;
   CURL * curl_handle = NULL;
-  struct curl_slist * header_list = NULL, * cookies_list = NULL;
-  char * key_esc = NULL, * value_esc = NULL, * cookie = NULL, * header = NULL, * fp = "?", * np = "&";
-  const char * value = NULL, ** keys = NULL;
-  int i, has_params = 0, ret, exit_loop;
+  struct curl_slist * header_list = NULL;
   struct _u_request * copy_request = NULL;
-  o_malloc_t malloc_fn;
-  o_realloc_t realloc_fn;
-  o_free_t free_fn;
+  int ret;
 
-  if (request != NULL) {
+  if (request != NULL && (http_client == NULL || http_client->share != NULL)) {
     // Duplicate the request and work on it
     if ((copy_request = ulfius_duplicate_request(request)) != NULL) {
-      o_get_alloc_funcs(&malloc_fn, &realloc_fn, &free_fn);
-      if (curl_global_init_mem(CURL_GLOBAL_DEFAULT, malloc_fn, free_fn, realloc_fn, *o_strdup, *calloc) == CURLE_OK) {
-        if ((curl_handle = curl_easy_init()) != NULL) {
-          ret = U_OK;
-
-          // Here comes the fake loop with breaks to exit smoothly
-          do {
-            // Set basic auth if defined
-            if (copy_request->auth_basic_user != NULL && copy_request->auth_basic_password != NULL) {
-              if (curl_easy_setopt(curl_handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC) == CURLE_OK) {
-                if (curl_easy_setopt(curl_handle, CURLOPT_USERNAME, copy_request->auth_basic_user) != CURLE_OK ||
-                    curl_easy_setopt(curl_handle, CURLOPT_PASSWORD, copy_request->auth_basic_password) != CURLE_OK) {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting HTTP Basic user name or password");
-                  ret = U_ERROR_LIBCURL;
-                  break;
-                }
-              } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting HTTP Basic Auth option");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
-
-#ifndef U_DISABLE_GNUTLS
-            // Set client certificate authentication if defined
-            if (request->client_cert_file != NULL && request->client_key_file != NULL) {
-              if (curl_easy_setopt(curl_handle, CURLOPT_SSLCERT, request->client_cert_file) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting client certificate file");
-                ret = U_ERROR_LIBCURL;
-                break;
-              } else if (curl_easy_setopt(curl_handle, CURLOPT_SSLKEY, request->client_key_file) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting client key file");
-                ret = U_ERROR_LIBCURL;
-                break;
-              } else if (request->client_key_password != NULL && curl_easy_setopt(curl_handle, CURLOPT_KEYPASSWD, request->client_key_password) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting client key password");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
-#endif
-
-            // Set proxy if defined
-            if (copy_request->proxy != NULL) {
-              if (curl_easy_setopt(curl_handle, CURLOPT_PROXY, copy_request->proxy) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting proxy option");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
-
-            // follow redirection if set
-            if (copy_request->follow_redirect) {
-              if (curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting follow redirection option");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
-
-#if MHD_VERSION >= 0x00095208
-            // Set network type
-            if (copy_request->network_type & U_USE_ALL) {
-              if (curl_easy_setopt(curl_handle, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_WHATEVER) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting IPRESOLVE WHATEVER option");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            } else if (copy_request->network_type & U_USE_IPV6) {
-              if (curl_easy_setopt(curl_handle, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V6) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting IPRESOLVE V6 option");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            } else {
-              if (curl_easy_setopt(curl_handle, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting IPRESOLVE V4 option");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
-#endif
-
-            has_params = (o_strchr(copy_request->http_url, '?') != NULL);
-            if (u_map_count(copy_request->map_url) > 0) {
-              // Append url parameters
-              keys = u_map_enum_keys(copy_request->map_url);
-
-              exit_loop = 0;
-              // Append parameters from map_url
-              for (i=0; !exit_loop && keys != NULL && keys[i] != NULL; i++) {
-                key_esc = curl_easy_escape(curl_handle, keys[i], 0);
-                if (key_esc != NULL) {
-                  value = u_map_get(copy_request->map_url, keys[i]);
-                  if (value != NULL) {
-                    value_esc = curl_easy_escape(curl_handle, value, 0);
-                    if (value_esc != NULL) {
-                      if (!has_params) {
-                        copy_request->http_url = mstrcatf(copy_request->http_url, "%s%s=%s", fp, key_esc, value_esc);
-                        has_params = 1;
-                      } else {
-                        copy_request->http_url = mstrcatf(copy_request->http_url, "%s%s=%s", np, key_esc, value_esc);
-                      }
-                      curl_free(value_esc);
-                    } else {
-                      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_escape for url parameter value %s=%s", keys[i], value);
-                      exit_loop = 1;
-                    }
-                  } else {
-                    if (!has_params) {
-                      copy_request->http_url = mstrcatf(copy_request->http_url, "%s%s", fp, key_esc);
-                      has_params = 1;
-                    } else {
-                      copy_request->http_url = mstrcatf(copy_request->http_url, "%s%s", np, key_esc);
-                    }
-                  }
-                  curl_free(key_esc);
-                } else {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_escape for url key %s", keys[i]);
-                  exit_loop = 1;
-                }
-              }
-              if (exit_loop) {
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
-
-            if (u_map_count(copy_request->map_post_body) > 0) {
-              o_free(copy_request->binary_body);
-              copy_request->binary_body = NULL;
-              copy_request->binary_body_length = 0;
-              // Append MHD_HTTP_POST_ENCODING_FORM_URLENCODED post parameters
-              keys = u_map_enum_keys(copy_request->map_post_body);
-              exit_loop = 0;
-              for (i=0; !exit_loop && keys != NULL && keys[i] != NULL; i++) {
-                // Build parameter
-                key_esc = curl_easy_escape(curl_handle, keys[i], 0);
-                if (key_esc != NULL) {
-                  value = u_map_get(copy_request->map_post_body, keys[i]);
-                  if (value != NULL) {
-                    value_esc = curl_easy_escape(curl_handle, value, 0);
-                    if (value_esc != NULL) {
-                      if (!i) {
-                        copy_request->binary_body = mstrcatf(copy_request->binary_body, "%s=%s", key_esc, value_esc);
-                      } else {
-                        copy_request->binary_body = mstrcatf(copy_request->binary_body, "%s%s=%s", np, key_esc, value_esc);
-                      }
-                      copy_request->binary_body_length = o_strlen(copy_request->binary_body);
-                    } else {
-                      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_escape for body parameter value %s=%s", keys[i], value);
-                      exit_loop = 1;
-                    }
-                    o_free(value_esc);
-                  } else {
-                    if (!i) {
-                      copy_request->binary_body = mstrcatf(copy_request->binary_body, "%s", key_esc);
-                    } else {
-                      copy_request->binary_body = mstrcatf(copy_request->binary_body, "%s%s", np, key_esc);
-                    }
-                    copy_request->binary_body_length = o_strlen(copy_request->binary_body);
-                  }
-                } else {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_escape for body key %s", keys[i]);
-                  exit_loop = 1;
-                }
-                o_free(key_esc);
-              }
-
-              if (exit_loop) {
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-
-              if (u_map_put(copy_request->map_header, ULFIUS_HTTP_HEADER_CONTENT, MHD_HTTP_POST_ENCODING_FORM_URLENCODED) != U_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headr fields");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
-
-            // Set body content
-            if (copy_request->binary_body_length && copy_request->binary_body != NULL) {
-              if (copy_request->binary_body_length < 2147483648) {
-                if (curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE, (curl_off_t)copy_request->binary_body_length) != CURLE_OK) {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting POST fields size");
-                  ret = U_ERROR_LIBCURL;
-                  break;
-                }
-              } else {
-                if (curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)copy_request->binary_body_length) != CURLE_OK) {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting POST fields size large");
-                  ret = U_ERROR_LIBCURL;
-                  break;
-                }
-              }
-
-              if (curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, copy_request->binary_body) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting POST fields");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
-
-            if (u_map_count(copy_request->map_header) > 0) {
-              // Append map headers
-              keys = u_map_enum_keys(copy_request->map_header);
-              exit_loop = 0;
-              for (i=0; !exit_loop && keys != NULL && keys[i] != NULL; i++) {
-                // Build parameter
-                value = u_map_get(copy_request->map_header, keys[i]);
-                if (value != NULL) {
-                  header = msprintf("%s:%s", keys[i], value);
-                  if ((header_list = curl_slist_append(header_list, header)) == NULL) {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_slist_append for header_list (1)");
-                    exit_loop = 1;
-                  }
-                  o_free(header);
-                } else {
-                  header = msprintf("%s:", keys[i]);
-                  if ((header_list = curl_slist_append(header_list, header)) == NULL) {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_slist_append for header_list (2)");
-                    exit_loop = 1;
-                  }
-                  o_free(header);
-                }
-              }
-              if (exit_loop) {
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
-
-            if (copy_request->map_cookie != NULL && u_map_count(copy_request->map_cookie) > 0) {
-              // Append cookies
-              keys = u_map_enum_keys(copy_request->map_cookie);
-              exit_loop = 0;
-              for (i=0; !exit_loop && keys != NULL && keys[i] != NULL; i++) {
-                // Build parameter
-                value = u_map_get(copy_request->map_cookie, keys[i]);
-                if (value != NULL) {
-                  cookie = msprintf("%s=%s", keys[i], value);
-                  if (curl_easy_setopt(curl_handle, CURLOPT_COOKIE, cookie) != CURLE_OK) {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting cookie %s", cookie);
-                    exit_loop = 1;
-                  }
-                  o_free(cookie);
-                } else {
-                  cookie = msprintf("%s:", keys[i]);
-                  if (curl_easy_setopt(curl_handle, CURLOPT_COOKIE, cookie) != CURLE_OK) {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting cookie %s", cookie);
-                    exit_loop = 1;
-                  }
-                  o_free(cookie);
-                }
-              }
-              if (exit_loop) {
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
-
-            // Request parameters
-            if (curl_easy_setopt(curl_handle, CURLOPT_URL, copy_request->http_url) != CURLE_OK ||
-                curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, copy_request->http_verb!=NULL?copy_request->http_verb:"GET") != CURLE_OK ||
-                curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, header_list) != CURLE_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (1)");
-              ret = U_ERROR_LIBCURL;
-              break;
-            }
-
-            // Set CURLOPT_WRITEFUNCTION if specified
-            if (write_body_function != NULL && curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_body_function) != CURLE_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (2)");
-              ret = U_ERROR_LIBCURL;
-              break;
-            }
-
-            // Set CURLOPT_WRITEDATA if specified
-            if (write_body_data != NULL && curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, write_body_data) != CURLE_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (3)");
-              ret = U_ERROR_LIBCURL;
-              break;
-            }
-
-            // Disable server certificate validation if needed
-            if (!copy_request->check_server_certificate) {
-              if (curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 0) != CURLE_OK || curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYHOST, 0) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (4)");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            } else {
-              if (!(copy_request->check_server_certificate_flag & U_SSL_VERIFY_PEER)) {
-                if (curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 0) != CURLE_OK) {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (5)");
-                  ret = U_ERROR_LIBCURL;
-                  break;
-                }
-              }
-              if (!(copy_request->check_server_certificate_flag & U_SSL_VERIFY_HOSTNAME)) {
-                if (curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYHOST, 0) != CURLE_OK) {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (6)");
-                  ret = U_ERROR_LIBCURL;
-                  break;
-                }
-              }
-            }
+      if (http_client != NULL) {
+        curl_handle = ulfius_http_client_get_handle(http_client);
+        ret = (curl_handle != NULL)?U_OK:U_ERROR_LIBCURL;
+      } else if ((ret = ulfius_curl_global_init()) == U_OK) {
+        if ((curl_handle = curl_easy_init()) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_init");
+          ret = U_ERROR_LIBCURL;
+        }
+      }
+      if (ret == U_OK && (ret = ulfius_set_curl_request(curl_handle, copy_request, response, write_body_function, write_body_data, &header_list)) == U_OK) {
+        res = curl_easy_perform(curl_handle);
+        if (res != CURLE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_perform");
+          y_log_message(Y_LOG_LEVEL_DEBUG, "Ulfius - libcurl error: %d, error message '%s'", res, curl_easy_strerror(res));
+          ret = U_ERROR_LIBCURL;
+        } else if (response != NULL) {
+          ret = ulfius_get_curl_response(curl_handle, response);
+        }
+      }
+      if (curl_handle != NULL) {
+        if (http_client != NULL) {
+          ulfius_http_client_release_handle(http_client, curl_handle);
+        } else {
+          curl_easy_cleanup(curl_handle);
+        }
+      }
+      ulfius_clean_request_full(copy_request);
+      curl_slist_free_all(header_list);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_duplicate_request");
+      ret = U_ERROR_MEMORY;
+    }
+  } else {
+    ret = U_ERROR_PARAMS;
+  }
+  return ret;
+}
 
-#if LIBCURL_VERSION_NUM >= 0x073400
-            // Disable proxy certificate validation if needed
-            if (!copy_request->check_proxy_certificate) {
-              if (curl_easy_setopt(curl_handle, CURLOPT_PROXY_SSL_VERIFYPEER, 0) != CURLE_OK || curl_easy_setopt(curl_handle, CURLOPT_PROXY_SSL_VERIFYHOST, 0) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (7)");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            } else {
-              if (!(copy_request->check_proxy_certificate_flag & U_SSL_VERIFY_PEER)) {
-                if (curl_easy_setopt(curl_handle, CURLOPT_PROXY_SSL_VERIFYPEER, 0) != CURLE_OK) {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (8)");
-                  ret = U_ERROR_LIBCURL;
-                  break;
-                }
-              }
-              if (!(copy_request->check_proxy_certificate_flag & U_SSL_VERIFY_HOSTNAME)) {
-                if (curl_easy_setopt(curl_handle, CURLOPT_PROXY_SSL_VERIFYHOST, 0) != CURLE_OK) {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (9)");
-                  ret = U_ERROR_LIBCURL;
-                  break;
-                }
-              }
-            }
-#endif
+/**
+ * ulfius_send_http_async_request
+ * Send a HTTP request asynchronously with a client context
+ * return U_OK if the request is added to the transfers of the client context
+ */
+int ulfius_send_http_async_request(struct _u_http_client * http_client,
+                                   const struct _u_request * request,
+                                   void (* http_callback) (int result, const struct _u_request * request, struct _u_response * response, void * http_user_data),
+                                   void * http_user_data) {
+  struct _u_http_client_async * async;
+  struct _u_http_transfer * transfer;
+  int ret;
 
-            // Set request ca_path value
-            if (copy_request->ca_path) {
-              if (curl_easy_setopt(curl_handle, CURLOPT_CAPATH, copy_request->ca_path) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (10)");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
+  if (http_client != NULL && http_client->async != NULL && request != NULL) {
+    async = (struct _u_http_client_async *)http_client->async;
+    if ((transfer = o_malloc(sizeof(struct _u_http_transfer))) != NULL) {
+      transfer->curl_handle = NULL;
+      transfer->response = NULL;
+      transfer->header_list = NULL;
+      transfer->body.data = NULL;
+      transfer->body.size = 0;
+      transfer->http_callback = http_callback;
+      transfer->http_user_data = http_user_data;
+      transfer->prev = NULL;
+      transfer->next = NULL;
+      if ((transfer->request = ulfius_duplicate_request(request)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_duplicate_request");
+        ret = U_ERROR_MEMORY;
+      } else if ((transfer->response = o_malloc(sizeof(struct _u_response))) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for transfer->response");
+        ret = U_ERROR_MEMORY;
+      } else if (ulfius_init_response(transfer->response) != U_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_init_response");
+        o_free(transfer->response);
+        transfer->response = NULL;
+        ret = U_ERROR_MEMORY;
+      } else if ((transfer->curl_handle = ulfius_http_client_get_handle(http_client)) == NULL) {
+        ret = U_ERROR_LIBCURL;
+      } else if ((ret = ulfius_set_curl_request(transfer->curl_handle, transfer->request, transfer->response, ulfius_write_body, &transfer->body, &transfer->header_list)) == U_OK) {
+        if (curl_easy_setopt(transfer->curl_handle, CURLOPT_PRIVATE, transfer) == CURLE_OK) {
+          pthread_mutex_lock(&async->lock);
+          if (async->pending_last != NULL) {
+            async->pending_last->next = transfer;
+          } else {
+            async->pending_first = transfer;
+          }
+          async->pending_last = transfer;
+          async->nb_transfers++;
+          pthread_mutex_unlock(&async->lock);
+          ulfius_http_client_async_wakeup(async);
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl CURLOPT_PRIVATE");
+          ret = U_ERROR_LIBCURL;
+        }
+      }
+      if (ret != U_OK) {
+        if (transfer->curl_handle != NULL) {
+          ulfius_http_client_release_handle(http_client, transfer->curl_handle);
+        }
+        curl_slist_free_all(transfer->header_list);
+        ulfius_clean_request_full(transfer->request);
+        ulfius_clean_response_full(transfer->response);
+        o_free(transfer);
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for transfer");
+      ret = U_ERROR_MEMORY;
+    }
+  } else {
+    ret = U_ERROR_PARAMS;
+  }
+  return ret;
+}
 
-            // Set request timeout value
-            if (copy_request->timeout) {
-              if (curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, copy_request->timeout) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl options (10)");
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
-            }
+/**
+ * ulfius_perform_http_client
+ * Run the asynchronous transfers of a client context in the current thread
+ * return U_OK on success
+ */
+int ulfius_perform_http_client(struct _u_http_client * http_client, unsigned int timeout) {
+  struct _u_http_client_async * async;
+  int ret;
 
-            // Response parameters
-            if (response != NULL) {
-              if (response->map_header != NULL) {
-                if (curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, write_header) != CURLE_OK ||
-                    curl_easy_setopt(curl_handle, CURLOPT_WRITEHEADER, response) != CURLE_OK) {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headers");
-                  ret = U_ERROR_LIBCURL;
-                  break;
-                }
-              }
-            }
+  if (http_client != NULL && http_client->async != NULL) {
+    async = (struct _u_http_client_async *)http_client->async;
+    pthread_mutex_lock(&async->lock);
+    ret = async->thread_running?U_ERROR_PARAMS:U_OK;
+    pthread_mutex_unlock(&async->lock);
+    if (ret == U_OK) {
+      pthread_mutex_lock(&async->multi_lock);
+      ulfius_http_client_run(http_client, timeout);
+      pthread_mutex_unlock(&async->multi_lock);
+    }
+  } else {
+    ret = U_ERROR_PARAMS;
+  }
+  return ret;
+}
 
-            if (curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1) != CURLE_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl CURLOPT_NOSIGNAL");
-              ret = U_ERROR_LIBCURL;
-              break;
-            }
+/**
+ * ulfius_http_client_nb_transfers
+ * Return the number of asynchronous transfers of a client context not completed yet
+ */
+size_t ulfius_http_client_nb_transfers(struct _u_http_client * http_client) {
+  struct _u_http_client_async * async;
+  size_t nb_transfers = 0;
 
-            if (curl_easy_setopt(curl_handle, CURLOPT_COOKIEFILE, "") != CURLE_OK) { // Apparently you have to do that to tell libcurl you'll need cookies afterwards
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting libcurl CURLOPT_COOKIEFILE");
-              ret = U_ERROR_LIBCURL;
-              break;
-            }
+  if (http_client != NULL && http_client->async != NULL) {
+    async = (struct _u_http_client_async *)http_client->async;
+    pthread_mutex_lock(&async->lock);
+    nb_transfers = async->nb_transfers;
+    pthread_mutex_unlock(&async->lock);
+  }
+  return nb_transfers;
+}
 
-            res = curl_easy_perform(curl_handle);
-            if (res != CURLE_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_perform");
-              y_log_message(Y_LOG_LEVEL_DEBUG, "Ulfius - libcurl error: %d, error message '%s'", res, curl_easy_strerror(res));
-              ret = U_ERROR_LIBCURL;
-              break;
-            } else if (res == CURLE_OK && response != NULL) {
-              if (curl_easy_getinfo (curl_handle, CURLINFO_RESPONSE_CODE, &response->status) != CURLE_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error executing http request, libcurl error: %d, error message '%s'", res, curl_easy_strerror(res));
-                ret = U_ERROR_LIBCURL;
-                break;
-              }
+/**
+ * ulfius_start_http_client_loop
+ * Start a thread running the asynchronous transfers of a client context
+ * return U_OK on success
+ */
+int ulfius_start_http_client_loop(struct _u_http_client * http_client) {
+  struct _u_http_client_async * async;
+  int ret;
 
-              if (curl_easy_getinfo(curl_handle, CURLINFO_COOKIELIST, &cookies_list) == CURLE_OK) {
-                struct curl_slist * nc = cookies_list;
-                char * key = NULL, * value = NULL, * expires = NULL, * domain = NULL, * path = NULL;
-                int secure = 0, http_only = 0;
-
-                while (nc != NULL) {
-                  char * nc_dup = o_strdup(nc->data), * saveptr, * elt;
-                  int counter = 0;
-
-                  if (nc_dup != NULL) {
-                    elt = strtok_r(nc_dup, "\t", &saveptr);
-                    while (elt != NULL) {
-                      // libcurl cookie format is domain\tsecure\tpath\thttp_only\texpires\tkey\tvalue
-                      switch (counter) {
-                        case 0:
-                          domain = o_strdup(elt);
-                          break;
-                        case 1:
-                          secure = (0==o_strcmp(elt, "TRUE"));
-                          break;
-                        case 2:
-                          path = o_strdup(elt);
-                          break;
-                        case 3:
-                          http_only = (0==o_strcmp(elt, "TRUE"));
-                          break;
-                        case 4:
-                          expires = o_strdup(elt);
-                          break;
-                        case 5:
-                          key = o_strdup(elt);
-                          break;
-                        case 6:
-                          value = o_strdup(elt);
-                          break;
-                      }
-                      elt = strtok_r(NULL, "\t", &saveptr);
-                      counter++;
-                    }
-                    if (ulfius_add_cookie_to_response(response, key, value, expires, 0, domain, path, secure, http_only) != U_OK) {
-                      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error adding cookie %s/%s to response", key, value);
-                    }
-                    o_free(key);
-                    o_free(value);
-                    o_free(domain);
-                    o_free(path);
-                    o_free(expires);
-                  }
-                  o_free(nc_dup);
-                  nc = nc->next;
-                }
-              } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error executing http request, libcurl error: %d, error message %s", res, curl_easy_strerror(res));
-                ret = U_ERROR_LIBCURL;
-              }
-              curl_slist_free_all(cookies_list);
-            }
-          } while (0);
-        } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_easy_init");
-          ret = U_ERROR_LIBCURL;
-        }
+  if (http_client != NULL && http_client->async != NULL) {
+    async = (struct _u_http_client_async *)http_client->async;
+    pthread_mutex_lock(&async->lock);
+    if (!async->thread_running) {
+      async->stop = 0;
+      if (!pthread_create(&async->thread, NULL, ulfius_http_client_loop, http_client)) {
+        async->thread_running = 1;
+        ret = U_OK;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error curl_global_init_mem");
-        ret = U_ERROR_MEMORY;
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating http client thread");
+        ret = U_ERROR;
       }
-      ulfius_clean_request_full(copy_request);
-      curl_easy_cleanup(curl_handle);
-      curl_slist_free_all(header_list);
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_duplicate_request");
-      ret = U_ERROR_MEMORY;
+      ret = U_ERROR_PARAMS;
     }
+    pthread_mutex_unlock(&async->lock);
   } else {
     ret = U_ERROR_PARAMS;
   }
   return ret;
 }
 
+/**
+ * ulfius_stop_http_client_loop
+ * Stop the thread running the asynchronous transfers of a client context
+ * The transfers not completed are kept in the client context
+ * return U_OK on success
+ */
+int ulfius_stop_http_client_loop(struct _u_http_client * http_client) {
+  struct _u_http_client_async * async;
+  int thread_running;
+
+  if (http_client != NULL && http_client->async != NULL) {
+    async = (struct _u_http_client_async *)http_client->async;
+    pthread_mutex_lock(&async->lock);
+    thread_running = async->thread_running;
+    async->stop = 1;
+    pthread_mutex_unlock(&async->lock);
+    if (thread_running) {
+      ulfius_http_client_async_wakeup(async);
+      pthread_join(async->thread, NULL);
+      pthread_mutex_lock(&async->lock);
+      async->thread_running = 0;
+      pthread_mutex_unlock(&async->lock);
+    }
+    return U_OK;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
 /**
  * Send an email using libcurl
  * email has the content-type specified in parameter
@@ -36,21 +36,182 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <zlib.h>
 #include <gnutls/crypto.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define U_WEBSOCKET_MASK_X86
+#endif
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
 
+/**
+ * Size of the stack buffer used to mask the payload of client frames
+ * Must be a multiple of 4
+ */
+#define U_WEBSOCKET_MASK_BUFFER_SIZE 16384
+
+/**
+ * zlib memory level of the permessage-deflate compression streams
+ */
+#define U_WEBSOCKET_DEFLATE_MEM_LEVEL 8
+
+/**
+ * Minimum size of the buffer of a decompressed message
+ */
+#define U_WEBSOCKET_INFLATE_BUFFER_SIZE 256
+
+/**
+ * permessage-deflate context of a websocket
+ * The deflate stream is used by one sender at a time, lock keeps the messages
+ * in the outgoing queue in the order they're compressed
+ * The inflate stream is used by the reader of the websocket only
+ */
+struct _websocket_deflate {
+  pthread_mutex_t lock;
+  z_stream        deflate_stream;
+  z_stream        inflate_stream;
+  unsigned int    deflate_window_bits;
+  int             deflate_no_context_takeover;
+  int             inflate_no_context_takeover;
+};
+
+/**
+ * Parameters of a permessage-deflate extension, a window bits value of 0 means the parameter is absent
+ */
+struct _websocket_deflate_params {
+  unsigned int server_max_window_bits;
+  unsigned int client_max_window_bits;
+  int          server_no_context_takeover;
+  int          client_no_context_takeover;
+};
+
+/**
+ * Close status sent when a decompressed message is larger than max_inflated_size (RFC 6455 7.4.1)
+ */
+#define U_WEBSOCKET_CLOSE_MESSAGE_TOO_BIG 1009
+
+static int ulfius_send_websocket_message_managed(struct _websocket_manager * websocket_manager,
+                                                 const uint8_t opcode,
+                                                 const uint64_t data_len,
+                                                 const char * data,
+                                                 const uint64_t fragment_len);
+
+/**
+ * The last 4 bytes of a deflate block flushed with Z_SYNC_FLUSH, removed from the compressed messages
+ */
+static const uint8_t ulfius_websocket_deflate_tail[4] = {0x00, 0x00, 0xff, 0xff};
+
 /**********************************/
 /** Internal websocket functions **/
 /**********************************/
 
+/**
+ * Portable mask function, 8 bytes at a time
+ */
+static void ulfius_websocket_mask_64(uint8_t * data, size_t len, const uint8_t * mask) {
+  uint64_t mask_64, block;
+  size_t i = 0;
+  
+  memcpy(&mask_64, mask, 4);
+  memcpy(((uint8_t *)&mask_64) + 4, mask, 4);
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&block, data + i, 8);
+    block ^= mask_64;
+    memcpy(data + i, &block, 8);
+  }
+  for (; i < len; i++) {
+    data[i] ^= mask[i%4];
+  }
+}
+
+#ifdef U_WEBSOCKET_MASK_X86
+/**
+ * SSE2 mask function, 16 bytes at a time
+ */
+__attribute__((target("sse2")))
+static void ulfius_websocket_mask_sse2(uint8_t * data, size_t len, const uint8_t * mask) {
+  uint32_t mask_32;
+  __m128i mask_128;
+  size_t i = 0;
+  
+  memcpy(&mask_32, mask, 4);
+  mask_128 = _mm_set1_epi32((int)mask_32);
+  for (; i + 16 <= len; i += 16) {
+    _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(data + i)), mask_128));
+  }
+  // i is a multiple of 4, so the mask is still aligned on the data
+  ulfius_websocket_mask_64(data + i, len - i, mask);
+}
+
+/**
+ * AVX2 mask function, 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+static void ulfius_websocket_mask_avx2(uint8_t * data, size_t len, const uint8_t * mask) {
+  uint32_t mask_32;
+  __m256i mask_256;
+  size_t i = 0;
+  
+  memcpy(&mask_32, mask, 4);
+  mask_256 = _mm256_set1_epi32((int)mask_32);
+  for (; i + 32 <= len; i += 32) {
+    _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(data + i)), mask_256));
+  }
+  ulfius_websocket_mask_64(data + i, len - i, mask);
+}
+#endif
+
+/**
+ * Mask function used, chosen on the first call depending on the CPU features
+ */
+static void (* ulfius_websocket_mask_function) (uint8_t * data, size_t len, const uint8_t * mask) = NULL;
+
+/**
+ * ulfius_websocket_mask
+ * Apply the 4 bytes mask to data in place, used to mask and unmask websocket payloads
+ */
+void ulfius_websocket_mask(uint8_t * data, size_t len, const uint8_t * mask) {
+  void (* mask_function) (uint8_t * data, size_t len, const uint8_t * mask) = __atomic_load_n(&ulfius_websocket_mask_function, __ATOMIC_RELAXED);
+  
+  if (mask_function == NULL) {
+    mask_function = ulfius_websocket_mask_64;
+#ifdef U_WEBSOCKET_MASK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      mask_function = ulfius_websocket_mask_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+      mask_function = ulfius_websocket_mask_sse2;
+    }
+#endif
+    __atomic_store_n(&ulfius_websocket_mask_function, mask_function, __ATOMIC_RELAXED);
+  }
+  if (len) {
+    mask_function(data, len, mask);
+  }
+}
+
+/**
+ * Wait for incoming data for U_WEBSOCKET_USEC_WAIT milliseconds
+ * The outgoing queue is flushed while waiting if the socket is writable
+ * return 1 if data is available
+ */
 static int is_websocket_data_available(struct _websocket_manager * websocket_manager) {
   int ret = 0, poll_ret = 0;
   
+  if (websocket_manager->read_buffer_offset < websocket_manager->read_buffer_len) {
+    // Data already read from the socket
+    return 1;
+  }
+  pthread_mutex_lock(&websocket_manager->queue_lock);
+  websocket_manager->fds.events = POLLIN | POLLRDHUP | (websocket_manager->queue_first!=NULL?POLLOUT:0);
+  pthread_mutex_unlock(&websocket_manager->queue_lock);
   poll_ret = poll(&websocket_manager->fds, 1, U_WEBSOCKET_USEC_WAIT);
   if (poll_ret == -1) {
     y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error poll websocket read");
@@ -58,194 +219,1042 @@ static int is_websocket_data_available(struct _websocket_manager * websocket_man
   } else if (websocket_manager->fds.revents & (POLLRDHUP|POLLERR|POLLHUP|POLLNVAL)) {
     websocket_manager->connected = 0;
   } else if (poll_ret > 0) {
-    ret = 1;
+    if ((websocket_manager->fds.revents & POLLOUT) && ulfius_websocket_flush_queue(websocket_manager, U_WEBSOCKET_FLUSH_LOCK) != U_OK) {
+      websocket_manager->connected = 0;
+    } else {
+      ret = (websocket_manager->fds.revents & POLLIN)?1:0;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Read at most len bytes from the socket with one system call
+ */
+static ssize_t read_socket(struct _websocket_manager * websocket_manager, uint8_t * data, size_t len) {
+  if (websocket_manager->tls) {
+    return gnutls_record_recv(websocket_manager->gnutls_session, data, len);
+  } else if (websocket_manager->type == U_WEBSOCKET_SERVER) {
+    return read(websocket_manager->mhd_sock, data, len);
+  } else {
+    return read(websocket_manager->tcp_sock, data, len);
+  }
+}
+
+/**
+ * Read len bytes from the websocket
+ * The data is read from the socket by blocks of U_WEBSOCKET_READ_BUFFER_SIZE bytes in websocket_manager->read_buffer,
+ * so the frames headers and small payloads don't cost one system call each
+ * return the number of bytes read, less than len if the connection is closed, -1 on error
+ */
+static ssize_t read_data_from_socket(struct _websocket_manager * websocket_manager, uint8_t * data, size_t len) {
+  ssize_t ret = 0, data_len;
+  size_t available;
+  
+  if (len > 0) {
+    do {
+      available = websocket_manager->read_buffer_len - websocket_manager->read_buffer_offset;
+      if (available) {
+        if (available > (len - ret)) {
+          available = (len - ret);
+        }
+        memcpy(data + ret, websocket_manager->read_buffer + websocket_manager->read_buffer_offset, available);
+        websocket_manager->read_buffer_offset += available;
+        ret += available;
+        continue;
+      } else if ((len - ret) >= U_WEBSOCKET_READ_BUFFER_SIZE) {
+        // Large payload, read it directly without copy
+        data_len = read_socket(websocket_manager, data + ret, (len - ret));
+        if (data_len > 0) {
+          ret += data_len;
+          continue;
+        }
+      } else {
+        if (websocket_manager->read_buffer == NULL && (websocket_manager->read_buffer = o_malloc(U_WEBSOCKET_READ_BUFFER_SIZE)) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for websocket_manager->read_buffer");
+          ret = -1;
+          break;
+        }
+        data_len = read_socket(websocket_manager, websocket_manager->read_buffer, U_WEBSOCKET_READ_BUFFER_SIZE);
+        if (data_len > 0) {
+          websocket_manager->read_buffer_offset = 0;
+          websocket_manager->read_buffer_len = (size_t)data_len;
+          continue;
+        }
+      }
+      if (data_len < 0) {
+        ret = -1;
+      }
+      // Connection closed
+      break;
+    } while (ret < (ssize_t)len);
+  }
+  return ret;
+}
+
+/**
+ * Send the buffers of iov in the socket, handles partial writes
+ * iov is modified by the function
+ * return U_OK when all the data is sent
+ */
+static int ulfius_websocket_send_iov(struct _websocket_manager * websocket_manager, struct iovec * iov, size_t iovcnt) {
+  struct msghdr msg;
+  struct pollfd fds_write;
+  ssize_t sent;
+  size_t i, off;
+  int ret = U_OK;
+  
+  if (websocket_manager->tls) {
+    for (i=0; ret == U_OK && i<iovcnt; i++) {
+      for (off=0; off<iov[i].iov_len; off+=sent) {
+        sent = gnutls_record_send(websocket_manager->gnutls_session, (uint8_t *)iov[i].iov_base + off, iov[i].iov_len - off);
+        if (sent == GNUTLS_E_AGAIN || sent == GNUTLS_E_INTERRUPTED) {
+          sent = 0;
+        } else if (sent < 0) {
+          ret = U_ERROR;
+          break;
+        }
+      }
+    }
+  } else {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    fds_write.fd = (websocket_manager->type == U_WEBSOCKET_SERVER)?websocket_manager->mhd_sock:websocket_manager->tcp_sock;
+    fds_write.events = POLLOUT;
+    while (msg.msg_iovlen > 0) {
+      sent = sendmsg(fds_write.fd, &msg, MSG_NOSIGNAL);
+      if (sent < 0) {
+        if (errno == EINTR) {
+          continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          // The socket is non blocking, wait until it's writable
+          if (poll(&fds_write, 1, -1) > 0 && !(fds_write.revents & (POLLERR|POLLHUP|POLLNVAL))) {
+            continue;
+          }
+        }
+        ret = U_ERROR;
+        break;
+      }
+      while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+        sent -= msg.msg_iov->iov_len;
+        msg.msg_iov++;
+        msg.msg_iovlen--;
+      }
+      if (msg.msg_iovlen > 0) {
+        msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + sent;
+        msg.msg_iov->iov_len -= sent;
+      }
+    }
+  }
+  return ret;
+}
+
+/**
+ * Workaround to make sure a message, as long as it can be is complete sent
+ */
+static void ulfius_websocket_send_frame(struct _websocket_manager * websocket_manager, const uint8_t * data, size_t len) {
+  struct iovec iov;
+  
+  if (data != NULL && len > 0) {
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    ulfius_websocket_send_iov(websocket_manager, &iov, 1);
+  }
+}
+
+/**
+ * ulfius_websocket_frame_header
+ * Write the header of a frame in header, header must be at least U_WEBSOCKET_FRAME_HEADER_MAX_SIZE bytes long
+ * The payload length uses the shortest encoding
+ * return the header length
+ */
+size_t ulfius_websocket_frame_header(uint8_t * header, const uint8_t opcode, const int fin, const uint64_t payload_len, const uint8_t * mask) {
+  size_t header_len, i;
+  
+  header[0] = opcode | (fin?U_WEBSOCKET_BIT_FIN:0);
+  if (payload_len > 65535) {
+    header[1] = 127;
+    for (i=0; i<8; i++) {
+      header[2+i] = (uint8_t)(payload_len >> (56-(8*i)));
+    }
+    header_len = 10;
+  } else if (payload_len > 125) {
+    header[1] = 126;
+    header[2] = (uint8_t)(payload_len >> 8);
+    header[3] = (uint8_t)(payload_len);
+    header_len = 4;
+  } else {
+    header[1] = (uint8_t)payload_len;
+    header_len = 2;
+  }
+  if (mask != NULL) {
+    header[1] |= U_WEBSOCKET_MASK;
+    memcpy(header + header_len, mask, 4);
+    header_len += 4;
+  }
+  return header_len;
+}
+
+/**
+ * Send one frame, the header is built on the stack and sent with the payload in one system call
+ * If mask is NULL, the payload is sent without copy,
+ * otherwise it's masked by blocks of U_WEBSOCKET_MASK_BUFFER_SIZE bytes on the stack
+ * return U_OK on success
+ */
+static int ulfius_websocket_send_frame_data(struct _websocket_manager * websocket_manager,
+                                            const uint8_t opcode,
+                                            const int fin,
+                                            const char * data,
+                                            const uint64_t data_len,
+                                            const uint8_t * mask) {
+  uint8_t header[U_WEBSOCKET_FRAME_HEADER_MAX_SIZE], masked[U_WEBSOCKET_MASK_BUFFER_SIZE];
+  struct iovec iov[2];
+  uint64_t offset = 0;
+  size_t iovcnt, cur_len;
+  int ret = U_OK;
+  
+  if (websocket_manager->tls) {
+    // Send the header and the payload in the same TLS records
+    gnutls_record_cork(websocket_manager->gnutls_session);
+  }
+  iov[0].iov_base = header;
+  iov[0].iov_len = ulfius_websocket_frame_header(header, opcode, fin, data_len, mask);
+  if (mask == NULL) {
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = data_len;
+    ret = ulfius_websocket_send_iov(websocket_manager, iov, data_len?2:1);
+  } else {
+    do {
+      // The header is sent with the first block
+      iovcnt = offset?0:1;
+      // U_WEBSOCKET_MASK_BUFFER_SIZE is a multiple of 4, so each block starts with the first byte of the mask
+      cur_len = (data_len - offset)<U_WEBSOCKET_MASK_BUFFER_SIZE?(size_t)(data_len - offset):U_WEBSOCKET_MASK_BUFFER_SIZE;
+      if (cur_len) {
+        memcpy(masked, data + offset, cur_len);
+        ulfius_websocket_mask(masked, cur_len, mask);
+        iov[iovcnt].iov_base = masked;
+        iov[iovcnt].iov_len = cur_len;
+        iovcnt++;
+      }
+      ret = ulfius_websocket_send_iov(websocket_manager, iov, iovcnt);
+      offset += cur_len;
+    } while (ret == U_OK && offset < data_len);
+  }
+  if (websocket_manager->tls && gnutls_record_uncork(websocket_manager->gnutls_session, GNUTLS_RECORD_WAIT) < 0) {
+    ret = U_ERROR;
+  }
+  return ret;
+}
+
+/**
+ * ulfius_websocket_frame_build
+ * Build the unmasked frames of data starting at offset in one buffer,
+ * each frame has at most fragment_len bytes of payload, 0 means one frame
+ * offset must be a multiple of fragment_len, the first frame is a continuation frame if offset isn't 0
+ * return NULL on error
+ */
+struct _websocket_frame * ulfius_websocket_frame_build(const uint8_t opcode, const uint64_t data_len, const char * data, const uint64_t fragment_len, const uint64_t offset) {
+  struct _websocket_frame * frame;
+  uint8_t header[U_WEBSOCKET_FRAME_HEADER_MAX_SIZE];
+  uint64_t max_len = fragment_len?fragment_len:data_len, cur_len, cur_offset = offset, len = 0;
+  size_t header_len;
+  
+  // Compute the size of the frames
+  do {
+    cur_len = max_len<(data_len - cur_offset)?max_len:(data_len - cur_offset);
+    len += ulfius_websocket_frame_header(header, opcode, 1, cur_len, NULL) + cur_len;
+    cur_offset += cur_len;
+  } while (cur_offset < data_len);
+  if (len > (uint64_t)(SIZE_MAX - sizeof(struct _websocket_frame))) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error websocket frame too large");
+    return NULL;
+  }
+  if ((frame = o_malloc(sizeof(struct _websocket_frame) + (size_t)len)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for websocket frame");
+    return NULL;
+  }
+  frame->refcount = 1;
+  frame->len = 0;
+  cur_offset = offset;
+  do {
+    cur_len = max_len<(data_len - cur_offset)?max_len:(data_len - cur_offset);
+    header_len = ulfius_websocket_frame_header(frame->data + frame->len, cur_offset?U_WEBSOCKET_OPCODE_CONTINUE:opcode, (cur_offset + cur_len >= data_len), cur_len, NULL);
+    frame->len += header_len;
+    if (cur_len) {
+      memcpy(frame->data + frame->len, data + cur_offset, (size_t)cur_len);
+      frame->len += (size_t)cur_len;
+    }
+    cur_offset += cur_len;
+  } while (cur_offset < data_len);
+  return frame;
+}
+
+/**
+ * ulfius_websocket_frame_release
+ * Release a reference to the frame, free it if it was the last one
+ */
+void ulfius_websocket_frame_release(struct _websocket_frame * frame) {
+  if (frame != NULL && !__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL)) {
+    o_free(frame);
+  }
+}
+
+/**
+ * zlib memory allocation functions, so the streams use the allocation functions set in orcania
+ */
+static voidpf ulfius_websocket_zalloc(voidpf opaque, uInt items, uInt size) {
+  UNUSED(opaque);
+  return o_malloc((size_t)items * size);
+}
+
+static void ulfius_websocket_zfree(voidpf opaque, voidpf address) {
+  UNUSED(opaque);
+  o_free(address);
+}
+
+/**
+ * Initialize a raw deflate stream
+ * zlib doesn't compress raw deflate streams with a 256 bytes window, so window_bits must be at least 9
+ * return U_OK on success
+ */
+static int ulfius_websocket_deflate_stream_init(z_stream * stream, unsigned int window_bits) {
+  memset(stream, 0, sizeof(z_stream));
+  stream->zalloc = ulfius_websocket_zalloc;
+  stream->zfree = ulfius_websocket_zfree;
+  if (deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -(int)window_bits, U_WEBSOCKET_DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error deflateInit2");
+    return U_ERROR;
+  }
+  return U_OK;
+}
+
+/**
+ * Allocate a permessage-deflate context
+ * return NULL on error
+ */
+static struct _websocket_deflate * ulfius_websocket_deflate_init(unsigned int deflate_window_bits,
+                                                                int deflate_no_context_takeover,
+                                                                unsigned int inflate_window_bits,
+                                                                int inflate_no_context_takeover) {
+  struct _websocket_deflate * deflate;
+  
+  if ((deflate = o_malloc(sizeof(struct _websocket_deflate))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for websocket deflate context");
+    return NULL;
+  }
+  deflate->deflate_window_bits = deflate_window_bits;
+  deflate->deflate_no_context_takeover = deflate_no_context_takeover;
+  deflate->inflate_no_context_takeover = inflate_no_context_takeover;
+  memset(&deflate->inflate_stream, 0, sizeof(z_stream));
+  deflate->inflate_stream.zalloc = ulfius_websocket_zalloc;
+  deflate->inflate_stream.zfree = ulfius_websocket_zfree;
+  if (pthread_mutex_init(&deflate->lock, NULL)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing websocket deflate lock");
+    o_free(deflate);
+    return NULL;
+  }
+  if (ulfius_websocket_deflate_stream_init(&deflate->deflate_stream, deflate_window_bits) != U_OK) {
+    pthread_mutex_destroy(&deflate->lock);
+    o_free(deflate);
+    return NULL;
+  }
+  // Some peers compress with a 512 bytes window when they negotiate a 256 bytes window
+  if (inflateInit2(&deflate->inflate_stream, -(int)(inflate_window_bits<9?9:inflate_window_bits)) != Z_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error inflateInit2");
+    deflateEnd(&deflate->deflate_stream);
+    pthread_mutex_destroy(&deflate->lock);
+    o_free(deflate);
+    return NULL;
+  }
+  return deflate;
+}
+
+/**
+ * Free a permessage-deflate context
+ */
+static void ulfius_websocket_deflate_free(struct _websocket_deflate * deflate) {
+  if (deflate != NULL) {
+    deflateEnd(&deflate->deflate_stream);
+    inflateEnd(&deflate->inflate_stream);
+    pthread_mutex_destroy(&deflate->lock);
+    o_free(deflate);
+  }
+}
+
+/**
+ * Compress data in a new buffer, the block is flushed and its last 4 bytes 0x00 0x00 0xff 0xff are removed
+ * out must be u_free'd after use
+ * return U_OK on success
+ */
+static int ulfius_websocket_deflate_stream(z_stream * stream, const char * data, const uint64_t data_len, uint8_t ** out, size_t * out_len) {
+  uint8_t * buffer, * new_buffer;
+  size_t buffer_len, len = 0;
+  uint64_t offset = 0;
+  uInt avail_out;
+  int flush;
+  
+  if (data_len > (uint64_t)(SIZE_MAX/2)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error websocket message too large to compress");
+    return U_ERROR_PARAMS;
+  }
+  // A flushed block takes at most a few bytes more than deflateBound
+  buffer_len = (size_t)deflateBound(stream, (uLong)data_len) + 16;
+  if ((buffer = o_malloc(buffer_len)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for compressed websocket message");
+    return U_ERROR_MEMORY;
+  }
+  do {
+    stream->next_in = (Bytef *)(data + offset);
+    stream->avail_in = (data_len - offset)>UINT_MAX?UINT_MAX:(uInt)(data_len - offset);
+    offset += stream->avail_in;
+    flush = (offset < data_len)?Z_NO_FLUSH:Z_SYNC_FLUSH;
+    do {
+      if (len == buffer_len) {
+        if ((new_buffer = o_realloc(buffer, buffer_len * 2)) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reallocating resources for compressed websocket message");
+          o_free(buffer);
+          return U_ERROR_MEMORY;
+        }
+        buffer = new_buffer;
+        buffer_len *= 2;
+      }
+      stream->next_out = buffer + len;
+      stream->avail_out = avail_out = (buffer_len - len)>UINT_MAX?UINT_MAX:(uInt)(buffer_len - len);
+      if (deflate(stream, flush) == Z_STREAM_ERROR) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error deflate");
+        o_free(buffer);
+        return U_ERROR;
+      }
+      len += avail_out - stream->avail_out;
+    } while (stream->avail_out == 0);
+  } while (offset < data_len);
+  if (len >= sizeof(ulfius_websocket_deflate_tail) && !memcmp(buffer + len - sizeof(ulfius_websocket_deflate_tail), ulfius_websocket_deflate_tail, sizeof(ulfius_websocket_deflate_tail))) {
+    len -= sizeof(ulfius_websocket_deflate_tail);
+  }
+  *out = buffer;
+  *out_len = len;
+  return U_OK;
+}
+
+/**
+ * Compress a message with the deflate stream of the websocket
+ * The lock of the deflate context must be held
+ * out must be u_free'd after use
+ * return U_OK on success
+ */
+static int ulfius_websocket_deflate_message(struct _websocket_deflate * deflate, const char * data, const uint64_t data_len, uint8_t ** out, size_t * out_len) {
+  int ret = ulfius_websocket_deflate_stream(&deflate->deflate_stream, data, data_len, out, out_len);
+  
+  // Resetting the deflate stream is always safe for the peer,
+  // the next messages won't refer to the previous ones
+  if (ret != U_OK || deflate->deflate_no_context_takeover) {
+    deflateReset(&deflate->deflate_stream);
+  }
+  return ret;
+}
+
+/**
+ * ulfius_websocket_inflate_message
+ * Decompress the data of a complete message received with RSV1
+ * The reader of the websocket must be the only one to call this function
+ * If the decompressed message is larger than max_inflated_size, a close frame with the status 1009 is sent
+ * return U_OK on success
+ */
+int ulfius_websocket_inflate_message(struct _websocket_manager * websocket_manager, struct _websocket_message * message) {
+  struct _websocket_deflate * deflate = (struct _websocket_deflate *)websocket_manager->deflate;
+  z_stream * stream;
+  const uint8_t * in;
+  char * buffer, * new_buffer;
+  uint8_t close_status[2];
+  size_t buffer_len, new_len, len = 0, in_len, i, max_len = websocket_manager->max_inflated_size;
+  uInt avail_out;
+  int ret = U_OK, z_ret = Z_OK;
+  
+  if (deflate == NULL || message == NULL) {
+    return U_ERROR_PARAMS;
+  }
+  stream = &deflate->inflate_stream;
+  buffer_len = message->data_len<(SIZE_MAX/4)?message->data_len*4:message->data_len;
+  if (buffer_len < U_WEBSOCKET_INFLATE_BUFFER_SIZE) {
+    buffer_len = U_WEBSOCKET_INFLATE_BUFFER_SIZE;
+  }
+  // The buffer never grows beyond one byte more than the maximum, to detect that it's exceeded
+  if (max_len && max_len < SIZE_MAX && buffer_len > max_len + 1) {
+    buffer_len = max_len + 1;
+  }
+  if ((buffer = o_malloc(buffer_len)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for decompressed websocket message");
+    return U_ERROR_MEMORY;
+  }
+  // Inflate the message data, then the 4 bytes removed by the sender
+  for (i=0; i<2 && ret == U_OK && z_ret != Z_STREAM_END; i++) {
+    in = i?ulfius_websocket_deflate_tail:(const uint8_t *)message->data;
+    in_len = i?sizeof(ulfius_websocket_deflate_tail):message->data_len;
+    while (in_len && ret == U_OK && z_ret != Z_STREAM_END) {
+      stream->next_in = (Bytef *)in;
+      stream->avail_in = in_len>UINT_MAX?UINT_MAX:(uInt)in_len;
+      in += stream->avail_in;
+      in_len -= stream->avail_in;
+      do {
+        if (len == buffer_len) {
+          if (max_len && len > max_len) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error decompressed websocket message larger than %zu bytes", max_len);
+            ret = U_ERROR_PARAMS;
+            break;
+          }
+          new_len = buffer_len>SIZE_MAX/2?SIZE_MAX:buffer_len*2;
+          if (max_len && max_len < SIZE_MAX && new_len > max_len + 1) {
+            new_len = max_len + 1;
+          }
+          if (new_len == buffer_len || (new_buffer = o_realloc(buffer, new_len)) == NULL) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reallocating resources for decompressed websocket message");
+            ret = U_ERROR_MEMORY;
+            break;
+          }
+          buffer = new_buffer;
+          buffer_len = new_len;
+        }
+        stream->next_out = (Bytef *)buffer + len;
+        stream->avail_out = avail_out = (buffer_len - len)>UINT_MAX?UINT_MAX:(uInt)(buffer_len - len);
+        z_ret = inflate(stream, Z_SYNC_FLUSH);
+        len += avail_out - stream->avail_out;
+        if (z_ret != Z_OK && z_ret != Z_BUF_ERROR && z_ret != Z_STREAM_END) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error inflating websocket message");
+          ret = U_ERROR;
+        }
+      } while (ret == U_OK && z_ret != Z_STREAM_END && stream->avail_out == 0);
+    }
+  }
+  if (ret == U_OK && max_len && len > max_len) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error decompressed websocket message larger than %zu bytes", max_len);
+    ret = U_ERROR_PARAMS;
+  }
+  if (ret == U_ERROR_PARAMS) {
+    // The peer must not send messages this large, the websocket is closed
+    close_status[0] = (uint8_t)(U_WEBSOCKET_CLOSE_MESSAGE_TOO_BIG >> 8);
+    close_status[1] = (uint8_t)(U_WEBSOCKET_CLOSE_MESSAGE_TOO_BIG & 0xff);
+    if (ulfius_send_websocket_message_managed(websocket_manager, U_WEBSOCKET_OPCODE_CLOSE, sizeof(close_status), (const char *)close_status, 0) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending close message");
+    }
+    ret = U_ERROR;
+  }
+  // A block with BFINAL set ends the stream, the next message starts a new one
+  if (ret != U_OK || z_ret == Z_STREAM_END || deflate->inflate_no_context_takeover) {
+    inflateReset(stream);
+  }
+  if (ret == U_OK) {
+    o_free(message->data);
+    if (len) {
+      message->data = buffer;
+    } else {
+      o_free(buffer);
+      message->data = NULL;
+    }
+    message->data_len = len;
+  } else {
+    o_free(buffer);
+  }
+  return ret;
+}
+
+/**
+ * ulfius_websocket_check_rsv
+ * Check the RSV bits of the first byte of a frame header
+ * Only the first frame of a text or binary message can have RSV1, if permessage-deflate is negotiated
+ * return U_OK if the bits are valid
+ */
+int ulfius_websocket_check_rsv(struct _websocket_manager * websocket_manager, const uint8_t header) {
+  uint8_t rsv = header & (U_WEBSOCKET_RSV1|U_WEBSOCKET_RSV2|U_WEBSOCKET_RSV3), opcode = header & 0x0F;
+  
+  if (!rsv || (rsv == U_WEBSOCKET_RSV1 && websocket_manager->deflate != NULL && (opcode == U_WEBSOCKET_OPCODE_TEXT || opcode == U_WEBSOCKET_OPCODE_BINARY))) {
+    return U_OK;
+  } else {
+    return U_ERROR;
+  }
+}
+
+/**
+ * Parse a window bits parameter value
+ * return the value between 8 and 15, 0 if the value is invalid
+ */
+static unsigned int ulfius_websocket_deflate_window_bits(const char * value) {
+  char * endptr = NULL;
+  long window_bits;
+  
+  if (o_strlen(value) && o_strlen(value) <= 2) {
+    window_bits = strtol(value, &endptr, 10);
+    if (endptr != NULL && *endptr == '\0' && window_bits >= 8 && window_bits <= U_WEBSOCKET_DEFLATE_WINDOW_BITS) {
+      return (unsigned int)window_bits;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Parse an element of a Sec-WebSocket-Extensions header
+ * return U_OK if the element is a valid permessage-deflate extension,
+ * U_ERROR_NOT_FOUND if it's another extension, U_ERROR_PARAMS if its parameters are invalid
+ */
+static int ulfius_websocket_deflate_parse(const char * extension, struct _websocket_deflate_params * params) {
+  char ** param_list = NULL, * name, * value;
+  size_t i, value_len;
+  int ret = U_OK;
+  
+  memset(params, 0, sizeof(struct _websocket_deflate_params));
+  if (split_string(extension, ";", &param_list) > 0 && 0 == o_strcmp(trimwhitespace(param_list[0]), U_WEBSOCKET_PERMESSAGE_DEFLATE)) {
+    for (i=1; param_list[i] != NULL && ret == U_OK; i++) {
+      if ((value = o_strchr(param_list[i], '=')) != NULL) {
+        *value = '\0';
+        value = trimwhitespace(value + 1);
+        // The value may be a quoted-string
+        value_len = o_strlen(value);
+        if (value_len >= 2 && value[0] == '"' && value[value_len-1] == '"') {
+          value[value_len-1] = '\0';
+          value++;
+        }
+      }
+      name = trimwhitespace(param_list[i]);
+      if (0 == o_strcmp(name, "server_no_context_takeover") && value == NULL && !params->server_no_context_takeover) {
+        params->server_no_context_takeover = 1;
+      } else if (0 == o_strcmp(name, "client_no_context_takeover") && value == NULL && !params->client_no_context_takeover) {
+        params->client_no_context_takeover = 1;
+      } else if (0 == o_strcmp(name, "server_max_window_bits") && !params->server_max_window_bits &&
+                 (params->server_max_window_bits = ulfius_websocket_deflate_window_bits(value))) {
+        // Valid value
+      } else if (0 == o_strcmp(name, "client_max_window_bits") && !params->client_max_window_bits &&
+                 (params->client_max_window_bits = (value==NULL?U_WEBSOCKET_DEFLATE_WINDOW_BITS:ulfius_websocket_deflate_window_bits(value)))) {
+        // Without value, the client only tells it supports the parameter
+      } else {
+        ret = U_ERROR_PARAMS;
+      }
+    }
+  } else {
+    ret = U_ERROR_NOT_FOUND;
+  }
+  free_string_array(param_list);
+  return ret;
+}
+
+/**
+ * Build a permessage-deflate extension with its parameters
+ * A window bits value of 0 omits the parameter, U_WEBSOCKET_DEFLATE_WINDOW_BITS + 1 sets the parameter without value
+ * returned value must be u_free'd after use
+ */
+static char * ulfius_websocket_deflate_extension(unsigned int server_max_window_bits, unsigned int client_max_window_bits, int server_no_context_takeover, int client_no_context_takeover) {
+  char server_param[32] = {0}, client_param[32] = {0};
+  
+  if (server_max_window_bits) {
+    snprintf(server_param, sizeof(server_param), "; server_max_window_bits=%u", server_max_window_bits);
+  }
+  if (client_max_window_bits > U_WEBSOCKET_DEFLATE_WINDOW_BITS) {
+    snprintf(client_param, sizeof(client_param), "; client_max_window_bits");
+  } else if (client_max_window_bits) {
+    snprintf(client_param, sizeof(client_param), "; client_max_window_bits=%u", client_max_window_bits);
+  }
+  return msprintf("%s%s%s%s%s", U_WEBSOCKET_PERMESSAGE_DEFLATE, server_param, client_param,
+                  server_no_context_takeover?"; server_no_context_takeover":"",
+                  client_no_context_takeover?"; client_no_context_takeover":"");
+}
+
+/**
+ * ulfius_websocket_deflate_negotiate
+ * Accept the first permessage-deflate offer of the Sec-WebSocket-Extensions header extensions
+ * compatible with the parameters of websocket_handle, then set the deflate context of websocket_manager
+ * return the extension to send in the handshake response, or NULL if no offer is accepted
+ * returned value must be u_free'd after use
+ */
+char * ulfius_websocket_deflate_negotiate(struct _websocket_manager * websocket_manager, const struct _websocket_handle * websocket_handle, const char * extensions) {
+  struct _websocket_deflate_params params;
+  char ** extension_list = NULL, * response_extension = NULL;
+  unsigned int server_window_bits, client_window_bits;
+  int server_no_context_takeover, client_no_context_takeover;
+  size_t i;
+  
+  if (websocket_manager != NULL && websocket_handle != NULL && websocket_handle->deflate_server_max_window_bits && extensions != NULL &&
+      split_string(extensions, ",", &extension_list) > 0) {
+    for (i=0; extension_list[i] != NULL; i++) {
+      if (ulfius_websocket_deflate_parse(extension_list[i], &params) == U_OK) {
+        server_window_bits = websocket_handle->deflate_server_max_window_bits;
+        if (params.server_max_window_bits && params.server_max_window_bits < server_window_bits) {
+          server_window_bits = params.server_max_window_bits;
+        }
+        if (server_window_bits < 9) {
+          // zlib can't compress with a 256 bytes window
+          continue;
+        }
+        // If the offer has no client_max_window_bits, the client may use the largest window
+        client_window_bits = U_WEBSOCKET_DEFLATE_WINDOW_BITS;
+        if (params.client_max_window_bits) {
+          client_window_bits = params.client_max_window_bits<websocket_handle->deflate_client_max_window_bits?params.client_max_window_bits:websocket_handle->deflate_client_max_window_bits;
+        }
+        server_no_context_takeover = websocket_handle->deflate_server_no_context_takeover || params.server_no_context_takeover;
+        client_no_context_takeover = websocket_handle->deflate_client_no_context_takeover || params.client_no_context_takeover;
+        if ((response_extension = ulfius_websocket_deflate_extension((params.server_max_window_bits || server_window_bits < U_WEBSOCKET_DEFLATE_WINDOW_BITS)?server_window_bits:0,
+                                                                     (params.client_max_window_bits && client_window_bits < U_WEBSOCKET_DEFLATE_WINDOW_BITS)?client_window_bits:0,
+                                                                     server_no_context_takeover,
+                                                                     client_no_context_takeover)) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for response_extension");
+        } else if ((websocket_manager->deflate = ulfius_websocket_deflate_init(server_window_bits, server_no_context_takeover, client_window_bits, client_no_context_takeover)) == NULL) {
+          o_free(response_extension);
+          response_extension = NULL;
+        }
+        break;
+      }
+    }
   }
-  return ret;
+  free_string_array(extension_list);
+  return response_extension;
 }
 
-static ssize_t read_data_from_socket(struct _websocket_manager * websocket_manager, uint8_t * data, size_t len) {
-  ssize_t ret = 0, data_len;
+/**
+ * Check the permessage-deflate extension accepted by the server against the offer of the client,
+ * then set the deflate context of the websocket_manager
+ * return U_OK on success or if permessage-deflate wasn't offered and accepted
+ */
+static int ulfius_websocket_deflate_client_accept(struct _websocket_manager * websocket_manager, const char * offer_extensions, const char * response_extensions) {
+  struct _websocket_deflate_params offer, response, params;
+  char ** extension_list = NULL;
+  unsigned int client_window_bits;
+  int has_offer = 0, has_response = 0, ret = U_OK, ret_parse;
+  size_t i;
   
-  if (len > 0) {
-    do {
-      if (websocket_manager->tls) {
-        data_len = gnutls_record_recv(websocket_manager->gnutls_session, data, (len - ret));
-      } else if (websocket_manager->type == U_WEBSOCKET_SERVER) {
-        data_len = read(websocket_manager->mhd_sock, data, (len - ret));
-      } else {
-        data_len = read(websocket_manager->tcp_sock, data, (len - ret));
+  if (offer_extensions != NULL && split_string(offer_extensions, ",", &extension_list) > 0) {
+    for (i=0; extension_list[i] != NULL && !has_offer; i++) {
+      if (ulfius_websocket_deflate_parse(extension_list[i], &offer) == U_OK) {
+        has_offer = 1;
       }
-      if (data_len > 0) {
-        ret += data_len;
-      } else if (data_len < 0) {
-        ret = -1;
-        break;
+    }
+  }
+  free_string_array(extension_list);
+  extension_list = NULL;
+  if (response_extensions != NULL && split_string(response_extensions, ",", &extension_list) > 0) {
+    for (i=0; extension_list[i] != NULL && ret == U_OK; i++) {
+      if ((ret_parse = ulfius_websocket_deflate_parse(extension_list[i], &params)) == U_OK && !has_response) {
+        response = params;
+        has_response = 1;
+      } else if (ret_parse != U_ERROR_NOT_FOUND) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Invalid permessage-deflate extension in the server response");
+        ret = U_ERROR;
       }
-    } while (ret < (ssize_t)len);
+    }
+  }
+  free_string_array(extension_list);
+  if (ret == U_OK && has_response) {
+    client_window_bits = offer.client_max_window_bits?offer.client_max_window_bits:U_WEBSOCKET_DEFLATE_WINDOW_BITS;
+    if (response.client_max_window_bits && response.client_max_window_bits < client_window_bits) {
+      client_window_bits = response.client_max_window_bits;
+    }
+    if (!has_offer ||
+        (response.client_max_window_bits && !offer.client_max_window_bits) ||
+        (offer.server_max_window_bits && response.server_max_window_bits > offer.server_max_window_bits) ||
+        client_window_bits < 9) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error permessage-deflate extension in the server response doesn't match the offer");
+      ret = U_ERROR;
+    } else if ((websocket_manager->deflate = ulfius_websocket_deflate_init(client_window_bits,
+                                                                          offer.client_no_context_takeover || response.client_no_context_takeover,
+                                                                          response.server_max_window_bits?response.server_max_window_bits:U_WEBSOCKET_DEFLATE_WINDOW_BITS,
+                                                                          response.server_no_context_takeover)) == NULL) {
+      ret = U_ERROR_MEMORY;
+    }
   }
   return ret;
 }
 
 /**
- * Workaround to make sure a message, as long as it can be is complete sent
+ * Release write_lock, then poll the socket for writing if frames were queued meanwhile
+ * The events are updated after the release, so a reactor thread that failed to lock write_lock
+ * can't miss the frames
  */
-static void ulfius_websocket_send_frame(struct _websocket_manager * websocket_manager, const uint8_t * data, size_t len) {
-  ssize_t ret = 0, off;
-  if (data != NULL && len > 0) {
-    for (off = 0; (size_t)off < len; off += ret) {
-      if (websocket_manager->type == U_WEBSOCKET_SERVER) {
-        ret = send(websocket_manager->mhd_sock, &data[off], len - off, MSG_NOSIGNAL);
-        if (ret < 0) {
-          break;
-        }
-      } else {
-        if (websocket_manager->tls) {
-          ret = gnutls_record_send(websocket_manager->gnutls_session, &data[off], len - off);
-        } else {
-          ret = send(websocket_manager->tcp_sock, &data[off], len - off, MSG_NOSIGNAL);
-        }
-        if (ret < 0) {
-          break;
-        }
-      }
+static void ulfius_websocket_write_unlock(struct _websocket_manager * websocket_manager) {
+  pthread_mutex_unlock(&websocket_manager->write_lock);
+  pthread_mutex_lock(&websocket_manager->queue_lock);
+  ulfius_websocket_reactor_update_events(websocket_manager, websocket_manager->queue_first != NULL);
+  pthread_mutex_unlock(&websocket_manager->queue_lock);
+}
+
+/**
+ * Add a frame in the outgoing queue, the queue takes its own reference to the frame
+ * If head is set, the frame is inserted first with offset bytes already sent,
+ * write_lock must be held and the first frame of the queue must not be started
+ * return U_OK on success
+ */
+static int ulfius_websocket_queue_push(struct _websocket_manager * websocket_manager, struct _websocket_frame * frame, int head, size_t offset) {
+  struct _websocket_frame_queue * item;
+  
+  if ((item = o_malloc(sizeof(struct _websocket_frame_queue))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for websocket queue item");
+    return U_ERROR_MEMORY;
+  }
+  __atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+  item->frame = frame;
+  pthread_mutex_lock(&websocket_manager->queue_lock);
+  if (head) {
+    item->next = websocket_manager->queue_first;
+    websocket_manager->queue_first = item;
+    if (websocket_manager->queue_last == NULL) {
+      websocket_manager->queue_last = item;
+    }
+    websocket_manager->queue_offset = offset;
+  } else {
+    item->next = NULL;
+    if (websocket_manager->queue_last != NULL) {
+      ((struct _websocket_frame_queue *)websocket_manager->queue_last)->next = item;
+    } else {
+      websocket_manager->queue_first = item;
     }
+    websocket_manager->queue_last = item;
   }
+  websocket_manager->queue_size += frame->len - offset;
+  ulfius_websocket_reactor_update_events(websocket_manager, 1);
+  pthread_mutex_unlock(&websocket_manager->queue_lock);
+  return U_OK;
 }
 
 /**
- * Builds a websocket frame from the given struct _websocket_message
- * returns U_OK on success
- * frame must be free'd after use
+ * Remove the frames not started from the outgoing queue
  */
-static int ulfius_build_frame (const struct _websocket_message * message,
-                               const uint64_t data_offset,
-                               const uint64_t data_len,
-                               uint8_t ** frame,
-                               size_t * frame_len) {
-  int ret, has_fin = 0;
-  unsigned int i;
-  uint64_t off, frame_data_len;
-  if (message != NULL && frame != NULL && frame_len != NULL) {
-    *frame_len = 2;
-    if (message->data_len > 65536) {
-      *frame_len += 8;
-    } else if (message->data_len > 125) {
-      *frame_len += 2;
-    }
-    if (message->has_mask) {
-      *frame_len += 4;
-    }
-    if (data_offset + data_len >= message->data_len) {
-      frame_data_len = message->data_len - data_offset;
-      has_fin = 1;
+static void ulfius_websocket_queue_discard(struct _websocket_manager * websocket_manager) {
+  struct _websocket_frame_queue * item, * next;
+  
+  pthread_mutex_lock(&websocket_manager->queue_lock);
+  item = websocket_manager->queue_first;
+  if (item != NULL) {
+    if (websocket_manager->queue_offset) {
+      // The frame partially sent must be completed
+      next = item->next;
+      item->next = NULL;
+      websocket_manager->queue_last = item;
+      websocket_manager->queue_size = item->frame->len - websocket_manager->queue_offset;
+      item = next;
     } else {
-      frame_data_len = data_len;
+      websocket_manager->queue_first = websocket_manager->queue_last = NULL;
+      websocket_manager->queue_size = 0;
     }
-    *frame_len += frame_data_len;
-    *frame = o_malloc(*frame_len);
-    if (*frame != NULL) {
-      if (has_fin) {
-        (*frame)[0] = (message->opcode | U_WEBSOCKET_BIT_FIN);
-      } else {
-        (*frame)[0] = 0;
+  }
+  pthread_mutex_unlock(&websocket_manager->queue_lock);
+  while (item != NULL) {
+    next = item->next;
+    ulfius_websocket_frame_release(item->frame);
+    o_free(item);
+    item = next;
+  }
+}
+
+/**
+ * ulfius_websocket_queue_frame
+ * Append the frame at the end of the outgoing queue and try to flush the queue
+ * If another thread is writing in the socket, the thread or the reactor of the websocket sends the frame later
+ * return U_OK on success
+ */
+int ulfius_websocket_queue_frame(struct _websocket_manager * websocket_manager, struct _websocket_frame * frame) {
+  int ret;
+  
+  if ((ret = ulfius_websocket_queue_push(websocket_manager, frame, 0, 0)) == U_OK) {
+    ret = ulfius_websocket_flush_queue(websocket_manager, U_WEBSOCKET_FLUSH_TRY);
+  }
+  return ret;
+}
+
+/**
+ * ulfius_websocket_flush_queue
+ * Send the outgoing queue in the socket
+ * The first frame stays in the queue until it's completely sent, so only the writer holding write_lock removes frames
+ * return U_OK if the connection is still valid, even if the queue isn't empty
+ */
+int ulfius_websocket_flush_queue(struct _websocket_manager * websocket_manager, int mode) {
+  struct _websocket_frame_queue * item;
+  struct iovec iov;
+  ssize_t sent;
+  size_t offset;
+  int ret = U_OK;
+  
+  if (mode == U_WEBSOCKET_FLUSH_TRY) {
+    if (pthread_mutex_trylock(&websocket_manager->write_lock)) {
+      // Stop polling the socket for writing while another thread writes,
+      // the writer polls it again when it releases write_lock
+      pthread_mutex_lock(&websocket_manager->queue_lock);
+      ulfius_websocket_reactor_update_events(websocket_manager, 0);
+      pthread_mutex_unlock(&websocket_manager->queue_lock);
+      if (pthread_mutex_trylock(&websocket_manager->write_lock)) {
+        return U_OK;
       }
-      if (message->data_len > 65536) {
-        (*frame)[1] = 127;
-        (*frame)[2] = (uint8_t)(frame_data_len >> 54);
-        (*frame)[3] = (uint8_t)(frame_data_len >> 48);
-        (*frame)[4] = (uint8_t)(frame_data_len >> 40);
-        (*frame)[5] = (uint8_t)(frame_data_len >> 32);
-        (*frame)[6] = (uint8_t)(frame_data_len >> 24);
-        (*frame)[7] = (uint8_t)(frame_data_len >> 16);
-        (*frame)[8] = (uint8_t)(frame_data_len >> 8);
-        (*frame)[9] = (uint8_t)(frame_data_len);
-        off = 10;
-      } else if (data_len > 125) {
-        (*frame)[1] = 126;
-        (*frame)[2] = (uint8_t)(frame_data_len >> 8);
-        (*frame)[3] = (uint8_t)(frame_data_len);
-        off = 4;
-      } else {
-        (*frame)[1] = (uint8_t)frame_data_len;
-        off = 2;
+    }
+  } else if (pthread_mutex_lock(&websocket_manager->write_lock)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error locking write lock");
+    return U_ERROR;
+  }
+  while (1) {
+    pthread_mutex_lock(&websocket_manager->queue_lock);
+    item = websocket_manager->queue_first;
+    offset = websocket_manager->queue_offset;
+    pthread_mutex_unlock(&websocket_manager->queue_lock);
+    if (item == NULL) {
+      break;
+    }
+    if (mode == U_WEBSOCKET_FLUSH_ALL) {
+      iov.iov_base = item->frame->data + offset;
+      iov.iov_len = item->frame->len - offset;
+      if ((ret = ulfius_websocket_send_iov(websocket_manager, &iov, 1)) != U_OK) {
+        break;
       }
-      if (message->has_mask) {
-        (*frame)[1] |= U_WEBSOCKET_MASK;
-        // Append mask
-        memcpy(*frame + off, message->mask, 4);
-        off += 4;
-        for (i=0; i < frame_data_len; i++) {
-          (*frame)[off + i] = message->data[data_offset + i] ^ message->mask[i%4];
+      sent = (ssize_t)(item->frame->len - offset);
+    } else {
+      sent = send(websocket_manager->mhd_sock, item->frame->data + offset, item->frame->len - offset, MSG_NOSIGNAL|MSG_DONTWAIT);
+      if (sent < 0) {
+        if (errno == EINTR) {
+          continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          ret = U_ERROR;
         }
-      } else {
-        memcpy((*frame) + off, message->data + data_offset, frame_data_len);
+        break;
       }
-      ret = U_OK;
+    }
+    pthread_mutex_lock(&websocket_manager->queue_lock);
+    websocket_manager->queue_offset += (size_t)sent;
+    websocket_manager->queue_size -= (size_t)sent;
+    if (websocket_manager->queue_offset == item->frame->len) {
+      websocket_manager->queue_first = item->next;
+      if (websocket_manager->queue_first == NULL) {
+        websocket_manager->queue_last = NULL;
+      }
+      websocket_manager->queue_offset = 0;
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for *frame");
-      ret = U_ERROR_MEMORY;
+      item = NULL;
+    }
+    pthread_mutex_unlock(&websocket_manager->queue_lock);
+    if (item != NULL) {
+      ulfius_websocket_frame_release(item->frame);
+      o_free(item);
     }
-  } else {
-    ret = U_ERROR_PARAMS;
   }
+  ulfius_websocket_write_unlock(websocket_manager);
   return ret;
 }
 
 /**
- * Builds a struct _websocket_message using the given parameters
- * returns a newly allocated struct _websocket_message
- * returned value must be free'd after use
+ * Apply the queue policy if the outgoing queue is above its high-water mark
+ * A message is always accepted in an empty queue
+ * If can_block is false, U_WEBSOCKET_QUEUE_BLOCK accepts the message
+ * return U_OK if the message can be queued
  */
-static struct _websocket_message * ulfius_build_message (const uint8_t opcode,
-                                                         const short int has_mask,
-                                                         const char * data,
-                                                         const uint64_t data_len) {
-  struct _websocket_message * new_message = NULL;
-  if ((
-       opcode == U_WEBSOCKET_OPCODE_TEXT ||
-       opcode == U_WEBSOCKET_OPCODE_BINARY ||
-       opcode == U_WEBSOCKET_OPCODE_CLOSE ||
-       opcode == U_WEBSOCKET_OPCODE_PING ||
-       opcode == U_WEBSOCKET_OPCODE_PONG
-     ) &&
-     (data_len == 0 || data != NULL)) {
-    new_message = o_malloc(sizeof(struct _websocket_message));
-    if (new_message != NULL) {
-      if (data_len) {
-        new_message->data = o_malloc(data_len*sizeof(char));
-      } else {
-        new_message->data = NULL;
-      }
-      if (!data_len || new_message->data != NULL) {
-        new_message->opcode = opcode;
-        new_message->data_len = data_len;
-        if (!has_mask) {
-          new_message->has_mask = 0;
-          memset(new_message->mask, 0, 4);
-        } else {
-          gnutls_rnd(GNUTLS_RND_NONCE, &new_message->mask, 4*sizeof(uint8_t));
-          new_message->has_mask = 1;
-        }
-        if (data_len > 0) {
-          memcpy(new_message->data, data, data_len);
+static int ulfius_websocket_queue_check(struct _websocket_manager * websocket_manager, uint64_t len, int can_block) {
+  int full, policy;
+  
+  pthread_mutex_lock(&websocket_manager->queue_lock);
+  full = websocket_manager->queue_high_water && websocket_manager->queue_first != NULL && (uint64_t)websocket_manager->queue_size + len > websocket_manager->queue_high_water;
+  policy = websocket_manager->queue_policy;
+  pthread_mutex_unlock(&websocket_manager->queue_lock);
+  if (!full) {
+    return U_OK;
+  } else if (policy == U_WEBSOCKET_QUEUE_DROP) {
+    y_log_message(Y_LOG_LEVEL_DEBUG, "Ulfius - Websocket outgoing queue full, message dropped");
+    return U_ERROR_QUEUE_FULL;
+  } else if (policy == U_WEBSOCKET_QUEUE_CLOSE) {
+    y_log_message(Y_LOG_LEVEL_DEBUG, "Ulfius - Websocket outgoing queue full, closing websocket");
+    ulfius_websocket_queue_discard(websocket_manager);
+    ulfius_websocket_send_close_signal(websocket_manager);
+    return U_ERROR_DISCONNECTED;
+  } else if (can_block) {
+    // U_WEBSOCKET_QUEUE_BLOCK, wait until the queue is sent
+    return ulfius_websocket_flush_queue(websocket_manager, U_WEBSOCKET_FLUSH_ALL);
+  } else {
+    return U_OK;
+  }
+}
+
+/**
+ * Send a message in a server websocket without waiting for the socket
+ * If the queue is empty, the frames are written directly from data without copy,
+ * then the data that doesn't fit in the socket is copied in the queue
+ * If check_queue is set, the queue policy applies to the message
+ * return U_OK on success
+ */
+static int ulfius_websocket_send_queued(struct _websocket_manager * websocket_manager,
+                                        const uint8_t opcode,
+                                        const uint64_t data_len,
+                                        const char * data,
+                                        const uint64_t fragment_len,
+                                        const int check_queue) {
+  uint8_t header[U_WEBSOCKET_FRAME_HEADER_MAX_SIZE];
+  uint64_t offset = 0, cur_len, max_len = fragment_len?fragment_len:data_len, len = 0;
+  struct _websocket_frame * frame;
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t sent = 0;
+  int ret = U_OK, direct = 0, complete = 0;
+  
+  if (check_queue) {
+    do {
+      cur_len = max_len<(data_len - offset)?max_len:(data_len - offset);
+      len += ulfius_websocket_frame_header(header, opcode, 1, cur_len, NULL) + cur_len;
+      offset += cur_len;
+    } while (offset < data_len);
+    offset = 0;
+    if ((ret = ulfius_websocket_queue_check(websocket_manager, len, 1)) != U_OK) {
+      return ret;
+    }
+  }
+  if (!pthread_mutex_trylock(&websocket_manager->write_lock)) {
+    pthread_mutex_lock(&websocket_manager->queue_lock);
+    direct = (websocket_manager->queue_first == NULL);
+    pthread_mutex_unlock(&websocket_manager->queue_lock);
+    if (!direct) {
+      ulfius_websocket_write_unlock(websocket_manager);
+    }
+  }
+  if (direct) {
+    memset(&msg, 0, sizeof(msg));
+    do {
+      cur_len = max_len<(data_len - offset)?max_len:(data_len - offset);
+      iov[0].iov_base = header;
+      iov[0].iov_len = ulfius_websocket_frame_header(header, offset?U_WEBSOCKET_OPCODE_CONTINUE:opcode, (offset + cur_len >= data_len), cur_len, NULL);
+      iov[1].iov_base = (void *)(data + offset);
+      iov[1].iov_len = (size_t)cur_len;
+      msg.msg_iov = iov;
+      msg.msg_iovlen = cur_len?2:1;
+      do {
+        sent = sendmsg(websocket_manager->mhd_sock, &msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+      } while (sent < 0 && errno == EINTR);
+      if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          ret = U_ERROR;
+          break;
         }
-        time(&new_message->datestamp);
+        sent = 0;
+      }
+      if ((size_t)sent < iov[0].iov_len + iov[1].iov_len) {
+        // The socket is full
+        break;
+      }
+      offset += cur_len;
+      sent = 0;
+      complete = (offset >= data_len);
+    } while (!complete);
+    if (ret == U_OK && !complete) {
+      // Queue the rest of the message before the frames queued by the other threads meanwhile
+      if ((frame = ulfius_websocket_frame_build(opcode, data_len, data, fragment_len, offset)) != NULL) {
+        ret = ulfius_websocket_queue_push(websocket_manager, frame, 1, (size_t)sent);
+        ulfius_websocket_frame_release(frame);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for new_message->data");
-        o_free(new_message);
-        new_message = NULL;
+        ret = U_ERROR_MEMORY;
       }
-    } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for new_message");
     }
+    ulfius_websocket_write_unlock(websocket_manager);
+  } else if ((frame = ulfius_websocket_frame_build(opcode, data_len, data, fragment_len, 0)) != NULL) {
+    ret = ulfius_websocket_queue_frame(websocket_manager, frame);
+    ulfius_websocket_frame_release(frame);
+  } else {
+    ret = U_ERROR_MEMORY;
   }
-  return new_message;
+  return ret;
 }
 
 /**
- * Builds a struct _websocket_message using the given parameters
  * Sends message to the websocket recipient in fragment if required
- * Then pushes the message in the outcoming message list
+ * Server websockets send the message through their outgoing queue without waiting for the client
+ * The data is not copied for server websockets if the socket can take it
+ * If permessage-deflate is negotiated, text and binary messages are compressed, then fragmented
  * returns U_OK on success
  */
 static int ulfius_send_websocket_message_managed(struct _websocket_manager * websocket_manager,
@@ -253,39 +1262,64 @@ static int ulfius_send_websocket_message_managed(struct _websocket_manager * web
                                                  const uint64_t data_len,
                                                  const char * data,
                                                  const uint64_t fragment_len) {
-  size_t offset = 0, cur_len;
-  struct _websocket_message * message;
-  uint8_t * frame = NULL;
-  size_t frame_len = 0;
-  int ret = U_OK;
+  struct _websocket_deflate * deflate = (struct _websocket_deflate *)websocket_manager->deflate;
+  uint64_t offset = 0, cur_len, max_len, frame_len = data_len;
+  uint8_t mask[4], * deflate_data = NULL, frame_opcode = opcode;
+  const char * frame_data = data;
+  size_t deflate_len = 0;
+  int ret = U_OK, compress = (deflate != NULL && (opcode == U_WEBSOCKET_OPCODE_TEXT || opcode == U_WEBSOCKET_OPCODE_BINARY));
   
-  if (data != NULL || data_len == 0) {
-    if (pthread_mutex_lock(&websocket_manager->write_lock)) {
+  if ((data != NULL || data_len == 0) &&
+      (opcode == U_WEBSOCKET_OPCODE_TEXT ||
+       opcode == U_WEBSOCKET_OPCODE_BINARY ||
+       opcode == U_WEBSOCKET_OPCODE_CLOSE ||
+       opcode == U_WEBSOCKET_OPCODE_PING ||
+       opcode == U_WEBSOCKET_OPCODE_PONG)) {
+    if (websocket_manager->type == U_WEBSOCKET_SERVER && compress) {
+      pthread_mutex_lock(&deflate->lock);
+      // The queue policy applies before the compression, a message compressed then dropped would break the compression context
+      if ((ret = ulfius_websocket_queue_check(websocket_manager, data_len, 1)) == U_OK &&
+          (ret = ulfius_websocket_deflate_message(deflate, data, data_len, &deflate_data, &deflate_len)) == U_OK) {
+        if ((ret = ulfius_websocket_send_queued(websocket_manager, opcode | U_WEBSOCKET_RSV1, deflate_len, (const char *)deflate_data, (fragment_len && fragment_len < data_len)?fragment_len:0, 0)) != U_OK) {
+          // The message isn't sent, so the next messages must not refer to it
+          deflateReset(&deflate->deflate_stream);
+        }
+        o_free(deflate_data);
+      }
+      pthread_mutex_unlock(&deflate->lock);
+      if (ret != U_OK && ret != U_ERROR_QUEUE_FULL && ret != U_ERROR_DISCONNECTED) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending websocket message");
+      }
+    } else if (websocket_manager->type == U_WEBSOCKET_SERVER) {
+      // Control frames are small and must not be delayed or dropped
+      if ((ret = ulfius_websocket_send_queued(websocket_manager, opcode, data_len, data, fragment_len, !(opcode & 0x08))) != U_OK && ret != U_ERROR_QUEUE_FULL && ret != U_ERROR_DISCONNECTED) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending websocket message");
+      }
+    } else if (pthread_mutex_lock(&websocket_manager->write_lock)) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error locking write lock");
+      ret = U_ERROR;
     } else {
-      message = ulfius_build_message(opcode, (websocket_manager->type == U_WEBSOCKET_CLIENT), data, data_len);
-      if (message != NULL) {
-        //if (ulfius_push_websocket_message(websocket_manager->message_list_outcoming, message) != U_OK) {
-        //  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error pushing new websocket message in list");
-        //}
-        while (offset < data_len) {
-          cur_len = fragment_len<(data_len - offset)?fragment_len:(data_len - offset);
-          if ((ret = ulfius_build_frame(message, offset, cur_len, &frame, &frame_len)) != U_OK) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_build_frame");
-            break;
-          } else {
-            ulfius_websocket_send_frame(websocket_manager, frame, frame_len);
-            offset += cur_len;
-            o_free(frame);
-            frame = NULL;
-            frame_len = 0;
-          }
+      // write_lock keeps the client messages in the order they're compressed
+      if (compress && (ret = ulfius_websocket_deflate_message(deflate, data, data_len, &deflate_data, &deflate_len)) == U_OK) {
+        frame_opcode = opcode | U_WEBSOCKET_RSV1;
+        frame_data = (const char *)deflate_data;
+        frame_len = deflate_len;
+      }
+      max_len = (fragment_len && fragment_len < data_len)?fragment_len:frame_len;
+      gnutls_rnd(GNUTLS_RND_NONCE, mask, 4*sizeof(uint8_t));
+      // Send at least one frame, control frames like close or pong may have no data
+      // The first frame has the opcode, the next ones are continuation frames
+      while (ret == U_OK) {
+        cur_len = max_len<(frame_len - offset)?max_len:(frame_len - offset);
+        if ((ret = ulfius_websocket_send_frame_data(websocket_manager, offset?U_WEBSOCKET_OPCODE_CONTINUE:frame_opcode, (offset + cur_len >= frame_len), frame_len?frame_data + offset:NULL, cur_len, mask)) != U_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending websocket frame");
+        }
+        offset += cur_len;
+        if (offset >= frame_len) {
+          break;
         }
-        ulfius_clear_websocket_message(message);
-      } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_build_message");
-        ret = U_ERROR;
       }
+      o_free(deflate_data);
       pthread_mutex_unlock(&websocket_manager->write_lock);
     }
   } else {
@@ -301,14 +1335,16 @@ static int ulfius_send_websocket_message_managed(struct _websocket_manager * web
  * Sets the new message in the message variable
  */
 static int ulfius_read_incoming_message(struct _websocket_manager * websocket_manager, struct _websocket_message ** message) {
-  int ret = U_OK, fin = 0, i;
+  int ret = U_OK, fin = 0;
   uint8_t header[2] = {0}, payload_len[8] = {0}, masking_key[4] = {0};
-  uint8_t * payload_data = NULL;
+  char * data = NULL;
   size_t msg_len = 0;
   ssize_t len = 0;
   
   *message = o_malloc(sizeof(struct _websocket_message));
   if (*message != NULL) {
+    (*message)->opcode = U_WEBSOCKET_OPCODE_CONTINUE;
+    (*message)->rsv = 0;
     (*message)->data_len = 0;
     (*message)->has_mask = 0;
     (*message)->data = NULL;
@@ -318,9 +1354,15 @@ static int ulfius_read_incoming_message(struct _websocket_manager * websocket_ma
       if (ret == U_OK) {
         // Read header
         if ((len = read_data_from_socket(websocket_manager, header, 2)) == 2) {
-          (*message)->opcode = header[0] & 0x0F;
+          if ((header[0] & 0x0F) != U_WEBSOCKET_OPCODE_CONTINUE) {
+            (*message)->opcode = header[0] & 0x0F;
+            (*message)->rsv = header[0] & (U_WEBSOCKET_RSV1|U_WEBSOCKET_RSV2|U_WEBSOCKET_RSV3);
+          }
           fin = (header[0] & U_WEBSOCKET_BIT_FIN);
-          if ((header[1] & U_WEBSOCKET_LEN_MASK) <= 125) {
+          if (ulfius_websocket_check_rsv(websocket_manager, header[0]) != U_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Incoming message has invalid RSV bits, exiting");
+            ret = U_ERROR;
+          } else if ((header[1] & U_WEBSOCKET_LEN_MASK) <= 125) {
             msg_len = (header[1] & U_WEBSOCKET_LEN_MASK);
           } else if ((header[1] & U_WEBSOCKET_LEN_MASK) == 126) {
             len = read_data_from_socket(websocket_manager, payload_len, 2);
@@ -342,7 +1384,7 @@ static int ulfius_read_incoming_message(struct _websocket_manager * websocket_ma
                         ((uint64_t)payload_len[3] << 32) |
                         ((uint64_t)payload_len[2] << 40) |
                         ((uint64_t)payload_len[1] << 48) |
-                        ((uint64_t)payload_len[0] << 54);
+                        ((uint64_t)payload_len[0] << 56);
             } else if (len >= 0) {
               ret = U_ERROR;
               y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reading websocket message length");
@@ -380,33 +1422,35 @@ static int ulfius_read_incoming_message(struct _websocket_manager * websocket_ma
             }
           }
         }
-        if (ret == U_OK) {
-          payload_data = o_malloc(msg_len*sizeof(uint8_t));
-          len = read_data_from_socket(websocket_manager, payload_data, msg_len);
-          if (len < 0) {
-            ret = U_ERROR_DISCONNECTED;
-          } else if ((unsigned int)len != msg_len) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reading websocket for payload_data");
-            ret = U_ERROR;
+        if (ret == U_OK && msg_len) {
+          // Read the payload at the end of the message data, then unmask it in place
+          if ((data = o_realloc((*message)->data, (msg_len+(*message)->data_len)*sizeof(uint8_t))) == NULL) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for (*message)->data");
+            ret = U_ERROR_MEMORY;
           } else {
-            // If mask, decode message
-            (*message)->data = o_realloc((*message)->data, (msg_len+(*message)->data_len)*sizeof(uint8_t));
-            if ((*message)->has_mask) {
-              for (i = (*message)->data_len; (unsigned int)i < (*message)->data_len + msg_len; i++) {
-                (*message)->data[i] = payload_data[i-(*message)->data_len] ^ masking_key[(i-(*message)->data_len)%4];
-              }
+            (*message)->data = data;
+            len = read_data_from_socket(websocket_manager, (uint8_t *)(*message)->data+(*message)->data_len, msg_len);
+            if (len < 0) {
+              ret = U_ERROR_DISCONNECTED;
+            } else if ((size_t)len != msg_len) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reading websocket for payload data");
+              ret = U_ERROR;
             } else {
-              memcpy((*message)->data+(*message)->data_len, payload_data, msg_len);
+              if ((*message)->has_mask) {
+                ulfius_websocket_mask((uint8_t *)(*message)->data+(*message)->data_len, msg_len, masking_key);
+              }
+              (*message)->data_len += msg_len;
             }
-            (*message)->data_len += msg_len;
           }
-          o_free(payload_data);
         }
         if (!fin) {
           while (!is_websocket_data_available(websocket_manager));
         }
       }
     } while (ret == U_OK && !fin);
+    if (ret == U_OK && ((*message)->rsv & U_WEBSOCKET_RSV1)) {
+      ret = ulfius_websocket_inflate_message(websocket_manager, *message);
+    }
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for *message");
   }
@@ -482,6 +1526,7 @@ void * ulfius_thread_websocket(void * data) {
               if (websocket->websocket_incoming_message_callback != NULL) {
                 websocket->websocket_incoming_message_callback(websocket->request, websocket->websocket_manager, message, websocket->websocket_incoming_user_data);
               }
+              ulfius_clear_websocket_message(message);
               //if (ulfius_push_websocket_message(websocket->websocket_manager->message_list_incoming, message) != U_OK) {
               //  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error pushing new websocket message in list");
               //  websocket->websocket_manager->connected = 0;
@@ -590,7 +1635,7 @@ static int ulfius_websocket_connection_handshake(struct _u_request * request, st
     o_free(http_line);
     if (0 == o_strcmp("Sec-WebSocket-Protocol", keys[i])) {
       check_websocket |= WEBSOCKET_RESPONSE_PROTCOL;
-    } else if (0 == o_strcmp("Sec-WebSocket-Extension", keys[i])) {
+    } else if (0 == o_strcmp("Sec-WebSocket-Extensions", keys[i])) {
       check_websocket |= WEBSOCKET_RESPONSE_EXTENSION;
     }
   }
@@ -626,8 +1671,8 @@ static int ulfius_websocket_connection_handshake(struct _u_request * request, st
           } else if (0 == o_strcmp(key, "Sec-WebSocket-Protocol")) {
             websocket->websocket_manager->protocol = o_strdup(value);
             websocket_response |= WEBSOCKET_RESPONSE_PROTCOL;
-          } else if (0 == o_strcmp(key, "Sec-WebSocket-Extension")) {
-            websocket->websocket_manager->extensions = o_strdup(value);
+          } else if (0 == o_strcmp(key, "Sec-WebSocket-Extensions")) {
+            websocket->websocket_manager->extensions = o_strdup(trimwhitespace(value));
             websocket_response |= WEBSOCKET_RESPONSE_EXTENSION;
           } else if (0 == o_strcmp(buffer, "Sec-WebSocket-Accept") && ulfius_check_handshake_response(u_map_get(request->map_header, "Sec-WebSocket-Key"), value) == U_OK) {
             websocket_response |= WEBSOCKET_RESPONSE_ACCEPT;
@@ -662,6 +1707,10 @@ static int ulfius_websocket_connection_handshake(struct _u_request * request, st
     close(websocket->websocket_manager->tcp_sock);
     websocket->websocket_manager->tcp_sock = -1;
     ret = U_ERROR;
+  } else if (ulfius_websocket_deflate_client_accept(websocket->websocket_manager, u_map_get(request->map_header, "Sec-WebSocket-Extensions"), websocket->websocket_manager->extensions) != U_OK) {
+    close(websocket->websocket_manager->tcp_sock);
+    websocket->websocket_manager->tcp_sock = -1;
+    ret = U_ERROR;
   } else {
     ret = U_OK;
   }
@@ -829,6 +1878,23 @@ void ulfius_start_websocket_cb (void * cls,
     websocket->websocket_manager->fds.events = POLLIN | POLLRDHUP;
     websocket->websocket_manager->connected = 1;
     websocket->websocket_manager->close_flag = 0;
+    if (websocket->instance != NULL) {
+      websocket->websocket_manager->queue_high_water = websocket->instance->websocket_queue_high_water;
+      websocket->websocket_manager->queue_policy = websocket->instance->websocket_queue_policy;
+      websocket->websocket_manager->max_inflated_size = websocket->instance->websocket_max_inflated_size;
+    }
+    if (websocket->instance != NULL && websocket->instance->websocket_handler != NULL &&
+        ((struct _websocket_handler *)websocket->instance->websocket_handler)->reactor != NULL) {
+      // Hand the websocket to the reactor threads
+      if (ulfius_websocket_reactor_add(((struct _websocket_handler *)websocket->instance->websocket_handler)->reactor, websocket) != U_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error adding websocket to the reactor");
+        if (websocket->websocket_onclose_callback != NULL) {
+          websocket->websocket_onclose_callback(websocket->request, websocket->websocket_manager, websocket->websocket_onclose_user_data);
+        }
+        ulfius_clear_websocket(websocket);
+      }
+      return;
+    }
     thread_ret_websocket = pthread_create(&thread_websocket, NULL, ulfius_thread_websocket, (void *)websocket);
     thread_detach_websocket = pthread_detach(thread_websocket);
     if (thread_ret_websocket || thread_detach_websocket) {
@@ -1030,16 +2096,23 @@ int ulfius_close_websocket(struct _websocket * websocket) {
  * Add a websocket in the list of active websockets of the instance
  */
 int ulfius_instance_add_websocket_active(struct _u_instance * instance, struct _websocket * websocket) {
+  struct _websocket ** websocket_active;
+  int ret;
+  
   if (instance != NULL && websocket != NULL) {
-    ((struct _websocket_handler *)instance->websocket_handler)->websocket_active = o_realloc(((struct _websocket_handler *)instance->websocket_handler)->websocket_active, (((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active+1)*sizeof(struct _websocket *));
-    if (((struct _websocket_handler *)instance->websocket_handler)->websocket_active != NULL) {
+    pthread_mutex_lock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
+    websocket_active = o_realloc(((struct _websocket_handler *)instance->websocket_handler)->websocket_active, (((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active+1)*sizeof(struct _websocket *));
+    if (websocket_active != NULL) {
+      ((struct _websocket_handler *)instance->websocket_handler)->websocket_active = websocket_active;
       ((struct _websocket_handler *)instance->websocket_handler)->websocket_active[((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active] = websocket;
       ((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active++;
-      return U_OK;
+      ret = U_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for instance->websocket_handler->websocket_active");
-      return U_ERROR_MEMORY;
+      ret = U_ERROR_MEMORY;
     }
+    pthread_mutex_unlock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
+    return ret;
   } else {
     return U_ERROR_PARAMS;
   }
@@ -1047,33 +2120,38 @@ int ulfius_instance_add_websocket_active(struct _u_instance * instance, struct _
 
 /**
  * Remove a websocket from the list of active websockets of the instance
+ * The list is protected by websocket_close_lock, so ulfius_websocket_broadcast can walk it
  */
 int ulfius_instance_remove_websocket_active(struct _u_instance * instance, struct _websocket * websocket) {
+  struct _websocket ** websocket_active;
   size_t i, j;
-  if (instance != NULL && ((struct _websocket_handler *)instance->websocket_handler)->websocket_active != NULL && websocket != NULL) {
+  int ret = U_ERROR_NOT_FOUND;
+  
+  if (instance != NULL && websocket != NULL) {
+    pthread_mutex_lock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
     for (i=0; i<((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active; i++) {
       if (((struct _websocket_handler *)instance->websocket_handler)->websocket_active[i] == websocket) {
         if (((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active > 1) {
           for (j=i; j<((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active-1; j++) {
             ((struct _websocket_handler *)instance->websocket_handler)->websocket_active[j] = ((struct _websocket_handler *)instance->websocket_handler)->websocket_active[j+1];
           }
-          ((struct _websocket_handler *)instance->websocket_handler)->websocket_active = o_realloc(((struct _websocket_handler *)instance->websocket_handler)->websocket_active, (((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active-1)*sizeof(struct _websocket *));
-          if (((struct _websocket_handler *)instance->websocket_handler)->websocket_active == NULL) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for instance->websocket_active");
-            return U_ERROR_MEMORY;
+          // Shrinking the array can't fail, keep the old one if it does
+          websocket_active = o_realloc(((struct _websocket_handler *)instance->websocket_handler)->websocket_active, (((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active-1)*sizeof(struct _websocket *));
+          if (websocket_active != NULL) {
+            ((struct _websocket_handler *)instance->websocket_handler)->websocket_active = websocket_active;
           }
         } else {
           o_free(((struct _websocket_handler *)instance->websocket_handler)->websocket_active);
           ((struct _websocket_handler *)instance->websocket_handler)->websocket_active = NULL;
         }
         ((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active--;
-        pthread_mutex_lock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
         pthread_cond_broadcast(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_cond);
-        pthread_mutex_unlock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
-        return U_OK;
+        ret = U_OK;
+        break;
       }
     }
-    return U_ERROR_NOT_FOUND;
+    pthread_mutex_unlock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
+    return ret;
   } else {
     return U_ERROR_PARAMS;
   }
@@ -1097,7 +2175,14 @@ int ulfius_websocket_send_fragmented_message(struct _websocket_manager * websock
   struct _websocket_message * message;
   
   if (websocket_manager != NULL && websocket_manager->connected) {
-    if (opcode == U_WEBSOCKET_OPCODE_CLOSE) {
+    if (opcode == U_WEBSOCKET_OPCODE_CLOSE && websocket_manager->reactor_connection != NULL) {
+      // In reactor mode, the reactor thread reads the close response and closes the connection
+      if ((ret = ulfius_send_websocket_message_managed(websocket_manager, U_WEBSOCKET_OPCODE_CLOSE, 0, NULL, 0)) != U_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending U_WEBSOCKET_OPCODE_CLOSE message");
+      }
+      websocket_manager->connected = 0;
+      ulfius_websocket_reactor_close_signal(websocket_manager);
+    } else if (opcode == U_WEBSOCKET_OPCODE_CLOSE) {
       if (ulfius_send_websocket_message_managed(websocket_manager, U_WEBSOCKET_OPCODE_CLOSE, 0, NULL, 0) == U_OK) {
         // If message sent is U_WEBSOCKET_OPCODE_CLOSE, wait for the close response for WEBSOCKET_MAX_CLOSE_TRY messages max, then close the connection
         do {
@@ -1108,6 +2193,7 @@ int ulfius_websocket_send_fragmented_message(struct _websocket_manager * websock
               if (message->opcode == U_WEBSOCKET_OPCODE_CLOSE) {
                 websocket_manager->connected = 0;
               }
+              ulfius_clear_websocket_message(message);
               //if (ulfius_push_websocket_message(websocket_manager->message_list_incoming, message) != U_OK) {
               //  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error pushing new websocket message in list");
               //}
@@ -1154,7 +2240,7 @@ struct _websocket_message * ulfius_websocket_pop_first_message(struct _websocket
       message_list->list[len] = message_list->list[len+1];
     }
     if (message_list->len > 1) {
-      message_list->list = o_realloc(message_list->list, (message_list->len-1));
+      message_list->list = o_realloc(message_list->list, (message_list->len-1)*sizeof(struct _websocket_message *));
     } else {
       o_free(message_list->list);
       message_list->list = NULL;
@@ -1266,13 +2352,26 @@ int ulfius_init_websocket_manager(struct _websocket_manager * websocket_manager)
     websocket_manager->tcp_sock = 0;
     websocket_manager->protocol = NULL;
     websocket_manager->extensions = NULL;
+    websocket_manager->read_buffer = NULL;
+    websocket_manager->read_buffer_offset = 0;
+    websocket_manager->read_buffer_len = 0;
+    websocket_manager->reactor_connection = NULL;
+    websocket_manager->queue_first = NULL;
+    websocket_manager->queue_last = NULL;
+    websocket_manager->queue_offset = 0;
+    websocket_manager->queue_size = 0;
+    websocket_manager->queue_want_write = 0;
+    websocket_manager->queue_high_water = U_WEBSOCKET_QUEUE_HIGH_WATER;
+    websocket_manager->queue_policy = U_WEBSOCKET_QUEUE_BLOCK;
+    websocket_manager->deflate = NULL;
+    websocket_manager->max_inflated_size = U_WEBSOCKET_MAX_INFLATED_SIZE;
     pthread_mutexattr_init ( &mutexattr );
     pthread_mutexattr_settype( &mutexattr, PTHREAD_MUTEX_RECURSIVE );
     if (pthread_mutex_init(&(websocket_manager->read_lock), &mutexattr) != 0 || pthread_mutex_init(&(websocket_manager->write_lock), &mutexattr) != 0) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Impossible to initialize Mutex Lock for websocket");
       ret = U_ERROR;
-    } else if (pthread_mutex_init(&websocket_manager->status_lock, NULL) || pthread_cond_init(&websocket_manager->status_cond, NULL)) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing status_lock or status_cond");
+    } else if (pthread_mutex_init(&websocket_manager->status_lock, NULL) || pthread_cond_init(&websocket_manager->status_cond, NULL) || pthread_mutex_init(&websocket_manager->queue_lock, NULL)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing status_lock, status_cond or queue_lock");
       ret = U_ERROR;
     } else if ((websocket_manager->message_list_incoming = o_malloc(sizeof(struct _websocket_message_list))) == NULL ||
                ulfius_init_websocket_message_list(websocket_manager->message_list_incoming) != U_OK ||
@@ -1299,9 +2398,19 @@ int ulfius_init_websocket_manager(struct _websocket_manager * websocket_manager)
  * Clear data of a websocket_manager
  */
 void ulfius_clear_websocket_manager(struct _websocket_manager * websocket_manager) {
+  struct _websocket_frame_queue * item;
+  
   if (websocket_manager != NULL) {
     pthread_mutex_destroy(&websocket_manager->read_lock);
     pthread_mutex_destroy(&websocket_manager->write_lock);
+    while ((item = websocket_manager->queue_first) != NULL) {
+      websocket_manager->queue_first = item->next;
+      ulfius_websocket_frame_release(item->frame);
+      o_free(item);
+    }
+    websocket_manager->queue_last = NULL;
+    websocket_manager->queue_size = 0;
+    pthread_mutex_destroy(&websocket_manager->queue_lock);
     ulfius_clear_websocket_message_list(websocket_manager->message_list_incoming);
     o_free(websocket_manager->message_list_incoming);
     websocket_manager->message_list_incoming = NULL;
@@ -1310,6 +2419,10 @@ void ulfius_clear_websocket_manager(struct _websocket_manager * websocket_manage
     websocket_manager->message_list_outcoming = NULL;
     o_free(websocket_manager->protocol);
     o_free(websocket_manager->extensions);
+    o_free(websocket_manager->read_buffer);
+    websocket_manager->read_buffer = NULL;
+    ulfius_websocket_deflate_free((struct _websocket_deflate *)websocket_manager->deflate);
+    websocket_manager->deflate = NULL;
   }
 }
 
@@ -1378,6 +2491,30 @@ int ulfius_set_websocket_response(struct _u_response * response,
   }
 }
 
+/**
+ * Enable the permessage-deflate extension on a websocket response
+ * The extension is used if the client offers it
+ * return U_OK on success
+ */
+int ulfius_add_websocket_deflate_extension(struct _u_response * response,
+                                           unsigned int server_max_window_bits,
+                                           unsigned int client_max_window_bits,
+                                           int server_no_context_takeover,
+                                           int client_no_context_takeover) {
+  if (response != NULL && response->websocket_handle != NULL &&
+      server_max_window_bits >= 9 && server_max_window_bits <= U_WEBSOCKET_DEFLATE_WINDOW_BITS &&
+      client_max_window_bits >= 9 && client_max_window_bits <= U_WEBSOCKET_DEFLATE_WINDOW_BITS) {
+    ((struct _websocket_handle *)response->websocket_handle)->deflate_server_max_window_bits = server_max_window_bits;
+    ((struct _websocket_handle *)response->websocket_handle)->deflate_client_max_window_bits = client_max_window_bits;
+    ((struct _websocket_handle *)response->websocket_handle)->deflate_server_no_context_takeover = server_no_context_takeover;
+    ((struct _websocket_handle *)response->websocket_handle)->deflate_client_no_context_takeover = client_no_context_takeover;
+    return U_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_add_websocket_deflate_extension params");
+    return U_ERROR_PARAMS;
+  }
+}
+
 /**
  * Sets the websocket in closing mode
  * The websocket will not necessarily be closed at the return of this function,
@@ -1389,6 +2526,7 @@ int ulfius_set_websocket_response(struct _u_response * response,
 int ulfius_websocket_send_close_signal(struct _websocket_manager * websocket_manager) {
   if (websocket_manager != NULL) {
     websocket_manager->close_flag = 1;
+    ulfius_websocket_reactor_close_signal(websocket_manager);
     return U_OK;
   } else {
     return U_ERROR_PARAMS;
@@ -1442,6 +2580,144 @@ int ulfius_websocket_wait_close(struct _websocket_manager * websocket_manager, u
   }
 }
 
+/**
+ * Set the high-water mark and the policy of the outgoing queue of a server websocket
+ * return U_OK on success
+ */
+int ulfius_websocket_set_queue_policy(struct _websocket_manager * websocket_manager, size_t high_water, int policy) {
+  if (websocket_manager != NULL && (policy == U_WEBSOCKET_QUEUE_BLOCK || policy == U_WEBSOCKET_QUEUE_DROP || policy == U_WEBSOCKET_QUEUE_CLOSE)) {
+    pthread_mutex_lock(&websocket_manager->queue_lock);
+    websocket_manager->queue_high_water = high_water;
+    websocket_manager->queue_policy = policy;
+    pthread_mutex_unlock(&websocket_manager->queue_lock);
+    return U_OK;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
+/**
+ * Get the number of bytes waiting in the outgoing queue of a server websocket
+ */
+size_t ulfius_websocket_queued_bytes(struct _websocket_manager * websocket_manager) {
+  size_t queue_size = 0;
+  
+  if (websocket_manager != NULL) {
+    pthread_mutex_lock(&websocket_manager->queue_lock);
+    queue_size = websocket_manager->queue_size;
+    pthread_mutex_unlock(&websocket_manager->queue_lock);
+  }
+  return queue_size;
+}
+
+/**
+ * Queue a broadcast message in a websocket using permessage-deflate
+ * Without context takeover, the compressed frame only depends on the window size,
+ * so it's compressed once per window size and shared in shared_frames
+ * return U_OK on success, or if the queue policy drops the message
+ */
+static int ulfius_websocket_broadcast_deflate(struct _websocket_manager * websocket_manager,
+                                              const uint8_t opcode,
+                                              const uint64_t data_len,
+                                              const char * data,
+                                              struct _websocket_frame ** shared_frames) {
+  struct _websocket_deflate * deflate = (struct _websocket_deflate *)websocket_manager->deflate;
+  struct _websocket_frame * frame = NULL;
+  z_stream stream;
+  uint8_t * deflate_data = NULL;
+  size_t deflate_len = 0;
+  int ret = U_OK;
+  
+  pthread_mutex_lock(&deflate->lock);
+  // The queue policy applies before the compression, so a dropped message doesn't break the compression context
+  if (ulfius_websocket_queue_check(websocket_manager, data_len, 0) == U_OK) {
+    if (deflate->deflate_no_context_takeover) {
+      if (shared_frames[deflate->deflate_window_bits] == NULL && (ret = ulfius_websocket_deflate_stream_init(&stream, deflate->deflate_window_bits)) == U_OK) {
+        if ((ret = ulfius_websocket_deflate_stream(&stream, data, data_len, &deflate_data, &deflate_len)) == U_OK &&
+            (shared_frames[deflate->deflate_window_bits] = ulfius_websocket_frame_build(opcode | U_WEBSOCKET_RSV1, deflate_len, (const char *)deflate_data, 0, 0)) == NULL) {
+          ret = U_ERROR_MEMORY;
+        }
+        deflateEnd(&stream);
+      }
+      if (shared_frames[deflate->deflate_window_bits] != NULL) {
+        ret = ulfius_websocket_queue_frame(websocket_manager, shared_frames[deflate->deflate_window_bits]);
+      }
+    } else if ((ret = ulfius_websocket_deflate_message(deflate, data, data_len, &deflate_data, &deflate_len)) == U_OK) {
+      if ((frame = ulfius_websocket_frame_build(opcode | U_WEBSOCKET_RSV1, deflate_len, (const char *)deflate_data, 0, 0)) != NULL) {
+        ret = ulfius_websocket_queue_frame(websocket_manager, frame);
+        ulfius_websocket_frame_release(frame);
+      } else {
+        // The message isn't sent, so the next messages must not refer to it
+        deflateReset(&deflate->deflate_stream);
+        ret = U_ERROR_MEMORY;
+      }
+    }
+    o_free(deflate_data);
+  }
+  pthread_mutex_unlock(&deflate->lock);
+  return ret;
+}
+
+/**
+ * Send a message to all the server websockets of the instance
+ * The frame is built once and queued to every websocket filtered by websocket_filter
+ * The websockets using permessage-deflate without context takeover share a compressed frame per window size,
+ * the other ones compress the message with their own context
+ * return U_OK on success
+ */
+int ulfius_websocket_broadcast(struct _u_instance * u_instance,
+                               const uint8_t opcode,
+                               const uint64_t data_len,
+                               const char * data,
+                               int (* websocket_filter) (const struct _u_request * request,
+                                                         struct _websocket_manager * websocket_manager,
+                                                         void * websocket_filter_user_data),
+                               void * websocket_filter_user_data) {
+  struct _websocket_frame * frame, * deflate_frames[U_WEBSOCKET_DEFLATE_WINDOW_BITS+1] = {NULL};
+  struct _websocket * websocket;
+  size_t i;
+  int ret = U_OK;
+  
+  if (u_instance != NULL && u_instance->websocket_handler != NULL && (data != NULL || data_len == 0) &&
+      (opcode == U_WEBSOCKET_OPCODE_TEXT || opcode == U_WEBSOCKET_OPCODE_BINARY || (opcode == U_WEBSOCKET_OPCODE_PING && data_len <= 125))) {
+    if ((frame = ulfius_websocket_frame_build(opcode, data_len, data, 0, 0)) != NULL) {
+      pthread_mutex_lock(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock);
+      for (i=0; i<((struct _websocket_handler *)u_instance->websocket_handler)->nb_websocket_active; i++) {
+        websocket = ((struct _websocket_handler *)u_instance->websocket_handler)->websocket_active[i];
+        if (websocket->websocket_manager != NULL &&
+            websocket->websocket_manager->type == U_WEBSOCKET_SERVER &&
+            websocket->websocket_manager->connected &&
+            !websocket->websocket_manager->close_flag &&
+            (websocket_filter == NULL || websocket_filter(websocket->request, websocket->websocket_manager, websocket_filter_user_data))) {
+          // The broadcast doesn't wait for slow clients
+          if (websocket->websocket_manager->deflate != NULL && opcode != U_WEBSOCKET_OPCODE_PING) {
+            if (ulfius_websocket_broadcast_deflate(websocket->websocket_manager, opcode, data_len, data, deflate_frames) == U_ERROR_MEMORY) {
+              ret = U_ERROR_MEMORY;
+              break;
+            }
+          } else if (ulfius_websocket_queue_check(websocket->websocket_manager, frame->len, 0) == U_OK &&
+                     ulfius_websocket_queue_frame(websocket->websocket_manager, frame) == U_ERROR_MEMORY) {
+            ret = U_ERROR_MEMORY;
+            break;
+          }
+          // On a socket error, the thread or the reactor of the websocket closes it
+        }
+      }
+      pthread_mutex_unlock(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock);
+      ulfius_websocket_frame_release(frame);
+      for (i=0; i<=U_WEBSOCKET_DEFLATE_WINDOW_BITS; i++) {
+        ulfius_websocket_frame_release(deflate_frames[i]);
+      }
+    } else {
+      ret = U_ERROR_MEMORY;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_websocket_broadcast params");
+    ret = U_ERROR_PARAMS;
+  }
+  return ret;
+}
+
 /********************************/
 /** Client websocket functions **/
 /********************************/
@@ -1529,6 +2805,51 @@ int ulfius_set_websocket_request(struct _u_request * request,
   return ret;
 }
 
+/**
+ * Offer the permessage-deflate extension in a websocket request
+ * return U_OK on success
+ */
+int ulfius_add_websocket_client_deflate_extension(struct _u_request * request,
+                                                  unsigned int server_max_window_bits,
+                                                  unsigned int client_max_window_bits,
+                                                  int server_no_context_takeover,
+                                                  int client_no_context_takeover) {
+  char * extension, * extensions;
+  int ret;
+  
+  if (request != NULL &&
+      server_max_window_bits >= 9 && server_max_window_bits <= U_WEBSOCKET_DEFLATE_WINDOW_BITS &&
+      client_max_window_bits >= 9 && client_max_window_bits <= U_WEBSOCKET_DEFLATE_WINDOW_BITS) {
+    // client_max_window_bits without value tells the server the client supports the parameter
+    extension = ulfius_websocket_deflate_extension(server_max_window_bits<U_WEBSOCKET_DEFLATE_WINDOW_BITS?server_max_window_bits:0,
+                                                   client_max_window_bits<U_WEBSOCKET_DEFLATE_WINDOW_BITS?client_max_window_bits:U_WEBSOCKET_DEFLATE_WINDOW_BITS+1,
+                                                   server_no_context_takeover,
+                                                   client_no_context_takeover);
+    if (extension == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for extension");
+      ret = U_ERROR_MEMORY;
+    } else {
+      if (o_strlen(u_map_get(request->map_header, "Sec-WebSocket-Extensions"))) {
+        extensions = msprintf("%s, %s", u_map_get(request->map_header, "Sec-WebSocket-Extensions"), extension);
+      } else {
+        extensions = o_strdup(extension);
+      }
+      if (extensions == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for extensions");
+        ret = U_ERROR_MEMORY;
+      } else {
+        ret = u_map_put(request->map_header, "Sec-WebSocket-Extensions", extensions);
+      }
+      o_free(extensions);
+      o_free(extension);
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_add_websocket_client_deflate_extension input parameters");
+    ret = U_ERROR_PARAMS;
+  }
+  return ret;
+}
+
 /**
  * Open a websocket client connection
  * Return U_OK on success
@@ -0,0 +1,844 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_websocket_reactor.c: epoll reactor engine for server websockets
+ *
+ * Copyright 2019 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "u_private.h"
+#include "ulfius.h"
+
+#ifndef U_DISABLE_WEBSOCKET
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**
+ * Size of the buffer used by a reactor thread to read the sockets
+ */
+#define U_WEBSOCKET_REACTOR_READ_SIZE 16384
+
+/**
+ * Maximum number of bytes read from one socket on each event,
+ * so a fast client can't starve the other sockets of the same reactor thread
+ */
+#define U_WEBSOCKET_REACTOR_READ_MAX (4*U_WEBSOCKET_REACTOR_READ_SIZE)
+
+/**
+ * Maximum number of events handled by a reactor thread on each epoll_wait
+ */
+#define U_WEBSOCKET_REACTOR_MAX_EVENTS 256
+
+struct _u_websocket_reactor;
+struct _u_websocket_reactor_thread;
+
+/**
+ * A server websocket handled by the reactor
+ * buffer, buffer_len and message belong to the reactor thread
+ * message_list, scheduled, closing and next_scheduled are protected by the reactor lock
+ */
+struct _u_websocket_connection {
+  struct _websocket                  * websocket;
+  struct _u_websocket_reactor_thread * thread;
+  uint8_t                            * buffer;
+  size_t                               buffer_len;
+  struct _websocket_message          * message;
+  struct _websocket_message_list       message_list;
+  int                                  scheduled;
+  int                                  closing;
+  unsigned int                         refcount;
+  struct _u_websocket_connection     * next_scheduled;
+  struct _u_websocket_connection     * prev;
+  struct _u_websocket_connection     * next;
+};
+
+/**
+ * A reactor thread, polls its sockets with epoll
+ * event_fd wakes the thread up to check the sockets to close or to stop
+ */
+struct _u_websocket_reactor_thread {
+  struct _u_websocket_reactor    * reactor;
+  pthread_t                        thread;
+  int                              thread_init;
+  int                              epoll_fd;
+  int                              event_fd;
+  int                              stop;
+  pthread_mutex_t                  lock;
+  struct _u_websocket_connection * connection_list;
+};
+
+/**
+ * The reactor, its threads and the worker pool that runs the websocket_incoming_message_callback functions
+ * The messages of a connection are run in order by one worker at a time
+ */
+struct _u_websocket_reactor {
+  unsigned int                         nb_threads;
+  struct _u_websocket_reactor_thread * threads;
+  unsigned int                         next_thread;
+  unsigned int                         nb_workers;
+  pthread_t                          * workers;
+  unsigned int                         nb_workers_running;
+  pthread_mutex_t                      lock;
+  pthread_cond_t                       cond;
+  int                                  stop;
+  struct _u_websocket_connection     * first_scheduled;
+  struct _u_websocket_connection     * last_scheduled;
+};
+
+/**
+ * Wake up the reactor thread of the connection
+ */
+static void ulfius_websocket_reactor_wakeup(struct _u_websocket_reactor_thread * thread) {
+  uint64_t one = 1;
+
+  if (write(thread->event_fd, &one, sizeof(one)) != sizeof(one)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error waking up websocket reactor thread");
+  }
+}
+
+/**
+ * Release a reference to the connection
+ * The last reference closes the websocket and frees the connection
+ */
+static void ulfius_websocket_reactor_release(struct _u_websocket_connection * connection) {
+  struct _websocket * websocket;
+
+  if (!__atomic_sub_fetch(&connection->refcount, 1, __ATOMIC_ACQ_REL)) {
+    websocket = connection->websocket;
+    if (websocket->websocket_onclose_callback != NULL) {
+      websocket->websocket_onclose_callback(websocket->request, websocket->websocket_manager, websocket->websocket_onclose_user_data);
+    }
+    if (ulfius_close_websocket(websocket) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error closing websocket");
+    }
+    pthread_mutex_lock(&websocket->websocket_manager->queue_lock);
+    websocket->websocket_manager->reactor_connection = NULL;
+    pthread_mutex_unlock(&websocket->websocket_manager->queue_lock);
+    ulfius_clear_websocket_message_list(&connection->message_list);
+    o_free(connection);
+    ulfius_clear_websocket(websocket);
+  }
+}
+
+/**
+ * Add the connection to the worker queue if it isn't already in it
+ * The reactor lock must be held
+ */
+static void ulfius_websocket_reactor_schedule(struct _u_websocket_reactor * reactor, struct _u_websocket_connection * connection) {
+  if (!connection->scheduled) {
+    connection->scheduled = 1;
+    connection->next_scheduled = NULL;
+    if (reactor->last_scheduled != NULL) {
+      reactor->last_scheduled->next_scheduled = connection;
+    } else {
+      reactor->first_scheduled = connection;
+    }
+    reactor->last_scheduled = connection;
+    pthread_cond_signal(&reactor->cond);
+  }
+}
+
+/**
+ * Worker thread
+ * Runs the websocket_incoming_message_callback of the scheduled connections
+ * then releases the reactor reference of the closed connections once all their messages are handled
+ */
+static void * ulfius_websocket_reactor_worker(void * args) {
+  struct _u_websocket_reactor * reactor = (struct _u_websocket_reactor *)args;
+  struct _u_websocket_connection * connection;
+  struct _websocket_message * message;
+  struct _websocket * websocket;
+
+  pthread_mutex_lock(&reactor->lock);
+  while (1) {
+    while (!reactor->stop && reactor->first_scheduled == NULL) {
+      pthread_cond_wait(&reactor->cond, &reactor->lock);
+    }
+    if (reactor->first_scheduled == NULL) {
+      break;
+    }
+    connection = reactor->first_scheduled;
+    reactor->first_scheduled = connection->next_scheduled;
+    if (reactor->first_scheduled == NULL) {
+      reactor->last_scheduled = NULL;
+    }
+    websocket = connection->websocket;
+    while ((message = ulfius_websocket_pop_first_message(&connection->message_list)) != NULL) {
+      pthread_mutex_unlock(&reactor->lock);
+      if (websocket->websocket_incoming_message_callback != NULL) {
+        websocket->websocket_incoming_message_callback(websocket->request, websocket->websocket_manager, message, websocket->websocket_incoming_user_data);
+      }
+      ulfius_clear_websocket_message(message);
+      pthread_mutex_lock(&reactor->lock);
+    }
+    connection->scheduled = 0;
+    if (connection->closing == 1) {
+      // The reactor won't push messages anymore
+      connection->closing = 2;
+      pthread_mutex_unlock(&reactor->lock);
+      ulfius_websocket_reactor_release(connection);
+      pthread_mutex_lock(&reactor->lock);
+    }
+  }
+  pthread_mutex_unlock(&reactor->lock);
+  return NULL;
+}
+
+/**
+ * Run the websocket_manager_callback in a separate thread
+ * The callback can block as long as the websocket is open
+ */
+static void * ulfius_websocket_reactor_manager_run(void * args) {
+  struct _u_websocket_connection * connection = (struct _u_websocket_connection *)args;
+  struct _websocket * websocket = connection->websocket;
+
+  websocket->websocket_manager_callback(websocket->request, websocket->websocket_manager, websocket->websocket_manager_user_data);
+  // Send close message if the websocket is still open
+  if (websocket->websocket_manager->connected) {
+    ulfius_websocket_send_close_signal(websocket->websocket_manager);
+  }
+  ulfius_websocket_reactor_release(connection);
+  return NULL;
+}
+
+/**
+ * Remove the connection from its reactor thread
+ * then hand it to the workers to run the remaining messages and release it
+ * The connection must not be used by the reactor thread after this call
+ */
+static void ulfius_websocket_reactor_remove(struct _u_websocket_reactor_thread * thread, struct _u_websocket_connection * connection) {
+  struct _u_websocket_reactor * reactor = thread->reactor;
+  struct _websocket_manager * websocket_manager = connection->websocket->websocket_manager;
+
+  if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, websocket_manager->mhd_sock, NULL)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error removing websocket from epoll");
+  }
+  pthread_mutex_lock(&thread->lock);
+  if (connection->prev != NULL) {
+    connection->prev->next = connection->next;
+  } else {
+    thread->connection_list = connection->next;
+  }
+  if (connection->next != NULL) {
+    connection->next->prev = connection->prev;
+  }
+  pthread_mutex_unlock(&thread->lock);
+
+  o_free(connection->buffer);
+  connection->buffer = NULL;
+  connection->buffer_len = 0;
+  ulfius_clear_websocket_message(connection->message);
+  connection->message = NULL;
+
+  websocket_manager->connected = 0;
+  pthread_mutex_lock(&websocket_manager->status_lock);
+  pthread_cond_broadcast(&websocket_manager->status_cond);
+  pthread_mutex_unlock(&websocket_manager->status_lock);
+
+  pthread_mutex_lock(&reactor->lock);
+  connection->closing = 1;
+  ulfius_websocket_reactor_schedule(reactor, connection);
+  pthread_mutex_unlock(&reactor->lock);
+}
+
+/**
+ * Push a complete message to the workers
+ * return U_OK on success
+ */
+static int ulfius_websocket_reactor_push_message(struct _u_websocket_connection * connection, struct _websocket_message * message) {
+  struct _u_websocket_reactor * reactor = connection->thread->reactor;
+  int ret;
+
+  if (connection->websocket->websocket_incoming_message_callback == NULL) {
+    ulfius_clear_websocket_message(message);
+    return U_OK;
+  }
+  pthread_mutex_lock(&reactor->lock);
+  if ((ret = ulfius_push_websocket_message(&connection->message_list, message)) == U_OK) {
+    ulfius_websocket_reactor_schedule(reactor, connection);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error pushing websocket message");
+    ulfius_clear_websocket_message(message);
+  }
+  pthread_mutex_unlock(&reactor->lock);
+  return ret;
+}
+
+/**
+ * Parse the complete frames available in data
+ * Sets the number of bytes used in parsed_len
+ * return U_OK if the connection is still open,
+ * U_WEBSOCKET_OPCODE_CLOSE if a close frame was received, U_ERROR on protocol error
+ */
+static int ulfius_websocket_reactor_parse(struct _u_websocket_connection * connection, const uint8_t * data, size_t data_len, size_t * parsed_len) {
+  struct _websocket_manager * websocket_manager = connection->websocket->websocket_manager;
+  struct _websocket_message * message;
+  size_t offset = 0, header_len, i;
+  uint64_t payload_len;
+  uint8_t opcode, fin;
+  const uint8_t * mask, * payload;
+  char * data_buffer;
+  int ret = U_OK;
+
+  while (ret == U_OK && data_len - offset >= 2) {
+    opcode = data[offset] & 0x0F;
+    fin = data[offset] & U_WEBSOCKET_BIT_FIN;
+    header_len = 2;
+    if ((data[offset+1] & U_WEBSOCKET_LEN_MASK) == 126) {
+      header_len += 2;
+    } else if ((data[offset+1] & U_WEBSOCKET_LEN_MASK) == 127) {
+      header_len += 8;
+    }
+    if (!(data[offset+1] & U_WEBSOCKET_MASK)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Incoming message has no MASK flag, exiting");
+      ret = U_ERROR;
+      break;
+    }
+    if (ulfius_websocket_check_rsv(websocket_manager, data[offset]) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Incoming message has invalid RSV bits, exiting");
+      ret = U_ERROR;
+      break;
+    }
+    header_len += 4;
+    if (data_len - offset < header_len) {
+      break;
+    }
+    if ((data[offset+1] & U_WEBSOCKET_LEN_MASK) == 126) {
+      payload_len = ((uint64_t)data[offset+2] << 8) | data[offset+3];
+    } else if ((data[offset+1] & U_WEBSOCKET_LEN_MASK) == 127) {
+      payload_len = 0;
+      for (i=0; i<8; i++) {
+        payload_len = (payload_len << 8) | data[offset+2+i];
+      }
+    } else {
+      payload_len = data[offset+1] & U_WEBSOCKET_LEN_MASK;
+    }
+    if (payload_len > (uint64_t)(data_len - offset - header_len)) {
+      // Incomplete frame, wait for more data
+      break;
+    }
+    mask = data + offset + header_len - 4;
+    payload = data + offset + header_len;
+
+    if (opcode & 0x08) {
+      // Control frame, may be interleaved with the fragments of a message
+      if (!fin || payload_len > 125) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Invalid websocket control frame");
+        ret = U_ERROR;
+        break;
+      }
+      message = o_malloc(sizeof(struct _websocket_message));
+      if (message == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for message");
+        ret = U_ERROR_MEMORY;
+        break;
+      }
+      message->opcode = opcode;
+      message->rsv = 0;
+      message->data_len = 0;
+      message->data = NULL;
+    } else if (opcode != U_WEBSOCKET_OPCODE_CONTINUE) {
+      if (connection->message != NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Websocket message started before the previous one is complete");
+        ret = U_ERROR;
+        break;
+      }
+      message = connection->message = o_malloc(sizeof(struct _websocket_message));
+      if (message == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for message");
+        ret = U_ERROR_MEMORY;
+        break;
+      }
+      message->opcode = opcode;
+      message->rsv = data[offset] & (U_WEBSOCKET_RSV1|U_WEBSOCKET_RSV2|U_WEBSOCKET_RSV3);
+      message->data_len = 0;
+      message->data = NULL;
+    } else if (connection->message != NULL) {
+      message = connection->message;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Websocket continuation frame without message");
+      ret = U_ERROR;
+      break;
+    }
+    if (!message->data_len) {
+      message->has_mask = 1;
+      memcpy(message->mask, mask, 4);
+      time(&message->datestamp);
+    }
+    if (payload_len) {
+      if ((data_buffer = o_realloc(message->data, message->data_len + payload_len)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for message->data");
+        if (message != connection->message) {
+          ulfius_clear_websocket_message(message);
+        }
+        ret = U_ERROR_MEMORY;
+        break;
+      }
+      message->data = data_buffer;
+      memcpy(message->data + message->data_len, payload, payload_len);
+      ulfius_websocket_mask((uint8_t *)message->data + message->data_len, payload_len, mask);
+      message->data_len += payload_len;
+    }
+    offset += header_len + payload_len;
+
+    if (message != connection->message) {
+      if (message->opcode == U_WEBSOCKET_OPCODE_CLOSE) {
+        ret = U_WEBSOCKET_OPCODE_CLOSE;
+      } else if (message->opcode == U_WEBSOCKET_OPCODE_PING) {
+        if (ulfius_websocket_send_message(websocket_manager, U_WEBSOCKET_OPCODE_PONG, message->data_len, message->data) != U_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending pong command");
+          ret = U_ERROR;
+        }
+      }
+      ulfius_websocket_reactor_push_message(connection, message);
+    } else if (fin) {
+      connection->message = NULL;
+      if ((message->rsv & U_WEBSOCKET_RSV1) && ulfius_websocket_inflate_message(websocket_manager, message) != U_OK) {
+        ulfius_clear_websocket_message(message);
+        ret = U_ERROR;
+        break;
+      }
+      ulfius_websocket_reactor_push_message(connection, message);
+    }
+  }
+  *parsed_len = offset;
+  return ret;
+}
+
+/**
+ * Read the available data of a socket and parse it
+ * The incomplete frame at the end of the data is kept in connection->buffer
+ * return U_OK if the connection is still open
+ */
+static int ulfius_websocket_reactor_read(struct _u_websocket_connection * connection, uint8_t * read_buffer) {
+  struct _websocket_manager * websocket_manager = connection->websocket->websocket_manager;
+  const uint8_t * data;
+  uint8_t * new_buffer;
+  size_t total_len = 0, data_len, parsed_len = 0;
+  ssize_t len;
+  int ret = U_OK;
+
+  while (ret == U_OK && total_len < U_WEBSOCKET_REACTOR_READ_MAX) {
+    len = read(websocket_manager->mhd_sock, read_buffer, U_WEBSOCKET_REACTOR_READ_SIZE);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        ret = U_ERROR_DISCONNECTED;
+      }
+      break;
+    } else if (!len) {
+      ret = U_ERROR_DISCONNECTED;
+      break;
+    }
+    total_len += len;
+    if (connection->buffer_len) {
+      // Append the data to the incomplete frame
+      if ((new_buffer = o_realloc(connection->buffer, connection->buffer_len + len)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for connection->buffer");
+        ret = U_ERROR_MEMORY;
+        break;
+      }
+      connection->buffer = new_buffer;
+      memcpy(connection->buffer + connection->buffer_len, read_buffer, len);
+      connection->buffer_len += len;
+      data = connection->buffer;
+      data_len = connection->buffer_len;
+    } else {
+      // Parse the data in place, most frames fit in one read
+      data = read_buffer;
+      data_len = (size_t)len;
+    }
+    ret = ulfius_websocket_reactor_parse(connection, data, data_len, &parsed_len);
+    if (ret == U_OK) {
+      if (parsed_len == data_len) {
+        o_free(connection->buffer);
+        connection->buffer = NULL;
+        connection->buffer_len = 0;
+      } else if (data == connection->buffer) {
+        memmove(connection->buffer, connection->buffer + parsed_len, data_len - parsed_len);
+        connection->buffer_len = data_len - parsed_len;
+      } else if ((connection->buffer = o_malloc(data_len - parsed_len)) != NULL) {
+        memcpy(connection->buffer, data + parsed_len, data_len - parsed_len);
+        connection->buffer_len = data_len - parsed_len;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for connection->buffer");
+        ret = U_ERROR_MEMORY;
+      }
+    }
+    if (len < U_WEBSOCKET_REACTOR_READ_SIZE) {
+      break;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Close the connection after a close frame, a close signal or an error
+ * Send a close frame to the client if the websocket is still connected
+ */
+static void ulfius_websocket_reactor_close(struct _u_websocket_reactor_thread * thread, struct _u_websocket_connection * connection, int send_close) {
+  struct _websocket_manager * websocket_manager = connection->websocket->websocket_manager;
+
+  if (send_close && websocket_manager->connected) {
+    if (ulfius_websocket_send_message(websocket_manager, U_WEBSOCKET_OPCODE_CLOSE, 0, NULL) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending close command");
+    }
+  }
+  ulfius_websocket_reactor_remove(thread, connection);
+}
+
+/**
+ * Reactor thread main loop
+ */
+static void * ulfius_websocket_reactor_run(void * args) {
+  struct _u_websocket_reactor_thread * thread = (struct _u_websocket_reactor_thread *)args;
+  struct _u_websocket_connection * connection, * next;
+  struct epoll_event events[U_WEBSOCKET_REACTOR_MAX_EVENTS];
+  uint8_t * read_buffer = o_malloc(U_WEBSOCKET_REACTOR_READ_SIZE);
+  uint64_t counter;
+  int nb_events, i, ret, check_close;
+
+  if (read_buffer == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for websocket reactor read_buffer");
+    return NULL;
+  }
+  while (!__atomic_load_n(&thread->stop, __ATOMIC_ACQUIRE)) {
+    nb_events = epoll_wait(thread->epoll_fd, events, U_WEBSOCKET_REACTOR_MAX_EVENTS, -1);
+    if (nb_events < 0) {
+      if (errno != EINTR) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error epoll_wait in websocket reactor");
+        break;
+      }
+      continue;
+    }
+    check_close = 0;
+    for (i=0; i<nb_events; i++) {
+      if (events[i].data.ptr == NULL) {
+        // Close signal or stop
+        if (read(thread->event_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reading websocket reactor event_fd");
+        }
+        check_close = 1;
+      } else {
+        connection = (struct _u_websocket_connection *)events[i].data.ptr;
+        ret = U_OK;
+        if (events[i].events & EPOLLIN) {
+          ret = ulfius_websocket_reactor_read(connection, read_buffer);
+        } else if (!(events[i].events & EPOLLOUT)) {
+          ret = U_ERROR_DISCONNECTED;
+        }
+        if (ret == U_OK && (events[i].events & EPOLLOUT)) {
+          // Send the outgoing queue without waiting for the socket or for the other writers
+          if (ulfius_websocket_flush_queue(connection->websocket->websocket_manager, U_WEBSOCKET_FLUSH_TRY) != U_OK) {
+            ret = U_ERROR_DISCONNECTED;
+          }
+        }
+        if (ret == U_WEBSOCKET_OPCODE_CLOSE) {
+          // Send close command back, then close the socket
+          ulfius_websocket_reactor_close(thread, connection, 1);
+        } else if (ret != U_OK) {
+          ulfius_websocket_reactor_close(thread, connection, 0);
+        } else if (events[i].events & (EPOLLERR|EPOLLHUP|EPOLLRDHUP)) {
+          ulfius_websocket_reactor_close(thread, connection, 0);
+        }
+      }
+    }
+    if (check_close) {
+      // The sockets are closed after the events, so no pending event refers to a removed connection
+      pthread_mutex_lock(&thread->lock);
+      connection = thread->connection_list;
+      pthread_mutex_unlock(&thread->lock);
+      while (connection != NULL) {
+        next = connection->next;
+        if (connection->websocket->websocket_manager->close_flag || !connection->websocket->websocket_manager->connected) {
+          ulfius_websocket_reactor_close(thread, connection, 1);
+        }
+        connection = next;
+      }
+    }
+  }
+  o_free(read_buffer);
+  return NULL;
+}
+
+/**
+ * ulfius_websocket_reactor_init
+ * Start the reactor threads and the worker pool
+ * return NULL on error
+ */
+struct _u_websocket_reactor * ulfius_websocket_reactor_init(unsigned int nb_threads, unsigned int nb_workers) {
+  struct _u_websocket_reactor * reactor = o_malloc(sizeof(struct _u_websocket_reactor));
+  struct epoll_event event;
+  unsigned int i;
+  int error = 0;
+
+  if (reactor == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for websocket reactor");
+    return NULL;
+  }
+  reactor->nb_threads = nb_threads?nb_threads:1;
+  reactor->nb_workers = nb_workers;
+  reactor->next_thread = 0;
+  reactor->nb_workers_running = 0;
+  reactor->stop = 0;
+  reactor->first_scheduled = reactor->last_scheduled = NULL;
+  reactor->threads = o_malloc(reactor->nb_threads*sizeof(struct _u_websocket_reactor_thread));
+  reactor->workers = o_malloc(reactor->nb_workers*sizeof(pthread_t));
+  if (reactor->threads == NULL || reactor->workers == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for websocket reactor threads");
+    o_free(reactor->threads);
+    o_free(reactor->workers);
+    o_free(reactor);
+    return NULL;
+  }
+  if (pthread_mutex_init(&reactor->lock, NULL) || pthread_cond_init(&reactor->cond, NULL)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing websocket reactor lock");
+    o_free(reactor->threads);
+    o_free(reactor->workers);
+    o_free(reactor);
+    return NULL;
+  }
+  for (i=0; i<reactor->nb_threads; i++) {
+    reactor->threads[i].reactor = reactor;
+    reactor->threads[i].thread_init = 0;
+    reactor->threads[i].stop = 0;
+    reactor->threads[i].connection_list = NULL;
+    reactor->threads[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->threads[i].event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    pthread_mutex_init(&reactor->threads[i].lock, NULL);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (reactor->threads[i].epoll_fd < 0 || reactor->threads[i].event_fd < 0 ||
+        epoll_ctl(reactor->threads[i].epoll_fd, EPOLL_CTL_ADD, reactor->threads[i].event_fd, &event)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing websocket reactor epoll");
+      error = 1;
+    } else if (pthread_create(&reactor->threads[i].thread, NULL, ulfius_websocket_reactor_run, &reactor->threads[i])) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating websocket reactor thread");
+      error = 1;
+    } else {
+      reactor->threads[i].thread_init = 1;
+    }
+  }
+  for (i=0; !error && i<reactor->nb_workers; i++) {
+    if (pthread_create(&reactor->workers[i], NULL, ulfius_websocket_reactor_worker, reactor)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating websocket reactor worker thread");
+      error = 1;
+    } else {
+      reactor->nb_workers_running++;
+    }
+  }
+  if (error) {
+    ulfius_websocket_reactor_clean(reactor);
+    reactor = NULL;
+  }
+  return reactor;
+}
+
+/**
+ * ulfius_websocket_reactor_clean
+ * Stop the reactor threads and the worker pool, then free the reactor
+ * All the websockets of the reactor must be closed
+ */
+void ulfius_websocket_reactor_clean(struct _u_websocket_reactor * reactor) {
+  unsigned int i;
+
+  if (reactor != NULL) {
+    for (i=0; i<reactor->nb_threads; i++) {
+      if (reactor->threads[i].thread_init) {
+        __atomic_store_n(&reactor->threads[i].stop, 1, __ATOMIC_RELEASE);
+        ulfius_websocket_reactor_wakeup(&reactor->threads[i]);
+        pthread_join(reactor->threads[i].thread, NULL);
+      }
+      if (reactor->threads[i].epoll_fd >= 0) {
+        close(reactor->threads[i].epoll_fd);
+      }
+      if (reactor->threads[i].event_fd >= 0) {
+        close(reactor->threads[i].event_fd);
+      }
+      pthread_mutex_destroy(&reactor->threads[i].lock);
+    }
+    pthread_mutex_lock(&reactor->lock);
+    reactor->stop = 1;
+    pthread_cond_broadcast(&reactor->cond);
+    pthread_mutex_unlock(&reactor->lock);
+    for (i=0; i<reactor->nb_workers_running; i++) {
+      pthread_join(reactor->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&reactor->lock);
+    pthread_cond_destroy(&reactor->cond);
+    o_free(reactor->threads);
+    o_free(reactor->workers);
+    o_free(reactor);
+  }
+}
+
+/**
+ * ulfius_websocket_reactor_add
+ * Hand an upgraded server websocket to the reactor
+ * The websocket_manager_callback, if any, runs in its own thread
+ * return U_OK on success, on error the websocket must be closed by the caller
+ */
+int ulfius_websocket_reactor_add(struct _u_websocket_reactor * reactor, struct _websocket * websocket) {
+  struct _u_websocket_connection * connection;
+  struct _u_websocket_reactor_thread * thread;
+  struct epoll_event event;
+  pthread_t thread_manager;
+  int flags;
+
+  if (reactor == NULL || websocket == NULL || websocket->websocket_manager == NULL) {
+    return U_ERROR_PARAMS;
+  }
+  if ((connection = o_malloc(sizeof(struct _u_websocket_connection))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for websocket connection");
+    return U_ERROR_MEMORY;
+  }
+  // The reactor reads the socket without blocking, the writes wait until the socket is writable
+  flags = fcntl(websocket->websocket_manager->mhd_sock, F_GETFL);
+  if (flags < 0 || fcntl(websocket->websocket_manager->mhd_sock, F_SETFL, flags|O_NONBLOCK) < 0) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting websocket non blocking");
+    o_free(connection);
+    return U_ERROR;
+  }
+  thread = &reactor->threads[__atomic_fetch_add(&reactor->next_thread, 1, __ATOMIC_RELAXED)%reactor->nb_threads];
+  connection->websocket = websocket;
+  connection->thread = thread;
+  connection->buffer = NULL;
+  connection->buffer_len = 0;
+  connection->message = NULL;
+  ulfius_init_websocket_message_list(&connection->message_list);
+  connection->scheduled = 0;
+  connection->closing = 0;
+  connection->next_scheduled = NULL;
+  // One reference for the reactor, one for the manager thread if any
+  connection->refcount = websocket->websocket_manager_callback!=NULL?2:1;
+  connection->prev = NULL;
+
+  pthread_mutex_lock(&thread->lock);
+  connection->next = thread->connection_list;
+  if (thread->connection_list != NULL) {
+    thread->connection_list->prev = connection;
+  }
+  thread->connection_list = connection;
+  pthread_mutex_unlock(&thread->lock);
+
+  event.events = EPOLLIN|EPOLLRDHUP;
+  event.data.ptr = connection;
+  if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, websocket->websocket_manager->mhd_sock, &event)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error adding websocket to epoll");
+    pthread_mutex_lock(&thread->lock);
+    if (connection->next != NULL) {
+      connection->next->prev = connection->prev;
+    }
+    if (connection->prev != NULL) {
+      connection->prev->next = connection->next;
+    } else {
+      thread->connection_list = connection->next;
+    }
+    pthread_mutex_unlock(&thread->lock);
+    o_free(connection);
+    return U_ERROR;
+  }
+  // The frames queued before are sent when the socket is writable
+  pthread_mutex_lock(&websocket->websocket_manager->queue_lock);
+  websocket->websocket_manager->reactor_connection = connection;
+  websocket->websocket_manager->queue_want_write = 0;
+  ulfius_websocket_reactor_update_events(websocket->websocket_manager, websocket->websocket_manager->queue_first != NULL);
+  pthread_mutex_unlock(&websocket->websocket_manager->queue_lock);
+
+  if (websocket->websocket_manager_callback != NULL) {
+    if (pthread_create(&thread_manager, NULL, ulfius_websocket_reactor_manager_run, connection)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating websocket manager thread");
+      ulfius_websocket_send_close_signal(websocket->websocket_manager);
+      ulfius_websocket_reactor_release(connection);
+    } else {
+      pthread_detach(thread_manager);
+    }
+  }
+  return U_OK;
+}
+
+/**
+ * ulfius_websocket_reactor_close_signal
+ * Wake up the reactor thread of the websocket to close it
+ */
+void ulfius_websocket_reactor_close_signal(struct _websocket_manager * websocket_manager) {
+  if (websocket_manager != NULL) {
+    pthread_mutex_lock(&websocket_manager->queue_lock);
+    if (websocket_manager->reactor_connection != NULL) {
+      ulfius_websocket_reactor_wakeup(((struct _u_websocket_connection *)websocket_manager->reactor_connection)->thread);
+    }
+    pthread_mutex_unlock(&websocket_manager->queue_lock);
+  }
+}
+
+/**
+ * ulfius_websocket_reactor_update_events
+ * Add EPOLLOUT to the events of the socket while the outgoing queue must be flushed
+ * The queue_lock of the websocket_manager must be held
+ */
+void ulfius_websocket_reactor_update_events(struct _websocket_manager * websocket_manager, int want_write) {
+  struct _u_websocket_connection * connection = (struct _u_websocket_connection *)websocket_manager->reactor_connection;
+  struct epoll_event event;
+
+  if (connection != NULL && want_write != websocket_manager->queue_want_write) {
+    websocket_manager->queue_want_write = want_write;
+    event.events = EPOLLIN|EPOLLRDHUP|(want_write?EPOLLOUT:0);
+    event.data.ptr = connection;
+    // Fails with ENOENT if the reactor already removed the socket
+    epoll_ctl(connection->thread->epoll_fd, EPOLL_CTL_MOD, websocket_manager->mhd_sock, &event);
+  }
+}
+
+#else
+
+struct _u_websocket_reactor * ulfius_websocket_reactor_init(unsigned int nb_threads, unsigned int nb_workers) {
+  UNUSED(nb_threads);
+  UNUSED(nb_workers);
+  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error, U_WEBSOCKET_MODE_REACTOR requires epoll");
+  return NULL;
+}
+
+void ulfius_websocket_reactor_clean(struct _u_websocket_reactor * reactor) {
+  UNUSED(reactor);
+}
+
+int ulfius_websocket_reactor_add(struct _u_websocket_reactor * reactor, struct _websocket * websocket) {
+  UNUSED(reactor);
+  UNUSED(websocket);
+  return U_ERROR_PARAMS;
+}
+
+void ulfius_websocket_reactor_close_signal(struct _websocket_manager * websocket_manager) {
+  UNUSED(websocket_manager);
+}
+
+void ulfius_websocket_reactor_update_events(struct _websocket_manager * websocket_manager, int want_write) {
+  UNUSED(websocket_manager);
+  UNUSED(want_write);
+}
+
+#endif
+#endif
@@ -0,0 +1,181 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_worker_pool.c: worker threads pool functions definitions
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <pthread.h>
+
+#include "u_private.h"
+#include "ulfius.h"
+
+/**
+ * The worker threads and their task queue
+ */
+struct _u_worker_pool {
+  unsigned int            nb_workers;
+  unsigned int            nb_workers_running;
+  pthread_t             * workers;
+  pthread_mutex_t         lock;
+  pthread_cond_t          cond;
+  int                     stop;
+  struct _u_worker_task * first_task;
+  struct _u_worker_task * last_task;
+};
+
+/**
+ * Worker thread
+ * Runs the queued tasks until the pool is stopped and the queue is empty
+ */
+static void * ulfius_worker_pool_worker(void * args) {
+  struct _u_worker_pool * pool = (struct _u_worker_pool *)args;
+  struct _u_worker_task * task;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (!pool->stop && pool->first_task == NULL) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if (pool->first_task == NULL) {
+      break;
+    }
+    task = pool->first_task;
+    pool->first_task = task->next;
+    if (pool->first_task == NULL) {
+      pool->last_task = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    // The task may be freed by its run function
+    task->run(task->args);
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/**
+ * ulfius_worker_pool_init
+ * Start a pool of nb_workers threads
+ * return NULL on error
+ */
+struct _u_worker_pool * ulfius_worker_pool_init(unsigned int nb_workers) {
+  struct _u_worker_pool * pool = o_malloc(sizeof(struct _u_worker_pool));
+  unsigned int i;
+  int error = 0;
+
+  if (pool == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for worker pool");
+    return NULL;
+  }
+  pool->nb_workers = nb_workers?nb_workers:1;
+  pool->nb_workers_running = 0;
+  pool->stop = 0;
+  pool->first_task = pool->last_task = NULL;
+  pool->workers = o_malloc(pool->nb_workers*sizeof(pthread_t));
+  if (pool->workers == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for worker threads");
+    o_free(pool);
+    return NULL;
+  }
+  if (pthread_mutex_init(&pool->lock, NULL) || pthread_cond_init(&pool->cond, NULL)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing worker pool lock");
+    o_free(pool->workers);
+    o_free(pool);
+    return NULL;
+  }
+  for (i=0; !error && i<pool->nb_workers; i++) {
+    if (pthread_create(&pool->workers[i], NULL, ulfius_worker_pool_worker, pool)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating worker thread");
+      error = 1;
+    } else {
+      pool->nb_workers_running++;
+    }
+  }
+  if (error) {
+    ulfius_worker_pool_clean(pool);
+    pool = NULL;
+  }
+  return pool;
+}
+
+/**
+ * ulfius_worker_pool_run
+ * Queue a task to be run by the first worker available
+ * return U_OK on success, U_ERROR if the pool is stopped
+ */
+int ulfius_worker_pool_run(struct _u_worker_pool * pool, struct _u_worker_task * task) {
+  int ret;
+
+  if (pool != NULL && task != NULL && task->run != NULL) {
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->stop) {
+      task->next = NULL;
+      if (pool->last_task != NULL) {
+        pool->last_task->next = task;
+      } else {
+        pool->first_task = task;
+      }
+      pool->last_task = task;
+      pthread_cond_signal(&pool->cond);
+      ret = U_OK;
+    } else {
+      ret = U_ERROR;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
+/**
+ * ulfius_worker_pool_stop
+ * Run the remaining tasks, then stop the workers
+ * The tasks queued afterwards are refused
+ */
+void ulfius_worker_pool_stop(struct _u_worker_pool * pool) {
+  unsigned int i;
+
+  if (pool != NULL) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i=0; i<pool->nb_workers_running; i++) {
+      pthread_join(pool->workers[i], NULL);
+    }
+    pool->nb_workers_running = 0;
+  }
+}
+
+/**
+ * ulfius_worker_pool_clean
+ * Stop the pool if needed and free it
+ */
+void ulfius_worker_pool_clean(struct _u_worker_pool * pool) {
+  if (pool != NULL) {
+    ulfius_worker_pool_stop(pool);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    o_free(pool->workers);
+    o_free(pool);
+  }
+}
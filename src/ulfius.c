@@ -27,6 +27,26 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define U_UTF8_X86
+#endif
+
+/**
+ * Number of bytes checked one sequence at a time by utf8_check_len before looking for an ASCII run again
+ */
+#define U_UTF8_BLOCK_SIZE 16
+
+/**
+ * Maximum first reservation of a request body whose Content-Length isn't bounded by max_post_body_size
+ */
+#define U_REQUEST_BODY_RESERVE_MAX (1024*1024)
 #include "u_private.h"
 #include "ulfius.h"
 
@@ -176,6 +196,11 @@ static int ulfius_validate_instance(const struct _u_instance * u_instance) {
   if (u_instance == NULL ||
       u_instance->port <= 0 ||
       u_instance->port >= 65536 ||
+      (u_instance->thread_mode != U_THREAD_PER_CONNECTION && u_instance->thread_mode != U_THREAD_POOL) ||
+#ifndef U_DISABLE_WEBSOCKET
+      (u_instance->websocket_mode != U_WEBSOCKET_MODE_THREAD && u_instance->websocket_mode != U_WEBSOCKET_MODE_REACTOR) ||
+      (u_instance->websocket_queue_policy != U_WEBSOCKET_QUEUE_BLOCK && u_instance->websocket_queue_policy != U_WEBSOCKET_QUEUE_DROP && u_instance->websocket_queue_policy != U_WEBSOCKET_QUEUE_CLOSE) ||
+#endif
       ulfius_validate_endpoint_list(u_instance->endpoint_list, u_instance->nb_endpoints) != U_OK) {
     y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error, instance or has invalid parameters");
     return U_ERROR_PARAMS;
@@ -187,40 +212,64 @@ static int ulfius_validate_instance(const struct _u_instance * u_instance) {
  * Internal method used to duplicate the full url before it's manipulated and modified by MHD
  */
 static void * ulfius_uri_logger (void * cls, const char * uri) {
-  struct connection_info_struct * con_info = o_malloc (sizeof (struct connection_info_struct));
-  UNUSED(cls);
+  struct _u_arena * arena = ulfius_arena_init(U_ARENA_BLOCK_SIZE);
+  struct connection_info_struct * con_info = ulfius_arena_alloc(arena, sizeof (struct connection_info_struct));
   
   if (con_info != NULL) {
+    con_info->arena = arena;
     con_info->callback_first_iteration = 1;
     con_info->u_instance = NULL;
     u_map_init(&con_info->map_url_initial);
-    con_info->request = o_malloc(sizeof(struct _u_request));
+    con_info->request = ulfius_arena_alloc(arena, sizeof(struct _u_request));
     if (con_info->request == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for con_info->request");
-      o_free(con_info);
+      ulfius_arena_free(arena);
       return NULL;
     }
     
-    if (NULL == con_info->request || ulfius_init_request(con_info->request) != U_OK) {
-      ulfius_clean_request_full(con_info->request);
-      o_free(con_info);
+    if (ulfius_init_request_arena(con_info->request, arena) != U_OK) {
+      ulfius_arena_free(arena);
       return NULL;
     }
-    con_info->request->http_url = o_strdup(uri);
+    con_info->request->http_url = ulfius_arena_strndup(arena, uri, o_strlen(uri));
     if (o_strchr(uri, '?') != NULL) {
-      con_info->request->url_path = o_strndup(uri, o_strchr(uri, '?') - uri);
+      con_info->request->url_path = ulfius_arena_strndup(arena, uri, o_strchr(uri, '?') - uri);
     } else {
-      con_info->request->url_path = o_strdup(uri);
+      con_info->request->url_path = con_info->request->http_url;
     }
     if (con_info->request->http_url == NULL || con_info->request->url_path == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for con_info->request->http_url or con_info->request->url_path");
-      ulfius_clean_request_full(con_info->request);
-      o_free(con_info);
+      ulfius_clean_request(con_info->request);
+      ulfius_arena_free(arena);
       return NULL;
     }
     con_info->max_post_param_size = 0;
+    con_info->connection = NULL;
+    pthread_mutex_init(&con_info->async_lock, NULL);
+    con_info->async_state = U_ASYNC_NONE;
+    con_info->async_callback_ret = U_CALLBACK_ERROR;
+    con_info->async_position = 0;
+    con_info->async_router = NULL;
+    con_info->async_endpoint_list = NULL;
+    con_info->async_nb_endpoints = 0;
+    con_info->async_response = NULL;
+    con_info->async_refcount = 1;
+    con_info->async_linked = 0;
+    con_info->async_prev = NULL;
+    con_info->async_next = NULL;
+    // The parse phase starts when the request line is received
+    con_info->metrics_time = ((struct _u_instance *)cls)->metrics!=NULL?ulfius_metrics_now():0;
+    memset(con_info->metrics_phases, 0, sizeof(con_info->metrics_phases));
+    con_info->body_checked = 0;
+    con_info->body_router = NULL;
+    con_info->body_endpoint = NULL;
+    con_info->body_offset = 0;
+    con_info->body_capacity = 0;
+    con_info->body_fd = -1;
+    con_info->store_body = 1;
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for con_info");
+    ulfius_arena_free(arena);
   }
   return con_info;
 }
@@ -228,7 +277,8 @@ static void * ulfius_uri_logger (void * cls, const char * uri) {
 /**
  * ulfius_get_body_from_response
  * Extract the body data from the response if any
- * Copy it in newly allocated response_buffer and set the size in response_buffer_len
+ * The ownership of the body is transferred to response_buffer without copy
+ * and the size is set in response_buffer_len
  * return U_OK on success
  */
 static int ulfius_get_body_from_response(struct _u_response * response, void ** response_buffer, size_t * response_buffer_len) {
@@ -236,21 +286,11 @@ static int ulfius_get_body_from_response(struct _u_response * response, void **
     return U_ERROR_PARAMS;
   } else {
     if (response->binary_body != NULL && response->binary_body_length > 0) {
-      // The user sent a binary response
-      *response_buffer = o_malloc(response->binary_body_length);
-      if (*response_buffer == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for response_buffer");
-        response->status = MHD_HTTP_INTERNAL_SERVER_ERROR;
-        response->binary_body = o_strdup(ULFIUS_HTTP_ERROR_BODY);
-        response->binary_body_length = o_strlen(ULFIUS_HTTP_ERROR_BODY);
-        if (response->binary_body == NULL) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for response->binary_body");
-          return U_ERROR_MEMORY;
-        }
-      } else {
-        memcpy(*response_buffer, response->binary_body, response->binary_body_length);
-        *response_buffer_len = response->binary_body_length;
-      }
+      // The user sent a binary response, MHD will free it when the response is sent
+      *response_buffer = response->binary_body;
+      *response_buffer_len = response->binary_body_length;
+      response->binary_body = NULL;
+      response->binary_body_length = 0;
     } else {
       *response_buffer = NULL;
       *response_buffer_len = 0;
@@ -259,6 +299,62 @@ static int ulfius_get_body_from_response(struct _u_response * response, void **
   }
 }
 
+/**
+ * ulfius_unlink_async_connection
+ * Remove con_info from the connections suspended by U_CALLBACK_ASYNC of the instance
+ */
+static void ulfius_unlink_async_connection(struct connection_info_struct * con_info) {
+  struct _u_async_list * async_list = (struct _u_async_list *)con_info->u_instance->async_connections;
+  
+  pthread_mutex_lock(&async_list->lock);
+  if (con_info->async_prev != NULL) {
+    con_info->async_prev->async_next = con_info->async_next;
+  } else {
+    async_list->first = con_info->async_next;
+  }
+  if (con_info->async_next != NULL) {
+    con_info->async_next->async_prev = con_info->async_prev;
+  }
+  con_info->async_prev = NULL;
+  con_info->async_next = NULL;
+  con_info->async_linked = 0;
+  pthread_mutex_unlock(&async_list->lock);
+}
+
+/**
+ * ulfius_release_connection_info
+ * Release a reference to con_info, held by the connection
+ * and by the callback function of an asynchronous response aborted when the instance stopped
+ * The last reference frees con_info, the request and the arena
+ */
+static void ulfius_release_connection_info(struct connection_info_struct * con_info) {
+  unsigned int refcount;
+  
+  pthread_mutex_lock(&con_info->async_lock);
+  refcount = --con_info->async_refcount;
+  pthread_mutex_unlock(&con_info->async_lock);
+  if (!refcount) {
+    if (con_info->async_response != NULL) {
+      // The aborted response was completed by the callback function
+      ulfius_clean_response(con_info->async_response);
+    }
+#ifndef _WIN32
+    if (con_info->body_fd >= 0) {
+      // The request body is mapped from a temporary file
+      munmap(con_info->request->binary_body, con_info->body_capacity);
+      close(con_info->body_fd);
+      con_info->request->binary_body = NULL;
+      con_info->request->binary_body_length = 0;
+    }
+#endif
+    pthread_mutex_destroy(&con_info->async_lock);
+    // con_info and the request belong to the arena
+    ulfius_clean_request(con_info->request);
+    u_map_clean(&con_info->map_url_initial);
+    ulfius_arena_free(con_info->arena);
+  }
+}
+
 /**
  * mhd_request_completed
  * function used to clean data allocated after a web call is complete
@@ -276,10 +372,28 @@ static void mhd_request_completed (void *cls, struct MHD_Connection *connection,
   if (con_info->has_post_processor && con_info->post_processor != NULL) {
     MHD_destroy_post_processor (con_info->post_processor);
   }
-  ulfius_clean_request_full(con_info->request);
-  u_map_clean(&con_info->map_url_initial);
-  con_info->request = NULL;
-  o_free(con_info);
+  if (con_info->async_linked) {
+    ulfius_unlink_async_connection(con_info);
+  }
+  if (con_info->async_response != NULL) {
+    // The connection was closed before the dispatcher got the asynchronous response back
+    o_free(con_info->async_endpoint_list);
+    ulfius_router_release((const struct _u_router *)con_info->async_router);
+    con_info->async_endpoint_list = NULL;
+    con_info->async_router = NULL;
+    pthread_mutex_lock(&con_info->async_lock);
+    if (con_info->async_state == U_ASYNC_SUSPENDED) {
+      // The response still belongs to the callback function, it's released when completed
+      con_info->async_state = U_ASYNC_ABORTED;
+      con_info->async_refcount++;
+    } else if (con_info->async_state != U_ASYNC_ABORTED) {
+      ulfius_clean_response(con_info->async_response);
+      con_info->async_response = NULL;
+    }
+    pthread_mutex_unlock(&con_info->async_lock);
+  }
+  ulfius_router_release((const struct _u_router *)con_info->body_router);
+  ulfius_release_connection_info(con_info);
   con_info = NULL;
   *con_cls = NULL;
 }
@@ -307,7 +421,7 @@ static int mhd_iterate_post_data (void * coninfo_cls, enum MHD_ValueKind kind, c
     }
   } else {
     if (con_info->u_instance) {
-      if (con_info->u_instance->check_utf8 && (utf8_check(key) != NULL || data == NULL || utf8_check(data) != NULL || (filename != NULL && utf8_check(filename) != NULL))) {
+      if (con_info->u_instance->check_utf8 && (utf8_check(key) != NULL || data == NULL || utf8_check_len(data, size) != NULL || (filename != NULL && utf8_check(filename) != NULL))) {
         return MHD_YES;
       } else {
         data_dup = o_strndup(data, size); // Force value to end with a NULL character
@@ -341,6 +455,286 @@ static int mhd_iterate_post_data (void * coninfo_cls, enum MHD_ValueKind kind, c
   }
 }
 
+/**
+ * ulfius_suspend_connection
+ * Suspend the connection after a callback function returned U_CALLBACK_ASYNC
+ * The router, the endpoint list and the response are kept in con_info until the connection is resumed
+ * return U_OK if the connection is suspended
+ * return U_ERROR if the response is already completed, the callback result is then in con_info->async_callback_ret
+ * return U_ERROR_DISCONNECTED if the instance is stopping, the response then still belongs to the callback function
+ */
+static int ulfius_suspend_connection(struct connection_info_struct * con_info,
+                                     const struct _u_router * router,
+                                     const struct _u_endpoint ** endpoint_list,
+                                     const struct _u_endpoint ** endpoint_stack,
+                                     size_t nb_endpoints,
+                                     size_t position,
+                                     struct _u_response * response) {
+  struct _u_async_list * async_list = (struct _u_async_list *)con_info->u_instance->async_connections;
+  int ret;
+  
+  pthread_mutex_lock(&async_list->lock);
+  pthread_mutex_lock(&con_info->async_lock);
+  if (con_info->async_state == U_ASYNC_COMPLETE) {
+    // ulfius_complete_async_response was called before the callback function returned
+    con_info->async_state = U_ASYNC_NONE;
+    ret = U_ERROR;
+  } else if (async_list->stopping || !async_list->suspend_resume) {
+    // The suspended connections are already aborted or the daemon can't suspend them,
+    // the response is released when the callback function completes it
+    if (!async_list->suspend_resume) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error U_CALLBACK_ASYNC, libmicrohttpd < 0.9.53 can't suspend a connection with U_THREAD_PER_CONNECTION");
+    }
+    con_info->async_router = NULL;
+    con_info->async_endpoint_list = NULL;
+    con_info->async_response = response;
+    con_info->async_state = U_ASYNC_ABORTED;
+    con_info->async_refcount++;
+    ret = U_ERROR_DISCONNECTED;
+  } else {
+    if (endpoint_list != endpoint_stack) {
+      con_info->async_endpoint_list = endpoint_list;
+      con_info->async_nb_endpoints = nb_endpoints;
+    } else if ((con_info->async_endpoint_list = o_malloc(nb_endpoints*sizeof(struct _u_endpoint *))) != NULL) {
+      // The endpoint list must outlive the current call of the dispatcher
+      memcpy(con_info->async_endpoint_list, endpoint_list, nb_endpoints*sizeof(struct _u_endpoint *));
+      con_info->async_nb_endpoints = nb_endpoints;
+    } else {
+      // The response can't be dropped while it belongs to the callback function,
+      // the connection is suspended anyway and the response will be an error 500 when resumed
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for async_endpoint_list");
+      con_info->async_nb_endpoints = position + 1;
+    }
+    con_info->async_router = router;
+    con_info->async_position = position;
+    con_info->async_response = response;
+    con_info->async_state = U_ASYNC_SUSPENDED;
+    if (!con_info->async_linked) {
+      con_info->async_prev = NULL;
+      con_info->async_next = async_list->first;
+      if (async_list->first != NULL) {
+        async_list->first->async_prev = con_info;
+      }
+      async_list->first = con_info;
+      con_info->async_linked = 1;
+    }
+    MHD_suspend_connection(con_info->connection);
+    ret = U_OK;
+  }
+  pthread_mutex_unlock(&con_info->async_lock);
+  pthread_mutex_unlock(&async_list->lock);
+  return ret;
+}
+
+/**
+ * ulfius_queue_aborted_response
+ * Send an error 500 for an asynchronous response aborted because the instance is stopping
+ * The response still belongs to the callback function so it isn't used
+ */
+static int ulfius_queue_aborted_response(struct MHD_Connection * connection) {
+  struct MHD_Response * mhd_response = MHD_create_response_from_buffer(o_strlen(ULFIUS_HTTP_ERROR_BODY), (void *)ULFIUS_HTTP_ERROR_BODY, MHD_RESPMEM_PERSISTENT);
+  int mhd_ret;
+  
+  if (mhd_response != NULL) {
+    mhd_ret = MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, mhd_response);
+    MHD_destroy_response(mhd_response);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error MHD_create_response_from_buffer");
+    mhd_ret = MHD_NO;
+  }
+  return mhd_ret;
+}
+
+/**
+ * A callback function run by the worker pool of the instance
+ */
+struct _u_offloaded_callback {
+  struct _u_worker_task      task;
+  const struct _u_endpoint * endpoint;
+  struct _u_request        * request;
+  struct _u_response       * response;
+};
+
+/**
+ * ulfius_run_offloaded_callback
+ * Run a callback function in a worker thread,
+ * then complete the response unless the callback function returned U_CALLBACK_ASYNC
+ */
+static void ulfius_run_offloaded_callback(void * args) {
+  struct _u_offloaded_callback * offloaded = (struct _u_offloaded_callback *)args;
+  int callback_ret = offloaded->endpoint->callback_function(offloaded->request, offloaded->response, offloaded->endpoint->user_data);
+  
+  if (callback_ret != U_CALLBACK_ASYNC && ulfius_complete_async_response(offloaded->response, callback_ret) != U_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_complete_async_response");
+  }
+}
+
+/**
+ * ulfius_offload_callback
+ * Hand the callback function of the endpoint to the worker pool of the instance
+ * The task is allocated in the request arena, it's released with the request
+ * return U_OK on success, the callback function must then be run in the connection thread on error
+ */
+static int ulfius_offload_callback(struct connection_info_struct * con_info, const struct _u_endpoint * endpoint, struct _u_response * response) {
+  struct _u_worker_pool * pool = __atomic_load_n((struct _u_worker_pool **)&con_info->u_instance->worker_pool, __ATOMIC_ACQUIRE);
+  struct _u_offloaded_callback * offloaded;
+  
+  if (pool == NULL) {
+    return U_ERROR_PARAMS;
+  } else if ((offloaded = ulfius_arena_alloc(con_info->arena, sizeof(struct _u_offloaded_callback))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for offloaded");
+    return U_ERROR_MEMORY;
+  } else {
+    offloaded->task.run = ulfius_run_offloaded_callback;
+    offloaded->task.args = offloaded;
+    offloaded->endpoint = endpoint;
+    offloaded->request = con_info->request;
+    offloaded->response = response;
+    return ulfius_worker_pool_run(pool, &offloaded->task);
+  }
+}
+
+#ifndef _WIN32
+/**
+ * ulfius_map_request_body
+ * Store the request body in an unlinked temporary file mapped in memory, large enough for capacity bytes
+ * The body already received is moved from the heap on the first call
+ * return U_OK on success
+ */
+static int ulfius_map_request_body(struct connection_info_struct * con_info, size_t capacity) {
+  const char * tmp_dir = getenv("TMPDIR");
+  char * path;
+  void * body;
+  int fd = con_info->body_fd;
+  
+  if (fd < 0) {
+    if ((path = msprintf("%s/ulfius-body-XXXXXX", tmp_dir!=NULL?tmp_dir:P_tmpdir)) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for path");
+      return U_ERROR_MEMORY;
+    }
+    fd = mkstemp(path);
+    if (fd >= 0) {
+      // The file is removed when the descriptor is closed
+      unlink(path);
+    }
+    o_free(path);
+    if (fd < 0) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating request body temporary file");
+      return U_ERROR;
+    }
+  }
+  if (ftruncate(fd, (off_t)capacity) || (body = mmap(NULL, capacity, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error mapping request body temporary file");
+    if (con_info->body_fd < 0) {
+      close(fd);
+    }
+    return U_ERROR;
+  }
+  if (con_info->body_fd < 0) {
+    if (con_info->request->binary_body_length) {
+      memcpy(body, con_info->request->binary_body, con_info->request->binary_body_length);
+    }
+    o_free(con_info->request->binary_body);
+    con_info->body_fd = fd;
+  } else {
+    munmap(con_info->request->binary_body, con_info->body_capacity);
+  }
+  con_info->request->binary_body = body;
+  con_info->body_capacity = capacity;
+  return U_OK;
+}
+#endif
+
+/**
+ * ulfius_reserve_request_body
+ * Make room for size bytes in the request body
+ * The first reservation uses Content-Length capped by max_post_body_size, so a body with a valid Content-Length is allocated once,
+ * Without max_post_body_size, Content-Length isn't trusted above U_REQUEST_BODY_RESERVE_MAX
+ * Then the body grows geometrically as the data is received
+ * A body larger than body_mmap_threshold is stored in a temporary file mapped in memory, except on Windows where it stays on the heap
+ * return U_OK on success
+ */
+static int ulfius_reserve_request_body(struct connection_info_struct * con_info, size_t size) {
+  const char * content_length;
+  char * end;
+  unsigned long long declared;
+  size_t capacity = 0;
+  void * body;
+  
+  if (size <= con_info->body_capacity) {
+    return U_OK;
+  }
+  if (!con_info->body_capacity && (content_length = u_map_get_case(con_info->request->map_header, "Content-Length")) != NULL) {
+    declared = strtoull(content_length, &end, 10);
+    if (end != content_length && *end == '\0' && declared <= SIZE_MAX) {
+      capacity = (size_t)declared;
+      if (!con_info->u_instance->max_post_body_size && capacity > U_REQUEST_BODY_RESERVE_MAX) {
+        // The client may announce a body much larger than what it sends
+        capacity = U_REQUEST_BODY_RESERVE_MAX;
+      }
+    }
+  }
+  if (capacity < size) {
+    capacity = con_info->body_capacity*2>size?con_info->body_capacity*2:size;
+  }
+  if (con_info->u_instance->max_post_body_size > 0 && capacity > con_info->u_instance->max_post_body_size) {
+    capacity = size>con_info->u_instance->max_post_body_size?size:con_info->u_instance->max_post_body_size;
+  }
+#ifndef _WIN32
+  if (con_info->body_fd >= 0 || (con_info->u_instance->body_mmap_threshold > 0 && capacity > con_info->u_instance->body_mmap_threshold)) {
+    return ulfius_map_request_body(con_info, capacity);
+  }
+#endif
+  if ((body = o_realloc(con_info->request->binary_body, capacity)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for con_info->request->binary_body");
+    return U_ERROR_MEMORY;
+  } else {
+    con_info->request->binary_body = body;
+    con_info->body_capacity = capacity;
+    return U_OK;
+  }
+}
+
+/**
+ * ulfius_set_body_endpoint
+ * Look for the first endpoint matching the request that has a body_callback
+ * The snapshot is kept in con_info until the request is completed, so the endpoint stays valid
+ */
+static void ulfius_set_body_endpoint(struct connection_info_struct * con_info, const char * method) {
+  const struct _u_endpoint * endpoint_stack[U_ENDPOINT_MATCH_STACK_SIZE], ** endpoint_list = endpoint_stack;
+  const struct _u_router * router = ulfius_router_acquire((struct _u_router_handle *)con_info->u_instance->router);
+  size_t nb_endpoints, i;
+  
+  con_info->body_checked = 1;
+  if (ulfius_router_has_body_callback(router)) {
+    nb_endpoints = ulfius_router_match(router, method, con_info->request->url_path, endpoint_stack, U_ENDPOINT_MATCH_STACK_SIZE);
+    if (nb_endpoints > U_ENDPOINT_MATCH_STACK_SIZE) {
+      if ((endpoint_list = o_malloc(nb_endpoints*sizeof(struct _u_endpoint *))) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for endpoint_list");
+        ulfius_router_release(router);
+        return;
+      }
+      ulfius_router_match(router, method, con_info->request->url_path, endpoint_list, nb_endpoints);
+    }
+    if (!nb_endpoints && (endpoint_list[0] = ulfius_router_get_default_endpoint(router)) != NULL) {
+      nb_endpoints = 1;
+    }
+    for (i=0; i<nb_endpoints && con_info->body_endpoint == NULL; i++) {
+      if (endpoint_list[i]->body_callback != NULL) {
+        con_info->body_endpoint = endpoint_list[i];
+      }
+    }
+    if (endpoint_list != endpoint_stack) {
+      o_free(endpoint_list);
+    }
+  }
+  if (con_info->body_endpoint != NULL) {
+    con_info->body_router = router;
+  } else {
+    ulfius_router_release(router);
+  }
+}
+
 #if MHD_VERSION >= 0x00096100
   #define MHD_CREATE_RESPONSE_FROM_BUFFER_PIMPED(len, buf, flag) MHD_create_response_from_buffer_with_free_callback((len), (buf), &o_free)
 #else
@@ -357,9 +751,13 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
                                          const char * version, const char * upload_data,
                                          size_t * upload_data_size, void ** con_cls) {
 
-  struct _u_endpoint * endpoint_list = ((struct _u_instance *)cls)->endpoint_list, ** current_endpoint_list = NULL, * current_endpoint = NULL;
+  const struct _u_router * router = NULL;
+  const struct _u_endpoint * endpoint_stack[U_ENDPOINT_MATCH_STACK_SIZE], ** current_endpoint_list = endpoint_stack, * current_endpoint = NULL;
+  size_t nb_endpoints, i;
   struct connection_info_struct * con_info = * con_cls;
-  int mhd_ret = MHD_NO, callback_ret = U_OK, i, close_loop = 0, inner_error = U_OK, mhd_response_flag;
+  int mhd_ret = MHD_NO, callback_ret = U_OK, close_loop = 0, inner_error = U_OK, mhd_response_flag, async_aborted, suspend_ret;
+  unsigned int status = 0;
+  uint64_t metrics_now;
 #ifndef U_DISABLE_WEBSOCKET
   // Websocket variables
   int upgrade_protocol = 0;
@@ -418,13 +816,14 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
     }
 #endif
     con_info->callback_first_iteration = 0;
+    con_info->connection = connection;
     so_client = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS)->client_addr;
     con_info->has_post_processor = 0;
     con_info->max_post_param_size = ((struct _u_instance *)cls)->max_post_param_size;
     con_info->request->socketFd = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_CONNECTION_FD)->connect_fd;
-    con_info->request->http_protocol = o_strdup(version);
-    con_info->request->http_verb = o_strdup(method);
-    con_info->request->client_address = o_malloc(sizeof(struct sockaddr));
+    con_info->request->http_protocol = ulfius_arena_strndup(con_info->arena, version, o_strlen(version));
+    con_info->request->http_verb = ulfius_arena_strndup(con_info->arena, method, o_strlen(method));
+    con_info->request->client_address = ulfius_arena_alloc(con_info->arena, sizeof(struct sockaddr));
     if (con_info->request->client_address == NULL || con_info->request->http_verb == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating client_address or http_verb");
       return MHD_NO;
@@ -442,64 +841,107 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
     content_type = (char*)u_map_get_case(con_info->request->map_header, ULFIUS_HTTP_HEADER_CONTENT);
     
     // Set POST Processor if content-type is properly set
+    // The decision is kept in con_info for the body chunks
+    con_info->store_body = 1;
     if (content_type != NULL && (0 == o_strncmp(MHD_HTTP_POST_ENCODING_FORM_URLENCODED, content_type, o_strlen(MHD_HTTP_POST_ENCODING_FORM_URLENCODED)) || 
         0 == o_strncmp(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA, content_type, o_strlen(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA)))) {
-      con_info->has_post_processor = 1;
-      con_info->post_processor = MHD_create_post_processor (connection, ULFIUS_POSTBUFFERSIZE, mhd_iterate_post_data, (void *) con_info);
-      if (NULL == con_info->post_processor) {
-        ulfius_clean_request_full(con_info->request);
-        con_info->request = NULL;
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating post_processor");
-        return MHD_NO;
+      con_info->store_body = (con_info->u_instance->form_body_mode & U_FORM_BODY_RAW);
+      if (con_info->u_instance->form_body_mode & U_FORM_BODY_PARSED) {
+        con_info->has_post_processor = 1;
+        con_info->post_processor = MHD_create_post_processor (connection, ULFIUS_POSTBUFFERSIZE, mhd_iterate_post_data, (void *) con_info);
+        if (NULL == con_info->post_processor) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating post_processor");
+          return MHD_NO;
+        }
       }
     }
     return MHD_YES;
   } else if (*upload_data_size != 0) {
-    size_t body_len = con_info->request->binary_body_length + *upload_data_size, upload_data_size_current = *upload_data_size;
-    
-    if (((struct _u_instance *)cls)->max_post_body_size > 0 && con_info->request->binary_body_length + *upload_data_size > ((struct _u_instance *)cls)->max_post_body_size) {
-      body_len = ((struct _u_instance *)cls)->max_post_body_size;
-      upload_data_size_current = ((struct _u_instance *)cls)->max_post_body_size - con_info->request->binary_body_length;
+    if (!con_info->body_checked) {
+      ulfius_set_body_endpoint(con_info, method);
     }
-    
-    if (body_len >= con_info->request->binary_body_length) {
-      con_info->request->binary_body = o_realloc(con_info->request->binary_body, body_len);
-      if (con_info->request->binary_body == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for con_info->request->binary_body");
+    if (con_info->body_endpoint != NULL) {
+      // The body is streamed to the endpoint instead of being stored in the request
+      size_t size = *upload_data_size;
+      
+      if (((struct _u_instance *)cls)->max_post_body_size > 0 && con_info->body_offset + size > ((struct _u_instance *)cls)->max_post_body_size) {
+        size = con_info->body_offset<((struct _u_instance *)cls)->max_post_body_size?(size_t)(((struct _u_instance *)cls)->max_post_body_size - con_info->body_offset):0;
+      }
+      if (size && con_info->body_endpoint->body_callback(con_info->request, upload_data, con_info->body_offset, size, con_info->body_endpoint->user_data) != U_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error body_callback");
         return MHD_NO;
-      } else {
-        memcpy((char*)con_info->request->binary_body + con_info->request->binary_body_length, upload_data, upload_data_size_current);
-        con_info->request->binary_body_length += upload_data_size_current;
-        // Handles request binary_body
-        const char * content_type = u_map_get_case(con_info->request->map_header, ULFIUS_HTTP_HEADER_CONTENT);
-        if (0 == o_strncmp(MHD_HTTP_POST_ENCODING_FORM_URLENCODED, content_type, o_strlen(MHD_HTTP_POST_ENCODING_FORM_URLENCODED)) || 
-            0 == o_strncmp(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA, content_type, o_strlen(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA))) {
-          MHD_post_process (con_info->post_processor, upload_data, *upload_data_size);
-        }
-        *upload_data_size = 0;
-        return MHD_YES;
       }
-    } else {
+      con_info->body_offset += size;
+      *upload_data_size = 0;
       return MHD_YES;
     }
+    if (con_info->store_body) {
+      size_t body_len = con_info->request->binary_body_length + *upload_data_size, upload_data_size_current = *upload_data_size;
+      
+      if (((struct _u_instance *)cls)->max_post_body_size > 0 && con_info->request->binary_body_length + *upload_data_size > ((struct _u_instance *)cls)->max_post_body_size) {
+        body_len = ((struct _u_instance *)cls)->max_post_body_size;
+        upload_data_size_current = ((struct _u_instance *)cls)->max_post_body_size - con_info->request->binary_body_length;
+      }
+      if (ulfius_reserve_request_body(con_info, body_len) != U_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_reserve_request_body");
+        return MHD_NO;
+      }
+      memcpy((char*)con_info->request->binary_body + con_info->request->binary_body_length, upload_data, upload_data_size_current);
+      con_info->request->binary_body_length += upload_data_size_current;
+    }
+    if (con_info->has_post_processor) {
+      // Fills request->map_post_body
+      MHD_post_process (con_info->post_processor, upload_data, *upload_data_size);
+    }
+    *upload_data_size = 0;
+    return MHD_YES;
   } else {
-    // Check if the endpoint has one or more matches
-    current_endpoint_list = ulfius_endpoint_match(method, con_info->request->url_path, endpoint_list);
-    
-    // Set to default_endpoint if no match
-    if ((current_endpoint_list == NULL || current_endpoint_list[0] == NULL) && ((struct _u_instance *)cls)->default_endpoint != NULL && ((struct _u_instance *)cls)->default_endpoint->callback_function != NULL) {
-      current_endpoint_list = o_realloc(current_endpoint_list, 2*sizeof(struct _u_endpoint *));
-      if (current_endpoint_list != NULL) {
-        if ((current_endpoint_list[0] = o_malloc(sizeof(struct _u_endpoint))) != NULL) {
-          if (ulfius_copy_endpoint(current_endpoint_list[0], ((struct _u_instance *)cls)->default_endpoint) != U_OK) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_copy_endpoint for current_endpoint_list[0]");
-          }
-        } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for current_endpoint_list[0] of default endpoint");
+    if (con_info->async_response != NULL) {
+      // The connection was resumed by ulfius_complete_async_response,
+      // the endpoint list goes on from the callback function that returned U_CALLBACK_ASYNC
+      // and the callback phase goes on for the metrics
+      router = (const struct _u_router *)con_info->async_router;
+      current_endpoint_list = con_info->async_endpoint_list;
+      nb_endpoints = con_info->async_nb_endpoints;
+      pthread_mutex_lock(&con_info->async_lock);
+      async_aborted = (con_info->async_state == U_ASYNC_ABORTED);
+      pthread_mutex_unlock(&con_info->async_lock);
+      if (async_aborted) {
+        // The instance is stopping, the response still belongs to the callback function
+        con_info->async_router = NULL;
+        con_info->async_endpoint_list = NULL;
+        o_free(current_endpoint_list);
+        ulfius_router_release(router);
+        return ulfius_queue_aborted_response(connection);
+      }
+    } else {
+      if (con_info->metrics_time) {
+        metrics_now = ulfius_metrics_now();
+        con_info->metrics_phases[U_METRICS_PHASE_PARSE] = metrics_now - con_info->metrics_time;
+        con_info->metrics_time = metrics_now;
+      }
+      // Check if the endpoint has one or more matches
+      // The endpoints are borrowed from the current snapshot until the end of the request
+      router = ulfius_router_acquire((struct _u_router_handle *)((struct _u_instance *)cls)->router);
+      nb_endpoints = ulfius_router_match(router, method, con_info->request->url_path, endpoint_stack, U_ENDPOINT_MATCH_STACK_SIZE);
+      if (nb_endpoints > U_ENDPOINT_MATCH_STACK_SIZE) {
+        if ((current_endpoint_list = o_malloc(nb_endpoints*sizeof(struct _u_endpoint *))) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for current_endpoint_list");
+          ulfius_router_release(router);
+          return MHD_NO;
         }
-        current_endpoint_list[1] = NULL;
-      } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for current_endpoint_list of default endpoint");
+        ulfius_router_match(router, method, con_info->request->url_path, current_endpoint_list, nb_endpoints);
+      }
+    
+      // Set to default_endpoint if no match
+      if (!nb_endpoints && (current_endpoint = ulfius_router_get_default_endpoint(router)) != NULL && current_endpoint->callback_function != NULL) {
+        current_endpoint_list[0] = current_endpoint;
+        nb_endpoints = 1;
+      }
+      if (con_info->metrics_time) {
+        metrics_now = ulfius_metrics_now();
+        con_info->metrics_phases[U_METRICS_PHASE_MATCH] = metrics_now - con_info->metrics_time;
+        con_info->metrics_time = metrics_now;
       }
     }
     
@@ -508,16 +950,18 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
 #else
     mhd_response_flag = MHD_RESPMEM_MUST_FREE;
 #endif
-    if (current_endpoint_list[0] != NULL) {
-      response = o_malloc(sizeof(struct _u_response));
-      if (response == NULL) {
+    if (nb_endpoints) {
+      if (con_info->async_response != NULL) {
+        response = con_info->async_response;
+      } else if ((response = ulfius_arena_alloc(con_info->arena, sizeof(struct _u_response))) == NULL) {
         y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating response");
         mhd_ret = MHD_NO;
       } else if (ulfius_init_response(response) != U_OK) {
-        o_free(response);
         y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_init_response");
         mhd_ret = MHD_NO;
+        response = NULL;
       } else {
+        response->async_handle = con_info;
         // Add default headers (if any) to the response header maps
         if (((struct _u_instance *)cls)->default_headers != NULL && u_map_count(((struct _u_instance *)cls)->default_headers) > 0) {
           u_map_clean_full(response->map_header);
@@ -526,18 +970,48 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
         
         // Initialize auth variables
         con_info->request->auth_basic_user = MHD_basic_auth_get_username_password(connection, &con_info->request->auth_basic_password);
-        
-        for (i=0; current_endpoint_list[i] != NULL && !close_loop; i++) {
-          current_endpoint = current_endpoint_list[i];
-          u_map_empty(con_info->request->map_url);
-          u_map_copy_into(con_info->request->map_url, &con_info->map_url_initial);
-          if (ulfius_parse_url(con_info->request->url_path, current_endpoint, con_info->request->map_url, con_info->u_instance->check_utf8) != U_OK) {
-            o_free(response);
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error parsing url: ", con_info->request->url_path);
-            mhd_ret = MHD_NO;
+      }
+      if (response != NULL) {
+        for (i=con_info->async_position; i<nb_endpoints && !close_loop; i++) {
+          if (con_info->async_response != NULL) {
+            // The callback function result is the one given to ulfius_complete_async_response
+            current_endpoint = current_endpoint_list!=NULL?current_endpoint_list[i]:NULL;
+            pthread_mutex_lock(&con_info->async_lock);
+            callback_ret = current_endpoint_list!=NULL?con_info->async_callback_ret:U_CALLBACK_ERROR;
+            con_info->async_state = U_ASYNC_NONE;
+            con_info->async_response = NULL;
+            pthread_mutex_unlock(&con_info->async_lock);
+          } else {
+            current_endpoint = current_endpoint_list[i];
+            u_map_empty(con_info->request->map_url);
+            u_map_copy_into(con_info->request->map_url, &con_info->map_url_initial);
+            if (ulfius_parse_url(con_info->request->url_path, current_endpoint, con_info->request->map_url, con_info->u_instance->check_utf8) != U_OK) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error parsing url: ", con_info->request->url_path);
+              mhd_ret = MHD_NO;
+            }
+            // Run callback function with the input parameters filled for the current callback
+            if (current_endpoint->offload && ulfius_offload_callback(con_info, current_endpoint, response) == U_OK) {
+              // The worker thread completes the response
+              callback_ret = U_CALLBACK_ASYNC;
+            } else {
+              callback_ret = current_endpoint->callback_function(con_info->request, response, current_endpoint->user_data);
+            }
+            if (callback_ret == U_CALLBACK_ASYNC) {
+              suspend_ret = ulfius_suspend_connection(con_info, router, current_endpoint_list, endpoint_stack, nb_endpoints, i, response);
+              if (suspend_ret == U_OK) {
+                // The router, the endpoint list and the response now belong to con_info until the connection is resumed
+                return MHD_YES;
+              } else if (suspend_ret == U_ERROR_DISCONNECTED) {
+                // The instance is stopping, the response still belongs to the callback function
+                if (current_endpoint_list != endpoint_stack) {
+                  o_free(current_endpoint_list);
+                }
+                ulfius_router_release(router);
+                return ulfius_queue_aborted_response(connection);
+              }
+              callback_ret = con_info->async_callback_ret;
+            }
           }
-          // Run callback function with the input parameters filled for the current callback
-          callback_ret = current_endpoint->callback_function(con_info->request, response, current_endpoint->user_data);
           con_info->request->callback_position++;
           if (response->timeout > 0 && MHD_set_connection_option(connection, MHD_CONNECTION_OPTION_TIMEOUT, response->timeout) !=  MHD_YES) {
             y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting connection response timeout value");
@@ -554,6 +1028,22 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
               mhd_ret = MHD_NO;
             }
             close_loop = 1;
+          } else if (response->file_fd >= 0) {
+            // The file is sent by MHD, with sendfile when possible
+            // A file response is always the last one
+            mhd_response = MHD_create_response_from_fd_at_offset64(response->file_size, response->file_fd, response->file_offset);
+            if (mhd_response == NULL) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error MHD_create_response_from_fd_at_offset64");
+              mhd_ret = MHD_NO;
+            } else {
+              // The file descriptor now belongs to mhd_response
+              response->file_fd = -1;
+              if (ulfius_set_response_header(mhd_response, response->map_header) == -1 || ulfius_set_response_cookie(mhd_response, response) == -1) {
+                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headers or cookies");
+                mhd_ret = MHD_NO;
+              }
+            }
+            close_loop = 1;
 #ifndef U_DISABLE_WEBSOCKET
           } else if (((struct _websocket_handle *)response->websocket_handle)->websocket_manager_callback != NULL ||
                      ((struct _websocket_handle *)response->websocket_handle)->websocket_incoming_message_callback != NULL) {
@@ -598,6 +1088,12 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
                         MHD_add_response_header (mhd_response,
                                                  "Sec-WebSocket-Protocol",
                                                  protocol);
+                        // permessage-deflate is used if the endpoint enables it and the client offers it
+                        if ((websocket->websocket_manager->extensions = ulfius_websocket_deflate_negotiate(websocket->websocket_manager, (struct _websocket_handle *)response->websocket_handle, u_map_get_case(con_info->request->map_header, "Sec-WebSocket-Extensions"))) != NULL) {
+                          MHD_add_response_header (mhd_response,
+                                                   "Sec-WebSocket-Extensions",
+                                                   websocket->websocket_manager->extensions);
+                        }
                         if (ulfius_set_response_header(mhd_response, response->map_header) == -1 || ulfius_set_response_cookie(mhd_response, response) == -1) {
                           y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headers or cookies");
                           mhd_ret = MHD_NO;
@@ -677,7 +1173,7 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
             }
 #endif
           } else {
-            if (callback_ret == U_CALLBACK_CONTINUE && current_endpoint_list[i+1] == NULL) {
+            if (callback_ret == U_CALLBACK_CONTINUE && i+1 == nb_endpoints) {
               // If callback_ret is U_CALLBACK_CONTINUE but callback function is the last one on the list
               callback_ret = U_CALLBACK_COMPLETE;
             }
@@ -764,24 +1260,38 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
             }
           }
         }
+        if (con_info->metrics_time) {
+          metrics_now = ulfius_metrics_now();
+          con_info->metrics_phases[U_METRICS_PHASE_CALLBACK] = metrics_now - con_info->metrics_time;
+          con_info->metrics_time = metrics_now;
+        }
         if (mhd_response != NULL) {
           if (auth_realm != NULL && inner_error == U_CALLBACK_UNAUTHORIZED) {
+            status = MHD_HTTP_UNAUTHORIZED;
             mhd_ret = MHD_queue_basic_auth_fail_response (connection, auth_realm, mhd_response);
           } else if (inner_error == U_CALLBACK_UNAUTHORIZED) {
+            status = MHD_HTTP_UNAUTHORIZED;
             mhd_ret = MHD_queue_response (connection, MHD_HTTP_UNAUTHORIZED, mhd_response);
 #ifndef U_DISABLE_WEBSOCKET
           } else if (upgrade_protocol) {
+            status = MHD_HTTP_SWITCHING_PROTOCOLS;
             mhd_ret = MHD_queue_response (connection,
                                           MHD_HTTP_SWITCHING_PROTOCOLS,
                                           mhd_response);
 #endif
           } else {
+            status = (unsigned int)response->status;
             mhd_ret = MHD_queue_response (connection, response->status, mhd_response);
           }
           MHD_destroy_response (mhd_response);
-          // Free Response parameters
-          ulfius_clean_response_full(response);
-          response = NULL;
+        }
+        // Free Response parameters, including the file descriptor if it wasn't handed to MHD
+        ulfius_clean_response(response);
+        response = NULL;
+        if (con_info->metrics_time) {
+          // The request is accounted to the last endpoint whose callback function was run
+          con_info->metrics_phases[U_METRICS_PHASE_QUEUE] = ulfius_metrics_now() - con_info->metrics_time;
+          ulfius_metrics_record(ulfius_router_get_metrics(router, current_endpoint), status, con_info->metrics_phases);
         }
       }
     } else {
@@ -803,15 +1313,72 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
 #else
     (void)mhd_response_flag;
 #endif
-    for (i=0; current_endpoint_list[i] != NULL; i++) {
-      ulfius_clean_endpoint(current_endpoint_list[i]);
-      o_free(current_endpoint_list[i]);
+    if (current_endpoint_list != endpoint_stack) {
+      o_free(current_endpoint_list);
     }
-    o_free(current_endpoint_list);
+    ulfius_router_release(router);
     return mhd_ret;
   }
 }
 
+/**
+ * ulfius_get_thread_pool_size
+ * return the number of threads to use in a thread pool
+ * if pool_size is 0, one thread per online CPU core is used
+ */
+static unsigned int ulfius_get_thread_pool_size(unsigned int pool_size) {
+  long nb_cpu = 0;
+  
+  if (pool_size > 0) {
+    return pool_size;
+  }
+#ifdef _SC_NPROCESSORS_ONLN
+  nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return nb_cpu>0?(unsigned int)nb_cpu:1;
+}
+
+/**
+ * ulfius_init_worker_pool
+ * Start the worker pool of the instance if an endpoint runs its callback function in it
+ * The pool is started before the endpoint is published, so the dispatcher always finds it
+ * If the pool can't be started, the callback functions run in the connection threads
+ * The caller must hold the router lock
+ */
+static void ulfius_init_worker_pool(struct _u_instance * u_instance) {
+  struct _u_worker_pool * pool;
+  int i, offload = (u_instance->default_endpoint != NULL && u_instance->default_endpoint->offload);
+  
+  for (i=0; !offload && i<u_instance->nb_endpoints; i++) {
+    offload = u_instance->endpoint_list[i].offload;
+  }
+  // Without suspend/resume, the offloaded callback functions run in the connection threads
+  if (offload && u_instance->worker_pool == NULL && ((struct _u_async_list *)u_instance->async_connections)->suspend_resume) {
+    if ((pool = ulfius_worker_pool_init(ulfius_get_thread_pool_size(u_instance->worker_pool_size))) != NULL) {
+      __atomic_store_n(&u_instance->worker_pool, pool, __ATOMIC_RELEASE);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_worker_pool_init");
+    }
+  }
+}
+
+/**
+ * ulfius_rebuild_router
+ * Publish a new snapshot of the endpoint_list and the default_endpoint of the instance
+ * The snapshot is only built when the framework is running,
+ * ulfius_run_mhd_daemon publishes the first one
+ * The caller must hold the router lock
+ * return U_OK on success
+ */
+static int ulfius_rebuild_router(struct _u_instance * u_instance) {
+  if (u_instance->status == U_STATUS_RUNNING) {
+    ulfius_init_worker_pool(u_instance);
+    return ulfius_router_publish((struct _u_router_handle *)u_instance->router, u_instance->endpoint_list, u_instance->default_endpoint, (struct _u_metrics *)u_instance->metrics);
+  } else {
+    return U_OK;
+  }
+}
+
 /**
  * ulfius_run_mhd_daemon
  * Starts a mhd daemon for the specified instance
@@ -819,21 +1386,68 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
  * 
  */
 static struct MHD_Daemon * ulfius_run_mhd_daemon(struct _u_instance * u_instance, const char * key_pem, const char * cert_pem, const char * root_ca_perm) {
-  unsigned int mhd_flags = MHD_USE_THREAD_PER_CONNECTION;
-  int index;
+  unsigned int mhd_flags;
+  int index, suspend_resume;
 
+  if (u_instance->thread_mode == U_THREAD_POOL) {
+    // Connections are multiplexed on a fixed pool of polling threads
+#if MHD_VERSION >= 0x00095300
+    if (MHD_is_feature_supported(MHD_FEATURE_EPOLL) == MHD_YES) {
+      mhd_flags = MHD_USE_EPOLL_INTERNAL_THREAD;
+    } else {
+      mhd_flags = MHD_USE_POLL_INTERNAL_THREAD;
+    }
+#else
+    mhd_flags = MHD_USE_SELECT_INTERNALLY;
+#endif
+  } else {
+    mhd_flags = MHD_USE_THREAD_PER_CONNECTION;
+#if MHD_VERSION >= 0x00095300
+    mhd_flags |= MHD_USE_INTERNAL_POLLING_THREAD;
+#endif
+  }
 #ifdef DEBUG
   mhd_flags |= MHD_USE_DEBUG;
 #endif
+  // Needed by the callback functions returning U_CALLBACK_ASYNC and the offloaded ones
+  // libmicrohttpd < 0.9.53 doesn't allow suspend/resume with a thread per connection
 #if MHD_VERSION >= 0x00095300
-  mhd_flags |= MHD_USE_INTERNAL_POLLING_THREAD;
+  mhd_flags |= MHD_ALLOW_SUSPEND_RESUME;
+  suspend_resume = 1;
+#else
+  suspend_resume = (u_instance->thread_mode == U_THREAD_POOL);
+  if (suspend_resume) {
+    mhd_flags |= MHD_USE_SUSPEND_RESUME;
+  }
 #endif
 #ifndef U_DISABLE_WEBSOCKET
   mhd_flags |= MHD_ALLOW_UPGRADE;
 #endif
   
   if (u_instance->mhd_daemon == NULL) {
-    struct MHD_OptionItem mhd_ops[8];
+    struct MHD_OptionItem mhd_ops[10];
+    
+    // Publish the first snapshot of the endpoints before accepting connections
+    ulfius_router_lock((struct _u_router_handle *)u_instance->router);
+    ((struct _u_async_list *)u_instance->async_connections)->suspend_resume = suspend_resume;
+    ((struct _u_async_list *)u_instance->async_connections)->stopping = 0;
+    ulfius_init_worker_pool(u_instance);
+    if (ulfius_router_publish((struct _u_router_handle *)u_instance->router, u_instance->endpoint_list, u_instance->default_endpoint, (struct _u_metrics *)u_instance->metrics) != U_OK) {
+      ulfius_router_unlock((struct _u_router_handle *)u_instance->router);
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_router_publish");
+      return NULL;
+    }
+    ulfius_router_unlock((struct _u_router_handle *)u_instance->router);
+    
+#ifndef U_DISABLE_WEBSOCKET
+    if (u_instance->websocket_mode == U_WEBSOCKET_MODE_REACTOR && ((struct _websocket_handler *)u_instance->websocket_handler)->reactor == NULL) {
+      ((struct _websocket_handler *)u_instance->websocket_handler)->reactor = ulfius_websocket_reactor_init(u_instance->websocket_reactor_threads, ulfius_get_thread_pool_size(u_instance->websocket_worker_pool_size));
+      if (((struct _websocket_handler *)u_instance->websocket_handler)->reactor == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_websocket_reactor_init");
+        return NULL;
+      }
+    }
+#endif
     
     // Default options
     mhd_ops[0].option = MHD_OPTION_NOTIFY_COMPLETED;
@@ -868,7 +1482,7 @@ static struct MHD_Daemon * ulfius_run_mhd_daemon(struct _u_instance * u_instance
     
     mhd_ops[2].option = MHD_OPTION_URI_LOG_CALLBACK;
     mhd_ops[2].value = (intptr_t)ulfius_uri_logger;
-    mhd_ops[2].ptr_value = NULL;
+    mhd_ops[2].ptr_value = (void *)u_instance;
     
     index = 3;
 
@@ -900,6 +1514,22 @@ static struct MHD_Daemon * ulfius_run_mhd_daemon(struct _u_instance * u_instance
       
       index++;
     }
+    
+    if (u_instance->thread_mode == U_THREAD_POOL) {
+      mhd_ops[index].option = MHD_OPTION_THREAD_POOL_SIZE;
+      mhd_ops[index].value = ulfius_get_thread_pool_size(u_instance->thread_pool_size);
+      mhd_ops[index].ptr_value = NULL;
+      
+      index++;
+    }
+    
+    if (u_instance->max_connections > 0) {
+      mhd_ops[index].option = MHD_OPTION_CONNECTION_LIMIT;
+      mhd_ops[index].value = u_instance->max_connections;
+      mhd_ops[index].ptr_value = NULL;
+      
+      index++;
+    }
 
     mhd_ops[index].option = MHD_OPTION_END;
     mhd_ops[index].value = 0;
@@ -1018,6 +1648,30 @@ int ulfius_start_secure_ca_trust_framework(struct _u_instance * u_instance, cons
 }
 #endif
 
+/**
+ * ulfius_abort_async_connections
+ * Resume the connections suspended by U_CALLBACK_ASYNC with an error 500 before the daemon stops
+ * The responses still belong to the callback functions and are released when completed
+ */
+static void ulfius_abort_async_connections(struct _u_instance * u_instance) {
+  struct _u_async_list * async_list = (struct _u_async_list *)u_instance->async_connections;
+  struct connection_info_struct * con_info;
+  
+  pthread_mutex_lock(&async_list->lock);
+  async_list->stopping = 1;
+  for (con_info = async_list->first; con_info != NULL; con_info = con_info->async_next) {
+    pthread_mutex_lock(&con_info->async_lock);
+    if (con_info->async_state == U_ASYNC_SUSPENDED) {
+      con_info->async_callback_ret = U_CALLBACK_ERROR;
+      con_info->async_state = U_ASYNC_ABORTED;
+      con_info->async_refcount++;
+      MHD_resume_connection(con_info->connection);
+    }
+    pthread_mutex_unlock(&con_info->async_lock);
+  }
+  pthread_mutex_unlock(&async_list->lock);
+}
+
 /**
  * ulfius_stop_framework
  * 
@@ -1030,17 +1684,26 @@ int ulfius_stop_framework(struct _u_instance * u_instance) {
 #ifndef U_DISABLE_WEBSOCKET
     int i;
     // Loop in all active websockets and send close signal
+    pthread_mutex_lock(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock);
     for (i=((struct _websocket_handler *)u_instance->websocket_handler)->nb_websocket_active-1; i>=0; i--) {
-      ((struct _websocket_handler *)u_instance->websocket_handler)->websocket_active[i]->websocket_manager->close_flag = 1;
+      ulfius_websocket_send_close_signal(((struct _websocket_handler *)u_instance->websocket_handler)->websocket_active[i]->websocket_manager);
     }
-    pthread_mutex_lock(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock);
     while (((struct _websocket_handler *)u_instance->websocket_handler)->nb_websocket_active > 0) {
       pthread_cond_wait(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_cond, &((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock);
     }
     pthread_mutex_unlock(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock);
+    // All the websockets are closed, stop the reactor threads
+    ulfius_websocket_reactor_clean(((struct _websocket_handler *)u_instance->websocket_handler)->reactor);
+    ((struct _websocket_handler *)u_instance->websocket_handler)->reactor = NULL;
 #endif 
+    // The offloaded callback functions are completed before the daemon stops, the next ones run in the connection threads
+    ulfius_worker_pool_stop((struct _u_worker_pool *)u_instance->worker_pool);
+    // MHD can't stop while connections are suspended
+    ulfius_abort_async_connections(u_instance);
     MHD_stop_daemon (u_instance->mhd_daemon);
     u_instance->mhd_daemon = NULL;
+    ulfius_worker_pool_clean((struct _u_worker_pool *)u_instance->worker_pool);
+    u_instance->worker_pool = NULL;
     u_instance->status = U_STATUS_STOP;
     return U_OK;
   } else if (u_instance != NULL) {
@@ -1051,6 +1714,47 @@ int ulfius_stop_framework(struct _u_instance * u_instance) {
   }
 }
 
+/**
+ * ulfius_complete_async_response
+ * Complete a response whose callback function returned U_CALLBACK_ASYNC
+ * and resume its connection, may be called from any thread
+ * return U_OK on success
+ */
+int ulfius_complete_async_response(struct _u_response * response, int callback_ret) {
+  struct connection_info_struct * con_info;
+  int ret;
+  
+  if (response != NULL && response->async_handle != NULL && callback_ret != U_CALLBACK_ASYNC) {
+    con_info = (struct connection_info_struct *)response->async_handle;
+    pthread_mutex_lock(&con_info->async_lock);
+    if (con_info->async_state == U_ASYNC_SUSPENDED) {
+      // The dispatcher waits for the lock before reading the result, so con_info outlives this call
+      con_info->async_callback_ret = callback_ret;
+      con_info->async_state = U_ASYNC_COMPLETE;
+      MHD_resume_connection(con_info->connection);
+      ret = U_OK;
+    } else if (con_info->async_state == U_ASYNC_NONE) {
+      // The callback function hasn't returned yet, the connection won't be suspended
+      con_info->async_callback_ret = callback_ret;
+      con_info->async_state = U_ASYNC_COMPLETE;
+      ret = U_OK;
+    } else if (con_info->async_state == U_ASYNC_ABORTED) {
+      // The instance was stopped before, the client was sent an error 500
+      pthread_mutex_unlock(&con_info->async_lock);
+      ulfius_release_connection_info(con_info);
+      return U_ERROR_DISCONNECTED;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error, response already completed");
+      ret = U_ERROR_PARAMS;
+    }
+    pthread_mutex_unlock(&con_info->async_lock);
+    return ret;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_complete_async_response, invalid parameters");
+    return U_ERROR_PARAMS;
+  }
+}
+
 /**
  * ulfius_copy_endpoint
  * return a copy of an endpoint with duplicate values
@@ -1063,6 +1767,8 @@ int ulfius_copy_endpoint(struct _u_endpoint * dest, const struct _u_endpoint * s
     dest->callback_function = source->callback_function;
     dest->user_data = source->user_data;
     dest->priority = source->priority;
+    dest->offload = source->offload;
+    dest->body_callback = source->body_callback;
     if (ulfius_is_valid_endpoint(dest, 0)) {
       return U_OK;
     } else {
@@ -1125,13 +1831,10 @@ void ulfius_clean_endpoint_list(struct _u_endpoint * endpoint_list) {
 }
 
 /**
- * Add a struct _u_endpoint * to the specified u_instance
- * Can be done during the execution of the webservice for injection
- * u_instance: pointer to a struct _u_instance that describe its port and bind address
- * u_endpoint: pointer to a struct _u_endpoint that will be copied in the u_instance endpoint_list
- * return U_OK on success
+ * Add a struct _u_endpoint * to the endpoint_list of the specified u_instance
+ * without updating the routing tree
  */
-int ulfius_add_endpoint(struct _u_instance * u_instance, const struct _u_endpoint * u_endpoint) {
+static int ulfius_append_endpoint(struct _u_instance * u_instance, const struct _u_endpoint * u_endpoint) {
   int res;
   
   if (u_instance != NULL && u_endpoint != NULL) {
@@ -1171,6 +1874,29 @@ int ulfius_add_endpoint(struct _u_instance * u_instance, const struct _u_endpoin
   return U_ERROR;
 }
 
+/**
+ * Add a struct _u_endpoint * to the specified u_instance
+ * Can be done during the execution of the webservice for injection
+ * u_instance: pointer to a struct _u_instance that describe its port and bind address
+ * u_endpoint: pointer to a struct _u_endpoint that will be copied in the u_instance endpoint_list
+ * return U_OK on success
+ */
+int ulfius_add_endpoint(struct _u_instance * u_instance, const struct _u_endpoint * u_endpoint) {
+  int res;
+  
+  if (u_instance != NULL) {
+    ulfius_router_lock((struct _u_router_handle *)u_instance->router);
+    if ((res = ulfius_append_endpoint(u_instance, u_endpoint)) == U_OK) {
+      res = ulfius_rebuild_router(u_instance);
+    }
+    ulfius_router_unlock((struct _u_router_handle *)u_instance->router);
+    return res;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - ulfius_add_endpoint, invalid parameters");
+    return U_ERROR_PARAMS;
+  }
+}
+
 /**
  * Add a struct _u_endpoint * list to the specified u_instance
  * Can be done during the execution of the webservice for injection
@@ -1181,13 +1907,18 @@ int ulfius_add_endpoint(struct _u_instance * u_instance, const struct _u_endpoin
 int ulfius_add_endpoint_list(struct _u_instance * u_instance, const struct _u_endpoint ** u_endpoint_list) {
   int i, res;
   if (u_instance != NULL && u_endpoint_list != NULL) {
+    ulfius_router_lock((struct _u_router_handle *)u_instance->router);
     for (i=0; !ulfius_equals_endpoints(u_endpoint_list[i], ulfius_empty_endpoint()); i++) {
-      res = ulfius_add_endpoint(u_instance, u_endpoint_list[i]);
+      res = ulfius_append_endpoint(u_instance, u_endpoint_list[i]);
       if (res != U_OK) {
+        ulfius_rebuild_router(u_instance);
+        ulfius_router_unlock((struct _u_router_handle *)u_instance->router);
         return res;
       }
     }
-    return U_OK;
+    res = ulfius_rebuild_router(u_instance);
+    ulfius_router_unlock((struct _u_router_handle *)u_instance->router);
+    return res;
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - ulfius_add_endpoint_list, invalid parameters");
     return U_ERROR_PARAMS;
@@ -1213,6 +1944,7 @@ int ulfius_remove_endpoint(struct _u_instance * u_instance, const struct _u_endp
     trim_prefix = trimcharacter(trim_prefix_save, '/');
     trim_format_save = o_strdup(u_endpoint->url_format);
     trim_format = trimcharacter(trim_format_save, '/');
+    ulfius_router_lock((struct _u_router_handle *)u_instance->router);
     for (i=u_instance->nb_endpoints-1; i>=0 && ret == U_OK; i--) {
       trim_cur_prefix_save = o_strdup(u_instance->endpoint_list[i].url_prefix);
       trim_cur_prefix = trimcharacter(trim_cur_prefix_save, '/');
@@ -1246,7 +1978,10 @@ int ulfius_remove_endpoint(struct _u_instance * u_instance, const struct _u_endp
     }
     if (!found) {
       ret = U_ERROR_NOT_FOUND;
+    } else if (ret == U_OK) {
+      ret = ulfius_rebuild_router(u_instance);
     }
+    ulfius_router_unlock((struct _u_router_handle *)u_instance->router);
     o_free(trim_prefix_save);
     o_free(trim_format_save);
     trim_prefix_save = NULL;
@@ -1270,6 +2005,8 @@ const struct _u_endpoint * ulfius_empty_endpoint() {
   empty_endpoint.url_format = NULL;
   empty_endpoint.callback_function = NULL;
   empty_endpoint.user_data = NULL;
+  empty_endpoint.offload = 0;
+  empty_endpoint.body_callback = NULL;
   return &empty_endpoint;
 }
 
@@ -1329,6 +2066,8 @@ int ulfius_add_endpoint_by_val(struct _u_instance * u_instance,
     endpoint.priority = priority;
     endpoint.callback_function = callback_function;
     endpoint.user_data = user_data;
+    endpoint.offload = 0;
+    endpoint.body_callback = NULL;
     return ulfius_add_endpoint(u_instance, &endpoint);
   } else {
     return U_ERROR_PARAMS;
@@ -1373,10 +2112,14 @@ int ulfius_remove_endpoint_by_val(struct _u_instance * u_instance, const char *
 int ulfius_set_default_endpoint(struct _u_instance * u_instance,
                                          int (* callback_function)(const struct _u_request * request, struct _u_response * response, void * user_data),
                                          void * user_data) {
+  int res;
+  
   if (u_instance != NULL && callback_function != NULL) {
+    ulfius_router_lock((struct _u_router_handle *)u_instance->router);
     if (u_instance->default_endpoint == NULL) {
       u_instance->default_endpoint = o_malloc(sizeof(struct _u_endpoint));
       if (u_instance->default_endpoint == NULL) {
+        ulfius_router_unlock((struct _u_router_handle *)u_instance->router);
         y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_instance->default_endpoint");
         return U_ERROR_MEMORY;
       }
@@ -1387,7 +2130,11 @@ int ulfius_set_default_endpoint(struct _u_instance * u_instance,
     u_instance->default_endpoint->callback_function = callback_function;
     u_instance->default_endpoint->user_data = user_data;
     u_instance->default_endpoint->priority = 0;
-    return U_OK;
+    u_instance->default_endpoint->offload = 0;
+    u_instance->default_endpoint->body_callback = NULL;
+    res = ulfius_rebuild_router(u_instance);
+    ulfius_router_unlock((struct _u_router_handle *)u_instance->router);
+    return res;
   } else {
     return U_ERROR_PARAMS;
   }
@@ -1440,17 +2187,29 @@ int ulfius_set_upload_file_callback_function(struct _u_instance * u_instance,
 void ulfius_clean_instance(struct _u_instance * u_instance) {
   if (u_instance != NULL) {
     ulfius_clean_endpoint_list(u_instance->endpoint_list);
+    ulfius_router_handle_clean((struct _u_router_handle *)u_instance->router);
     u_map_clean_full(u_instance->default_headers);
     o_free(u_instance->default_auth_realm);
     o_free(u_instance->default_endpoint);
     u_instance->endpoint_list = NULL;
+    u_instance->router = NULL;
     u_instance->default_headers = NULL;
     u_instance->default_auth_realm = NULL;
     u_instance->bind_address = NULL;
     u_instance->default_endpoint = NULL;
+    ulfius_worker_pool_clean((struct _u_worker_pool *)u_instance->worker_pool);
+    u_instance->worker_pool = NULL;
+    ulfius_metrics_clean((struct _u_metrics *)u_instance->metrics);
+    u_instance->metrics = NULL;
+    if (u_instance->async_connections != NULL) {
+      pthread_mutex_destroy(&((struct _u_async_list *)u_instance->async_connections)->lock);
+      o_free(u_instance->async_connections);
+      u_instance->async_connections = NULL;
+    }
 #ifndef U_DISABLE_WEBSOCKET
     /* ulfius_clean_instance might be called without websocket_handler being initialized */
     if ((struct _websocket_handler *)u_instance->websocket_handler) {
+        ulfius_websocket_reactor_clean(((struct _websocket_handler *)u_instance->websocket_handler)->reactor);
         if (((struct _websocket_handler *)u_instance->websocket_handler)->pthread_init && 
             (pthread_mutex_destroy(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock) ||
             pthread_cond_destroy(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_cond))) {
@@ -1494,18 +2253,41 @@ UNUSED(network_type);
     u_instance->default_auth_realm = o_strdup(default_auth_realm);
     u_instance->nb_endpoints = 0;
     u_instance->endpoint_list = NULL;
+    u_instance->router = ulfius_router_handle_init();
     u_instance->default_headers = o_malloc(sizeof(struct _u_map));
     u_instance->mhd_response_copy_data = 0;
     u_instance->check_utf8 = 1;
-    if (u_instance->default_headers == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_instance->default_headers");
+    u_instance->thread_mode = U_THREAD_PER_CONNECTION;
+    u_instance->thread_pool_size = 0;
+    u_instance->max_connections = 0;
+    u_instance->worker_pool_size = 0;
+    u_instance->worker_pool = NULL;
+    u_instance->metrics = NULL;
+    if ((u_instance->async_connections = o_malloc(sizeof(struct _u_async_list))) != NULL) {
+      pthread_mutex_init(&((struct _u_async_list *)u_instance->async_connections)->lock, NULL);
+      ((struct _u_async_list *)u_instance->async_connections)->suspend_resume = 0;
+      ((struct _u_async_list *)u_instance->async_connections)->stopping = 0;
+      ((struct _u_async_list *)u_instance->async_connections)->first = NULL;
+    }
+#ifndef U_DISABLE_WEBSOCKET
+    u_instance->websocket_mode = U_WEBSOCKET_MODE_THREAD;
+    u_instance->websocket_reactor_threads = 0;
+    u_instance->websocket_worker_pool_size = 0;
+    u_instance->websocket_queue_high_water = U_WEBSOCKET_QUEUE_HIGH_WATER;
+    u_instance->websocket_queue_policy = U_WEBSOCKET_QUEUE_BLOCK;
+    u_instance->websocket_max_inflated_size = U_WEBSOCKET_MAX_INFLATED_SIZE;
+#endif
+    u_instance->default_endpoint = NULL;
+    if (u_instance->default_headers == NULL || u_instance->router == NULL || u_instance->async_connections == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_instance->default_headers, u_instance->router or u_instance->async_connections");
       ulfius_clean_instance(u_instance);
       return U_ERROR_MEMORY;
     }
     u_map_init(u_instance->default_headers);
-    u_instance->default_endpoint = NULL;
     u_instance->max_post_param_size = 0;
     u_instance->max_post_body_size = 0;
+    u_instance->body_mmap_threshold = 0;
+    u_instance->form_body_mode = U_FORM_BODY_RAW|U_FORM_BODY_PARSED;
     u_instance->file_upload_callback = NULL;
     u_instance->file_upload_cls = NULL;
 #ifndef U_DISABLE_GNUTLS
@@ -1521,6 +2303,7 @@ UNUSED(network_type);
     ((struct _websocket_handler *)u_instance->websocket_handler)->pthread_init = 0;
     ((struct _websocket_handler *)u_instance->websocket_handler)->nb_websocket_active = 0;
     ((struct _websocket_handler *)u_instance->websocket_handler)->websocket_active = NULL;
+    ((struct _websocket_handler *)u_instance->websocket_handler)->reactor = NULL;
     if (pthread_mutex_init(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock, NULL) || 
         pthread_cond_init(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_cond, NULL)) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing websocket_close_lock or websocket_close_cond");
@@ -1579,6 +2362,157 @@ void u_free(void * data) {
   o_free(data);
 }
 
+/**
+ * utf8_sequence_len
+ * Check the UTF-8 sequence starting at s, end is the end of the string
+ * return the length of the sequence, 0 if it's malformed, overlong, a surrogate,
+ * U+FFFE, U+FFFF, above U+10FFFF or truncated by end
+ *
+ * Based on the utf8_check() function by
+ * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/> -- 2005-03-30
+ * License: http://www.cl.cam.ac.uk/~mgk25/short-license.html
+ */
+static size_t utf8_sequence_len(const unsigned char * s, const unsigned char * end) {
+  size_t avail = (size_t)(end - s);
+  
+  if (s[0] < 0x80) {
+    /* 0xxxxxxx */
+    return 1;
+  } else if ((s[0] & 0xe0) == 0xc0) {
+    /* 110XXXXx 10xxxxxx */
+    if (avail < 2 ||
+        (s[1] & 0xc0) != 0x80 ||
+        (s[0] & 0xfe) == 0xc0) {                  /* overlong? */
+      return 0;
+    } else {
+      return 2;
+    }
+  } else if ((s[0] & 0xf0) == 0xe0) {
+    /* 1110XXXX 10Xxxxxx 10xxxxxx */
+    if (avail < 3 ||
+        (s[1] & 0xc0) != 0x80 ||
+        (s[2] & 0xc0) != 0x80 ||
+        (s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) ||      /* overlong? */
+        (s[0] == 0xed && (s[1] & 0xe0) == 0xa0) ||      /* surrogate? */
+        (s[0] == 0xef && s[1] == 0xbf &&
+         (s[2] & 0xfe) == 0xbe)) {                      /* U+FFFE or U+FFFF? */
+      return 0;
+    } else {
+      return 3;
+    }
+  } else if ((s[0] & 0xf8) == 0xf0) {
+    /* 11110XXX 10XXxxxx 10xxxxxx 10xxxxxx */
+    if (avail < 4 ||
+        (s[1] & 0xc0) != 0x80 ||
+        (s[2] & 0xc0) != 0x80 ||
+        (s[3] & 0xc0) != 0x80 ||
+        (s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) ||      /* overlong? */
+        (s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4) { /* > U+10FFFF? */
+      return 0;
+    } else {
+      return 4;
+    }
+  } else {
+    return 0;
+  }
+}
+
+/**
+ * Portable ASCII prefix function, 8 bytes at a time
+ * return the length of the ASCII blocks at the beginning of s
+ */
+static size_t utf8_ascii_prefix_64(const unsigned char * s, size_t len) {
+  uint64_t block;
+  size_t i = 0;
+  
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&block, s + i, 8);
+    if (block & 0x8080808080808080ULL) {
+      break;
+    }
+  }
+  return i;
+}
+
+#ifdef U_UTF8_X86
+/**
+ * SSE2 ASCII prefix function, 16 bytes at a time
+ */
+__attribute__((target("sse2")))
+static size_t utf8_ascii_prefix_sse2(const unsigned char * s, size_t len) {
+  size_t i = 0;
+  
+  for (; i + 16 <= len; i += 16) {
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)))) {
+      break;
+    }
+  }
+  return i;
+}
+
+/**
+ * AVX2 ASCII prefix function, 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+static size_t utf8_ascii_prefix_avx2(const unsigned char * s, size_t len) {
+  size_t i = 0;
+  
+  for (; i + 32 <= len; i += 32) {
+    if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)))) {
+      break;
+    }
+  }
+  return i + utf8_ascii_prefix_sse2(s + i, len - i);
+}
+#endif
+
+/**
+ * ASCII prefix function used, chosen on the first call depending on the CPU features
+ */
+static size_t (* utf8_ascii_prefix_function) (const unsigned char * s, size_t len) = NULL;
+
+/**
+ * utf8_check_len
+ * Same as utf8_check on the len bytes starting at s_orig, s_orig doesn't need to be '\0'-terminated
+ * The ASCII runs are skipped by blocks with the widest vector instructions available,
+ * the other sequences are checked one at a time
+ */
+const unsigned char * utf8_check_len(const char * s_orig, size_t len) {
+  const unsigned char * s = (const unsigned char *)s_orig, * end = s + len, * block_end;
+  size_t (* ascii_prefix) (const unsigned char * s, size_t len) = __atomic_load_n(&utf8_ascii_prefix_function, __ATOMIC_RELAXED);
+  size_t sequence_len;
+  
+  if (ascii_prefix == NULL) {
+    ascii_prefix = utf8_ascii_prefix_64;
+#ifdef U_UTF8_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      ascii_prefix = utf8_ascii_prefix_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+      ascii_prefix = utf8_ascii_prefix_sse2;
+    }
+#endif
+    __atomic_store_n(&utf8_ascii_prefix_function, ascii_prefix, __ATOMIC_RELAXED);
+  }
+  while (s < end) {
+    if ((size_t)(end - s) >= U_UTF8_BLOCK_SIZE) {
+      s += ascii_prefix(s, (size_t)(end - s));
+    }
+    // Check the block that stopped the ASCII run, or the end of the string, one sequence at a time
+    block_end = (size_t)(end - s)>U_UTF8_BLOCK_SIZE?s + U_UTF8_BLOCK_SIZE:end;
+    while (s < block_end) {
+      if (*s < 0x80) {
+        s++;
+      } else if (!(sequence_len = utf8_sequence_len(s, end))) {
+        return s;
+      } else {
+        s += sequence_len;
+      }
+    }
+  }
+  return NULL;
+}
+
 /**
  * The utf8_check() function scans the '\0'-terminated string starting
  * at s. It returns a pointer to the first byte of the first malformed
@@ -1591,55 +2525,11 @@ void u_free(void * data) {
  * very effective heuristic for distinguishing between UTF-8 and other
  * encodings.
  *
- * I wrote this code mainly as a specification of functionality; there
- * are no doubt performance optimizations possible for certain CPUs.
- *
  * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/> -- 2005-03-30
  * License: http://www.cl.cam.ac.uk/~mgk25/short-license.html
  */
 const unsigned char * utf8_check(const char * s_orig) {
-  const unsigned char * s = (unsigned char *)s_orig;
-  while (*s) {
-    if (*s < 0x80) {
-      /* 0xxxxxxx */
-      s++;
-    } else if ((s[0] & 0xe0) == 0xc0) {
-      /* 110XXXXx 10xxxxxx */
-      if ((s[1] & 0xc0) != 0x80 ||
-          (s[0] & 0xfe) == 0xc0) {                  /* overlong? */
-        return s;
-      } else {
-        s += 2;
-      }
-    } else if ((s[0] & 0xf0) == 0xe0) {
-      /* 1110XXXX 10Xxxxxx 10xxxxxx */
-      if ((s[1] & 0xc0) != 0x80 ||
-	  (s[2] & 0xc0) != 0x80 ||
-	  (s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) ||      /* overlong? */
-	  (s[0] == 0xed && (s[1] & 0xe0) == 0xa0) ||      /* surrogate? */
-	  (s[0] == 0xef && s[1] == 0xbf &&
-	   (s[2] & 0xfe) == 0xbe)) {                      /* U+FFFE or U+FFFF? */
-        return s;
-      } else {
-        s += 3;
-      }
-    } else if ((s[0] & 0xf8) == 0xf0) {
-      /* 11110XXX 10XXxxxx 10xxxxxx 10xxxxxx */
-      if ((s[1] & 0xc0) != 0x80 ||
-	  (s[2] & 0xc0) != 0x80 ||
-	  (s[3] & 0xc0) != 0x80 ||
-	  (s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) ||      /* overlong? */
-	  (s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4) { /* > U+10FFFF? */
-        return s;
-      } else {
-        s += 4;
-      }
-    } else {
-      return s;
-    }
-  }
-
-  return NULL;
+  return utf8_check_len(s_orig, o_strlen(s_orig));
 }
 
 /**
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
 #ifndef _WIN32
 #include <netinet/in.h>
 #endif
@@ -429,6 +430,8 @@ END_TEST
 START_TEST(test_ulfius_response)
 {
   struct _u_response resp1, resp2, * resp3;
+  char * no_copy_body;
+  int fds[2];
 #ifndef U_DISABLE_JANSSON
   json_t * j_body = json_pack("{ss}", "test", "body"), * j_body2 = NULL;
   char * str_body = json_dumps(j_body, JSON_COMPACT);
@@ -553,6 +556,27 @@ START_TEST(test_ulfius_response)
   ck_assert_int_eq(ulfius_set_binary_body_response(&resp1, STATUS, BINARY_BODY, BINARY_BODY_LEN), U_OK);
   ck_assert_ptr_ne(resp1.binary_body, NULL);
   ck_assert_int_eq(resp1.binary_body_length, BINARY_BODY_LEN);
+  
+  ck_assert_int_eq(ulfius_set_binary_body_response_no_copy(&resp1, STATUS, NULL, BINARY_BODY_LEN), U_ERROR_PARAMS);
+  no_copy_body = o_malloc(BINARY_BODY_LEN);
+  memcpy(no_copy_body, BINARY_BODY, BINARY_BODY_LEN);
+  ck_assert_int_eq(ulfius_set_binary_body_response_no_copy(&resp1, STATUS, no_copy_body, BINARY_BODY_LEN), U_OK);
+  ck_assert_ptr_eq(resp1.binary_body, no_copy_body);
+  ck_assert_int_eq(resp1.binary_body_length, BINARY_BODY_LEN);
+  
+  ck_assert_int_eq(resp1.file_fd, -1);
+  ck_assert_int_eq(ulfius_set_fd_response(&resp1, STATUS, -1, 0, 0), U_ERROR_PARAMS);
+  ck_assert_int_eq(pipe(fds), 0);
+  ck_assert_int_eq(ulfius_set_fd_response(&resp1, STATUS, fds[0], 0, BINARY_BODY_LEN), U_OK);
+  ck_assert_int_eq(resp1.file_fd, fds[0]);
+  ck_assert_ptr_eq(resp1.binary_body, NULL);
+  ck_assert_int_eq(resp1.file_size, BINARY_BODY_LEN);
+  ck_assert_int_eq(ulfius_clean_response(&resp1), U_OK);
+  ck_assert_int_eq(resp1.file_fd, -1);
+  ck_assert_int_eq(close(fds[0]), -1);
+  close(fds[1]);
+  ck_assert_int_eq(ulfius_init_response(&resp1), U_OK);
+  ck_assert_int_eq(ulfius_set_binary_body_response(&resp1, STATUS, BINARY_BODY, BINARY_BODY_LEN), U_OK);
 
 #ifndef U_DISABLE_JANSSON
   ck_assert_int_eq(ulfius_set_json_body_response(&resp1, STATUS, j_body), U_OK);
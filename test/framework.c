@@ -10,6 +10,7 @@
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <fcntl.h>
 
 #ifndef _WIN32
   #include <sys/socket.h>
@@ -339,6 +340,17 @@ int callback_function_body_param(const struct _u_request * request, struct _u_re
   return U_CALLBACK_CONTINUE;
 }
 
+int callback_function_body_param_parsed(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ck_assert_int_eq(request->binary_body_length, 0);
+  return callback_function_body_param(request, response, user_data);
+}
+
+int callback_function_body_param_raw(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ck_assert_int_eq(u_map_count(request->map_post_body), 0);
+  ulfius_set_binary_body_response(response, 200, request->binary_body, request->binary_body_length);
+  return U_CALLBACK_CONTINUE;
+}
+
 int callback_function_header_param(const struct _u_request * request, struct _u_response * response, void * user_data) {
   char * body;
   
@@ -409,12 +421,187 @@ size_t my_write_body(void * contents, size_t size, size_t nmemb, void * user_dat
   return size * nmemb;
 }
 
+int callback_function_request_alloc(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  char * value = ulfius_request_alloc(request, o_strlen(u_map_get(request->map_url, "value")) + 1);
+  
+  if (value != NULL) {
+    o_strcpy(value, u_map_get(request->map_url, "value"));
+    ulfius_set_string_body_response(response, 200, value);
+  } else {
+    ulfius_set_string_body_response(response, 500, "error");
+  }
+  return U_CALLBACK_CONTINUE;
+}
+
+#define FD_FILE_PATH "/tmp/ulfius_fd_response"
+#define FD_FILE_CONTENT "file content sent with sendfile"
+
+int callback_function_fd(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  int fd = open(FD_FILE_PATH, O_RDONLY);
+  
+  if (fd < 0 || ulfius_set_fd_response(response, 200, fd, o_strlen("file "), o_strlen(FD_FILE_CONTENT) - o_strlen("file ")) != U_OK) {
+    ulfius_set_string_body_response(response, 500, "error");
+  }
+  return U_CALLBACK_CONTINUE;
+}
+
+int callback_function_client_port(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  char * body = msprintf("%u", ntohs(((struct sockaddr_in *)request->client_address)->sin_port));
+  
+  if (user_data != NULL) {
+    ck_assert_int_eq(ulfius_add_cookie_to_response(response, "session", "value_cookie", NULL, 100, NULL, NULL, 0, 1), U_OK);
+  }
+  ulfius_set_string_body_response(response, 200, body);
+  o_free(body);
+  return U_CALLBACK_CONTINUE;
+}
+
+#define ASYNC_NB_REQUESTS 4
+
+struct async_responses {
+  pthread_mutex_t      lock;
+  pthread_cond_t       cond;
+  struct _u_response * responses[ASYNC_NB_REQUESTS];
+  size_t               nb_responses;
+};
+
+int callback_function_async(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  struct async_responses * async = (struct async_responses *)user_data;
+  
+  pthread_mutex_lock(&async->lock);
+  async->responses[async->nb_responses++] = response;
+  pthread_cond_signal(&async->cond);
+  pthread_mutex_unlock(&async->lock);
+  return U_CALLBACK_ASYNC;
+}
+
+int callback_function_async_completed(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ck_assert_int_eq(ulfius_complete_async_response(response, U_CALLBACK_ASYNC), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_complete_async_response(response, U_CALLBACK_ERROR), U_OK);
+  ck_assert_int_eq(ulfius_complete_async_response(response, U_CALLBACK_COMPLETE), U_ERROR_PARAMS);
+  return U_CALLBACK_ASYNC;
+}
+
+int callback_function_async_next(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ulfius_set_string_body_response(response, 200, "async");
+  return U_CALLBACK_CONTINUE;
+}
+
+void * run_complete_async_responses(void * args) {
+  struct async_responses * async = (struct async_responses *)args;
+  size_t i;
+  
+  // The responses are completed once all the requests are suspended
+  pthread_mutex_lock(&async->lock);
+  while (async->nb_responses < ASYNC_NB_REQUESTS) {
+    pthread_cond_wait(&async->cond, &async->lock);
+  }
+  pthread_mutex_unlock(&async->lock);
+  for (i=0; i<ASYNC_NB_REQUESTS; i++) {
+    ck_assert_int_eq(ulfius_complete_async_response(async->responses[i], U_CALLBACK_CONTINUE), U_OK);
+  }
+  return NULL;
+}
+
+void * run_async_stop_request(void * args) {
+  struct _u_request request;
+  struct _u_response response;
+  
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  request.http_url = o_strdup("http://localhost:8080/async");
+  // The connection is either sent an error 500 or closed when the instance stops
+  if (ulfius_send_http_request(&request, &response) == U_OK) {
+    ck_assert_int_eq(response.status, 500);
+  }
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  return NULL;
+}
+
+struct offload_state {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int             fast_done;
+};
+
+int callback_function_offload_slow(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  struct offload_state * state = (struct offload_state *)user_data;
+  struct timespec abstime;
+  
+  // Blocks until the fast endpoint is served by the same connection thread
+  clock_gettime(CLOCK_REALTIME, &abstime);
+  abstime.tv_sec += 2;
+  pthread_mutex_lock(&state->lock);
+  while (!state->fast_done && pthread_cond_timedwait(&state->cond, &state->lock, &abstime) == 0);
+  ck_assert_int_eq(state->fast_done, 1);
+  pthread_mutex_unlock(&state->lock);
+  ulfius_set_string_body_response(response, 200, "slow");
+  return U_CALLBACK_CONTINUE;
+}
+
+int callback_function_offload_fast(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  struct offload_state * state = (struct offload_state *)user_data;
+  
+  pthread_mutex_lock(&state->lock);
+  state->fast_done = 1;
+  pthread_cond_signal(&state->cond);
+  pthread_mutex_unlock(&state->lock);
+  ulfius_set_string_body_response(response, 200, "fast");
+  return U_CALLBACK_CONTINUE;
+}
+
+#define BODY_STREAM_SIZE (4*1024*1024)
+
+struct body_stream_state {
+  uint64_t size;
+  unsigned int sum;
+  int      error;
+};
+
+int body_callback_stream(const struct _u_request * request, const char * data, uint64_t offset, size_t size, void * user_data) {
+  struct body_stream_state * state = (struct body_stream_state *)user_data;
+  size_t i;
+  
+  if (offset != state->size) {
+    state->error = 1;
+  }
+  for (i=0; i<size; i++) {
+    state->sum += (unsigned char)data[i];
+  }
+  state->size += size;
+  return U_OK;
+}
+
+int callback_function_body_stream(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  struct body_stream_state * state = (struct body_stream_state *)user_data;
+  
+  ck_assert_int_eq(request->binary_body_length, 0);
+  ulfius_set_string_body_response(response, state->error?400:200, "streamed");
+  return U_CALLBACK_CONTINUE;
+}
+
+int callback_function_body_pattern(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  size_t i;
+  
+  ck_assert_int_eq(request->binary_body_length, BODY_STREAM_SIZE);
+  for (i=0; i<request->binary_body_length; i++) {
+    if (((const unsigned char *)request->binary_body)[i] != (unsigned char)(i*7)) {
+      break;
+    }
+  }
+  ulfius_set_string_body_response(response, i==BODY_STREAM_SIZE?200:400, "body");
+  return U_CALLBACK_CONTINUE;
+}
+
 int callback_check_utf8_ignored(const struct _u_request * request, struct _u_response * response, void * user_data) {
   ck_assert_int_eq(u_map_has_key(request->map_header, "utf8_param"), 0);
   ck_assert_int_eq(u_map_has_key(request->map_url, "utf8_param1"), 0);
   ck_assert_int_eq(u_map_has_key(request->map_url, "utf8_param2"), 0);
   ck_assert_int_eq(u_map_has_key(request->map_post_body, "utf8_param"), 0);
+  ck_assert_int_eq(u_map_has_key(request->map_header, "utf8_param_long"), 0);
   ck_assert_int_eq(u_map_has_key(request->map_header, "utf8_param_valid"), 1);
+  ck_assert_int_eq(u_map_has_key(request->map_header, "utf8_param_long_valid"), 1);
   ck_assert_int_eq(u_map_has_key(request->map_url, "utf8_param_valid1"), 1);
   ck_assert_int_eq(u_map_has_key(request->map_url, "utf8_param_valid2"), 1);
   ck_assert_int_eq(u_map_has_key(request->map_post_body, "utf8_param_valid"), 1);
@@ -459,6 +646,11 @@ int callback_function_redirect_last(const struct _u_request * request, struct _u
   return U_CALLBACK_CONTINUE;
 }
 
+int callback_function_user_data(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ulfius_set_string_body_response(response, 200, (const char *)user_data);
+  return U_CALLBACK_COMPLETE;
+}
+
 int via_free_with_test = 0;
 
 void free_with_test(void * ptr) {
@@ -977,6 +1169,125 @@ START_TEST(test_ulfius_endpoint_multiple)
 }
 END_TEST
 
+START_TEST(test_ulfius_endpoint_router)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "router", "/:param/static", 1, &callback_function_user_data, "param_static"), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "router/static", "/static", 0, &callback_function_user_data, "static_static"), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "/router/", "/@param/@param2", 0, &callback_function_user_data, "param_param"), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "*", "router", "/static/*", 2, &callback_function_user_data, "static_wildcard"), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/router/static/static");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(o_strncmp(response.binary_body, "static_static", o_strlen("static_static")), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/router/value/static");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(o_strncmp(response.binary_body, "param_param", o_strlen("param_param")), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/router/static/value/value2");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(o_strncmp(response.binary_body, "static_wildcard", o_strlen("static_wildcard")), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("POST");
+  request.http_url = o_strdup("http://localhost:8080/router/static");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(o_strncmp(response.binary_body, "static_wildcard", o_strlen("static_wildcard")), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_remove_endpoint_by_val(&u_instance, "*", "router", "/static/*"), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/router/static/value/value2");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 404);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_set_default_endpoint(&u_instance, &callback_function_user_data, "default"), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/router/static/value/value2");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(o_strncmp(response.binary_body, "default", o_strlen("default")), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+#define INJECTION_LOOPS 200
+
+static void * run_endpoint_injection(void * args) {
+  struct _u_instance * u_instance = (struct _u_instance *)args;
+  int i;
+  
+  for (i=0; i<INJECTION_LOOPS; i++) {
+    ulfius_add_endpoint_by_val(u_instance, "GET", "injection", "/:param", 0, &callback_function_user_data, "injected");
+    ulfius_remove_endpoint_by_val(u_instance, "GET", "injection", "/:param");
+  }
+  return NULL;
+}
+
+START_TEST(test_ulfius_endpoint_injection_concurrent)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  pthread_t thread;
+  int i;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "injection", "/static", 0, &callback_function_user_data, "static"), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ck_assert_int_eq(pthread_create(&thread, NULL, run_endpoint_injection, &u_instance), 0);
+  for (i=0; i<INJECTION_LOOPS; i++) {
+    ulfius_init_request(&request);
+    request.http_url = o_strdup("http://localhost:8080/injection/static");
+    ulfius_init_response(&response);
+    ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+    ck_assert_int_eq(response.status, 200);
+    ck_assert_int_eq(o_strncmp(response.binary_body, "static", o_strlen("static")), 0);
+    ulfius_clean_request(&request);
+    ulfius_clean_response(&response);
+  }
+  pthread_join(thread, NULL);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
 START_TEST(test_ulfius_endpoint_stream)
 {
   struct _u_instance u_instance;
@@ -999,6 +1310,509 @@ START_TEST(test_ulfius_endpoint_stream)
 }
 END_TEST
 
+START_TEST(test_ulfius_endpoint_request_alloc)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  char * body;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "alloc", ":value", 0, &callback_function_request_alloc, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  ck_assert_ptr_eq(ulfius_request_alloc(&request, 16), NULL);
+  request.http_url = o_strdup("http://localhost:8080/alloc/arena");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  body = o_strndup(response.binary_body, response.binary_body_length);
+  ck_assert_str_eq(body, "arena");
+  o_free(body);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_fd)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  FILE * f;
+  char * body;
+  
+  f = fopen(FD_FILE_PATH, "w");
+  ck_assert_ptr_ne(f, NULL);
+  fputs(FD_FILE_CONTENT, f);
+  fclose(f);
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "fd", NULL, 0, &callback_function_fd, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/fd");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  body = o_strndup(response.binary_body, response.binary_body_length);
+  ck_assert_str_eq(body, "content sent with sendfile");
+  o_free(body);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+  unlink(FD_FILE_PATH);
+}
+END_TEST
+
+void http_async_callback(int result, const struct _u_request * request, struct _u_response * response, void * http_user_data) {
+  ck_assert_int_eq(result, U_OK);
+  ck_assert_int_eq(response->status, 200);
+  ck_assert_int_gt(response->binary_body_length, 0);
+  (*((int *)http_user_data))++;
+}
+
+START_TEST(test_ulfius_endpoint_async)
+{
+  struct _u_instance u_instance;
+  struct _u_http_client http_client;
+  struct _u_request request;
+  struct _u_response response;
+  struct async_responses async;
+  pthread_t thread;
+  int i, completed = 0;
+  
+  pthread_mutex_init(&async.lock, NULL);
+  pthread_cond_init(&async.cond, NULL);
+  async.nb_responses = 0;
+  ck_assert_int_eq(ulfius_complete_async_response(NULL, U_CALLBACK_COMPLETE), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  // A single thread serves all the connections, the requests can only be pending together if they are suspended
+  u_instance.thread_mode = U_THREAD_POOL;
+  u_instance.thread_pool_size = 1;
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "async", NULL, 0, &callback_function_async, &async), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "async", NULL, 1, &callback_function_async_next, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "async_completed", NULL, 0, &callback_function_async_completed, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  ck_assert_int_eq(ulfius_init_http_client(&http_client, ASYNC_NB_REQUESTS), U_OK);
+  ck_assert_int_eq(pthread_create(&thread, NULL, run_complete_async_responses, &async), 0);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/async");
+  for (i=0; i<ASYNC_NB_REQUESTS; i++) {
+    ck_assert_int_eq(ulfius_send_http_async_request(&http_client, &request, &http_async_callback, &completed), U_OK);
+  }
+  for (i=0; i<200 && ulfius_http_client_nb_transfers(&http_client); i++) {
+    ck_assert_int_eq(ulfius_perform_http_client(&http_client, 50), U_OK);
+  }
+  ck_assert_int_eq(completed, ASYNC_NB_REQUESTS);
+  pthread_join(thread, NULL);
+  ulfius_clean_request(&request);
+  
+  // The response completed before its callback function returned is sent right away
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/async_completed");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 500);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_clean_http_client(&http_client);
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+  pthread_mutex_destroy(&async.lock);
+  pthread_cond_destroy(&async.cond);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_async_stop)
+{
+  struct _u_instance u_instance;
+  struct async_responses async;
+  pthread_t thread;
+  
+  pthread_mutex_init(&async.lock, NULL);
+  pthread_cond_init(&async.cond, NULL);
+  async.nb_responses = 0;
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "async", NULL, 0, &callback_function_async, &async), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  ck_assert_int_eq(pthread_create(&thread, NULL, run_async_stop_request, NULL), 0);
+  
+  pthread_mutex_lock(&async.lock);
+  while (!async.nb_responses) {
+    pthread_cond_wait(&async.cond, &async.lock);
+  }
+  pthread_mutex_unlock(&async.lock);
+  // The instance stops while the connection is suspended, the response is released when completed afterwards
+  ck_assert_int_eq(ulfius_stop_framework(&u_instance), U_OK);
+  ck_assert_int_eq(ulfius_complete_async_response(async.responses[0], U_CALLBACK_COMPLETE), U_ERROR_DISCONNECTED);
+  pthread_join(thread, NULL);
+  
+  ulfius_clean_instance(&u_instance);
+  pthread_mutex_destroy(&async.lock);
+  pthread_cond_destroy(&async.cond);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_offload)
+{
+  struct _u_instance u_instance;
+  struct _u_http_client http_client;
+  struct _u_endpoint endpoint;
+  struct _u_request request;
+  struct _u_response response;
+  struct offload_state state;
+  int i, completed = 0;
+  
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.cond, NULL);
+  state.fast_done = 0;
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  // A single thread serves all the connections, the slow callback function must not block it
+  u_instance.thread_mode = U_THREAD_POOL;
+  u_instance.thread_pool_size = 1;
+  u_instance.worker_pool_size = 2;
+  endpoint.http_method = "GET";
+  endpoint.url_prefix = NULL;
+  endpoint.url_format = "slow";
+  endpoint.priority = 0;
+  endpoint.callback_function = &callback_function_offload_slow;
+  endpoint.user_data = &state;
+  endpoint.offload = 1;
+  endpoint.body_callback = NULL;
+  ck_assert_int_eq(ulfius_add_endpoint(&u_instance, &endpoint), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "fast", NULL, 0, &callback_function_offload_fast, &state), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  ck_assert_ptr_ne(u_instance.worker_pool, NULL);
+  ck_assert_int_eq(ulfius_init_http_client(&http_client, 1), U_OK);
+  ck_assert_int_eq(ulfius_start_http_client_loop(&http_client), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/slow");
+  ck_assert_int_eq(ulfius_send_http_async_request(&http_client, &request, &http_async_callback, &completed), U_OK);
+  ulfius_clean_request(&request);
+  
+  // The fast endpoint is served while the slow one is running
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/fast");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  for (i=0; i<100 && ulfius_http_client_nb_transfers(&http_client); i++) {
+    usleep(50000);
+  }
+  ck_assert_int_eq(completed, 1);
+  ck_assert_int_eq(ulfius_stop_http_client_loop(&http_client), U_OK);
+  
+  ulfius_clean_http_client(&http_client);
+  ulfius_stop_framework(&u_instance);
+  ck_assert_ptr_eq(u_instance.worker_pool, NULL);
+  ulfius_clean_instance(&u_instance);
+  pthread_mutex_destroy(&state.lock);
+  pthread_cond_destroy(&state.cond);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_body_stream)
+{
+  struct _u_instance u_instance;
+  struct _u_endpoint endpoint;
+  struct _u_request request;
+  struct _u_response response;
+  struct body_stream_state state = {0, 0, 0};
+  unsigned int sum = 0;
+  size_t i;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  endpoint.http_method = "POST";
+  endpoint.url_prefix = NULL;
+  endpoint.url_format = "stream";
+  endpoint.priority = 0;
+  endpoint.callback_function = &callback_function_body_stream;
+  endpoint.user_data = &state;
+  endpoint.offload = 0;
+  endpoint.body_callback = &body_callback_stream;
+  ck_assert_int_eq(ulfius_add_endpoint(&u_instance, &endpoint), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  request.http_verb = o_strdup("POST");
+  request.http_url = o_strdup("http://localhost:8080/stream");
+  request.binary_body = o_malloc(BODY_STREAM_SIZE);
+  request.binary_body_length = BODY_STREAM_SIZE;
+  for (i=0; i<BODY_STREAM_SIZE; i++) {
+    ((unsigned char *)request.binary_body)[i] = (unsigned char)(i*7);
+    sum += (unsigned char)(i*7);
+  }
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(state.size, BODY_STREAM_SIZE);
+  ck_assert_int_eq(state.sum, sum);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_body_mmap)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  size_t i;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  // The bodies larger than 64kB are stored in a temporary file
+  u_instance.body_mmap_threshold = 64*1024;
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "POST", "pattern", NULL, 0, &callback_function_body_pattern, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  request.http_verb = o_strdup("POST");
+  request.http_url = o_strdup("http://localhost:8080/pattern");
+  request.binary_body = o_malloc(BODY_STREAM_SIZE);
+  request.binary_body_length = BODY_STREAM_SIZE;
+  for (i=0; i<BODY_STREAM_SIZE; i++) {
+    ((unsigned char *)request.binary_body)[i] = (unsigned char)(i*7);
+  }
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ulfius_clean_response(&response);
+  
+  // Without threshold, the body stays on the heap
+  u_instance.body_mmap_threshold = 0;
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_form_body_mode)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(u_instance.form_body_mode, U_FORM_BODY_RAW|U_FORM_BODY_PARSED);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "POST", "parsed", NULL, 0, &callback_function_body_param_parsed, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "POST", "raw", NULL, 0, &callback_function_body_param_raw, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  u_instance.form_body_mode = U_FORM_BODY_PARSED;
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("POST");
+  request.http_url = o_strdup("http://localhost:8080/parsed/");
+  u_map_put(request.map_post_body, "param1", "value3");
+  u_map_put(request.map_post_body, "param2", "value4");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(o_strncmp(response.binary_body, "param1 is value3, param2 is value4", o_strlen("param1 is value3, param2 is value4")), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  u_instance.form_body_mode = U_FORM_BODY_RAW;
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("POST");
+  request.http_url = o_strdup("http://localhost:8080/raw/");
+  u_map_put(request.map_post_body, "param1", "value3");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, o_strlen("param1=value3"));
+  ck_assert_int_eq(o_strncmp(response.binary_body, "param1=value3", o_strlen("param1=value3")), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_metrics)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct _u_endpoint_metrics metrics;
+  uint64_t nb_buckets;
+  size_t i;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "empty", NULL, 0, &callback_function_empty, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "error", NULL, 0, &callback_function_error, NULL), U_OK);
+  ck_assert_int_eq(ulfius_enable_metrics(&u_instance, "/metrics"), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  ck_assert_int_eq(ulfius_enable_metrics(&u_instance, NULL), U_ERROR_PARAMS);
+  
+  for (i=0; i<3; i++) {
+    ulfius_init_request(&request);
+    request.http_url = o_strdup("http://localhost:8080/empty");
+    ulfius_init_response(&response);
+    ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+    ck_assert_int_eq(response.status, 200);
+    ulfius_clean_request(&request);
+    ulfius_clean_response(&response);
+  }
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/error");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 500);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_get_endpoint_metrics(&u_instance, "GET", "empty", NULL, &metrics), U_OK);
+  ck_assert_int_eq(metrics.nb_requests, 3);
+  ck_assert_int_eq(metrics.nb_status[1], 3);
+  ck_assert_int_eq(metrics.nb_status[4], 0);
+  for (nb_buckets=0, i=0; i<U_METRICS_NB_BUCKETS; i++) {
+    nb_buckets += metrics.phases[U_METRICS_PHASE_CALLBACK].buckets[i];
+  }
+  ck_assert_int_eq(nb_buckets, 3);
+  ck_assert_int_eq(metrics.phases[U_METRICS_PHASE_CALLBACK].count, 3);
+  ck_assert_int_eq(ulfius_get_endpoint_metrics(&u_instance, "GET", "error", NULL, &metrics), U_OK);
+  ck_assert_int_eq(metrics.nb_requests, 1);
+  ck_assert_int_eq(metrics.nb_status[4], 1);
+  ck_assert_int_eq(ulfius_get_endpoint_metrics(&u_instance, "GET", "unknown", NULL, &metrics), U_ERROR_NOT_FOUND);
+  
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  request.http_url = o_strdup("http://localhost:8080/metrics");
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_ptr_ne(o_strnstr(response.binary_body, "ulfius_requests_total{method=\"GET\",url=\"/empty\"} 3", response.binary_body_length), NULL);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_metrics_bucket_limit(0), 1);
+  ck_assert_int_eq(ulfius_metrics_bucket_limit(2), 3);
+  ck_assert_int_eq(ulfius_metrics_bucket_limit(3), 4);
+  ck_assert(ulfius_metrics_bucket_limit(U_METRICS_NB_BUCKETS-1) == UINT64_MAX);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_http_client)
+{
+  struct _u_instance u_instance;
+  struct _u_http_client http_client;
+  struct _u_request request;
+  struct _u_response response;
+  char * port = NULL;
+  int i;
+  
+  ck_assert_int_eq(ulfius_init_http_client(NULL, 4), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_init_http_client(&http_client, 0), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "port", NULL, 0, &callback_function_client_port, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "cookie", NULL, 0, &callback_function_client_port, &u_instance), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  ck_assert_int_eq(ulfius_init_http_client(&http_client, 4), U_OK);
+  
+  ulfius_init_request(&request);
+  ck_assert_int_eq(ulfius_send_http_client_request(&http_client, NULL, NULL), U_ERROR_PARAMS);
+  ulfius_clean_request(&request);
+  
+  // The requests of the client context are sent on the same connection
+  for (i=0; i<4; i++) {
+    ulfius_init_request(&request);
+    request.http_url = o_strdup(i==1?"http://localhost:8080/cookie":"http://localhost:8080/port");
+    ulfius_init_response(&response);
+    ck_assert_int_eq(ulfius_send_http_client_request(&http_client, &request, &response), U_OK);
+    ck_assert_int_eq(response.status, 200);
+    // The cookies of a response aren't kept for the next requests
+    ck_assert_int_eq(response.nb_cookies, i==1?1:0);
+    if (port == NULL) {
+      port = o_strndup(response.binary_body, response.binary_body_length);
+    } else {
+      ck_assert_int_eq(response.binary_body_length, o_strlen(port));
+      ck_assert_int_eq(o_strncmp(response.binary_body, port, response.binary_body_length), 0);
+    }
+    ulfius_clean_request(&request);
+    ulfius_clean_response(&response);
+  }
+  o_free(port);
+  
+  ulfius_clean_http_client(&http_client);
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_http_client_async)
+{
+  struct _u_instance u_instance;
+  struct _u_http_client http_client;
+  struct _u_request request;
+  int i, completed = 0;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "port", NULL, 0, &callback_function_client_port, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  ck_assert_int_eq(ulfius_init_http_client(&http_client, 4), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/port");
+  ck_assert_int_eq(ulfius_send_http_async_request(NULL, &request, &http_async_callback, &completed), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_send_http_async_request(&http_client, NULL, &http_async_callback, &completed), U_ERROR_PARAMS);
+  
+  // Run the transfers in the current thread
+  for (i=0; i<8; i++) {
+    ck_assert_int_eq(ulfius_send_http_async_request(&http_client, &request, &http_async_callback, &completed), U_OK);
+  }
+  ck_assert_int_eq(ulfius_http_client_nb_transfers(&http_client), 8);
+  for (i=0; i<100 && ulfius_http_client_nb_transfers(&http_client); i++) {
+    ck_assert_int_eq(ulfius_perform_http_client(&http_client, 50), U_OK);
+  }
+  ck_assert_int_eq(completed, 8);
+  
+  // Run the transfers in the client thread
+  ck_assert_int_eq(ulfius_start_http_client_loop(&http_client), U_OK);
+  ck_assert_int_eq(ulfius_start_http_client_loop(&http_client), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_perform_http_client(&http_client, 0), U_ERROR_PARAMS);
+  for (i=0; i<8; i++) {
+    ck_assert_int_eq(ulfius_send_http_async_request(&http_client, &request, &http_async_callback, &completed), U_OK);
+  }
+  for (i=0; i<100 && ulfius_http_client_nb_transfers(&http_client); i++) {
+    usleep(50000);
+  }
+  ck_assert_int_eq(ulfius_http_client_nb_transfers(&http_client), 0);
+  ck_assert_int_eq(completed, 16);
+  ck_assert_int_eq(ulfius_stop_http_client_loop(&http_client), U_OK);
+  ulfius_clean_request(&request);
+  
+  ulfius_clean_http_client(&http_client);
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
 START_TEST(test_ulfius_utf8_not_ignored)
 {
   char * invalid_utf8_seq2 = msprintf("value %c%c", 0xC3, 0x28);
@@ -1037,7 +1851,10 @@ START_TEST(test_ulfius_utf8_ignored)
   char * invalid_utf8_seq2 = msprintf("invalid value %c%c", 0xC3, 0x28);
   char * invalid_utf8_seq3 = msprintf("invalid value %c%c%c", 0xE2, 0x28, 0xA1);
   char * invalid_utf8_seq4 = msprintf("invalid value %c%c%c%c", 0xF0, 0x90, 0x28, 0xBC);
+  // The invalid sequence comes after long ASCII runs
+  char * invalid_utf8_long = msprintf("invalid value after an ASCII run longer than 64 bytes, the run goes on %c%c%c", 0xED, 0xA0, 0x80);
   char * valid_utf8 = "valid value ȸ Ɇ  ɤ ¯\\_(ツ)_/¯";
+  char * valid_utf8_long = "valid value with an ASCII run longer than 64 bytes before the multibyte characters ȸ Ɇ  ɤ ¯\\_(ツ)_/¯ and after them";
   struct _u_instance u_instance;
   struct _u_request request;
   
@@ -1051,6 +1868,8 @@ START_TEST(test_ulfius_utf8_ignored)
   request.http_verb = o_strdup("POST");
   u_map_put(request.map_header, "utf8_param", invalid_utf8_seq3);
   u_map_put(request.map_header, "utf8_param_valid", valid_utf8);
+  u_map_put(request.map_header, "utf8_param_long", invalid_utf8_long);
+  u_map_put(request.map_header, "utf8_param_long_valid", valid_utf8_long);
   u_map_put(request.map_post_body, "utf8_param", invalid_utf8_seq4);
   u_map_put(request.map_post_body, "utf8_param_valid", valid_utf8);
   ck_assert_int_eq(ulfius_send_http_request(&request, NULL), U_OK);
@@ -1059,6 +1878,7 @@ START_TEST(test_ulfius_utf8_ignored)
   o_free(invalid_utf8_seq2);
   o_free(invalid_utf8_seq3);
   o_free(invalid_utf8_seq4);
+  o_free(invalid_utf8_long);
   ulfius_stop_framework(&u_instance);
   ulfius_clean_instance(&u_instance);
 }
@@ -1318,7 +2138,20 @@ static Suite *ulfius_suite(void)
   tcase_add_test(tc_core, test_ulfius_endpoint_parameters);
   tcase_add_test(tc_core, test_ulfius_endpoint_injection);
   tcase_add_test(tc_core, test_ulfius_endpoint_multiple);
+  tcase_add_test(tc_core, test_ulfius_endpoint_router);
+  tcase_add_test(tc_core, test_ulfius_endpoint_injection_concurrent);
   tcase_add_test(tc_core, test_ulfius_endpoint_stream);
+  tcase_add_test(tc_core, test_ulfius_endpoint_request_alloc);
+  tcase_add_test(tc_core, test_ulfius_endpoint_fd);
+  tcase_add_test(tc_core, test_ulfius_endpoint_async);
+  tcase_add_test(tc_core, test_ulfius_endpoint_async_stop);
+  tcase_add_test(tc_core, test_ulfius_endpoint_offload);
+  tcase_add_test(tc_core, test_ulfius_endpoint_metrics);
+  tcase_add_test(tc_core, test_ulfius_endpoint_body_stream);
+  tcase_add_test(tc_core, test_ulfius_endpoint_body_mmap);
+  tcase_add_test(tc_core, test_ulfius_endpoint_form_body_mode);
+  tcase_add_test(tc_core, test_ulfius_http_client);
+  tcase_add_test(tc_core, test_ulfius_http_client_async);
   tcase_add_test(tc_core, test_ulfius_utf8_not_ignored);
   tcase_add_test(tc_core, test_ulfius_utf8_ignored);
   tcase_add_test(tc_core, test_ulfius_endpoint_callback_position);
@@ -176,6 +176,43 @@ START_TEST(test_u_map_copy_empty)
 }
 END_TEST
 
+START_TEST(test_u_map_many_keys)
+{
+  struct _u_map map;
+  char key[32], value[32];
+  int i;
+  u_map_init(&map);
+  for (i=0; i<100; i++) {
+    sprintf(key, "Header-%d", i);
+    sprintf(value, "value%d", i);
+    ck_assert_int_eq(u_map_put(&map, key, value), U_OK);
+  }
+  ck_assert_int_eq(u_map_put(&map, "header-42", "lowercase"), U_OK);
+  ck_assert_int_eq(u_map_count(&map), 101);
+  for (i=0; i<100; i++) {
+    sprintf(key, "Header-%d", i);
+    sprintf(value, "value%d", i);
+    ck_assert_str_eq(u_map_get(&map, key), value);
+    ck_assert_str_eq(u_map_enum_keys(&map)[i], key);
+    ck_assert_str_eq(u_map_enum_values(&map)[i], value);
+    sprintf(key, "HEADER-%d", i);
+    ck_assert_int_eq(u_map_has_key(&map, key), 0);
+    ck_assert_int_eq(u_map_has_key_case(&map, key), 1);
+  }
+  ck_assert_str_eq(u_map_get(&map, "header-42"), "lowercase");
+  ck_assert_str_eq(u_map_get_case(&map, "HEADER-42"), "value42");
+  ck_assert_int_eq(u_map_remove_from_key(&map, "Header-42"), U_OK);
+  ck_assert_str_eq(u_map_get_case(&map, "HEADER-42"), "lowercase");
+  ck_assert_int_eq(u_map_remove_at(&map, 0), U_OK);
+  ck_assert_ptr_eq(u_map_get(&map, "Header-0"), NULL);
+  ck_assert_str_eq(u_map_get(&map, "Header-99"), "value99");
+  ck_assert_int_eq(u_map_remove_from_key_case(&map, "HEADER-42"), U_OK);
+  ck_assert_int_eq(u_map_has_key_case(&map, "header-42"), 0);
+  ck_assert_int_eq(u_map_count(&map), 98);
+  u_map_clean(&map);
+}
+END_TEST
+
 static Suite *ulfius_suite(void)
 {
 	Suite *s;
@@ -191,6 +228,7 @@ static Suite *ulfius_suite(void)
 	tcase_add_test(tc_core, test_u_map_has);
 	tcase_add_test(tc_core, test_u_map_remove);
 	tcase_add_test(tc_core, test_u_map_copy_empty);
+	tcase_add_test(tc_core, test_u_map_many_keys);
 	tcase_set_timeout(tc_core, 30);
 	suite_add_tcase(s, tc_core);
 
@@ -8,6 +8,7 @@
 
 #include <check.h>
 #include <ulfius.h>
+#include <u_private.h>
 
 #define WEBSOCKET_URL "http://localhost:8378/websocket"
 #define DEFAULT_PROTOCOL "proto"
@@ -15,6 +16,7 @@
 #define DEFAULT_MESSAGE "message content with a few characters"
 #define PORT 9275
 #define PREFIX_WEBSOCKET "/websocket"
+#define LARGE_MESSAGE_LEN 70000
 
 #ifndef U_DISABLE_WEBSOCKET
 void websocket_manager_callback_empty (const struct _u_request * request, struct _websocket_manager * websocket_manager, void * websocket_manager_user_data) {
@@ -219,6 +221,317 @@ START_TEST(test_websocket_ulfius_websocket_client_no_onclose)
 }
 END_TEST
 
+START_TEST(test_websocket_ulfius_websocket_client_reactor)
+{
+  struct _u_instance instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct _websocket_client_handler websocket_client_handler;
+  char url[64], * allocated_data = o_strdup("plop");
+
+  ck_assert_int_eq(ulfius_init_instance(&instance, PORT, NULL, NULL), U_OK);
+  instance.websocket_mode = U_WEBSOCKET_MODE_REACTOR;
+  instance.websocket_worker_pool_size = 2;
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", PREFIX_WEBSOCKET, NULL, 0, &callback_websocket, allocated_data), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  sprintf(url, "ws://localhost:%d/%s", PORT, PREFIX_WEBSOCKET);
+  
+  // Test correct websocket connection on a websocket service running in a reactor
+  ck_assert_int_eq(ulfius_set_websocket_request(&request, url, DEFAULT_PROTOCOL, DEFAULT_EXTENSION), U_OK);
+  ck_assert_int_eq(ulfius_open_websocket_client_connection(&request, &websocket_manager_callback_client, NULL, &websocket_incoming_message_callback_client, NULL, websocket_onclose_callback_client, allocated_data, &websocket_client_handler, &response), U_OK);
+  ck_assert_int_eq(ulfius_websocket_client_connection_wait_close(&websocket_client_handler, 0), U_WEBSOCKET_STATUS_CLOSE);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  // Test a second connection on the same reactor
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_set_websocket_request(&request, url, DEFAULT_PROTOCOL, DEFAULT_EXTENSION), U_OK);
+  ck_assert_int_eq(ulfius_open_websocket_client_connection(&request, &websocket_manager_callback_client, NULL, &websocket_incoming_message_callback_client, NULL, websocket_onclose_callback_client, allocated_data, &websocket_client_handler, &response), U_OK);
+  ck_assert_int_eq(ulfius_websocket_client_connection_wait_close(&websocket_client_handler, 0), U_WEBSOCKET_STATUS_CLOSE);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_stop_framework(&instance), U_OK);
+  ulfius_clean_instance(&instance);
+  o_free(allocated_data);
+}
+END_TEST
+
+void websocket_incoming_message_callback_broadcast (const struct _u_request * request, struct _websocket_manager * websocket_manager, const struct _websocket_message * message, void * websocket_incoming_user_data) {
+  ck_assert_int_eq(message->opcode, U_WEBSOCKET_OPCODE_TEXT);
+  ck_assert_int_eq(0, o_strncmp(message->data, DEFAULT_MESSAGE, message->data_len));
+  *((int *)websocket_incoming_user_data) = 1;
+  ulfius_websocket_send_close_signal(websocket_manager);
+}
+
+int websocket_filter_broadcast (const struct _u_request * request, struct _websocket_manager * websocket_manager, void * websocket_filter_user_data) {
+  return o_strstr(request->http_url, PREFIX_WEBSOCKET) != NULL;
+}
+
+int callback_websocket_broadcast (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  int ret;
+  
+  ret = ulfius_set_websocket_response(response, NULL, NULL, NULL, NULL, &websocket_incoming_message_callback_empty, NULL, NULL, NULL);
+  ck_assert_int_eq(ret, U_OK);
+  return (ret == U_OK)?U_CALLBACK_CONTINUE:U_CALLBACK_ERROR;
+}
+
+START_TEST(test_websocket_ulfius_websocket_broadcast)
+{
+  struct _u_instance instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct _websocket_client_handler websocket_client_handler;
+  char url[64];
+  int received = 0, i;
+
+  ck_assert_int_eq(ulfius_init_instance(&instance, PORT, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", PREFIX_WEBSOCKET, NULL, 0, &callback_websocket_broadcast, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+  
+  // No websocket connected
+  ck_assert_int_eq(ulfius_websocket_broadcast(&instance, U_WEBSOCKET_OPCODE_TEXT, o_strlen(DEFAULT_MESSAGE), DEFAULT_MESSAGE, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_websocket_broadcast(&instance, U_WEBSOCKET_OPCODE_CLOSE, 0, NULL, NULL, NULL), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_websocket_broadcast(NULL, U_WEBSOCKET_OPCODE_TEXT, o_strlen(DEFAULT_MESSAGE), DEFAULT_MESSAGE, NULL, NULL), U_ERROR_PARAMS);
+
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  sprintf(url, "ws://localhost:%d/%s", PORT, PREFIX_WEBSOCKET);
+  ck_assert_int_eq(ulfius_set_websocket_request(&request, url, DEFAULT_PROTOCOL, DEFAULT_EXTENSION), U_OK);
+  ck_assert_int_eq(ulfius_open_websocket_client_connection(&request, NULL, NULL, &websocket_incoming_message_callback_broadcast, &received, NULL, NULL, &websocket_client_handler, &response), U_OK);
+  
+  // The client closes the websocket when it receives the message
+  for (i=0; i<40 && ulfius_websocket_client_connection_wait_close(&websocket_client_handler, 50) == U_WEBSOCKET_STATUS_OPEN; i++) {
+    ck_assert_int_eq(ulfius_websocket_broadcast(&instance, U_WEBSOCKET_OPCODE_TEXT, o_strlen(DEFAULT_MESSAGE), DEFAULT_MESSAGE, &websocket_filter_broadcast, NULL), U_OK);
+  }
+  ck_assert_int_eq(ulfius_websocket_client_connection_wait_close(&websocket_client_handler, 0), U_WEBSOCKET_STATUS_CLOSE);
+  ck_assert_int_eq(received, 1);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_stop_framework(&instance), U_OK);
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+
+void websocket_manager_callback_queue (const struct _u_request * request, struct _websocket_manager * websocket_manager, void * websocket_manager_user_data) {
+  ck_assert_int_eq(ulfius_websocket_set_queue_policy(websocket_manager, 1024, 42), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_websocket_set_queue_policy(websocket_manager, 1024, U_WEBSOCKET_QUEUE_DROP), U_OK);
+  // A message is always accepted in an empty queue
+  ck_assert_int_eq(ulfius_websocket_send_message(websocket_manager, U_WEBSOCKET_OPCODE_TEXT, o_strlen(DEFAULT_MESSAGE), DEFAULT_MESSAGE), U_OK);
+  ulfius_websocket_wait_close(websocket_manager, 0);
+}
+
+int callback_websocket_queue (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  int ret;
+  
+  ret = ulfius_set_websocket_response(response, NULL, NULL, &websocket_manager_callback_queue, NULL, NULL, NULL, NULL, NULL);
+  ck_assert_int_eq(ret, U_OK);
+  return (ret == U_OK)?U_CALLBACK_CONTINUE:U_CALLBACK_ERROR;
+}
+
+START_TEST(test_websocket_ulfius_websocket_queue_policy)
+{
+  struct _u_instance instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct _websocket_client_handler websocket_client_handler;
+  char url[64];
+  int received = 0;
+
+  ck_assert_int_eq(ulfius_websocket_set_queue_policy(NULL, 1024, U_WEBSOCKET_QUEUE_DROP), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_websocket_queued_bytes(NULL), 0);
+  
+  ck_assert_int_eq(ulfius_init_instance(&instance, PORT, NULL, NULL), U_OK);
+  ck_assert_int_eq(instance.websocket_queue_high_water, U_WEBSOCKET_QUEUE_HIGH_WATER);
+  ck_assert_int_eq(instance.websocket_queue_policy, U_WEBSOCKET_QUEUE_BLOCK);
+  instance.websocket_queue_policy = 42;
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_ERROR_PARAMS);
+  instance.websocket_queue_policy = U_WEBSOCKET_QUEUE_CLOSE;
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", PREFIX_WEBSOCKET, NULL, 0, &callback_websocket_queue, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  sprintf(url, "ws://localhost:%d/%s", PORT, PREFIX_WEBSOCKET);
+  ck_assert_int_eq(ulfius_set_websocket_request(&request, url, DEFAULT_PROTOCOL, DEFAULT_EXTENSION), U_OK);
+  ck_assert_int_eq(ulfius_open_websocket_client_connection(&request, NULL, NULL, &websocket_incoming_message_callback_broadcast, &received, NULL, NULL, &websocket_client_handler, &response), U_OK);
+  ck_assert_int_eq(ulfius_websocket_client_connection_wait_close(&websocket_client_handler, 0), U_WEBSOCKET_STATUS_CLOSE);
+  ck_assert_int_eq(received, 1);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_stop_framework(&instance), U_OK);
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+
+void websocket_incoming_message_callback_deflate (const struct _u_request * request, struct _websocket_manager * websocket_manager, const struct _websocket_message * message, void * websocket_incoming_user_data) {
+  ck_assert_int_eq(message->opcode, U_WEBSOCKET_OPCODE_TEXT);
+  ck_assert_int_eq(message->rsv, U_WEBSOCKET_RSV1);
+  ck_assert_int_eq(message->data_len, o_strlen(DEFAULT_MESSAGE));
+  ck_assert_int_eq(0, o_strncmp(message->data, DEFAULT_MESSAGE, message->data_len));
+  (*((int *)websocket_incoming_user_data))++;
+}
+
+int callback_websocket_deflate (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  int ret;
+  
+  ret = ulfius_set_websocket_response(response, NULL, NULL, NULL, NULL, &websocket_echo_message_callback, NULL, NULL, NULL);
+  ck_assert_int_eq(ret, U_OK);
+  ck_assert_int_eq(ulfius_add_websocket_deflate_extension(response, 8, 15, 0, 0), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_add_websocket_deflate_extension(response, 15, 16, 0, 0), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_add_websocket_deflate_extension(response, 12, 15, 0, 0), U_OK);
+  return (ret == U_OK)?U_CALLBACK_CONTINUE:U_CALLBACK_ERROR;
+}
+
+START_TEST(test_websocket_ulfius_websocket_deflate)
+{
+  struct _u_instance instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct _websocket_client_handler websocket_client_handler;
+  char url[64];
+  int received = 0;
+
+  ck_assert_int_eq(ulfius_add_websocket_deflate_extension(NULL, 15, 15, 0, 0), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_add_websocket_client_deflate_extension(NULL, 15, 15, 0, 0), U_ERROR_PARAMS);
+  
+  ck_assert_int_eq(ulfius_init_instance(&instance, PORT, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", PREFIX_WEBSOCKET, NULL, 0, &callback_websocket_deflate, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  sprintf(url, "ws://localhost:%d/%s", PORT, PREFIX_WEBSOCKET);
+  ck_assert_int_eq(ulfius_set_websocket_request(&request, url, DEFAULT_PROTOCOL, DEFAULT_EXTENSION), U_OK);
+  ck_assert_int_eq(ulfius_add_websocket_client_deflate_extension(&request, 15, 16, 0, 0), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_add_websocket_client_deflate_extension(&request, 15, 15, 0, 1), U_OK);
+  ck_assert_int_eq(ulfius_open_websocket_client_connection(&request, &websocket_manager_callback_client, NULL, &websocket_incoming_message_callback_deflate, &received, NULL, NULL, &websocket_client_handler, &response), U_OK);
+  ck_assert_int_eq(ulfius_websocket_client_connection_wait_close(&websocket_client_handler, 0), U_WEBSOCKET_STATUS_CLOSE);
+  ck_assert_int_eq(0, o_strncmp(u_map_get_case(response.map_header, "Sec-WebSocket-Extensions"), U_WEBSOCKET_PERMESSAGE_DEFLATE, o_strlen(U_WEBSOCKET_PERMESSAGE_DEFLATE)));
+  ck_assert_int_gt(received, 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_stop_framework(&instance), U_OK);
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+
+struct _fragmented_large_data {
+  const char * large_message;
+  int received;
+};
+
+void websocket_echo_all_message_callback (const struct _u_request * request,
+                                         struct _websocket_manager * websocket_manager,
+                                         const struct _websocket_message * last_message,
+                                         void * websocket_incoming_message_user_data) {
+  if (last_message->opcode == U_WEBSOCKET_OPCODE_TEXT || last_message->opcode == U_WEBSOCKET_OPCODE_BINARY) {
+    ck_assert_int_eq(ulfius_websocket_send_message(websocket_manager, last_message->opcode, last_message->data_len, last_message->data), U_OK);
+  }
+}
+
+int callback_websocket_echo_all (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  int ret;
+  
+  ret = ulfius_set_websocket_response(response, NULL, NULL, NULL, NULL, &websocket_echo_all_message_callback, NULL, NULL, NULL);
+  ck_assert_int_eq(ret, U_OK);
+  return (ret == U_OK)?U_CALLBACK_CONTINUE:U_CALLBACK_ERROR;
+}
+
+void websocket_manager_callback_fragmented_large (const struct _u_request * request, struct _websocket_manager * websocket_manager, void * websocket_manager_user_data) {
+  const char * large_message = (const char *)websocket_manager_user_data;
+  
+  // A fragmented text message, a large message in one frame with a 64 bits payload length, then the same large message fragmented
+  ck_assert_int_eq(ulfius_websocket_send_fragmented_message(websocket_manager, U_WEBSOCKET_OPCODE_TEXT, o_strlen(DEFAULT_MESSAGE), DEFAULT_MESSAGE, 5), U_OK);
+  ck_assert_int_eq(ulfius_websocket_send_message(websocket_manager, U_WEBSOCKET_OPCODE_BINARY, LARGE_MESSAGE_LEN, large_message), U_OK);
+  ck_assert_int_eq(ulfius_websocket_send_fragmented_message(websocket_manager, U_WEBSOCKET_OPCODE_BINARY, LARGE_MESSAGE_LEN, large_message, 10000), U_OK);
+  ulfius_websocket_wait_close(websocket_manager, 0);
+}
+
+void websocket_incoming_message_callback_fragmented_large (const struct _u_request * request, struct _websocket_manager * websocket_manager, const struct _websocket_message * message, void * websocket_incoming_user_data) {
+  struct _fragmented_large_data * data = (struct _fragmented_large_data *)websocket_incoming_user_data;
+  
+  if (!data->received) {
+    ck_assert_int_eq(message->opcode, U_WEBSOCKET_OPCODE_TEXT);
+    ck_assert_int_eq(message->data_len, o_strlen(DEFAULT_MESSAGE));
+    ck_assert_int_eq(0, memcmp(message->data, DEFAULT_MESSAGE, message->data_len));
+  } else {
+    ck_assert_int_eq(message->opcode, U_WEBSOCKET_OPCODE_BINARY);
+    ck_assert_int_eq(message->data_len, LARGE_MESSAGE_LEN);
+    ck_assert_int_eq(0, memcmp(message->data, data->large_message, LARGE_MESSAGE_LEN));
+  }
+  if (++data->received == 3) {
+    ulfius_websocket_send_close_signal(websocket_manager);
+  }
+}
+
+START_TEST(test_websocket_ulfius_websocket_fragmented_large)
+{
+  struct _u_instance instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct _websocket_client_handler websocket_client_handler;
+  struct _fragmented_large_data data;
+  char url[64], * large_message = o_malloc(LARGE_MESSAGE_LEN);
+  size_t i;
+
+  ck_assert_ptr_ne(large_message, NULL);
+  for (i=0; i<LARGE_MESSAGE_LEN; i++) {
+    large_message[i] = (char)(i%251);
+  }
+  data.large_message = large_message;
+  data.received = 0;
+  
+  ck_assert_int_eq(ulfius_init_instance(&instance, PORT, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", PREFIX_WEBSOCKET, NULL, 0, &callback_websocket_echo_all, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  sprintf(url, "ws://localhost:%d/%s", PORT, PREFIX_WEBSOCKET);
+  ck_assert_int_eq(ulfius_set_websocket_request(&request, url, DEFAULT_PROTOCOL, DEFAULT_EXTENSION), U_OK);
+  ck_assert_int_eq(ulfius_open_websocket_client_connection(&request, &websocket_manager_callback_fragmented_large, large_message, &websocket_incoming_message_callback_fragmented_large, &data, NULL, NULL, &websocket_client_handler, &response), U_OK);
+  ck_assert_int_eq(ulfius_websocket_client_connection_wait_close(&websocket_client_handler, 0), U_WEBSOCKET_STATUS_CLOSE);
+  ck_assert_int_eq(data.received, 3);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_stop_framework(&instance), U_OK);
+  ulfius_clean_instance(&instance);
+  o_free(large_message);
+}
+END_TEST
+
+START_TEST(test_websocket_ulfius_websocket_mask)
+{
+  uint8_t data[1024+4], expected[1024+4], mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+  size_t lengths[] = {15, 16, 17, 31, 32, 33, 47, 63, 64, 65, 127, 128, 129, 255, 256, 257, 1000, 1024}, len, off, i, j;
+
+  srand((unsigned int)time(NULL));
+  // Every length from 0 to 100, then lengths around the 16 and 32 bytes vector widths, on every alignment
+  for (j=0; j<=100+(sizeof(lengths)/sizeof(size_t)); j++) {
+    len = j<=100?j:lengths[j-101];
+    for (off=0; off<4; off++) {
+      for (i=0; i<len+off; i++) {
+        data[i] = expected[i] = (uint8_t)rand();
+      }
+      for (i=0; i<len; i++) {
+        expected[off+i] ^= mask[i%4];
+      }
+      ulfius_websocket_mask(data+off, len, mask);
+      ck_assert_int_eq(0, memcmp(data, expected, len+off));
+    }
+  }
+}
+END_TEST
+
 #endif
 
 static Suite *ulfius_suite(void)
@@ -234,6 +547,12 @@ static Suite *ulfius_suite(void)
 	tcase_add_test(tc_websocket, test_websocket_ulfius_open_websocket_client_connection_error);
 	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_client);
 	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_client_no_onclose);
+	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_client_reactor);
+	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_broadcast);
+	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_queue_policy);
+	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_deflate);
+	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_fragmented_large);
+	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_mask);
 #endif
 	tcase_set_timeout(tc_websocket, 30);
 	suite_add_tcase(s, tc_websocket);